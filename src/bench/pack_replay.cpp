@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include <vpu_io.h>
+#include <vpu_lib.h>
+}
+
+#include "latency_histogram.hpp"
+#include "pack_capture.hpp"
+#include "pack_queue.hpp"
+#include "simple_logger.hpp"
+#include "vpu_decoder.hpp"
+
+/* Drives VPUDecoder from pack capture (see pack_capture.hpp, vpu_playback -w
+ records them) with no parser in the loop, so that decoder and scheduling
+ changes can be compared on exactly the same packs. Packs go into the queue
+ when they are due by their arrival times in the capture, sped up by -s
+ (default 1, original timing) - or, with -s 0, as fast as decoder takes them,
+ keeping REPLAY_PACKS_AHEAD in the queue. Frames are returned to the decoder
+ right away, and once the capture is over decoder is flushed, so that frames
+ it held for reordering count too. -a has decoder feed that many packs ahead.
+
+ For each capture frames/s, step latencies and decoder stats are printed,
+ with -j as one JSON document */
+
+/* Packs kept in queue when replaying as fast as possible */
+#define REPLAY_PACKS_AHEAD 4
+/* Display frames decoder is opened with, same as player stream handlers */
+#define REPLAY_DISPLAY_FRAMES 2
+
+class ReplayResult {
+public:
+    const char *name = nullptr;
+    bool opened = false;
+    size_t packs = 0;
+    size_t packs_dropped = 0;
+    size_t frames = 0;
+    double seconds = 0.0;
+    airtame::LatencyHistogram step_latency;
+    airtame::DecodingStats stats;
+
+    double get_fps() const
+    {
+        return (seconds > 0.0) ? frames / seconds : 0.0;
+    }
+};
+
+static void replay(airtame::CodecLogger &logger, airtame::PackCaptureReader &reader,
+                   double speed, size_t feed_ahead, ReplayResult &result)
+{
+    airtame::PackQueue queue;
+    airtame::VPUDecoder decoder(logger, REPLAY_DISPLAY_FRAMES);
+    decoder.set_feed_ahead(feed_ahead);
+
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        /* Packs due by now go in */
+        airtame::Timestamp arrival;
+        airtame::Timestamp now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        while (reader.peek_arrival(arrival)
+               && ((speed > 0) ? (arrival / speed <= now)
+                               : (queue.size() < feed_ahead + REPLAY_PACKS_AHEAD))) {
+            if (!reader.read(queue)) {
+                break;
+            }
+        }
+
+        if (queue.has_pack_for_consumption() && decoder.has_frame_for_decoding()) {
+            auto before = std::chrono::steady_clock::now();
+            airtame::VPUOutputFrame frame = decoder.step(queue);
+            result.step_latency.add_usec_since(before);
+            if (frame.has_data()) {
+                ++result.frames;
+                decoder.return_output_frame(frame);
+            }
+            continue;
+        }
+
+        /* Nothing to decode until next pack comes */
+        if (!reader.peek_arrival(arrival)) {
+            break;
+        }
+        if (speed > 0) {
+            airtame::Timestamp until = (airtame::Timestamp)(arrival / speed) - now;
+            if (until > 0) {
+                ::usleep(until);
+            }
+        } else if (!reader.read(queue)) {
+            break;
+        }
+    }
+
+    /* Capture is over, frames decoder still holds (reordering) come out by
+     flushing, which closes it once there are none left. Frames go right back,
+     so it always has one to decode into */
+    while (!decoder.is_closed() && decoder.has_frame_for_decoding()) {
+        auto before = std::chrono::steady_clock::now();
+        airtame::VPUOutputFrame frame = decoder.flush_step();
+        result.step_latency.add_usec_since(before);
+        if (frame.has_data()) {
+            ++result.frames;
+            decoder.return_output_frame(frame);
+        }
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    result.seconds = duration.count();
+    result.packs = reader.get_number_of_packs_read();
+    result.packs_dropped = queue.get_number_of_packs_dropped();
+    result.stats = decoder.get_stats();
+    decoder.close();
+}
+
+static void print_text(const ReplayResult &result)
+{
+    printf("%s:\n", result.name);
+    if (!result.opened) {
+        printf("\tnot a pack capture\n");
+        return;
+    }
+    printf("\t%zu packs, %zu frames in %.2fs, %.2f frames/s\n", result.packs, result.frames,
+           result.seconds, result.get_fps());
+    char line[512];
+    result.step_latency.print_summary(line, sizeof(line), "step");
+    printf("\t%s\n", line);
+    result.stats.print_summary(line, sizeof(line));
+    printf("\t%s\n", line);
+    printf("\t%zu decodes, %zu rolled back, %zu session opens, %zu packs dropped\n",
+           result.stats.number_of_decode_operations, result.stats.number_of_rolled_back_decodes,
+           result.stats.number_of_session_opens, result.packs_dropped);
+}
+
+static void print_json_histogram(const char *name, const airtame::LatencyHistogram &histogram)
+{
+    printf("\"%s\": {\"avg\": %" PRId64 ", \"p50\": %" PRId64 ", \"p90\": %" PRId64
+           ", \"p99\": %" PRId64 ", \"max\": %" PRId64 "}",
+           name, histogram.get_average(), histogram.get_percentile(50),
+           histogram.get_percentile(90), histogram.get_percentile(99), histogram.get_max());
+}
+
+static void print_json(const ReplayResult &result)
+{
+    /* Capture paths are given by the user, and only quotes would break it */
+    printf("    {\"capture\": \"");
+    for (const char *c = result.name; *c; ++c) {
+        if (('"' == *c) || ('\\' == *c)) {
+            putchar('\\');
+        }
+        putchar(*c);
+    }
+    printf("\", \"opened\": %s", result.opened ? "true" : "false");
+    if (result.opened) {
+        const airtame::DecodingStats &stats = result.stats;
+        printf(", \"packs\": %zu, \"frames\": %zu, \"seconds\": %.3f, \"fps\": %.2f, ",
+               result.packs, result.frames, result.seconds, result.get_fps());
+        print_json_histogram("step_latency_usec", result.step_latency);
+        printf(", ");
+        print_json_histogram("decode_latency_usec", stats.decode_latency);
+        printf(", \"decodes\": %zu, \"rolled_back_decodes\": %zu, \"session_opens\": %zu"
+               ", \"packs_dropped\": %zu, \"peak_dma_bytes\": %zu",
+               stats.number_of_decode_operations, stats.number_of_rolled_back_decodes,
+               stats.number_of_session_opens, result.packs_dropped,
+               stats.max_dma_allocation_size);
+    }
+    printf("}");
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    double speed = 1.0;
+    size_t feed_ahead = 0;
+    const char *program = argv[0];
+    while (argc > 1) {
+        if (!strcmp(argv[1], "-j")) {
+            json = true;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-s")) {
+            speed = ::atof(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && !strcmp(argv[1], "-a")) {
+            feed_ahead = ::atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    if ((argc < 2) || (speed < 0)) {
+        fprintf(stderr, "Usage:\n%s [-j] [-s speed] [-a packs] capture0 [capture1]...\n",
+                program);
+        return -1;
+    }
+
+    /* Gotta init VPU, or decode init will fail */
+    if (RETCODE_SUCCESS != vpu_Init(nullptr)) {
+        fprintf(stderr, "Could not initialize the VPU\n");
+        return -1;
+    }
+
+    airtame::SimpleLogger logger;
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        ReplayResult replayed;
+        replayed.name = argv[i];
+        airtame::PackCaptureReader reader(logger);
+        replayed.opened = reader.open(argv[i]);
+        if (replayed.opened) {
+            replay(logger, reader, speed, feed_ahead, replayed);
+        } else {
+            result = -1;
+        }
+
+        if (json) {
+            printf((1 == i) ? "{\"replays\": [\n" : ",\n");
+            print_json(replayed);
+        } else {
+            print_text(replayed);
+        }
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+
+    vpu_UnInit();
+    return result;
+}
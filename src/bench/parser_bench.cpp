@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h264_nal.hpp"
+#include "h264_stream_parser.hpp"
+#include "ivf.h"
+#include "pack_queue.hpp"
+#include "stream.hpp"
+#include "vp8_stream_parser.hpp"
+
+/* Benchmark of stream parsers, built on the host without VPU SDK. Give it real
+ captures (raw Annex B h264, or VP8 in IVF - recognized by its magic number)
+ and it will run every file through the parser as the player does (h264 one
+ NAL per buffer, VP8 one frame per buffer), with the packs consumed as soon as
+ they are complete, as decoder would do. It prints throughput, and heap
+ allocations per pack, both these done inside of PackQueue (packs and chunks
+ not in the pools) and all of them (metadata, parameter set copies and such).
+
+ Packs made, NALs parsed and a checksum of pack layout (sizes of chunks and
+ flags of the packs) are printed too, and have to be the same for every run of
+ a file - if not, that is reported and bench fails. These are to be kept from
+ the run before parser change and compared with the ones after, any
+ difference means parser splits the stream differently than it used to.
+
+ With -l h264 files are rewritten into length prefixed NALs first (see
+ convert_to_length_prefixed()) and parsed in that mode. Every NAL is then two
+ chunks (start code and payload) and so the checksum differs from Annex B run
+ of the same file, while number of packs has to be the same
+
+ -s saves packs, NALs, checksum and allocations per pack of every file into
+ a baseline file, and -b compares the run with such file: different pack
+ layout, or more allocations per pack than before fail the bench. Files are
+ told apart by mode and name as given, so baseline is to be made by the same
+ command line (see README) */
+
+/* All the allocations of the process, counted by replaced operator new */
+static std::atomic<size_t> s_number_of_allocations(0);
+
+void *operator new(size_t size)
+{
+    ++s_number_of_allocations;
+    void *pointer = ::malloc(size ? size : 1);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    ::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    ::free(pointer);
+}
+
+namespace airtame {
+
+class SilentLogger : public CodecLogger {
+public:
+    size_t number_of_errors = 0;
+
+    SilentLogger()
+    {
+        set_level(CodecLogger::WARNING);
+    }
+
+    void Log(int, const char *, const char *, int, const char *format, ...) override
+    {
+        ++number_of_errors;
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        fprintf(stderr, "\n");
+    }
+};
+
+class RunResult {
+public:
+    size_t number_of_packs = 0;
+    size_t number_of_nals = 0;
+    size_t number_of_bytes = 0;
+    size_t number_of_queue_allocations = 0;
+    size_t number_of_allocations = 0;
+    uint64_t checksum = 0;
+    double duration = 0; /* sec */
+
+    bool operator==(const RunResult &other) const
+    {
+        return (number_of_packs == other.number_of_packs)
+            && (number_of_nals == other.number_of_nals) && (checksum == other.checksum);
+    }
+};
+
+/* What -s saves for a file, and -b compares with */
+class BaselineEntry {
+public:
+    size_t number_of_packs = 0;
+    size_t number_of_nals = 0;
+    uint64_t checksum = 0;
+    /* Per pack, see RunResult */
+    double queue_allocations = 0;
+    double allocations = 0;
+};
+
+/* Lines of "name packs NALs checksum queue-allocations allocations" */
+static bool load_baseline(const char *path, std::map<std::string, BaselineEntry> &baseline)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Couldn't open baseline %s\n", path);
+        return false;
+    }
+    char name[1024];
+    BaselineEntry entry;
+    unsigned long long checksum;
+    while (6 == fscanf(file, "%1023s %zu %zu %llx %lf %lf", name, &entry.number_of_packs,
+                       &entry.number_of_nals, &checksum, &entry.queue_allocations,
+                       &entry.allocations)) {
+        entry.checksum = checksum;
+        baseline[name] = entry;
+    }
+    bool ended = feof(file);
+    fclose(file);
+    if (!ended) {
+        fprintf(stderr, "Baseline %s is broken\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool save_baseline(const char *path,
+                          const std::map<std::string, BaselineEntry> &baseline)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Couldn't save baseline to %s\n", path);
+        return false;
+    }
+    for (auto &entry : baseline) {
+        fprintf(file, "%s %zu %zu %016llx %.3f %.3f\n", entry.first.c_str(),
+                entry.second.number_of_packs, entry.second.number_of_nals,
+                (unsigned long long)entry.second.checksum, entry.second.queue_allocations,
+                entry.second.allocations);
+    }
+    return !fclose(file);
+}
+
+/* False if the run differs from the baseline in the way that fails it */
+static bool compare_with_baseline(const std::string &name, const BaselineEntry &run,
+                                  const std::map<std::string, BaselineEntry> &baseline)
+{
+    auto it = baseline.find(name);
+    if (it == baseline.end()) {
+        fprintf(stderr, "%s is not in the baseline\n", name.c_str());
+        return true;
+    }
+    const BaselineEntry &base = it->second;
+    if ((run.number_of_packs != base.number_of_packs)
+        || (run.number_of_nals != base.number_of_nals) || (run.checksum != base.checksum)) {
+        fprintf(stderr, "%s made %zu packs out of %zu NALs (checksum %016llx), baseline %zu "
+                        "out of %zu (%016llx)\n",
+                name.c_str(), run.number_of_packs, run.number_of_nals,
+                (unsigned long long)run.checksum, base.number_of_packs, base.number_of_nals,
+                (unsigned long long)base.checksum);
+        return false;
+    }
+    /* Saved rounded, so compared the same */
+    if (((int64_t)(run.queue_allocations * 1000 + 0.5)
+         > (int64_t)(base.queue_allocations * 1000 + 0.5))
+        || ((int64_t)(run.allocations * 1000 + 0.5) > (int64_t)(base.allocations * 1000 + 0.5))) {
+        fprintf(stderr, "%s allocates %.3f/%.3f times per pack, baseline %.3f/%.3f\n",
+                name.c_str(), run.queue_allocations, run.allocations, base.queue_allocations,
+                base.allocations);
+        return false;
+    }
+    return true;
+}
+
+static void consume_pack(PackQueue &queue, RunResult &result)
+{
+    const Pack &pack = queue.front();
+    uint64_t checksum = result.checksum;
+    for (auto &chunk : pack.m_chunks) {
+        checksum = checksum * 31 + chunk.size;
+    }
+    checksum = checksum * 31 + pack.m_chunks.size();
+    checksum = checksum * 31
+        + ((pack.m_can_reopen_decoding ? 1 : 0) | (pack.m_can_be_dropped ? 2 : 0)
+           | (pack.m_needs_reordering ? 4 : 0) | (pack.m_needs_flushing ? 8 : 0)
+           | (pack.m_low_latency ? 16 : 0));
+    result.checksum = checksum;
+    ++result.number_of_packs;
+    queue.pop_front();
+}
+
+static void consume_complete_packs(PackQueue &queue, RunResult &result)
+{
+    while (!queue.empty() && queue.front().m_is_complete) {
+        consume_pack(queue, result);
+    }
+}
+
+static void consume_all_packs(PackQueue &queue, RunResult &result)
+{
+    while (!queue.empty()) {
+        consume_pack(queue, result);
+    }
+}
+
+static bool run_h264(CodecLogger &logger, const unsigned char *data, size_t size,
+                     RunResult &result)
+{
+    PackQueue queue;
+    H264StreamParser parser(logger, queue, false);
+    size_t allocations = s_number_of_allocations;
+    auto before = std::chrono::steady_clock::now();
+
+    const unsigned char *limit = data + size;
+    const unsigned char *nal = at_h264_next_start_code(data, limit);
+    while (nal) {
+        const unsigned char *next_nal = at_h264_next_start_code(nal + 4, limit);
+        VideoBuffer buffer;
+        buffer.data = nal;
+        buffer.size = (next_nal ? next_nal : limit) - nal;
+        parser.process_buffer(buffer);
+        consume_complete_packs(queue, result);
+        nal = next_nal;
+    }
+    consume_all_packs(queue, result);
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - before;
+    result.duration = duration.count();
+    result.number_of_allocations = s_number_of_allocations - allocations;
+    result.number_of_queue_allocations
+        = queue.get_number_of_pack_allocations() + queue.get_number_of_chunk_allocations();
+    result.number_of_nals = parser.get_stats().number_of_nals_parsed;
+    result.number_of_bytes = size;
+    return true;
+}
+
+/* Annex B stream rewritten with 4 byte big endian length in place of every
+ start code (and trailing zeros, which belong to the next start code, dropped)
+ as MP4 has it, to run parser in length prefixed mode */
+static void convert_to_length_prefixed(const unsigned char *data, size_t size,
+                                       std::vector<unsigned char> &converted)
+{
+    const unsigned char *limit = data + size;
+    const unsigned char *nal = at_h264_next_start_code(data, limit);
+    while (nal) {
+        const unsigned char *next_nal = at_h264_next_start_code(nal + 4, limit);
+        const unsigned char *payload = nal + 3;
+        const unsigned char *payload_limit = next_nal ? next_nal : limit;
+        while ((payload_limit > payload) && !payload_limit[-1]) {
+            --payload_limit;
+        }
+        size_t payload_size = payload_limit - payload;
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            converted.push_back((unsigned char)(payload_size >> shift));
+        }
+        converted.insert(converted.end(), payload, payload_limit);
+        nal = next_nal;
+    }
+}
+
+/* Same as run_h264(), for stream from convert_to_length_prefixed() */
+static bool run_h264_length_prefixed(CodecLogger &logger, const unsigned char *data,
+                                     size_t size, RunResult &result)
+{
+    PackQueue queue;
+    H264StreamParser parser(logger, queue, false);
+    parser.set_nal_length_size(4);
+    size_t allocations = s_number_of_allocations;
+    auto before = std::chrono::steady_clock::now();
+
+    const unsigned char *current = data;
+    const unsigned char *limit = data + size;
+    while (limit - current >= 4) {
+        size_t nal_size = ((size_t)current[0] << 24) | (current[1] << 16) | (current[2] << 8)
+            | current[3];
+        VideoBuffer buffer;
+        buffer.data = current;
+        buffer.size = 4 + nal_size;
+        parser.process_buffer(buffer);
+        consume_complete_packs(queue, result);
+        current += 4 + nal_size;
+    }
+    consume_all_packs(queue, result);
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - before;
+    result.duration = duration.count();
+    result.number_of_allocations = s_number_of_allocations - allocations;
+    result.number_of_queue_allocations
+        = queue.get_number_of_pack_allocations() + queue.get_number_of_chunk_allocations();
+    result.number_of_nals = parser.get_stats().number_of_nals_parsed;
+    result.number_of_bytes = size;
+    return true;
+}
+
+static bool run_vp8(CodecLogger &logger, const unsigned char *data, size_t size,
+                    RunResult &result)
+{
+    /* See VP8StreamHandler(), header size is in the header */
+    if ((size < 32) || (*(uint16_t *)(data + 6) > size)) {
+        fprintf(stderr, "Broken IVF header\n");
+        return false;
+    }
+    const unsigned char *read_pointer = data + *(uint16_t *)(data + 6);
+    const unsigned char *limit = data + size;
+
+    PackQueue queue;
+    VP8StreamParser parser(logger, queue);
+    size_t allocations = s_number_of_allocations;
+    auto before = std::chrono::steady_clock::now();
+
+    while ((size_t)(limit - read_pointer) >= 12) {
+        size_t frame_size = *(uint32_t *)read_pointer;
+        if (frame_size + 12 > (size_t)(limit - read_pointer)) {
+            break;
+        }
+        VideoBuffer buffer;
+        buffer.data = read_pointer + 12;
+        buffer.size = frame_size;
+        parser.process_buffer(buffer);
+        consume_complete_packs(queue, result);
+        read_pointer += frame_size + 12;
+        ++result.number_of_nals;
+    }
+    consume_all_packs(queue, result);
+
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - before;
+    result.duration = duration.count();
+    result.number_of_allocations = s_number_of_allocations - allocations;
+    result.number_of_queue_allocations
+        = queue.get_number_of_pack_allocations() + queue.get_number_of_chunk_allocations();
+    result.number_of_bytes = read_pointer - data;
+    return true;
+}
+}
+
+using namespace airtame;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage:\n%s [-n iterations] [-l] [-b baseline] [-s baseline] "
+                        "file0 [file1]...\n", argv[0]);
+        return -1;
+    }
+
+    size_t iterations = 20;
+    bool length_prefixed = false;
+    const char *save_path = nullptr;
+    const char *baseline_path = nullptr;
+    std::map<std::string, BaselineEntry> baseline;
+    int result = 0;
+    bool header_printed = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc)) {
+            iterations = ::atoi(argv[++i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-l")) {
+            length_prefixed = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-s") && (i + 1 < argc)) {
+            save_path = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-b") && (i + 1 < argc)) {
+            baseline_path = argv[++i];
+            if (!load_baseline(baseline_path, baseline)) {
+                return -1;
+            }
+            continue;
+        }
+
+        Stream stream;
+        if (!stream.open(argv[i])) {
+            result = -1;
+            continue;
+        }
+        const unsigned char *data = stream.get_read_pointer();
+        size_t size = stream.get_size_left();
+        bool vp8 = (size >= 4) && !::memcmp(data, IVF_MAGIC_NUMBER, 4);
+        std::vector<unsigned char> converted;
+        if (length_prefixed && !vp8) {
+            convert_to_length_prefixed(data, size, converted);
+            data = converted.data();
+            size = converted.size();
+        }
+
+        SilentLogger logger;
+        RunResult first;
+        double total_duration = 0;
+        bool failed = false;
+        for (size_t iteration = 0; iteration < iterations; iteration++) {
+            RunResult run;
+            bool ran = vp8 ? run_vp8(logger, data, size, run)
+                           : (length_prefixed ? run_h264_length_prefixed(logger, data, size, run)
+                                              : run_h264(logger, data, size, run));
+            if (!ran) {
+                failed = true;
+                break;
+            }
+            if (!iteration) {
+                first = run;
+            } else if (!(run == first)) {
+                fprintf(stderr, "%s: run %zu made %zu packs out of %zu NALs (checksum %016llx), "
+                                "first one %zu out of %zu (%016llx)\n",
+                        argv[i], iteration, run.number_of_packs, run.number_of_nals,
+                        (unsigned long long)run.checksum, first.number_of_packs,
+                        first.number_of_nals, (unsigned long long)first.checksum);
+                failed = true;
+                break;
+            }
+            total_duration += run.duration;
+        }
+        if (failed || !iterations) {
+            result = -1;
+            continue;
+        }
+
+        if (!header_printed) {
+            printf("%-32s %10s %12s %10s %12s %12s %12s\n", "Benchmark", "Time/run",
+                   "Iterations", "MB/s", "NALs/s", "QueueAl/pack", "Allocs/pack");
+            header_printed = true;
+        }
+        double run_duration = total_duration / iterations;
+        size_t packs = first.number_of_packs ? first.number_of_packs : 1;
+        std::string name
+            = std::string(vp8 ? "vp8/" : (length_prefixed ? "h264-avcc/" : "h264/")) + argv[i];
+        printf("%-32s %8.3fms %12zu %10.1f %12.0f %12.3f %12.3f\n", name.c_str(),
+               run_duration * 1000, iterations,
+               (double)first.number_of_bytes / run_duration / (1024.0 * 1024.0),
+               (double)first.number_of_nals / run_duration,
+               (double)first.number_of_queue_allocations / packs,
+               (double)first.number_of_allocations / packs);
+        printf("%-32s packs %zu, %s %zu, errors %zu, checksum %016llx\n", "", first.number_of_packs,
+               vp8 ? "frames" : "NALs", first.number_of_nals, logger.number_of_errors / iterations,
+               (unsigned long long)first.checksum);
+
+        BaselineEntry entry;
+        entry.number_of_packs = first.number_of_packs;
+        entry.number_of_nals = first.number_of_nals;
+        entry.checksum = first.checksum;
+        entry.queue_allocations = (double)first.number_of_queue_allocations / packs;
+        entry.allocations = (double)first.number_of_allocations / packs;
+        if (baseline_path && !compare_with_baseline(name, entry, baseline)) {
+            result = -1;
+        }
+        if (save_path) {
+            baseline[name] = entry;
+        }
+    }
+
+    if (save_path && !save_baseline(save_path, baseline)) {
+        result = -1;
+    }
+    if (baseline_path && !result) {
+        printf("Same as baseline %s\n", baseline_path);
+    }
+    return result;
+}
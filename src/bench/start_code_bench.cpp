@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <chrono>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h264_nal.hpp"
+#include "jpeg_parser.hpp"
+#include "stream.hpp"
+
+/* Micro-benchmark of start code/marker scanners. Give it real captures (raw
+ Annex B h264, or JPEG/MJPEG files - these are recognized by 0xff 0xd8 at the
+ begin) and it will walk every file from start to end, finding all the start
+ codes/markers with both byte-by-byte scalar version and the fast one, check
+ that results are the same, and print the throughput of both */
+
+using ScanFunction = const unsigned char *(*)(const unsigned char *, const unsigned char *);
+
+/* Returns number of codes found, and sum of their offsets as a checksum */
+static size_t scan(ScanFunction function, size_t code_size, const unsigned char *data,
+                   size_t size, size_t &checksum)
+{
+    const unsigned char *limit = data + size;
+    const unsigned char *ptr = function(data, limit);
+    size_t found = 0;
+    checksum = 0;
+    while (ptr) {
+        ++found;
+        checksum += ptr - data;
+        ptr = function(ptr + code_size, limit);
+    }
+    return found;
+}
+
+static double benchmark(ScanFunction function, size_t code_size, const unsigned char *data,
+                        size_t size, size_t iterations, size_t &found, size_t &checksum)
+{
+    auto before = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        found = scan(function, code_size, data, size, checksum);
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - before;
+    /* MB/s */
+    return (double)size * iterations / duration.count() / (1024.0 * 1024.0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage:\n%s [-n iterations] file0 [file1]...\n", argv[0]);
+        return -1;
+    }
+
+    size_t iterations = 20;
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc)) {
+            iterations = ::atoi(argv[++i]);
+            continue;
+        }
+
+        airtame::Stream stream;
+        if (!stream.open(argv[i])) {
+            result = -1;
+            continue;
+        }
+        const unsigned char *data = stream.get_read_pointer();
+        size_t size = stream.get_size_left();
+
+        bool jpeg = (size >= 2) && (0xff == data[0]) && (0xd8 == data[1]);
+        ScanFunction scalar = jpeg ? at_jpeg_next_marker_scalar : at_h264_next_start_code_scalar;
+        ScanFunction fast = jpeg ? at_jpeg_next_marker : at_h264_next_start_code;
+        size_t code_size = jpeg ? 2 : 4;
+
+        size_t scalar_found, scalar_checksum, fast_found, fast_checksum;
+        double scalar_speed = benchmark(scalar, code_size, data, size, iterations,
+                                        scalar_found, scalar_checksum);
+        double fast_speed = benchmark(fast, code_size, data, size, iterations,
+                                      fast_found, fast_checksum);
+
+        printf("%s (%s, %zu bytes, %zu %s):\n", argv[i], jpeg ? "JPEG" : "h264", size,
+               scalar_found, jpeg ? "markers" : "start codes");
+        printf("\tscalar: %8.1f MB/s\n", scalar_speed);
+        printf("\tfast:   %8.1f MB/s (x%.2f)\n", fast_speed, fast_speed / scalar_speed);
+        if ((scalar_found != fast_found) || (scalar_checksum != fast_checksum)) {
+            fprintf(stderr, "\tMISMATCH: fast version found %zu codes\n", fast_found);
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,830 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern "C" {
+#include <vpu_io.h>
+#include <vpu_lib.h>
+}
+
+#include "decode_scheduler.hpp"
+#include "latency_histogram.hpp"
+#include "pipeline_executor.hpp"
+#include "presentation_scheduler.hpp"
+#include "stream.hpp"
+#include "stream_handler.hpp"
+#include "vpu_frame_pool.hpp"
+
+/* Headless decode benchmark. Runs the same stream handler pipelines as
+ vpu_playback (so parser, pack queue and VPU decoder), but without display:
+ every decoded frame is handed straight back to the decoder and the next one
+ is decoded right away. So what gets measured is decoder throughput alone,
+ without blit cost or display pacing.
+
+ Files are decoded one after another, and for each one frames/s, per-frame
+ latency (time of a handler step producing one frame, usec), rolled back
+ decodes, decoder session opens and peak DMA usage are printed - either as
+ text or, with -j, as one JSON document to keep track of regressions.
+
+ With -c it answers "how many of these streams can the board play at once"
+ instead: the file is played by 1, 2, ... stream handlers at once, the way
+ vpu_playback -p does it (timestamp paced, sharing frame pool and
+ DecodeScheduler), but again without display. Every level runs for a while,
+ and once one can't keep all its streams on time, the ramp stops - what made
+ it this far is the capacity. Report has, per level, frames/s of each stream
+ against the rate of its timestamps, missed deadlines, VPU busy fraction and
+ peak DMA. -e has the streams parsed on worker threads (see
+ PipelineExecutor), as vpu_playback -e does, and levels report how busy each
+ worker core was
+
+ With -l every file is decoded twice, into linear and into tiled VPU frames
+ (see VPUFrameLayout), and each result also has DDR bytes read and written
+ while it ran, from the MMDC (i.MX6 DRAM controller) perf counters - which
+ count everything that used the memory meanwhile, so the rest of the system
+ should be quiet. Without the counters (kernel built without MMDC perf
+ support) only frames/s get compared */
+
+/* Where kernel describes MMDC perf counters */
+#define DDR_COUNTERS_PATH "/sys/bus/event_source/devices/mmdc"
+
+/* Defaults of -t and -m */
+#define CAPACITY_LEVEL_SECONDS 10
+#define CAPACITY_MAX_STREAMS 16
+/* Level is sustained when no more of its frames than that missed their
+ deadline (presented PRESENTATION_LATE_THRESHOLD late)... */
+#define CAPACITY_MAX_MISSED_RATIO 0.01
+/* ...and every stream kept at least this part of its timestamp frame rate */
+#define CAPACITY_MIN_REALTIME_RATIO 0.98
+
+class BenchResult {
+public:
+    const char *name = nullptr;
+    bool recognized = false;
+    size_t frames = 0;
+    double seconds = 0.0;
+    airtame::LatencyHistogram frame_latency;
+    /* Copy of the decoder stats, if handler has a decoder */
+    bool has_decoding_stats = false;
+    airtame::DecodingStats stats;
+    /* -l only */
+    const char *layout = nullptr;
+    bool has_ddr_traffic = false;
+    uint64_t ddr_read_bytes = 0;
+    uint64_t ddr_write_bytes = 0;
+
+    double get_fps() const
+    {
+        return (seconds > 0.0) ? frames / seconds : 0.0;
+    }
+};
+
+/* DDR bytes read and written, counted by the MMDC perf PMU */
+class DDRCounters {
+private:
+    int m_read = -1;
+    int m_write = -1;
+
+    static bool read_number(const char *name, const char *format, unsigned long &number)
+    {
+        std::string path = std::string(DDR_COUNTERS_PATH "/") + name;
+        FILE *file = ::fopen(path.c_str(), "r");
+        if (!file) {
+            return false;
+        }
+        bool read = (1 == ::fscanf(file, format, &number));
+        ::fclose(file);
+        return read;
+    }
+
+    static int open_counter(unsigned long type, unsigned long cpu, const char *event)
+    {
+        unsigned long config;
+        if (!read_number(event, " event=%lx", config)) {
+            return -1;
+        }
+        struct perf_event_attr attr;
+        ::memset(&attr, 0, sizeof(attr));
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        /* Uncore counter, counts for all processes on the CPU that owns it */
+        return ::syscall(__NR_perf_event_open, &attr, -1, (int)cpu, -1, 0);
+    }
+
+public:
+    DDRCounters()
+    {
+        unsigned long type;
+        unsigned long cpu;
+        if (!read_number("type", "%lu", type) || !read_number("cpumask", "%lu", cpu)) {
+            return;
+        }
+        m_read = open_counter(type, cpu, "events/read-bytes");
+        m_write = open_counter(type, cpu, "events/write-bytes");
+    }
+    DDRCounters(const DDRCounters &) = delete;
+    DDRCounters &operator=(const DDRCounters &) = delete;
+
+    ~DDRCounters()
+    {
+        if (m_read >= 0) {
+            ::close(m_read);
+        }
+        if (m_write >= 0) {
+            ::close(m_write);
+        }
+    }
+
+    bool is_available() const
+    {
+        return (m_read >= 0) && (m_write >= 0);
+    }
+
+    void start()
+    {
+        if (!is_available()) {
+            return;
+        }
+        ::ioctl(m_read, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(m_write, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(m_read, PERF_EVENT_IOC_ENABLE, 0);
+        ::ioctl(m_write, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    /* False if counters aren't there, or can't be read */
+    bool stop(uint64_t &read_bytes, uint64_t &write_bytes)
+    {
+        if (!is_available()) {
+            return false;
+        }
+        ::ioctl(m_read, PERF_EVENT_IOC_DISABLE, 0);
+        ::ioctl(m_write, PERF_EVENT_IOC_DISABLE, 0);
+        return (sizeof(read_bytes) == ::read(m_read, &read_bytes, sizeof(read_bytes)))
+            && (sizeof(write_bytes) == ::read(m_write, &write_bytes, sizeof(write_bytes)));
+    }
+};
+
+static void run(airtame::Stream &stream, BenchResult &result,
+                airtame::VPUFrameLayout layout = airtame::VPUFrameLayout::LINEAR,
+                DDRCounters *ddr = nullptr)
+{
+    airtame::StreamHandler *handler = airtame::produce_stream_handler(stream);
+    if (!handler) {
+        return;
+    }
+    handler->set_frame_layout(layout);
+    result.recognized = true;
+    if (!handler->init()) {
+        fprintf(stderr, "Couldn't init the decoder\n");
+        delete handler;
+        return;
+    }
+
+    if (ddr) {
+        ddr->start();
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        auto before = std::chrono::steady_clock::now();
+        if (!handler->step()) {
+            break;
+        }
+        result.frame_latency.add_usec_since(before);
+        ++result.frames;
+        /* Nothing to display, so previous frame goes back right away */
+        handler->swap();
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    result.seconds = duration.count();
+    if (ddr) {
+        result.has_ddr_traffic = ddr->stop(result.ddr_read_bytes, result.ddr_write_bytes);
+    }
+
+    const airtame::DecodingStats *stats = handler->get_decoding_stats();
+    if (stats) {
+        result.has_decoding_stats = true;
+        result.stats = *stats;
+    }
+    delete handler;
+}
+
+static void print_text(const BenchResult &result)
+{
+    if (result.layout) {
+        printf("%s (%s):\n", result.name, result.layout);
+    } else {
+        printf("%s:\n", result.name);
+    }
+    if (!result.recognized) {
+        printf("\tnot recognized\n");
+        return;
+    }
+    const airtame::LatencyHistogram &latency = result.frame_latency;
+    printf("\t%zu frames in %.2fs, %.2f frames/s\n", result.frames, result.seconds,
+           result.get_fps());
+    printf("\tframe latency (usec): avg %" PRId64 ", p50 %" PRId64 ", p90 %" PRId64
+           ", p99 %" PRId64 ", max %" PRId64 "\n",
+           latency.get_average(), latency.get_percentile(50), latency.get_percentile(90),
+           latency.get_percentile(99), latency.get_max());
+    if (result.has_ddr_traffic) {
+        double mb = 1024 * 1024;
+        printf("\tDDR read %.1fMB, written %.1fMB, %.2fMB per frame\n",
+               result.ddr_read_bytes / mb, result.ddr_write_bytes / mb,
+               result.frames ? (result.ddr_read_bytes + result.ddr_write_bytes) / mb / result.frames
+                             : 0.0);
+    } else if (result.layout) {
+        printf("\tDDR traffic not available\n");
+    }
+    if (!result.has_decoding_stats) {
+        return;
+    }
+    const airtame::DecodingStats &stats = result.stats;
+    printf("\tdecode latency (usec): avg %" PRId64 ", p50 %" PRId64 ", p99 %" PRId64
+           ", max %" PRId64 "\n",
+           stats.decode_latency.get_average(), stats.decode_latency.get_percentile(50),
+           stats.decode_latency.get_percentile(99), stats.decode_latency.get_max());
+    printf("\t%zu decodes, %zu rolled back, %zu session opens\n",
+           stats.number_of_decode_operations, stats.number_of_rolled_back_decodes,
+           stats.number_of_session_opens);
+    printf("\topen to first frame (usec): avg %" PRId64 ", max %" PRId64 "\n",
+           stats.open_to_first_frame_latency.get_average(),
+           stats.open_to_first_frame_latency.get_max());
+    printf("\tpeak DMA %.2fMB\n", (double)stats.max_dma_allocation_size / (1024 * 1024));
+}
+
+static void print_json_histogram(const char *name, const airtame::LatencyHistogram &histogram)
+{
+    printf("\"%s\": {\"avg\": %" PRId64 ", \"p50\": %" PRId64 ", \"p90\": %" PRId64
+           ", \"p99\": %" PRId64 ", \"max\": %" PRId64 "}",
+           name, histogram.get_average(), histogram.get_percentile(50),
+           histogram.get_percentile(90), histogram.get_percentile(99), histogram.get_max());
+}
+
+/* Prints file name as JSON string, escaping what needs to be escaped */
+static void print_json_string(const char *string)
+{
+    putchar('"');
+    for (const char *c = string; *c; ++c) {
+        if (('"' == *c) || ('\\' == *c)) {
+            printf("\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            printf("\\u%04x", (unsigned char)*c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_json(const BenchResult &result)
+{
+    printf("    {\"file\": ");
+    print_json_string(result.name);
+    if (result.layout) {
+        printf(", \"layout\": \"%s\"", result.layout);
+    }
+    printf(", \"recognized\": %s", result.recognized ? "true" : "false");
+    if (result.recognized) {
+        printf(", \"frames\": %zu, \"seconds\": %.3f, \"fps\": %.2f, ", result.frames,
+               result.seconds, result.get_fps());
+        print_json_histogram("frame_latency_usec", result.frame_latency);
+    }
+    if (result.has_ddr_traffic) {
+        printf(", \"ddr_read_bytes\": %" PRIu64 ", \"ddr_write_bytes\": %" PRIu64,
+               result.ddr_read_bytes, result.ddr_write_bytes);
+    }
+    if (result.has_decoding_stats) {
+        const airtame::DecodingStats &stats = result.stats;
+        printf(", ");
+        print_json_histogram("decode_latency_usec", stats.decode_latency);
+        printf(", ");
+        print_json_histogram("open_to_first_frame_usec", stats.open_to_first_frame_latency);
+        printf(", \"decodes\": %zu, \"rolled_back_decodes\": %zu, \"session_opens\": %zu"
+               ", \"peak_dma_bytes\": %zu",
+               stats.number_of_decode_operations, stats.number_of_rolled_back_decodes,
+               stats.number_of_session_opens, stats.max_dma_allocation_size);
+    }
+    printf("}");
+}
+
+class CapacityStream {
+public:
+    size_t frames = 0;
+    size_t missed_deadlines = 0;
+    airtame::Timestamp first_timestamp = 0;
+    airtame::Timestamp last_timestamp = 0;
+    std::chrono::steady_clock::time_point first_presented;
+    double fps = 0.0;
+    /* What the stream declares, see StreamHandler::get_frame_rate() */
+    double declared_fps = 0.0;
+
+    /* Rate the stream asks for. Frames presented only tell it when none were
+     shed or skipped, as span of their timestamps covers these too */
+    double get_nominal_fps() const
+    {
+        if (declared_fps > 0.0) {
+            return declared_fps;
+        }
+        airtame::Timestamp span = last_timestamp - first_timestamp;
+        return ((frames > 1) && (span > 0)) ? (frames - 1) * 1000000.0 / span : 0.0;
+    }
+};
+
+class CapacityLevel {
+public:
+    size_t number_of_streams = 0;
+    double seconds = 0.0;
+    /* Some stream ended before the level could run its time */
+    bool short_of_input = false;
+    std::vector<CapacityStream> streams;
+    /* Sum of streams' parts of VPU time */
+    double vpu_busy = 0.0;
+    /* Most DMA memory decoders held at once, sampled each round */
+    size_t peak_dma_size = 0;
+    size_t peak_pool_size = 0;
+    /* With -e, busy part of each worker */
+    std::vector<airtame::PipelineExecutor::Utilization> workers;
+
+    size_t get_number_of_frames() const
+    {
+        size_t frames = 0;
+        for (auto &stream : streams) {
+            frames += stream.frames;
+        }
+        return frames;
+    }
+
+    size_t get_number_of_missed_deadlines() const
+    {
+        size_t missed = 0;
+        for (auto &stream : streams) {
+            missed += stream.missed_deadlines;
+        }
+        return missed;
+    }
+
+    double get_min_fps() const
+    {
+        double fps = streams.empty() ? 0.0 : streams.front().fps;
+        for (auto &stream : streams) {
+            fps = (stream.fps < fps) ? stream.fps : fps;
+        }
+        return fps;
+    }
+
+    bool is_sustained() const
+    {
+        size_t frames = get_number_of_frames();
+        if (streams.empty() || !frames
+            || ((double)get_number_of_missed_deadlines() / frames > CAPACITY_MAX_MISSED_RATIO)) {
+            return false;
+        }
+        for (auto &stream : streams) {
+            if (stream.fps < CAPACITY_MIN_REALTIME_RATIO * stream.get_nominal_fps()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+class CapacityResult {
+public:
+    const char *name = nullptr;
+    bool recognized = false;
+    size_t width = 0;
+    size_t height = 0;
+    double seconds_per_level = CAPACITY_LEVEL_SECONDS;
+    size_t max_streams = CAPACITY_MAX_STREAMS;
+    /* Parses streams, with -e */
+    std::shared_ptr<airtame::PipelineExecutor> executor;
+    std::vector<CapacityLevel> levels;
+
+    /* Most streams played on time */
+    size_t get_capacity() const
+    {
+        size_t capacity = 0;
+        for (auto &level : levels) {
+            if (level.is_sustained()) {
+                capacity = level.number_of_streams;
+            }
+        }
+        return capacity;
+    }
+};
+
+/* Plays number_of_streams copies of the file at once, paced, until level
+ time is up. False if file can't be played at all */
+static bool run_level(const char *name, CapacityResult &result, CapacityLevel &level)
+{
+    std::list<airtame::StreamHandler *> handlers;
+    std::shared_ptr<airtame::VPUFramePool> frame_pool = airtame::VPUFramePool::create();
+    bool played = true;
+    for (size_t n = 0; played && (n < level.number_of_streams); n++) {
+        airtame::Stream stream;
+        airtame::StreamHandler *handler = stream.open(name)
+            ? airtame::produce_stream_handler(stream) : nullptr;
+        if (!handler) {
+            played = false;
+            break;
+        }
+        handler->set_frame_pool(frame_pool);
+        /* Streams that can start over do, so that level runs its time */
+        handler->set_looping(true);
+        if (!handler->init()) {
+            fprintf(stderr, "Couldn't init the decoder\n");
+            delete handler;
+            played = false;
+            break;
+        }
+        handlers.push_back(handler);
+    }
+    result.recognized = result.recognized || !handlers.empty();
+
+    airtame::PresentationScheduler presentation;
+    std::unique_ptr<airtame::DecodeScheduler> scheduler;
+    if (played) {
+        for (size_t n = 0; n < handlers.size(); ++n) {
+            presentation.add_stream();
+        }
+        scheduler.reset(new airtame::DecodeScheduler(handlers, result.executor));
+        for (size_t n = 0; n < handlers.size(); ++n) {
+            scheduler->set_clock(n, presentation.get_clock(n));
+        }
+    }
+    level.streams.resize(handlers.size());
+    size_t stream = 0;
+    for (auto h : handlers) {
+        level.streams[stream++].declared_fps = h->get_frame_rate();
+    }
+    if (result.executor) {
+        /* Counts from here */
+        result.executor->get_utilization();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::microseconds((airtame::Timestamp)(result.seconds_per_level
+                                                                      * 1000000));
+    while (played && (std::chrono::steady_clock::now() < end)) {
+        if (!scheduler->step() && !scheduler->has_pending_work()) {
+            level.short_of_input = true;
+            break;
+        }
+        /* Per decoder peaks come at different times, their sum is more than
+         was ever held */
+        size_t dma_size = 0;
+        for (auto h : handlers) {
+            const airtame::DecodingStats *stats = h->get_decoding_stats();
+            if (stats) {
+                dma_size += stats->current_dma_allocation_size;
+            }
+        }
+        if (level.peak_dma_size < dma_size) {
+            level.peak_dma_size = dma_size;
+        }
+        scheduler->prepare_all();
+
+        /* Nothing is displayed, frames are just presented when due */
+        bool found = false;
+        airtame::Timestamp earliest = 0;
+        size_t n = 0;
+        for (auto h : handlers) {
+            const airtame::VPUOutputFrame *frame = h->get_decoded_frame();
+            if (frame && frame->meta) {
+                airtame::Timestamp until
+                    = presentation.get_time_until_due(n, frame->meta.get_timestamp());
+                if (!found || (until < earliest)) {
+                    earliest = until;
+                    found = true;
+                }
+            }
+            ++n;
+        }
+        if (earliest > 0) {
+            ::usleep(earliest);
+        }
+        n = 0;
+        for (auto h : handlers) {
+            const airtame::VPUOutputFrame *frame = h->get_decoded_frame();
+            CapacityStream &stream = level.streams[n];
+            if (frame && frame->meta) {
+                airtame::Timestamp timestamp = frame->meta.get_timestamp();
+                airtame::Timestamp until = presentation.get_time_until_due(n, timestamp);
+                if (until <= 0) {
+                    if (!stream.frames) {
+                        stream.first_timestamp = timestamp;
+                        stream.first_presented = std::chrono::steady_clock::now();
+                    } else if (-until > PRESENTATION_LATE_THRESHOLD) {
+                        ++stream.missed_deadlines;
+                    }
+                    stream.last_timestamp = timestamp;
+                    ++stream.frames;
+                    presentation.presented(n, timestamp);
+                    h->swap();
+                }
+            } else if (frame) {
+                h->swap();
+            }
+            if (h->end()) {
+                level.short_of_input = true;
+            }
+            ++n;
+        }
+        if (level.short_of_input) {
+            break;
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+    std::chrono::duration<double> duration = finish - start;
+    level.seconds = duration.count();
+    if (result.executor) {
+        level.workers = result.executor->get_utilization();
+    }
+
+    size_t n = 0;
+    for (auto h : handlers) {
+        CapacityStream &stream = level.streams[n];
+        std::chrono::duration<double> presenting = finish - stream.first_presented;
+        if ((stream.frames > 1) && (presenting.count() > 0.0)) {
+            stream.fps = (stream.frames - 1) / presenting.count();
+        }
+        size_t id;
+        if (scheduler && scheduler->get_stream(n, id)) {
+            level.vpu_busy += scheduler->get_vpu_scheduler().get_utilization(id);
+        }
+        if (!result.width && h->get_last_frame().has_data()) {
+            result.width = h->get_last_frame().geometry.m_true_width;
+            result.height = h->get_last_frame().geometry.m_true_height;
+        }
+        ++n;
+    }
+    level.peak_pool_size = frame_pool->get_max_total_size();
+
+    scheduler.reset();
+    while (!handlers.empty()) {
+        delete handlers.front();
+        handlers.pop_front();
+    }
+    return played;
+}
+
+/* Ramps up to the first level that isn't sustained */
+static void run_capacity(const char *name, CapacityResult &result)
+{
+    for (size_t streams = 1; streams <= result.max_streams; streams++) {
+        CapacityLevel level;
+        level.number_of_streams = streams;
+        if (!run_level(name, result, level)) {
+            break;
+        }
+        result.levels.push_back(level);
+        fprintf(stderr, "%zu streams: %.2f frames/s slowest, %zu of %zu frames late, VPU %.1f%% "
+                        "busy\n",
+                streams, level.get_min_fps(), level.get_number_of_missed_deadlines(),
+                level.get_number_of_frames(), 100 * level.vpu_busy);
+        if (!level.is_sustained()) {
+            break;
+        }
+    }
+}
+
+static void print_capacity_text(const CapacityResult &result)
+{
+    printf("%s:\n", result.name);
+    if (!result.recognized) {
+        printf("\tnot recognized\n");
+        return;
+    }
+    printf("\t%zux%zu, %zu streams sustained\n", result.width, result.height,
+           result.get_capacity());
+    for (auto &level : result.levels) {
+        double nominal = level.streams.empty() ? 0.0 : level.streams.front().get_nominal_fps();
+        printf("\t%zu streams%s: %.2f frames/s slowest (of %.2f), %zu of %zu frames missed "
+               "deadline, VPU %.1f%% busy, peak DMA %.2fMB (pool %.2fMB)%s\n",
+               level.number_of_streams, level.is_sustained() ? "" : " (not sustained)",
+               level.get_min_fps(), nominal, level.get_number_of_missed_deadlines(),
+               level.get_number_of_frames(), 100 * level.vpu_busy,
+               (double)level.peak_dma_size / (1024 * 1024),
+               (double)level.peak_pool_size / (1024 * 1024),
+               level.short_of_input ? ", input ended early" : "");
+        for (auto &worker : level.workers) {
+            printf("\t\tcore %d %.1f%% busy, %zu tasks, %zu stolen\n", worker.core,
+                   100 * worker.busy, worker.number_of_tasks, worker.number_of_steals);
+        }
+    }
+}
+
+static void print_capacity_json(const CapacityResult &result)
+{
+    printf("    {\"file\": ");
+    print_json_string(result.name);
+    printf(", \"recognized\": %s", result.recognized ? "true" : "false");
+    printf(", \"width\": %zu, \"height\": %zu, \"seconds_per_level\": %.1f, \"max_streams\": %zu"
+           ", \"max_missed_ratio\": %.3f, \"min_realtime_ratio\": %.3f"
+           ", \"sustained_streams\": %zu, \"levels\": [",
+           result.width, result.height, result.seconds_per_level, result.max_streams,
+           CAPACITY_MAX_MISSED_RATIO, CAPACITY_MIN_REALTIME_RATIO, result.get_capacity());
+    bool first = true;
+    for (auto &level : result.levels) {
+        printf("%s\n        {\"streams\": %zu, \"sustained\": %s, \"seconds\": %.3f"
+               ", \"input_ended_early\": %s, \"frames\": %zu, \"missed_deadlines\": %zu"
+               ", \"vpu_busy\": %.4f, \"peak_dma_bytes\": %zu, \"peak_pool_bytes\": %zu"
+               ", \"per_stream\": [",
+               first ? "" : ",", level.number_of_streams,
+               level.is_sustained() ? "true" : "false", level.seconds,
+               level.short_of_input ? "true" : "false", level.get_number_of_frames(),
+               level.get_number_of_missed_deadlines(), level.vpu_busy, level.peak_dma_size,
+               level.peak_pool_size);
+        for (size_t n = 0; n < level.streams.size(); n++) {
+            const CapacityStream &stream = level.streams[n];
+            printf("%s{\"fps\": %.2f, \"nominal_fps\": %.2f, \"frames\": %zu"
+                   ", \"missed_deadlines\": %zu}",
+                   n ? ", " : "", stream.fps, stream.get_nominal_fps(), stream.frames,
+                   stream.missed_deadlines);
+        }
+        printf("], \"workers\": [");
+        for (size_t n = 0; n < level.workers.size(); n++) {
+            const airtame::PipelineExecutor::Utilization &worker = level.workers[n];
+            printf("%s{\"core\": %d, \"busy\": %.4f, \"tasks\": %zu, \"stolen\": %zu}",
+                   n ? ", " : "", worker.core, worker.busy, worker.number_of_tasks,
+                   worker.number_of_steals);
+        }
+        printf("]}");
+        first = false;
+    }
+    printf("\n    ]}");
+}
+
+int main(int argc, char *argv[])
+{
+    /* -c ramps streams up (capacity mode), -t seconds each level runs, -m
+     most streams tried, -e parses on worker threads, -l compares frame
+     layouts. -j can go anywhere */
+    bool capacity = false;
+    bool executor_enabled = false;
+    bool layouts = false;
+    double seconds_per_level = CAPACITY_LEVEL_SECONDS;
+    size_t max_streams = CAPACITY_MAX_STREAMS;
+    const char *program = argv[0];
+    while (argc > 1) {
+        if (!strcmp(argv[1], "-c")) {
+            capacity = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-l")) {
+            layouts = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-e")) {
+            executor_enabled = true;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-t")) {
+            seconds_per_level = ::atof(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && !strcmp(argv[1], "-m")) {
+            max_streams = ::atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    if ((argc < 2) || (seconds_per_level <= 0) || !max_streams || (capacity && layouts)) {
+        fprintf(stderr, "Usage:\n%s [-j] file0 [file1]...\n"
+                        "%s -c [-j] [-e] [-t seconds] [-m streams] file0 [file1]...\n"
+                        "%s -l [-j] file0 [file1]...\n",
+                program, program, program);
+        return -1;
+    }
+    /* One for all the levels, so that worker threads start once */
+    std::shared_ptr<airtame::PipelineExecutor> executor;
+    if (capacity && executor_enabled) {
+        executor.reset(new airtame::PipelineExecutor(
+            airtame::PipelineExecutor::get_default_number_of_workers()));
+    }
+    DDRCounters ddr;
+    if (layouts && !ddr.is_available()) {
+        fprintf(stderr, "No MMDC perf counters, DDR traffic won't be measured\n");
+    }
+
+    /* Gotta init VPU, or decode init will fail */
+    if (RETCODE_SUCCESS != vpu_Init(nullptr)) {
+        fprintf(stderr, "Could not initialize the VPU\n");
+        return -1;
+    }
+
+    /* Output mode has to be known before the first result gets printed */
+    bool json = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j")) {
+            json = true;
+        }
+    }
+    const char *json_name = capacity ? "capacity" : "results";
+
+    bool first = true;
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j")) {
+            continue;
+        }
+
+        if (json) {
+            printf(first ? "{\"%s\": [\n" : ",\n", json_name);
+        }
+        first = false;
+
+        if (capacity) {
+            CapacityResult bench;
+            bench.name = argv[i];
+            bench.seconds_per_level = seconds_per_level;
+            bench.max_streams = max_streams;
+            bench.executor = executor;
+            run_capacity(argv[i], bench);
+            if (!bench.recognized) {
+                result = -1;
+            }
+            if (json) {
+                print_capacity_json(bench);
+            } else {
+                print_capacity_text(bench);
+            }
+            continue;
+        }
+
+        if (layouts) {
+            /* Same file decoded into each layout, one after the other */
+            const airtame::VPUFrameLayout compared[] = {airtame::VPUFrameLayout::LINEAR,
+                                                        airtame::VPUFrameLayout::TILED};
+            for (airtame::VPUFrameLayout layout : compared) {
+                BenchResult bench;
+                bench.name = argv[i];
+                bench.layout = (airtame::VPUFrameLayout::TILED == layout) ? "tiled" : "linear";
+                airtame::Stream stream;
+                if (stream.open(argv[i])) {
+                    run(stream, bench, layout, &ddr);
+                }
+                if (!bench.recognized) {
+                    result = -1;
+                }
+                if (json) {
+                    if (airtame::VPUFrameLayout::TILED == layout) {
+                        printf(",\n");
+                    }
+                    print_json(bench);
+                } else {
+                    print_text(bench);
+                }
+            }
+            continue;
+        }
+
+        BenchResult bench;
+        bench.name = argv[i];
+        airtame::Stream stream;
+        if (stream.open(argv[i])) {
+            run(stream, bench);
+        }
+        if (!bench.recognized) {
+            result = -1;
+        }
+
+        if (json) {
+            print_json(bench);
+        } else {
+            print_text(bench);
+        }
+    }
+
+    if (json) {
+        if (first) {
+            printf("{\"%s\": []}\n", json_name);
+        } else {
+            printf("\n]}\n");
+        }
+    }
+
+    vpu_UnInit();
+    return result;
+}
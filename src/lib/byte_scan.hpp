@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AT_BYTE_SCAN_BLOCK_SIZE 16
+#else
+#define AT_BYTE_SCAN_BLOCK_SIZE 8
+#endif
+
+/* Helper for start code/marker scanners. Both H264 start codes and JPEG
+ markers begin with particular byte (0x00 or 0xff), and in real data most of
+ the bytes are something else. So instead of looking at every byte we can skip
+ over whole blocks not containing that byte, and leave the exact checking to
+ caller.
+
+ Returns pointer to the first block that contains the value (that is, value
+ is in [result, result + AT_BYTE_SCAN_BLOCK_SIZE)), or to the first byte of the
+ tail shorter than a block, that needs to be checked byte-by-byte. Never reads
+ at or beyond limit */
+inline const unsigned char *at_skip_blocks_without_byte(const unsigned char *ptr,
+                                                        const unsigned char *limit,
+                                                        unsigned char value)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t pattern = vdupq_n_u8(value);
+    while (limit - ptr >= 16) {
+        uint64x2_t equal = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(ptr), pattern));
+        if (vgetq_lane_u64(equal, 0) | vgetq_lane_u64(equal, 1)) {
+            break;
+        }
+        ptr += 16;
+    }
+#else
+    /* Classic "does word have zero byte" trick, after XOR-ing with pattern
+     bytes equal to value become zero */
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t pattern = ones * value;
+    while (limit - ptr >= 8) {
+        uint64_t word;
+        ::memcpy(&word, ptr, 8); /* Compiles to plain load, but alignment-safe */
+        word ^= pattern;
+        if ((word - ones) & ~word & highs) {
+            break;
+        }
+        ptr += 8;
+    }
+#endif
+    return ptr;
+}
@@ -12,6 +12,7 @@
 #include <stdint.h>
 
 #include "frame_meta_data.hpp"
+#include "latency_histogram.hpp"
 
 namespace airtame {
 
@@ -23,7 +24,7 @@ namespace airtame {
 class VideoBuffer {
 public:
     const unsigned char *data = nullptr;
-    std::shared_ptr<FrameMetaData> meta;
+    FrameMeta meta;
     size_t size = 0;
     using FreeCallback = std::function<void(void)>;
     FreeCallback free_callback = 0;
@@ -123,10 +124,122 @@ public:
     size_t number_of_decode_operations = 0;
     /* Number of decode operations rolled back with NOT_ENOUGH_DATA */
     size_t number_of_rolled_back_decodes = 0;
+    /* Number of decoding sessions opened (first one and all the reopens) */
+    size_t number_of_session_opens = 0;
+    /* Decoded frames that got metadata of other pack than the one fed last,
+     judging by bitstream buffer read index (see VPUBitstreamBufferMonitoring) */
+    size_t number_of_reattributed_frames = 0;
     /* Longest decode operation (msec) */
     Timestamp max_decode_duration = 0;
     /* Biggest DMA allocation size */
     size_t max_dma_allocation_size = 0;
+    /* Most frame memory borrowed from shared VPUFramePool at once (bytes),
+     zero when decoder doesn't use one */
+    size_t max_pooled_frame_memory = 0;
+    /* Sizes of decoder buffers (bytes) as chosen for current stream
+     parameters, see VPUDecoderBuffers::init_for_h264(), and number of times
+     stream turned out to need bigger bitstream buffer than that */
+    size_t bitstream_buffer_size = 0;
+    size_t slice_buffer_size = 0;
+    size_t ps_save_buffer_size = 0;
+    size_t mb_prediction_buffer_size = 0;
+    size_t number_of_bitstream_buffer_grows = 0;
+    /* Number of times pack didn't fit into free bitstream buffer space, and
+     the rest of it was left to be fed on later step */
+    size_t number_of_partial_feeds = 0;
+    /* Number of decoder reopens that used frames allocated ahead of time
+     (see VPUFrameBuffers::prewarm()), and allocation time it saved (msec) */
+    size_t number_of_prewarmed_reopens = 0;
+    Timestamp total_prewarm_time_saved = 0;
+    /* Number of slices in decoded h264 pictures, summed up and maximum */
+    size_t number_of_slices_decoded = 0;
+    size_t max_slices_per_picture = 0;
+    /* Part of above decode operations (and their time, msec) that were fed
+     in one go, see Pack::m_coalesce_chunks */
+    size_t number_of_coalesced_decode_operations = 0;
+    Timestamp total_coalesced_decoding_time = 0;
+    /* Packs dropped before decode by PackQueue drop policy, and latency
+     (in timestamp units) it recovered by that: first by dropping
+     non-reference packs, then by jumping to decoding reopen points */
+    size_t number_of_non_reference_packs_dropped = 0;
+    Timestamp latency_recovered_by_non_reference_drops = 0;
+    size_t number_of_jumps = 0;
+    size_t number_of_packs_dropped_by_jumps = 0;
+    Timestamp latency_recovered_by_jumps = 0;
+    /* Packs dropped before decode for trick play (see TrickPlayDropPolicy):
+     by fast forward, jumps it made between reopen points (their packs are
+     counted in the former), and packs precise seek didn't need to decode to
+     get to its target */
+    size_t number_of_fast_forward_packs_dropped = 0;
+    size_t number_of_fast_forward_jumps = 0;
+    size_t number_of_preroll_packs_dropped = 0;
+    /* Inter frame packs dropped in keyframes only mode, see
+     VPUDecoder::set_keyframes_only() */
+    size_t number_of_inter_packs_skipped = 0;
+    /* Changes of display frame reserve on reopening, see
+     VPUDecoder::set_display_frame_bounds() */
+    size_t number_of_display_reserve_grows = 0;
+    size_t number_of_display_reserve_shrinks = 0;
+    /* Parameter set chunks not fed, because session had them already, see
+     VPUDecodingSession::has_parameter_set() */
+    size_t number_of_parameter_sets_skipped = 0;
+    /* DMA allocations that failed on decoder (re)opening, and steps decoder
+     took down because of these (see VPUMemoryPressure): display reserve
+     shrinks, reclaims of idle pool frames (and memory that freed, bytes),
+     falls back to keyframes only, and times it ran out of steps. Also steps
+     it tried back up (failing one takes it down again), and level it is on
+     now */
+    size_t number_of_dma_allocation_failures = 0;
+    size_t number_of_pressure_reserve_shrinks = 0;
+    size_t number_of_pool_reclaims = 0;
+    size_t total_pool_memory_reclaimed = 0;
+    size_t number_of_pressure_keyframes_only_fallbacks = 0;
+    size_t number_of_memory_starvations = 0;
+    size_t number_of_memory_pressure_recoveries = 0;
+    size_t memory_pressure_level = 0;
+    /* Streams following each other in the same queue (see
+     Pack::m_ends_stream) that went on in the same decoder session, and ones
+     that needed decoder flushed and opened again */
+    size_t number_of_seamless_transitions = 0;
+    size_t number_of_flushed_transitions = 0;
+
+    /* Per stage latency (usec) of decode operations: feeding the pack into
+     bitstream buffer, waiting for VPU interrupt, getting output info, and all
+     of the decode call. Also of returning frames back to the decoder */
+    LatencyHistogram feed_latency;
+    LatencyHistogram wait_for_interrupt_latency;
+    LatencyHistogram output_info_latency;
+    LatencyHistogram decode_latency;
+    LatencyHistogram frame_return_latency;
+    /* Time consumer held frames given out (usec), from output to return,
+     kept with adaptive display frame reserve only */
+    LatencyHistogram display_hold_latency;
+    /* Time from one decode finishing to the next one starting (usec), so what
+     VPU spends waiting for the host, and time spent feeding packs ahead (see
+     VPUDecoder::set_feed_ahead()) */
+    LatencyHistogram decode_gap_latency;
+    LatencyHistogram feed_ahead_latency;
+    /* Time from decoder session open to its first frame given out (usec),
+     and number of sessions VPU initial info disagreed with what parser told
+     about the picture (see VPUDecodingSession::check_initial_info()) */
+    LatencyHistogram open_to_first_frame_latency;
+    size_t number_of_initial_info_mismatches = 0;
+    /* Time spent in VPUBusyCallback while VPU was decoding (usec), and
+     number of times VPU finished before the callback did */
+    LatencyHistogram busy_work_latency;
+    size_t number_of_busy_work_overruns = 0;
+    /* Bytes fed into the decoder, and the wall clock time (usec, steady
+     clock) of the first and the last feed, to tell input bitrate */
+    uint64_t total_bytes_fed = 0;
+    Timestamp first_feed_time = 0;
+    Timestamp last_feed_time = 0;
+    /* Number of packs waiting in PackQueue, sampled on every step */
+    size_t accumulated_queue_depth = 0;
+    size_t number_of_queue_depth_samples = 0;
+    size_t max_queue_depth = 0;
+    /* DMA memory (bytes) held by the decoder for current session, buffers
+     and frames together */
+    size_t current_dma_allocation_size = 0;
 
     void update_decode_timing(Timestamp last_duration)
     {
@@ -136,11 +249,126 @@ public:
         }
     }
 
+    void update_slice_count(size_t number_of_slices)
+    {
+        number_of_slices_decoded += number_of_slices;
+        if (max_slices_per_picture < number_of_slices) {
+            max_slices_per_picture = number_of_slices;
+        }
+    }
+
+    void update_coalesced_decode_timing(Timestamp last_duration)
+    {
+        ++number_of_coalesced_decode_operations;
+        total_coalesced_decoding_time += last_duration;
+    }
+
     void update_dma_allocation_size(size_t current_size)
     {
+        current_dma_allocation_size = current_size;
         if (max_dma_allocation_size < current_size) {
             max_dma_allocation_size = current_size;
         }
     }
+
+    void update_bytes_fed(size_t size)
+    {
+        Timestamp now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (!total_bytes_fed) {
+            first_feed_time = now;
+        }
+        last_feed_time = now;
+        total_bytes_fed += size;
+    }
+
+    void update_queue_depth(size_t depth)
+    {
+        accumulated_queue_depth += depth;
+        ++number_of_queue_depth_samples;
+        if (max_queue_depth < depth) {
+            max_queue_depth = depth;
+        }
+    }
+
+    /* Input bitrate (bits per second of wall clock) since the first feed */
+    uint64_t get_bitrate() const
+    {
+        if (last_feed_time <= first_feed_time) {
+            return 0;
+        }
+        return total_bytes_fed * 8 * 1000000 / (last_feed_time - first_feed_time);
+    }
+
+    double get_average_queue_depth() const
+    {
+        if (!number_of_queue_depth_samples) {
+            return 0.0;
+        }
+        return (double)accumulated_queue_depth / number_of_queue_depth_samples;
+    }
+
+    /* One line summary (the way snprintf() does it): stage latencies as
+     avg/p50/p99/max usec, then bitrate, queue depth and DMA usage */
+    int print_summary(char *buffer, size_t size) const
+    {
+        const LatencyHistogram *histograms[] = {
+            &feed_latency, &wait_for_interrupt_latency, &output_info_latency,
+            &decode_latency, &frame_return_latency, &decode_gap_latency
+        };
+        const char *names[] = { "feed", "wait", "info", "decode", "return", "gap" };
+        size_t total = 0;
+        for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); ++i) {
+            size_t offset = (total < size) ? total : size;
+            int printed = histograms[i]->print_summary(buffer + offset, size - offset, names[i]);
+            if (printed < 0) {
+                return printed;
+            }
+            total += printed + 1;
+            /* Separator replaces the terminator, if it fit */
+            if (total < size) {
+                buffer[total - 1] = ' ';
+            }
+        }
+        size_t offset = (total < size) ? total : size;
+        int printed = snprintf(buffer + offset, size - offset,
+                               "%.2fMbit/s queue %.1f/%zu DMA %.2fMB",
+                               (double)get_bitrate() / 1000000, get_average_queue_depth(),
+                               max_queue_depth,
+                               (double)current_dma_allocation_size / (1024 * 1024));
+        return (printed < 0) ? printed : (int)total + printed;
+    }
+};
+
+class ParsingStats {
+public:
+    /* Number of NALs handled by stream parser, and summed up/longest time
+     spent handling single one (nsec, NALs are handled way below 1 usec) */
+    size_t number_of_nals_parsed = 0;
+    Timestamp total_nal_parsing_time = 0;
+    Timestamp max_nal_parsing_duration = 0;
+    /* Number of slice headers parsed, and how many of these turned out to
+     continue already started picture */
+    size_t number_of_slice_headers_parsed = 0;
+    size_t number_of_continuation_slices = 0;
+    /* Number of non-IDR pictures marked as reopen points, because recovery
+     point SEI came with them */
+    size_t number_of_recovery_points = 0;
+    /* SPS/PPS NALs that came again unchanged, and so were not parsed */
+    size_t number_of_repeated_parameter_sets = 0;
+    /* Same NAL handling time, histogram of it. Unlike stage latencies of
+     DecodingStats this is in nsec, usec buckets would have all NALs in the
+     first one */
+    LatencyHistogram nal_parsing_latency_nsec;
+
+    void update_nal_parsing_timing(Timestamp last_duration_nsec)
+    {
+        nal_parsing_latency_nsec.add(last_duration_nsec);
+        ++number_of_nals_parsed;
+        total_nal_parsing_time += last_duration_nsec;
+        if (max_nal_parsing_duration < last_duration_nsec) {
+            max_nal_parsing_duration = last_duration_nsec;
+        }
+    }
 };
 }
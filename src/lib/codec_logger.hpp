@@ -7,9 +7,29 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most verbose level compiled in, messages above it (see CodecLogger levels)
+ are gone from the build together with their arguments. Everything by
+ default, production builds can go with -DCODEC_LOG_LEVEL=2 (warnings) */
+#ifndef CODEC_LOG_LEVEL
+#define CODEC_LOG_LEVEL 5
+#endif
+
+/* Shortest time (usec) between two messages of the same rate limited call
+ site, see codec_log_limited() */
+#define CODEC_LOG_RATE_LIMIT_PERIOD 1000000
+
 namespace airtame {
 
 class CodecLogger {
+private:
+    int m_level = TRACE;
+
 public:
     enum { FATAL = 0, ERROR, WARNING, INFO, DEBUG, TRACE };
 
@@ -18,24 +38,85 @@ public:
     virtual void Log(int severity, const char *file, const char *func, int line, const char *format,
                      ...)
         = 0;
+
+    /* Most verbose level logged, on top of CODEC_LOG_LEVEL. Checked by the
+     macros below before anything gets formatted, or Log() called. Everything
+     by default */
+    void set_level(int level)
+    {
+        m_level = level;
+    }
+
+    bool is_enabled(int severity) const
+    {
+        return severity <= m_level;
+    }
 };
 
-#define codec_log_trace(logger, ...)                                                                 \
-    (logger).Log(CodecLogger::TRACE, __FILE__, __func__, __LINE__, __VA_ARGS__)
+/* Lets messages of one call site through once per CODEC_LOG_RATE_LIMIT_PERIOD,
+ counting the ones it held back in the meantime. Safe to use from several
+ threads */
+class CodecLogRateLimiter {
+private:
+    std::atomic<int64_t> m_next{ 0 };
+    std::atomic<size_t> m_suppressed{ 0 };
+
+public:
+    bool allow(size_t &suppressed)
+    {
+        int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t next = m_next.load(std::memory_order_relaxed);
+        if ((now < next)
+            || !m_next.compare_exchange_strong(next, now + CODEC_LOG_RATE_LIMIT_PERIOD)) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+/* Arguments are only evaluated for the messages that get logged */
+#define codec_log(logger, severity, ...)                                                             \
+    (((CODEC_LOG_LEVEL >= (severity)) && (logger).is_enabled(severity))                              \
+         ? (logger).Log(severity, __FILE__, __func__, __LINE__, __VA_ARGS__)                         \
+         : (void)0)
+
+#define codec_log_trace(logger, ...) codec_log(logger, CodecLogger::TRACE, __VA_ARGS__)
+
+#define codec_log_debug(logger, ...) codec_log(logger, CodecLogger::DEBUG, __VA_ARGS__)
+
+#define codec_log_info(logger, ...) codec_log(logger, CodecLogger::INFO, __VA_ARGS__)
+
+#define codec_log_warn(logger, ...) codec_log(logger, CodecLogger::WARNING, __VA_ARGS__)
 
-#define codec_log_debug(logger, ...)                                                                 \
-    (logger).Log(CodecLogger::DEBUG, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define codec_log_error(logger, ...) codec_log(logger, CodecLogger::ERROR, __VA_ARGS__)
 
-#define codec_log_info(logger, ...)                                                                  \
-    (logger).Log(CodecLogger::INFO, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define codec_log_fatal(logger, ...) codec_log(logger, CodecLogger::FATAL, __VA_ARGS__)
 
-#define codec_log_warn(logger, ...)                                                                  \
-    (logger).Log(CodecLogger::WARNING, __FILE__, __func__, __LINE__, __VA_ARGS__)
+/* For messages that can come with every NAL or frame once stream goes bad:
+ same as codec_log(), but at most once per CODEC_LOG_RATE_LIMIT_PERIOD for
+ the call site (shared by all the loggers), and how many were held back is
+ told before next one goes out. Statement, not expression */
+#define codec_log_limited(logger, severity, ...)                                                     \
+    do {                                                                                             \
+        static airtame::CodecLogRateLimiter codec_log_limiter;                                       \
+        size_t codec_log_suppressed = 0;                                                             \
+        if ((CODEC_LOG_LEVEL >= (severity)) && (logger).is_enabled(severity)                         \
+            && codec_log_limiter.allow(codec_log_suppressed)) {                                      \
+            if (codec_log_suppressed) {                                                              \
+                (logger).Log(severity, __FILE__, __func__, __LINE__,                                 \
+                             "Message below repeated %zu more times", codec_log_suppressed);         \
+            }                                                                                        \
+            (logger).Log(severity, __FILE__, __func__, __LINE__, __VA_ARGS__);                       \
+        }                                                                                            \
+    } while (0)
 
-#define codec_log_error(logger, ...)                                                                 \
-    (logger).Log(CodecLogger::ERROR, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define codec_log_warn_limited(logger, ...)                                                          \
+    codec_log_limited(logger, CodecLogger::WARNING, __VA_ARGS__)
 
-#define codec_log_fatal(logger, ...)                                                                 \
-    (logger).Log(CodecLogger::FATAL, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define codec_log_error_limited(logger, ...)                                                         \
+    codec_log_limited(logger, CodecLogger::ERROR, __VA_ARGS__)
 
 } // namespace airtame
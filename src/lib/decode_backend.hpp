@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "codec_common.hpp"
+#include "pack_queue.hpp"
+#include "vpu_frame_pool.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* Called by decoders while decode is in progress, see VPUBusyCallback */
+using DecodeBusyCallback = std::function<void(void)>;
+
+/* Decode engine that takes packs off PackQueue and gives out decoded frames.
+ Parsers don't know what decodes their packs, so that any engine can - VPU
+ (VPUDecoder) or CPU (SoftwareDecoder) one. All of them follow the contract
+ of VPUDecoder::step(), and give out VPUOutputFrame in DMA memory, so that the
+ display (G2D) handles frames of all of them the same way.
+
+ Features particular to an engine (VPU rotation, feed-ahead and such) stay
+ with its class, users that need them hold the engine itself */
+class DecodeBackend {
+public:
+    virtual ~DecodeBackend() {}
+
+    /* See VPUDecoder for all of these */
+    virtual VPUOutputFrame step(PackQueue &queue) = 0;
+    virtual VPUOutputFrame try_to_step(PackQueue &queue) = 0;
+    virtual VPUOutputFrame flush_step() = 0;
+    virtual bool has_frame_for_decoding() const = 0;
+    virtual void return_output_frame(long physical_address) = 0;
+    /* By default goes back by physical address */
+    virtual void return_output_frame(const VPUOutputFrame &frame)
+    {
+        return_output_frame(frame.dma->phy_addr);
+    }
+    virtual void close() = 0;
+    virtual bool is_closed() const = 0;
+    virtual void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool) = 0;
+    virtual void set_busy_callback(const DecodeBusyCallback &callback) = 0;
+    virtual const DecodingStats &get_stats() const = 0;
+    virtual void reset_stats() = 0;
+    virtual size_t get_number_of_frames_given() const = 0;
+
+    /* True if frames are decoded by the VPU, so that they add to its load,
+     see DecoderPlacement */
+    virtual bool is_hardware() const = 0;
+};
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <algorithm>
+
+#include "decoder_placement.hpp"
+
+namespace airtame {
+
+DecoderPlacement::Engine DecoderPlacement::place(const Pack &pack)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    update_vpu_load();
+    if ((m_vpu_load > m_max_vpu_load) && can_decode_on_cpu(pack)) {
+        ++m_number_of_cpu_placements;
+        return Engine::CPU;
+    }
+    return Engine::VPU;
+}
+
+bool DecoderPlacement::migrate(const Pack &pack)
+{
+    if (!can_decode_on_cpu(pack)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_number_of_migrations;
+    return true;
+}
+
+void DecoderPlacement::add_decoder(const DecodeBackend &decoder)
+{
+    if (!decoder.is_hardware()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_vpu_decoders.push_back(&decoder);
+    /* Its decode time so far doesn't count in the period going on */
+    m_last_decode_time += decoder.get_stats().decode_latency.get_total();
+}
+
+void DecoderPlacement::remove_decoder(const DecodeBackend &decoder)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find(m_vpu_decoders.begin(), m_vpu_decoders.end(), &decoder);
+    if (it == m_vpu_decoders.end()) {
+        return;
+    }
+    m_vpu_decoders.erase(it);
+    /* Its time goes away from the sum, so gets taken out of the start too */
+    m_last_decode_time -= decoder.get_stats().decode_latency.get_total();
+}
+
+double DecoderPlacement::get_vpu_load()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    update_vpu_load();
+    return m_vpu_load;
+}
+
+Timestamp DecoderPlacement::get_vpu_decode_time() const
+{
+    Timestamp total = 0;
+    for (const DecodeBackend *decoder : m_vpu_decoders) {
+        total += decoder->get_stats().decode_latency.get_total();
+    }
+    return total;
+}
+
+bool DecoderPlacement::can_decode_on_cpu(const Pack &pack) const
+{
+#ifdef HAVE_LIBAVCODEC
+    size_t macroblocks = (pack.m_geometry.m_padded_width / 16)
+        * (pack.m_geometry.m_padded_height / 16);
+    return ((CodecType::H264 == pack.m_codec_type) || (CodecType::VP8 == pack.m_codec_type))
+        && (macroblocks <= m_max_software_macroblocks);
+#else
+    (void)pack;
+    return false;
+#endif
+}
+
+void DecoderPlacement::update_vpu_load()
+{
+    auto now = std::chrono::steady_clock::now();
+    Timestamp period
+        = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last_sample).count();
+    if (period < DECODER_PLACEMENT_LOAD_PERIOD) {
+        return;
+    }
+    Timestamp decode_time = get_vpu_decode_time();
+    /* Stats reset by the user make it go back, that period is not known */
+    if (decode_time >= m_last_decode_time) {
+        m_vpu_load = (double)(decode_time - m_last_decode_time) / period;
+    }
+    m_last_decode_time = decode_time;
+    m_last_sample = now;
+}
+}
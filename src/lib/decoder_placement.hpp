@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "codec_common.hpp"
+#include "decode_backend.hpp"
+#include "software_decoder.hpp"
+
+namespace airtame {
+
+/* VPU load (part of wall clock time VPU spends decoding) new streams still go
+ to the VPU under */
+#define DECODER_PLACEMENT_MAX_VPU_LOAD 0.8
+/* Shortest period load is measured over (usec), shorter ones give previous
+ measurement */
+#define DECODER_PLACEMENT_LOAD_PERIOD 500000
+
+/* Decides which engine decodes new stream. VPU decodes one frame at a time
+ for all the decoders, so once streams decoded on it add up to more than its
+ macroblock rate, all of them fall behind - one stream more can make several
+ streams stutter. So VPU decode time of all the decoders placed on it is
+ summed up (DecodingStats::decode_latency), and when VPU is busy for more than
+ max_vpu_load of the time, streams small enough for the CPU go there instead.
+ Bigger ones still go to the VPU, CPU would be too slow for them anyway.
+
+ Shared by all the streams, and can be used from several threads at once.
+ Decoders have to be removed before they go away */
+class DecoderPlacement {
+public:
+    enum class Engine {
+        VPU,
+        CPU
+    };
+
+private:
+    double m_max_vpu_load;
+    size_t m_max_software_macroblocks;
+
+    mutable std::mutex m_mutex;
+    std::vector<const DecodeBackend *> m_vpu_decoders;
+    /* What load was measured from: summed decode time (usec) and when */
+    Timestamp m_last_decode_time = 0;
+    std::chrono::steady_clock::time_point m_last_sample;
+    double m_vpu_load = 0;
+    size_t m_number_of_cpu_placements = 0;
+    size_t m_number_of_migrations = 0;
+
+public:
+    DecoderPlacement(double max_vpu_load = DECODER_PLACEMENT_MAX_VPU_LOAD,
+                     size_t max_software_macroblocks = SOFTWARE_DECODER_MAX_MACROBLOCKS)
+        : m_max_vpu_load(max_vpu_load)
+        , m_max_software_macroblocks(max_software_macroblocks)
+        , m_last_sample(std::chrono::steady_clock::now())
+    {
+    }
+
+    /* Engine for stream starting with given pack (one that can reopen
+     decoding, so its geometry is known). Always VPU if software decoder
+     wasn't built in */
+    Engine place(const Pack &pack);
+
+    /* Whether stream VPU can't decode anymore (see
+     VPUDecoder::is_memory_starved()) can move to the CPU, starting with given
+     pack (one that can reopen decoding), however busy VPU is. Caller removes
+     VPU decoder and adds software one */
+    bool migrate(const Pack &pack);
+
+    /* Decoders whose decode time counts as VPU load, VPUDecoders (see
+     DecodeBackend::is_hardware()) placed with place() */
+    void add_decoder(const DecodeBackend &decoder);
+    void remove_decoder(const DecodeBackend &decoder);
+
+    /* Part of time (0-1) VPU spent decoding lately */
+    double get_vpu_load();
+
+    size_t get_number_of_cpu_placements() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_number_of_cpu_placements;
+    }
+
+    size_t get_number_of_migrations() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_number_of_migrations;
+    }
+
+private:
+    bool can_decode_on_cpu(const Pack &pack) const;
+    Timestamp get_vpu_decode_time() const;
+    void update_vpu_load();
+};
+}
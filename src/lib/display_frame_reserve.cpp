@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "display_frame_reserve.hpp"
+
+namespace airtame {
+
+void DisplayFrameReserve::frame_given(unsigned long physical_address, bool blocked)
+{
+    if (!is_enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_held.emplace_back(physical_address, std::chrono::steady_clock::now());
+    if (m_peak_held < m_held.size()) {
+        m_peak_held = m_held.size();
+    }
+    ++m_number_of_outputs;
+    if (blocked) {
+        ++m_number_of_blocked_outputs;
+    }
+}
+
+void DisplayFrameReserve::frame_returned(unsigned long physical_address)
+{
+    if (!is_enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_held.begin(); it != m_held.end(); ++it) {
+        if (it->first == physical_address) {
+            m_total_hold_latency.add(m_hold_latency.add_usec_since(it->second));
+            m_held.erase(it);
+            return;
+        }
+    }
+}
+
+size_t DisplayFrameReserve::decide(size_t current_frames, CodecLogger &logger,
+                                   DecodingStats &stats)
+{
+    if (!is_enabled()) {
+        return current_frames;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t frames = clamp(current_frames);
+    if (m_number_of_outputs < DISPLAY_FRAME_RESERVE_MIN_OUTPUTS) {
+        return frames;
+    }
+
+    double blocked_ratio = (double)m_number_of_blocked_outputs / m_number_of_outputs;
+    if ((blocked_ratio > DISPLAY_FRAME_RESERVE_MAX_BLOCKED_RATIO) && (frames < m_max_frames)) {
+        ++frames;
+        ++stats.number_of_display_reserve_grows;
+    } else if ((m_peak_held < frames) && (frames > m_min_frames)) {
+        /* Consumer never had all of them, so one was never needed */
+        --frames;
+        ++stats.number_of_display_reserve_shrinks;
+    }
+    if (frames != current_frames) {
+        codec_log_info(logger,
+                       "Display reserve %zu -> %zu frames: held %zu at most, for %lld usec "
+                       "(p90), decoding blocked after %.1f%% of %zu frames",
+                       current_frames, frames, m_peak_held,
+                       (long long)m_hold_latency.get_percentile(90), 100 * blocked_ratio,
+                       m_number_of_outputs);
+    }
+
+    m_hold_latency.reset();
+    m_peak_held = m_held.size();
+    m_number_of_outputs = 0;
+    m_number_of_blocked_outputs = 0;
+    return frames;
+}
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "latency_histogram.hpp"
+
+namespace airtame {
+
+/* Frames given out that decide() needs to have seen before it changes
+ anything, fewer tell too little about the consumer */
+#define DISPLAY_FRAME_RESERVE_MIN_OUTPUTS 30
+/* Part of frames given out after which decoding was blocked, waiting for
+ the consumer to return one, above which the reserve grows */
+#define DISPLAY_FRAME_RESERVE_MAX_BLOCKED_RATIO 0.05
+
+/* Sizes display frame reserve of a decoder (frames the consumer holds on top
+ of the reference ones) by how the consumer uses it. Too few, and decoding
+ blocks in has_frame_for_decoding() while display holds frames, too many,
+ and every one of them is a whole DMA frame held for nothing. So between
+ decoder giving frame out and it being returned, the reserve tracks:
+ - how long the frame was held (DecodingStats::display_hold_latency)
+ - the most frames held at once
+ - how often giving a frame out left decoder without a free one
+ and decide(), called when the decoder reopens anyway (frame allocation
+ can't change in the middle of a session), grows the reserve by a frame
+ when decoding got blocked too often, or shrinks it by one when the
+ consumer never held all the frames. Always within bounds.
+
+ Frames returned from other thread than the decoding one get here once
+ their returns are applied (see VPUFrameBuffers::apply_queued_returns()),
+ on the decoding thread, but the reserve can be read from any */
+class DisplayFrameReserve {
+private:
+    size_t m_min_frames = 0;
+    size_t m_max_frames = 0;
+
+    mutable std::mutex m_mutex;
+    /* Frames the consumer holds, by physical address, and since when */
+    std::vector<std::pair<unsigned long, std::chrono::steady_clock::time_point>> m_held;
+    /* Since the last decide() */
+    LatencyHistogram m_hold_latency;
+    /* Since the start */
+    LatencyHistogram m_total_hold_latency;
+    size_t m_peak_held = 0;
+    size_t m_number_of_outputs = 0;
+    size_t m_number_of_blocked_outputs = 0;
+
+public:
+    /* Zero max_frames (default) disables it. Has to be called before frames
+     are given out */
+    void set_bounds(size_t min_frames, size_t max_frames)
+    {
+        m_min_frames = min_frames;
+        m_max_frames = max_frames;
+    }
+
+    bool is_enabled() const
+    {
+        return m_max_frames > 0;
+    }
+
+    size_t clamp(size_t frames) const
+    {
+        if (!is_enabled()) {
+            return frames;
+        }
+        if (frames < m_min_frames) {
+            return m_min_frames;
+        }
+        return (frames > m_max_frames) ? m_max_frames : frames;
+    }
+
+    /* Frame given to the consumer, blocked if decoder has no free frame
+     left after that */
+    void frame_given(unsigned long physical_address, bool blocked);
+    /* Frames not known (for example given out before it was enabled) are
+     ignored */
+    void frame_returned(unsigned long physical_address);
+
+    /* Hold time of all the frames returned (usec), for
+     DecodingStats::display_hold_latency */
+    LatencyHistogram get_hold_latency() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_total_hold_latency;
+    }
+
+    /* Reserve decoder reopening with current_frames should use now. Starts
+     measurement over if it decided */
+    size_t decide(size_t current_frames, CodecLogger &logger, DecodingStats &stats);
+};
+}
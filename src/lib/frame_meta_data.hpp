@@ -8,11 +8,13 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "timestamp.hpp"
 
 #include <memory>
 #include <cassert>
+#include <type_traits>
 
 namespace airtame {
 
@@ -33,6 +35,11 @@ public:
     void set_timestamp(Timestamp timestamp) {
         m_timestamp = timestamp;
     }
+    /* So that FrameMeta can take rotation out of subclass that has it, with
+     no RTTI */
+    virtual int get_rotation() const {
+        return 0;
+    }
 protected:
     Timestamp m_timestamp;
 };
@@ -54,11 +61,131 @@ public:
         }
     }
 
-    int get_rotation() const {
+    virtual int get_rotation() const override {
         return m_rotation;
     }
 protected:
     int m_rotation;
 };
 
+/* Bytes of user data FrameMeta carries */
+#define FRAME_META_PAYLOAD_SIZE 32
+
+/* Frame metadata carried by value, from VideoBuffer through packs, bitstream
+ buffer and decoder frames, to VPUOutputFrame: timestamp, rotation and user
+ defined POD payload in fixed size record, so that frames cost no allocation
+ or atomic reference counting for it. Empty one (false) means producer gave
+ none.
+
+ Polymorphic FrameMetaData above is still accepted for compatibility: it is
+ carried along shared, the way it always was, and timestamp and rotation of
+ the record are taken out of it */
+class FrameMeta {
+private:
+    Timestamp m_timestamp = 0;
+    int32_t m_rotation = 0;
+    bool m_valid = false;
+    unsigned char m_payload[FRAME_META_PAYLOAD_SIZE] = {};
+    std::shared_ptr<FrameMetaData> m_shared;
+
+public:
+    FrameMeta() = default;
+
+    explicit FrameMeta(Timestamp timestamp, int rotation = 0)
+        : m_timestamp(timestamp)
+        , m_rotation(rotation)
+        , m_valid(true)
+    {
+    }
+
+    FrameMeta(const std::shared_ptr<FrameMetaData> &shared)
+        : m_valid(!!shared)
+        , m_shared(shared)
+    {
+        if (shared) {
+            m_timestamp = shared->get_timestamp();
+            m_rotation = shared->get_rotation();
+        }
+    }
+
+    explicit operator bool() const
+    {
+        return m_valid;
+    }
+
+    void reset()
+    {
+        *this = FrameMeta();
+    }
+
+    Timestamp get_timestamp() const
+    {
+        return m_timestamp;
+    }
+
+    /* Shared metadata, if any, is stamped too */
+    void set_timestamp(Timestamp timestamp)
+    {
+        m_timestamp = timestamp;
+        if (m_shared) {
+            m_shared->set_timestamp(timestamp);
+        }
+    }
+
+    int get_rotation() const
+    {
+        return m_rotation;
+    }
+
+    void set_rotation(int rotation)
+    {
+        m_rotation = rotation;
+    }
+
+    template <typename T>
+    void set_payload(const T &payload)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Payload is copied bytewise");
+        static_assert(sizeof(T) <= FRAME_META_PAYLOAD_SIZE, "Payload doesn't fit");
+        ::memcpy(m_payload, &payload, sizeof(T));
+    }
+
+    template <typename T>
+    T get_payload() const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Payload is copied bytewise");
+        static_assert(sizeof(T) <= FRAME_META_PAYLOAD_SIZE, "Payload doesn't fit");
+        T payload;
+        ::memcpy(&payload, m_payload, sizeof(T));
+        return payload;
+    }
+
+    /* nullptr unless it was made from FrameMetaData */
+    const std::shared_ptr<FrameMetaData> &get_shared() const
+    {
+        return m_shared;
+    }
+
+    /* Same as FrameMetaDataWithRotation::merge(), without virtual call:
+     record with newer timestamp wins */
+    void merge(const FrameMeta &other)
+    {
+        if (other.m_valid && (!m_valid || (other.m_timestamp > m_timestamp))) {
+            *this = other;
+        }
+    }
+
+    bool operator==(const FrameMeta &other) const
+    {
+        return (m_valid == other.m_valid) && (m_timestamp == other.m_timestamp)
+            && (m_rotation == other.m_rotation) && (m_shared == other.m_shared)
+            && !::memcmp(m_payload, other.m_payload, sizeof(m_payload));
+    }
+
+    bool operator!=(const FrameMeta &other) const
+    {
+        return !(*this == other);
+    }
+};
+
 }
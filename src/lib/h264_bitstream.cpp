@@ -8,51 +8,50 @@
 #include "h264_bitstream.hpp"
 #include <cassert>
 #include <stdio.h>
+#include <string.h>
 
-/* Reads an unsigned integer of up to 24 bits taken from the bitstream.
- 24 bits should suffice because longer values in H264 stream are encoded
- as Exp-Golomb codes, with zero-bit string indicating length of code (and
- number of less significant bits to follow. Now, we know that H264 start
- code is 23 zero bits followed by one (0x000001), and start-code emulation
- is carefully avoided in the stream. So Exp-Golob codes are probably limited
- to 22-long, and so reading 24 bits is enough.
+/* Cache is refilled a byte at a time only when there is a chance of hitting
+ emulation prevention byte (0x00, 0x00, 0x03 sequence, see 7.4.1 of H.264),
+ otherwise whole 64-bit word is loaded at once. Previous version of code here
+ used 32-bit cache and loaded it byte by byte on every read, but reads are
+ now cheap shifts of the cache, and refills are rare.
 
- Previous version of code here used 64-bit values for extra safety which is
- unfortunately performance problem on 32-bit ARM CPU we have on the i.mx6 */
-H264Bitstream::Result H264Bitstream::read_un_bits(size_t n)
+ Note that unlike previous version emulation prevention bytes are removed,
+ so they no longer get parsed as data. Parameter sets and slice headers rarely
+ contain them, but when they do, previous version got those wrong */
+void H264Bitstream::refill()
 {
-    assert(n <= 24);
-
-    H264Bitstream::Result error(0, true), ok(0, false);
-
-    if (!n) {
-        /* This behavior is specified by H.264 and read_uev_bits depends
-         on it */
-        return ok;
-    }
-
-    /* Make sure we have enough bits */
-    while (m_bits_available < n) {
-        if (!m_data_size) {
-            /* Technically, H264 read_bits() returns zeros when reading beyond
-             the stream end, but to detect errors we'd have to understand whole
-             stream then, and that ain't practical */
-            return error;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if ((m_data_size >= 8) && !m_zero_run && (m_cache_bits < 57)) {
+        uint64_t word;
+        ::memcpy(&word, m_data, 8);
+        /* No zero bytes means no emulation prevention, load in bulk */
+        if (!((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL)) {
+            word = __builtin_bswap64(word);
+            size_t bytes = (64 - m_cache_bits) / 8;
+            size_t total_bits = m_cache_bits + bytes * 8;
+            /* Mask out bits of the byte that doesn't fully fit */
+            uint64_t mask = (64 == total_bits) ? ~0ULL : ~(~0ULL >> total_bits);
+            m_cache |= (word >> m_cache_bits) & mask;
+            m_cache_bits = total_bits;
+            m_data += bytes;
+            m_data_size -= bytes;
+            return;
         }
-        /* Load next byte (bit string in "stream order", significant bits first) */
-        m_bits |= (*m_data++) << (24 - m_bits_available);
-        m_bits_available += 8;
+    }
+#endif
+    while ((m_cache_bits <= 56) && m_data_size) {
+        unsigned char byte = *m_data++;
         --m_data_size;
+        if ((m_zero_run >= 2) && (0x03 == byte)) {
+            /* Emulation prevention byte, drop it */
+            m_zero_run = 0;
+            continue;
+        }
+        m_zero_run = byte ? 0 : m_zero_run + 1;
+        m_cache |= (uint64_t)byte << (56 - m_cache_bits);
+        m_cache_bits += 8;
     }
-
-    /* OK, now we know we have at least n bits on top of m_bits, return these */
-    ok.value = m_bits >> (32 - n);
-
-    /* Shift these out */
-    m_bits <<= n;
-    m_bits_available -= n;
-
-    return ok;
 }
 
 /* From ITU-T Rec. H.264 (05/2003, 7.4.2.1
@@ -77,54 +76,50 @@ H264Bitstream::Result H264Bitstream::read_un_bits(size_t n)
 H264Bitstream::Result H264Bitstream::read_uev_bits()
 {
     H264Bitstream::Result error(0, true), ok(0, false);
-    int leading_zero_bits = 0;
-    /* Technically, this is how standard _describes_ Exp-Golomb code, and it doesn'
-     * mean it really should be _implemented_ this way (reading bit by bit with buffer
-     * bounds checking and all that stuff). Performance code should have at least
-     * "pre load max size" (which we know is < 24, and we can buffer that) followed
-     * by cheaper "peek n bits without bounds checking". Could even use some machine
-     * "find topmost nonzero bit" instruction for really fast approach.
-     *
-     * But right now shooting for safe solution, not performant one */
-    while (1) {
-        auto leading_0_bit = read_un_bits(1);
-        if (leading_0_bit.error) {
-            return error;
-        }
-        if (leading_0_bit.value) {
-            break;
-        }
-        leading_zero_bits++;
+    /* Standard describes it bit by bit, but with the cache leading zeros can
+     be counted with single CLZ instruction */
+    if (m_cache_bits < 64) {
+        refill();
     }
-
-    auto suffix_bits = read_un_bits(leading_zero_bits);
-    if (suffix_bits.error) {
+    size_t leading_zero_bits = m_cache ? __builtin_clzll(m_cache) : 64;
+    if (leading_zero_bits >= m_cache_bits) {
+        /* Either end of data, or more zeros than we can have in the cache
+         (can't happen in H264 stream, because of start code emulation
+         prevention) */
         return error;
     }
 
     /* We expect Exp-Golomb codes to have at most 22-bits long zero-prefix due to
-     * H264 avoiding start code emulation
+     * H264 avoiding start code emulation, but anything that fits 32 bits can be
+     * returned
      */
-    assert(leading_zero_bits < 23);
+    if (leading_zero_bits > 31) {
+        return error;
+    }
+
+    /* Shift out zeros and the one */
+    m_cache <<= leading_zero_bits + 1;
+    m_cache_bits -= leading_zero_bits + 1;
+    auto suffix_bits = read_un_bits(leading_zero_bits);
+    if (suffix_bits.error) {
+        return error;
+    }
 
-    /* Using 32-bit values here helps with performance on ARM, and Exp-Golomb codes
-     that one can expect in H264 stream should fit in 23 bits anyway */
     ok.value = ((uint32_t)1 << leading_zero_bits) - 1 + suffix_bits.value;
 
     return ok;
 }
 
 /* See 9.1.1 "Mapping process for signed Exp-Golomb codes" */
-H264Bitstream::Result H264Bitstream::read_sev_bits()
+H264Bitstream::SignedResult H264Bitstream::read_sev_bits()
 {
     /* Read unsigned Exp-Golomb code */
-    Result result = read_uev_bits();
-    if (result.error) {
-        return result;
+    Result code = read_uev_bits();
+    if (code.error) {
+        return SignedResult(0, true);
     }
     /* Convert value to signed */
-    bool plus = result.value & 0x1; /* Even numbers are converted to positive ones */
-    int32_t value = (result.value + 1) >> 1; /* ceil(value/2) */
-    result.value = plus ? value : -value;
-    return result;
+    bool plus = code.value & 0x1; /* Even numbers are converted to positive ones */
+    int32_t value = (int32_t)((code.value >> 1) + (code.value & 0x1)); /* ceil(value/2) */
+    return SignedResult(plus ? value : -value, false);
 }
@@ -6,6 +6,7 @@
  */
 
 #pragma once
+#include <cassert>
 #include <cstdlib>
 #include <cstdint>
 
@@ -13,23 +14,32 @@ class H264Bitstream {
 private:
     const unsigned char *m_data{ nullptr };
     size_t m_data_size{ 0 };
-    size_t m_bits_available{ 0 };
-    uint32_t m_bits{ 0 };
+    /* Bit cache, bits kept in "stream order" starting from the most significant
+     one. Only top m_cache_bits bits are valid, the rest is always zeroed */
+    uint64_t m_cache{ 0 };
+    size_t m_cache_bits{ 0 };
+    /* Number of zero bytes just loaded, for emulation prevention */
+    size_t m_zero_run{ 0 };
 
 public:
-    struct Result {
-        Result()
+    /* Unsigned reads give uint32_t, so that values of 32 bits keep the top
+     one, signed Exp-Golomb gives int32_t */
+    template <typename T>
+    struct BasicResult {
+        BasicResult()
         {
         }
-        Result(int32_t val, bool err)
+        BasicResult(T val, bool err)
         {
             value = val;
             error = err;
         }
 
-        int32_t value{ 0 };
+        T value{ 0 };
         bool error{ true };
     };
+    using Result = BasicResult<uint32_t>;
+    using SignedResult = BasicResult<int32_t>;
 
     H264Bitstream(const unsigned char *data, size_t data_size)
     {
@@ -40,8 +50,9 @@ public:
     {
         m_data = data;
         m_data_size = data_size;
-        m_bits_available = 0;
-        m_bits = 0;
+        m_cache = 0;
+        m_cache_bits = 0;
+        m_zero_run = 0;
     }
 
     /* Functions below used to have ignore_* counterparts. But I don't think
@@ -50,13 +61,41 @@ public:
      functions that return same value as read functions, just ignore the
      values in code */
 
-    /* Reads an unsigned integer of up to 24 bits from the bitstream */
-    Result read_un_bits(size_t n);
+    /* Reads an unsigned integer of up to 32 bits from the bitstream. This is
+     called for almost every syntax element, so common case (enough bits in
+     cache) is kept inline here */
+    Result read_un_bits(size_t n)
+    {
+        assert(n <= 32);
+        if (m_cache_bits < n) {
+            refill();
+            if (m_cache_bits < n) {
+                /* Technically, H264 read_bits() returns zeros when reading
+                 beyond the stream end, but to detect errors we'd have to
+                 understand whole stream then, and that ain't practical */
+                return Result(0, true);
+            }
+        }
+        if (!n) {
+            /* This behavior is specified by H.264 and read_uev_bits depends
+             on it */
+            return Result(0, false);
+        }
+        uint32_t value = (uint32_t)(m_cache >> (64 - n));
+        m_cache <<= n;
+        m_cache_bits -= n;
+        return Result(value, false);
+    }
 
     /* Reads an unsigned integer of variable length (Exp-Golomb coded).
-     In H264 stream that will be limited to 24 bits */
+     In H264 stream that will be limited to 32 bits */
     Result read_uev_bits();
 
     /* Same, but signed Exp-Golomb coded */
-    Result read_sev_bits();
+    SignedResult read_sev_bits();
+
+private:
+    /* Loads as many bytes into the cache as will fit, dropping emulation
+     prevention bytes on the way */
+    void refill();
 };
@@ -5,6 +5,7 @@
  * See LICENSE.txt for further information.
  */
 
+#include "byte_scan.hpp"
 #include "h264_bitstream.hpp"
 #include "h264_nal.hpp"
 #include <assert.h>
@@ -71,6 +72,7 @@ bool at_h264_get_sps_info(const unsigned char *data, size_t size, SpsNalInfo &sp
 
     // TODO: use bs_parser all along
     H264Bitstream::Result bits;
+    H264Bitstream::SignedResult signed_bits;
 
     /* Skip the NAL sync units (0x00000001 or 0x000001 pattern) */
     while (*data == 0x00) {
@@ -211,22 +213,22 @@ bool at_h264_get_sps_info(const unsigned char *data, size_t size, SpsNalInfo &sp
         RETURN_IF_ERROR(bits);
         sps_info.delta_pic_order_always_zero_flag = bits.value ? true : false;
 
-        bits = bs_parser.read_sev_bits(); // offset_for_non_ref_pic
-        RETURN_IF_ERROR(bits);
-        sps_info.offset_for_non_ref_pic = bits.value;
+        signed_bits = bs_parser.read_sev_bits(); // offset_for_non_ref_pic
+        RETURN_IF_ERROR(signed_bits);
+        sps_info.offset_for_non_ref_pic = signed_bits.value;
 
-        bs_parser.read_sev_bits(); // offset_for_top_to_bottom_field
-        RETURN_IF_ERROR(bits);
-        sps_info.offset_for_top_to_bottom_field = bits.value;
+        signed_bits = bs_parser.read_sev_bits(); // offset_for_top_to_bottom_field
+        RETURN_IF_ERROR(signed_bits);
+        sps_info.offset_for_top_to_bottom_field = signed_bits.value;
 
         bits = bs_parser.read_uev_bits(); // num_ref_frames_in_pic_order_cnt_cycle
         RETURN_IF_ERROR(bits);
         sps_info.num_ref_frames_in_pic_order_cnt_cycle = bits.value;
 
         for (uint32_t i = 0; i < sps_info.num_ref_frames_in_pic_order_cnt_cycle; i++) {
-            bits = bs_parser.read_sev_bits(); // offset_for_ref_frame[i]
-            RETURN_IF_ERROR(bits);
-            sps_info.offset_for_ref_frame[i] = bits.value;
+            signed_bits = bs_parser.read_sev_bits(); // offset_for_ref_frame[i]
+            RETURN_IF_ERROR(signed_bits);
+            sps_info.offset_for_ref_frame[i] = signed_bits.value;
         }
     }
     bits = bs_parser.read_uev_bits(); // num_ref_frames
@@ -315,7 +317,7 @@ bool at_h264_get_sps_info(const unsigned char *data, size_t size, SpsNalInfo &sp
 // TODO: check against the new standard versions!
 static bool at_h264_ignore_sps_fre_scaling_list(H264Bitstream &bs_parser, size_t size)
 {
-    H264Bitstream::Result bits;
+    H264Bitstream::SignedResult bits;
     int last_scale = 8, next_scale = 8;
     for (size_t i = 0; i < size; i++) {
         if (next_scale) {
@@ -335,6 +337,7 @@ bool at_h264_get_pps_info(const unsigned char *data, size_t size, PpsNalInfo &pp
     memset(&pps_info, 0, sizeof(pps_info));
     // TODO: use bs_parser all along
     H264Bitstream::Result bits;
+    H264Bitstream::SignedResult signed_bits;
 
     /* Skip the NAL sync units (0x00000001 or 0x000001 pattern) */
     while (*data == 0x00) {
@@ -444,14 +447,14 @@ bool at_h264_get_pps_info(const unsigned char *data, size_t size, PpsNalInfo &pp
     RETURN_IF_ERROR(bits);
     pps_info.weighted_bipred_idc = bits.value;
 
-    bits = bs_parser.read_sev_bits(); /* pic_init_qp_minus_26 */
-    RETURN_IF_ERROR(bits);
+    signed_bits = bs_parser.read_sev_bits(); /* pic_init_qp_minus_26 */
+    RETURN_IF_ERROR(signed_bits);
 
-    bits = bs_parser.read_sev_bits(); /* pic_init_qs_minus_26 */
-    RETURN_IF_ERROR(bits);
+    signed_bits = bs_parser.read_sev_bits(); /* pic_init_qs_minus_26 */
+    RETURN_IF_ERROR(signed_bits);
 
-    bits = bs_parser.read_sev_bits(); /* chroma_qp_index_offset */
-    RETURN_IF_ERROR(bits);
+    signed_bits = bs_parser.read_sev_bits(); /* chroma_qp_index_offset */
+    RETURN_IF_ERROR(signed_bits);
 
     bits = bs_parser.read_un_bits(1); /* deblocking_filter_control_present_flag */
     RETURN_IF_ERROR(bits);
@@ -466,8 +469,8 @@ bool at_h264_get_pps_info(const unsigned char *data, size_t size, PpsNalInfo &pp
     return true;
 }
 
-static bool at_h264_get_initial_slice_header_info_implementation(H264Bitstream &bs_parser,
-                                                                 SliceHeaderInfo &slice_header_info)
+bool at_h264_get_initial_slice_header_info(H264Bitstream &bs_parser,
+                                           SliceHeaderInfo &slice_header_info)
 {
     memset(&slice_header_info, 0, sizeof(slice_header_info));
     /* Skip zeroed out bytes  */
@@ -498,8 +501,9 @@ static bool at_h264_get_initial_slice_header_info_implementation(H264Bitstream &
     slice_header_info.IdrPicFlag
         = NalType::IDR_SLICE == slice_header_info.nal_unit_type ? true : false;
 
-    bits = bs_parser.read_uev_bits(); /* first_mb_in_slice, ignore */
+    bits = bs_parser.read_uev_bits(); /* first_mb_in_slice */
     RETURN_IF_ERROR(bits);
+    slice_header_info.first_mb_in_slice = bits.value;
 
     bits = bs_parser.read_uev_bits(); /* slice_type */
     RETURN_IF_ERROR(bits);
@@ -529,7 +533,7 @@ bool at_h264_get_initial_slice_header_info(const unsigned char *data, size_t siz
                                            SliceHeaderInfo &slice_header_info)
 {
     H264Bitstream bs_parser(data, size);
-    return at_h264_get_initial_slice_header_info_implementation(bs_parser, slice_header_info);
+    return at_h264_get_initial_slice_header_info(bs_parser, slice_header_info);
 }
 
 /* This split into initial and full slice header info functions stems from
@@ -549,11 +553,21 @@ bool at_h264_get_full_slice_header_info(const unsigned char *data, size_t size,
                                         SliceHeaderInfo &slice_header_info)
 {
     H264Bitstream bs_parser(data, size);
-    if (!at_h264_get_initial_slice_header_info_implementation(bs_parser, slice_header_info)) {
+    if (!at_h264_get_initial_slice_header_info(bs_parser, slice_header_info)) {
         return false;
     }
+    return at_h264_get_remaining_slice_header_info(bs_parser, sps, pps, slice_header_info);
+}
 
+/* Second level of slice header parsing, reads just the fields that
+ at_h264_are_different_pictures() needs (which are all sitting right after
+ pic_parameter_set_id) and stops there */
+bool at_h264_get_remaining_slice_header_info(H264Bitstream &bs_parser,
+                                             const SpsNalInfo &sps, const PpsNalInfo &pps,
+                                             SliceHeaderInfo &slice_header_info)
+{
     H264Bitstream::Result bits;
+    H264Bitstream::SignedResult signed_bits;
 
     /* at_h264_get_initial_slice_header_info reads up to (including)
      pic_parameter_set_id so the next field in stream is optional
@@ -596,9 +610,9 @@ bool at_h264_get_full_slice_header_info(const unsigned char *data, size_t size,
         slice_header_info.pic_order_cnt_lsb = bits.value;
 
         if (pps.pic_order_present_flag && !slice_header_info.field_pic_flag) {
-            bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt_bottom */
-            RETURN_IF_ERROR(bits);
-            slice_header_info.delta_pic_order_cnt_bottom = bits.value;
+            signed_bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt_bottom */
+            RETURN_IF_ERROR(signed_bits);
+            slice_header_info.delta_pic_order_cnt_bottom = signed_bits.value;
         }
     }
 
@@ -607,14 +621,14 @@ bool at_h264_get_full_slice_header_info(const unsigned char *data, size_t size,
     slice_header_info.delta_pic_order_cnt[1] = 0;
     if ((1 == sps.pic_order_cnt_type)
         && !sps.delta_pic_order_always_zero_flag) {
-        bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt[0] */
-        RETURN_IF_ERROR(bits);
-        slice_header_info.delta_pic_order_cnt[0] = bits.value;
+        signed_bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt[0] */
+        RETURN_IF_ERROR(signed_bits);
+        slice_header_info.delta_pic_order_cnt[0] = signed_bits.value;
 
         if (pps.pic_order_present_flag && !slice_header_info.field_pic_flag) {
-            bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt[1] */
-            RETURN_IF_ERROR(bits);
-            slice_header_info.delta_pic_order_cnt[1] = bits.value;
+            signed_bits = bs_parser.read_sev_bits(); /* delta_pic_order_cnt[1] */
+            RETURN_IF_ERROR(signed_bits);
+            slice_header_info.delta_pic_order_cnt[1] = signed_bits.value;
         }
     }
 
@@ -636,6 +650,84 @@ bool at_h264_get_full_slice_header_info(const unsigned char *data, size_t size,
     return true;
 }
 
+/* Syntax per 7.3.2.3 "Supplemental enhancement information RBSP syntax" and
+ D.1.7 "Recovery point SEI message syntax". Payload type and size are coded as
+ runs of 0xff bytes, each adding 255, ended by the last byte. Messages other
+ than recovery point are skipped over. Errors are not asserted on here, SEI
+ is not needed for decoding and broken one is just ignored */
+static bool at_h264_read_sei_value(H264Bitstream &bs_parser, uint32_t &value)
+{
+    value = 0;
+    H264Bitstream::Result bits;
+    do {
+        bits = bs_parser.read_un_bits(8);
+        if (bits.error) {
+            return false;
+        }
+        value += bits.value;
+    } while (0xff == bits.value);
+    return true;
+}
+
+bool at_h264_get_recovery_point_info(const unsigned char *data, size_t size,
+                                     RecoveryPointInfo &recovery_point_info)
+{
+    memset(&recovery_point_info, 0, sizeof(recovery_point_info));
+
+    /* Skip the NAL sync units (0x00000001 or 0x000001 pattern) */
+    while (size && (*data == 0x00)) {
+        data++;
+        size--;
+    }
+    if (size < 2) {
+        return false;
+    }
+    data++;
+    size--;
+
+    H264Bitstream bs_parser(data, size);
+    H264Bitstream::Result bits = bs_parser.read_un_bits(8); // NAL header
+    if (bits.error || ((bits.value & 0x1f) != 0x6)) {
+        return false;
+    }
+
+    uint32_t payload_type;
+    uint32_t payload_size;
+    while (at_h264_read_sei_value(bs_parser, payload_type)
+           && at_h264_read_sei_value(bs_parser, payload_size)) {
+        if (H264_SEI_RECOVERY_POINT == payload_type) {
+            bits = bs_parser.read_uev_bits(); // recovery_frame_cnt
+            if (bits.error) {
+                return false;
+            }
+            recovery_point_info.recovery_frame_cnt = bits.value;
+            bits = bs_parser.read_un_bits(1); // exact_match_flag
+            if (bits.error) {
+                return false;
+            }
+            recovery_point_info.exact_match_flag = bits.value ? true : false;
+            bits = bs_parser.read_un_bits(1); // broken_link_flag
+            if (bits.error) {
+                return false;
+            }
+            recovery_point_info.broken_link_flag = bits.value ? true : false;
+            bits = bs_parser.read_un_bits(2); // changing_slice_group_idc
+            if (bits.error) {
+                return false;
+            }
+            recovery_point_info.changing_slice_group_idc = bits.value;
+            return true;
+        }
+        /* Payloads are byte aligned, so just skip bytes */
+        for (uint32_t idx = 0; idx < payload_size; idx++) {
+            if (bs_parser.read_un_bits(8).error) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
 /* 7.4.1.2.4 explains how to tell where new _primary_ coded picture starts:
  "frame_num differs in value. The value of frame_num used to test this condition
  is the value of frame_num that appears in the syntax of the slice header (...)
@@ -719,6 +811,32 @@ bool at_h264_are_different_pictures(const SliceHeaderInfo &current,
 }
 
 const unsigned char *at_h264_next_start_code(const unsigned char *ptr, const unsigned char *limit)
+{
+    /* Start code has to fit before limit, so last place where it can begin
+     is limit - 4 */
+    if (limit - ptr < 4) {
+        return nullptr;
+    }
+    const unsigned char *last = limit - 3;
+    while (ptr < last) {
+        /* No start code can begin in a block without zero bytes */
+        ptr = at_skip_blocks_without_byte(ptr, last, 0x00);
+        const unsigned char *block_limit = ptr + AT_BYTE_SCAN_BLOCK_SIZE;
+        if (block_limit > last) {
+            block_limit = last;
+        }
+        for (; ptr < block_limit; ++ptr) {
+            if (!ptr[0] && !ptr[1] && (0x01 == ptr[2])) {
+                return ptr;
+            }
+        }
+    }
+    /* Not found */
+    return nullptr;
+}
+
+const unsigned char *at_h264_next_start_code_scalar(const unsigned char *ptr,
+                                                   const unsigned char *limit)
 {
     /* Make sure we have "safe" initial contents of start code state */
     uint32_t state = 0xdeadbeef;
@@ -740,6 +858,70 @@ const unsigned char *at_h264_next_start_code(const unsigned char *ptr, const uns
     return nullptr;
 }
 
+/* Level limits from Table A-1, only those we need. MaxCPB is in units of
+ cpbBrVclFactor bits */
+struct H264LevelLimits {
+    uint32_t level_idc;
+    uint32_t max_mbps;
+    uint32_t max_cpb;
+    uint32_t min_cr;
+};
+
+static const H264LevelLimits h264_level_limits[] = {
+    { 9, 1485, 350, 2 }, /* Level 1b (as signalled by High profiles) */
+    { 10, 1485, 175, 2 },
+    { 11, 3000, 500, 2 }, /* Or 1b, with constraint_set3_flag, but 1.1 is above */
+    { 12, 6000, 1000, 2 },
+    { 13, 11880, 2000, 2 },
+    { 20, 11880, 2000, 2 },
+    { 21, 19800, 4000, 2 },
+    { 22, 20250, 4000, 2 },
+    { 30, 40500, 10000, 2 },
+    { 31, 108000, 14000, 4 },
+    { 32, 216000, 20000, 4 },
+    { 40, 245760, 25000, 4 },
+    { 41, 245760, 62500, 2 },
+    { 42, 522240, 62500, 2 },
+    { 50, 589824, 135000, 2 },
+    { 51, 983040, 240000, 2 },
+    { 52, 2073600, 240000, 2 },
+};
+
+/* A.3.1/A.3.3 item (d) limits number of bytes of primary coded picture to
+ 384 * Max(PicSizeInMbs, fR * MaxMBPS) / MinCR, where fR is 1/172 for frame
+ pictures. Also, no picture can be bigger than whole CPB, which is MaxCPB times
+ cpbBrNalFactor (Table A-2, so 1200 for Baseline/Main/Extended and 1500 for
+ High) bits. Note that 384 bytes is raw macroblock size for 8-bit 4:2:0, levels
+ for higher bit depths/chroma formats are not cared for - VPU can't decode
+ those anyway */
+size_t at_h264_get_max_coded_picture_size(const SpsNalInfo &sps)
+{
+    const H264LevelLimits *limits = nullptr;
+    for (const H264LevelLimits &l : h264_level_limits) {
+        if (l.level_idc == sps.level_idc) {
+            limits = &l;
+            break;
+        }
+    }
+    if (!limits) {
+        return 0;
+    }
+
+    size_t pic_size_in_mbs = (sps.padded_frame_width / 16) * (sps.padded_frame_height / 16);
+    size_t mbs = limits->max_mbps / 172;
+    if (mbs < pic_size_in_mbs) {
+        mbs = pic_size_in_mbs;
+    }
+    size_t picture_size = 384 * mbs / limits->min_cr;
+
+    bool high = (H264Profile::BASELINE != sps.profile_idc)
+        && (H264Profile::MAIN != sps.profile_idc)
+        && (H264Profile::EXTENDED != sps.profile_idc);
+    size_t cpb_size = (size_t)limits->max_cpb * (high ? 1500 : 1200) / 8;
+
+    return picture_size < cpb_size ? picture_size : cpb_size;
+}
+
 const char *at_h264_slice_type_description(int type)
 {
     switch (type) {
@@ -9,6 +9,8 @@
 #include <cstdlib>
 #include <cstdint>
 
+#include "h264_bitstream.hpp"
+
 /* H264 standard, Table 7-1, "NAL unit type codes" */
 enum class NalType {
     /* Unspecified NAL, for app use */
@@ -174,6 +176,7 @@ struct SliceHeaderInfo {
      marked */
     uint32_t ref_nal_idc; /* NEEDED to tell frames apart */
     NalType nal_unit_type;
+    uint32_t first_mb_in_slice;
     uint32_t slice_type;
     int pic_parameter_set_id; /* Also NEEDED to tell frames apart */
     uint32_t frame_num; /* NEEDED to tell frames apart */
@@ -197,6 +200,20 @@ struct SliceHeaderInfo {
     bool IdrPicFlag; /* NEEDED to tell frames apart */
 };
 
+/* H264 standard, D.2.7 "Recovery point SEI message semantics". Pictures
+ from the one this comes with on can be decoded without the ones before, the
+ picture recovery_frame_cnt frames later being correct in content. That is
+ how streams using intra refresh instead of IDR pictures can be joined */
+struct RecoveryPointInfo {
+    uint32_t recovery_frame_cnt;
+    bool exact_match_flag;
+    bool broken_link_flag;
+    uint32_t changing_slice_group_idc;
+};
+
+/* SEI message payloadType of recovery point */
+#define H264_SEI_RECOVERY_POINT 6
+
 bool at_h264_get_nal_type(const unsigned char *data, size_t size, NalType &out_nal_type);
 bool at_h264_get_sps_info(const unsigned char *data, size_t size, SpsNalInfo &out_sps_info);
 bool at_h264_get_pps_info(const unsigned char *data, size_t size, PpsNalInfo &out_pps_info);
@@ -205,6 +222,27 @@ bool at_h264_get_initial_slice_header_info(const unsigned char *data, size_t siz
 bool at_h264_get_full_slice_header_info(const unsigned char *data, size_t size,
                                         const SpsNalInfo &sps, const PpsNalInfo &pps,
                                         SliceHeaderInfo &slice_header_info);
+/* Two-level variant of the above, working on caller's bitstream: first call
+ parses up to pic_parameter_set_id, and leaves bs_parser positioned so that the
+ second one can continue from there (once caller looked up SPS/PPS) instead of
+ parsing the NAL from the start again */
+bool at_h264_get_initial_slice_header_info(H264Bitstream &bs_parser,
+                                           SliceHeaderInfo &slice_header_info);
+bool at_h264_get_remaining_slice_header_info(H264Bitstream &bs_parser,
+                                             const SpsNalInfo &sps, const PpsNalInfo &pps,
+                                             SliceHeaderInfo &slice_header_info);
+/* Looks for recovery point message among those of SEI NAL, false if there
+ is none (or NAL is broken) */
+bool at_h264_get_recovery_point_info(const unsigned char *data, size_t size,
+                                     RecoveryPointInfo &recovery_point_info);
 bool at_h264_are_different_pictures(const SliceHeaderInfo &current, const SliceHeaderInfo &next);
+/* Returns pointer to the first 0x00, 0x00, 0x01, code sequence in [ptr, limit)
+ or nullptr. Scalar version is the original byte-by-byte one, kept as a
+ reference for benchmarking */
 const unsigned char *at_h264_next_start_code(const unsigned char *ptr, const unsigned char *limit);
+const unsigned char *at_h264_next_start_code_scalar(const unsigned char *ptr,
+                                                   const unsigned char *limit);
 const char *at_h264_slice_type_description(int type);
+/* Upper bound of coded picture size (bytes) that stream conforming to SPS
+ level can have, according to Annex A, or zero if level is not known */
+size_t at_h264_get_max_coded_picture_size(const SpsNalInfo &sps);
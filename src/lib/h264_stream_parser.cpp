@@ -6,7 +6,11 @@
  */
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include "h264_stream_parser.hpp"
+#include "trace.hpp"
 
 /* H264Parser handles proper NAL-feeding for the decoder. This is because for
  H264 you can't really have "dumb" feeding of H264 data into decoder. At least,
@@ -55,22 +59,75 @@
 
 namespace airtame {
 
-// TODO: this is for "Annex B", we could also have "AVCC"
+/* Start code bytes preceding NAL header byte, for NALs which had start code
+ split by fragment boundary, and for length prefixed NALs (which is also why
+ it has static storage - chunks of those point right at it) */
+static const unsigned char h264_start_code[3] = { 0x00, 0x00, 0x01 };
 
-// TODO: we could easily handle fragmented buffers now. It could help on
-// the user side too - right now we kinda have two parsers - very simple
-// one. To help with NALs broken by the buffer boundaries we could save
-// three "carry" bytes from the end of the buffer to next one. Could have
-// special field for that in Chunk/Pack
+/* Bytes of NAL (start code included) its handler reads, when it has to be
+ copied for parsing: all of parameter sets (which are kept) and SEIs (recovery
+ point may come after long user data message), slice header for slices, and
+ just the NAL header for all the others, which get thrown away */
+static size_t get_nal_parse_size(NalType type, size_t size)
+{
+    size_t parse_size;
+    switch (type) {
+        case NalType::SEQUENCE_PARAMETER_SET:
+        case NalType::PICTURE_PARAMETER_SET:
+        case NalType::SUPPLEMENTAL_ENHANCED_INFORMATION:
+            return size;
+        case NalType::NON_IDR_SLICE:
+        case NalType::PARTITION_A_SLICE:
+        case NalType::IDR_SLICE:
+            parse_size = H264_SLICE_HEADER_PARSE_SIZE;
+            break;
+        default:
+            parse_size = sizeof(h264_start_code) + 1;
+            break;
+    }
+    return std::min(parse_size, size);
+}
+
+H264StreamParser::~H264StreamParser()
+{
+    /* Pending NAL never made it to the queue, so nobody else will free the
+     fragments it refers to */
+    for (auto &piece : m_nal_pieces) {
+        if (piece.free_callback) {
+            piece.free_callback();
+        }
+    }
+    for (auto &callback : m_orphaned_free_callbacks) {
+        if (callback) {
+            callback();
+        }
+    }
+}
+
+void H264StreamParser::reset()
+{
+    assert(!m_have_pending_nal);
+    /* Same trick as when active parameter set gets replaced, no slice refers
+     to PPS -1 so next one is always first slice of a picture */
+    m_current_picture_slice_header.pic_parameter_set_id = -1;
+    m_pending_recovery_point = false;
+}
+
+/* Buffers with whole NALs. For fragmented input see process_fragment() */
 void H264StreamParser::process_buffer(const VideoBuffer &buffer)
 {
+    TRACE_SCOPE("process_buffer", nullptr, (int64_t)buffer.size);
+    if (m_nal_length_size) {
+        process_length_prefixed_buffer(buffer);
+        return;
+    }
     const unsigned char *limit = buffer.data + buffer.size;
     const unsigned char *current_nal = at_h264_next_start_code(buffer.data, limit);
     if (!current_nal) {
         /* No start code found, WTF is this? */
-        codec_log_warn(m_logger,
-                       "H264 parser given entire buffer without NAL "
-                       "start code in it");
+        codec_log_warn_limited(m_logger,
+                               "H264 parser given entire buffer without NAL "
+                               "start code in it");
         return;
     }
 
@@ -79,10 +136,10 @@ void H264StreamParser::process_buffer(const VideoBuffer &buffer)
         /* Found start code, but it isn't very first thing in buffer, so
          issue a warning. It is OK for start code to be preceeded by one
          zero, though */
-        codec_log_warn(m_logger,
-                       "H264 NAL start code not the first thing in "
-                       "given buffer, skipping %zu bytes",
-                       bytes_consumed);
+        codec_log_warn_limited(m_logger,
+                               "H264 NAL start code not the first thing in "
+                               "given buffer, skipping %zu bytes",
+                               bytes_consumed);
     }
 
     while (current_nal) {
@@ -93,7 +150,7 @@ void H264StreamParser::process_buffer(const VideoBuffer &buffer)
         const unsigned char *current_nal_limit = next_nal ? next_nal : limit;
         size_t current_nal_size = (size_t)(current_nal_limit - current_nal);
         /* Pass NAL to top level handler */
-        handle_nal(buffer.meta, current_nal, current_nal_size);
+        parse_nal(buffer.meta, current_nal, current_nal_size);
         /* Decoder consumed this NAL, can move on */
         bytes_consumed += current_nal_size;
         current_nal = next_nal;
@@ -104,7 +161,343 @@ void H264StreamParser::process_buffer(const VideoBuffer &buffer)
     m_frames.attach_free_callback(buffer.free_callback);
 }
 
-void H264StreamParser::handle_nal(const std::shared_ptr<FrameMetaData> &meta,
+void H264StreamParser::process_length_prefixed_buffer(const VideoBuffer &buffer)
+{
+    const unsigned char *current = buffer.data;
+    const unsigned char *limit = buffer.data + buffer.size;
+    while ((size_t)(limit - current) >= m_nal_length_size) {
+        size_t size = 0;
+        for (size_t i = 0; i < m_nal_length_size; i++) {
+            size = (size << 8) | current[i];
+        }
+        current += m_nal_length_size;
+        if (size > (size_t)(limit - current)) {
+            codec_log_warn_limited(m_logger,
+                                   "H264 NAL length %zu is past the end of buffer, "
+                                   "dropping last %zu bytes",
+                                   size, (size_t)(limit - current));
+            current = limit;
+            break;
+        }
+        if (size) {
+            parse_prefixed_nal(buffer.meta, current, size);
+        }
+        current += size;
+    }
+    if (current != limit) {
+        codec_log_warn_limited(m_logger, "H264 buffer ends with %zu bytes that are not NAL",
+                               (size_t)(limit - current));
+    }
+
+    /* Same as for Annex B, payload chunks point into the buffer */
+    m_frames.attach_free_callback(buffer.free_callback);
+}
+
+/* NAL handlers take NALs with start code in front, and so the parsing copy
+ gets one. Only the part of the NAL parsing needs is copied, same as for NALs
+ split between fragments, see get_nal_parse_size() */
+void H264StreamParser::parse_prefixed_nal(const FrameMeta &meta, const unsigned char *payload,
+                                          size_t size)
+{
+    NalType type = NalType(payload[0] & 0x1f);
+    size_t parse_size = get_nal_parse_size(type, sizeof(h264_start_code) + size)
+        - sizeof(h264_start_code);
+    m_parse_buffer.assign(h264_start_code, h264_start_code + sizeof(h264_start_code));
+    m_parse_buffer.insert(m_parse_buffer.end(), payload, payload + parse_size);
+
+    m_prefixed_nal = payload;
+    m_prefixed_nal_size = size;
+    parse_nal(meta, m_parse_buffer.data(), m_parse_buffer.size());
+    m_prefixed_nal = nullptr;
+    m_prefixed_nal_size = 0;
+}
+
+/* avcC layout: version (1), profile, profile compatibility, level, six bits
+ reserved and two of NAL length size minus one, three bits reserved and five
+ of number of SPSes, then the SPSes, each with 16 bit length in front, then
+ number of PPSes and the PPSes the same way. Whatever comes after that (high
+ profile chroma format and such) repeats what SPS says, and is skipped */
+bool H264StreamParser::set_avcc_config(const unsigned char *record, size_t size)
+{
+    if ((size < 7) || (1 != record[0])) {
+        codec_log_error(m_logger, "avcC record is too short, or of unknown version");
+        return false;
+    }
+    size_t nal_length_size = (record[4] & 0x03) + 1;
+    if (3 == nal_length_size) {
+        codec_log_error(m_logger, "avcC record has NAL length size of 3");
+        return false;
+    }
+
+    /* Checked all through first, so that broken record changes nothing */
+    std::vector<std::pair<const unsigned char *, size_t>> parameter_sets;
+    const unsigned char *current = record + 5;
+    const unsigned char *limit = record + size;
+    for (int list = 0; list < 2; list++) {
+        if (current == limit) {
+            codec_log_error(m_logger, "avcC record ends before %s list", list ? "PPS" : "SPS");
+            return false;
+        }
+        size_t count = list ? *current : (*current & 0x1f);
+        ++current;
+        for (size_t i = 0; i < count; i++) {
+            size_t nal_size = (limit - current >= 2) ? ((current[0] << 8) | current[1]) : 0;
+            if (!nal_size || (nal_size > (size_t)(limit - current - 2))) {
+                codec_log_error(m_logger, "avcC record has broken %s %zu",
+                                list ? "PPS" : "SPS", i);
+                return false;
+            }
+            NalType type = NalType(current[2] & 0x1f);
+            if ((list ? NalType::PPS : NalType::SPS) != type) {
+                codec_log_error(m_logger, "avcC record has NAL of type %d in %s list",
+                                (int)type, list ? "PPS" : "SPS");
+                return false;
+            }
+            parameter_sets.emplace_back(current + 2, nal_size);
+            current += 2 + nal_size;
+        }
+    }
+
+    m_nal_length_size = nal_length_size;
+    for (auto &parameter_set : parameter_sets) {
+        parse_prefixed_nal(FrameMeta(), parameter_set.first, parameter_set.second);
+    }
+    return true;
+}
+
+void H264StreamParser::process_fragment(const VideoBuffer &buffer)
+{
+    const unsigned char *limit = buffer.data + buffer.size;
+    const unsigned char *search_from = buffer.data;
+    /* Beginning of data belonging to pending NAL */
+    const unsigned char *piece_begin = buffer.data;
+
+    /* First see if start code begun in previous fragment(s) - then its last
+     byte is one of the first three bytes here */
+    uint32_t state = m_carry_state;
+    for (size_t i = 0; (i < 3) && (buffer.data + i != limit); ++i) {
+        state = (state << 8) | buffer.data[i];
+        if (0x00000100 == (state & ~0xff)) {
+            /* 3 - i bytes of start code are already in the pending NAL, they
+             belong to the next one */
+            size_t prefix_size = 3 - i;
+            if (m_have_pending_nal) {
+                trim_pending_nal(prefix_size);
+                finish_pending_nal();
+            }
+            begin_pending_nal(buffer.meta, prefix_size);
+            search_from = buffer.data + i + 1;
+            break;
+        }
+    }
+
+    const unsigned char *nal = at_h264_next_start_code(search_from, limit);
+    size_t bytes_skipped = nal ? nal - buffer.data : 0;
+    if (!m_have_pending_nal
+        && ((bytes_skipped > 1) || ((bytes_skipped == 1) && (buffer.data[0])))) {
+        /* Same as in process_buffer(), except this can happen only before
+         first start code ever received */
+        codec_log_warn(m_logger,
+                       "H264 NAL start code not the first thing in "
+                       "given fragment, skipping %zu bytes",
+                       bytes_skipped);
+    }
+    while (nal) {
+        /* Whatever was before this start code completes pending NAL */
+        if (m_have_pending_nal) {
+            append_to_pending_nal(piece_begin, nal - piece_begin, 0);
+            finish_pending_nal();
+        }
+        begin_pending_nal(buffer.meta, 0);
+        piece_begin = nal;
+        nal = at_h264_next_start_code(nal + 4, limit);
+    }
+
+    /* Carry last bytes for the next fragment. Do it now, because fragment
+     may be freed right below */
+    const unsigned char *carry = (buffer.size > 3) ? limit - 3 : buffer.data;
+    for (; carry != limit; ++carry) {
+        m_carry_state = (m_carry_state << 8) | *carry;
+    }
+
+    if (m_have_pending_nal) {
+        /* Rest of the fragment goes to pending NAL, and so does the
+         responsibility of freeing this fragment */
+        append_to_pending_nal(piece_begin, limit - piece_begin, buffer.free_callback);
+    } else {
+        /* Nothing here we could use */
+        m_frames.attach_free_callback(buffer.free_callback);
+    }
+
+}
+
+void H264StreamParser::flush_fragments()
+{
+    if (m_have_pending_nal) {
+        finish_pending_nal();
+    }
+    m_carry_state = H264_CARRY_STATE_RESET;
+}
+
+void H264StreamParser::begin_pending_nal(const FrameMeta &meta,
+                                         size_t prefix_size)
+{
+    assert(!m_have_pending_nal);
+    assert(m_nal_pieces.empty());
+    m_have_pending_nal = true;
+    m_nal_prefix_size = prefix_size;
+    m_nal_meta = meta;
+}
+
+void H264StreamParser::append_to_pending_nal(const unsigned char *data, size_t size,
+                                             const VideoBuffer::FreeCallback &free_callback)
+{
+    if (!size) {
+        /* Fragment had no data for this NAL, but pieces of it may still sit
+         in some earlier chunks */
+        if (free_callback) {
+            m_orphaned_free_callbacks.push_back(free_callback);
+        }
+        return;
+    }
+    m_nal_pieces.push_back(NALPiece());
+    m_nal_pieces.back().data = data;
+    m_nal_pieces.back().size = size;
+    m_nal_pieces.back().free_callback = free_callback;
+}
+
+/* Take away bytes from the end of pending NAL - this is for start codes split
+ between fragments */
+void H264StreamParser::trim_pending_nal(size_t size)
+{
+    while (size) {
+        /* Start code can only be found after the previous one, so it can't
+         eat up more than what was appended */
+        assert(!m_nal_pieces.empty());
+        NALPiece &piece = m_nal_pieces.back();
+        if (piece.size > size) {
+            piece.size -= size;
+            return;
+        }
+        size -= piece.size;
+        if (piece.free_callback) {
+            m_orphaned_free_callbacks.push_back(piece.free_callback);
+        }
+        m_nal_pieces.pop_back();
+    }
+}
+
+void H264StreamParser::finish_pending_nal()
+{
+    assert(m_have_pending_nal);
+    size_t size = m_nal_prefix_size;
+    for (auto &piece : m_nal_pieces) {
+        size += piece.size;
+    }
+
+    if (size < 4) {
+        /* Only part of the start code, nothing to handle */
+    } else if (!m_nal_prefix_size && (1 == m_nal_pieces.size())) {
+        /* NAL was in one fragment after all, can be parsed in place */
+        m_handling_pieces = true;
+        parse_nal(m_nal_meta, m_nal_pieces[0].data, m_nal_pieces[0].size);
+        m_handling_pieces = false;
+    } else {
+        /* Have to make contiguous copy for parsing. Byte #3 is NAL header,
+         which tells how much of the NAL is needed, see get_nal_parse_size() */
+        m_parse_buffer.assign(h264_start_code, h264_start_code + m_nal_prefix_size);
+        for (auto &piece : m_nal_pieces) {
+            m_parse_buffer.insert(m_parse_buffer.end(), piece.data, piece.data + piece.size);
+            if (m_parse_buffer.size() >= 4) {
+                NalType type = NalType(m_parse_buffer[3] & 0x1f);
+                size_t parse_size = get_nal_parse_size(type, m_parse_buffer.size());
+                if (parse_size < m_parse_buffer.size()) {
+                    m_parse_buffer.resize(parse_size);
+                    break;
+                }
+            }
+        }
+        m_handling_pieces = true;
+        parse_nal(m_nal_meta, m_parse_buffer.data(), m_parse_buffer.size());
+        m_handling_pieces = false;
+    }
+
+    /* Whatever wasn't pushed along with the NAL is attached to the last chunk
+     pushed so far, or fired right away if there are none, just like for any
+     other buffer */
+    for (auto &piece : m_nal_pieces) {
+        if (piece.free_callback) {
+            m_frames.attach_free_callback(piece.free_callback);
+        }
+    }
+    for (auto &callback : m_orphaned_free_callbacks) {
+        m_frames.attach_free_callback(callback);
+    }
+    m_nal_pieces.clear();
+    m_orphaned_free_callbacks.clear();
+    m_nal_meta.reset();
+    m_have_pending_nal = false;
+}
+
+uint64_t H264StreamParser::next_parameter_set_version()
+{
+    static std::atomic<uint64_t> version{ 0 };
+    return ++version;
+}
+
+/* FNV-1a, parameter sets are short and this only has to tell resent ones
+ apart from changed (which is then confirmed by comparing) */
+uint64_t H264StreamParser::hash_nal(const unsigned char *nal, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ nal[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* All NALs that go to the queue go through here */
+void H264StreamParser::push_chunk(const unsigned char *nal, size_t size,
+                                  const char *description)
+{
+    if (m_prefixed_nal) {
+        /* Given pointer is the parsing copy, see parse_prefixed_nal() */
+        m_frames.push_chunk(h264_start_code, sizeof(h264_start_code), description);
+        m_frames.push_chunk(m_prefixed_nal, m_prefixed_nal_size, description);
+        return;
+    }
+    if (!m_handling_pieces) {
+        m_frames.push_chunk(nal, size, description);
+        return;
+    }
+
+    /* NAL comes from process_fragment(), given pointer may be just parsing
+     copy, so push the pieces it was made of instead */
+    if (m_nal_prefix_size) {
+        m_frames.push_chunk_copy(h264_start_code, m_nal_prefix_size,
+                                 description);
+    }
+    for (auto &piece : m_nal_pieces) {
+        m_frames.push_chunk(piece.data, piece.size, description);
+        if (piece.free_callback) {
+            /* This is the last piece of its fragment in the queue */
+            m_frames.attach_free_callback(piece.free_callback);
+            piece.free_callback = 0;
+        }
+    }
+}
+
+void H264StreamParser::parse_nal(const FrameMeta &meta,
+                                 const unsigned char *nal, size_t size)
+{
+    auto before = std::chrono::steady_clock::now();
+    handle_nal(meta, nal, size);
+    auto duration = std::chrono::steady_clock::now() - before;
+    m_stats.update_nal_parsing_timing(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+void H264StreamParser::handle_nal(const FrameMeta &meta,
                                   const unsigned char *nal, size_t size)
 {
     /* Fourth byte of NAL (last byte of start code), five low bits are
@@ -236,6 +629,13 @@ void H264StreamParser::handle_nal(const std::shared_ptr<FrameMetaData> &meta,
  back */
 void H264StreamParser::handle_sps_nal(const unsigned char *nal, size_t size)
 {
+    /* Resent as is, nothing to parse or update */
+    uint64_t hash = hash_nal(nal, size);
+    if (m_sequence_parameter_sets.contains(nal, size, hash)) {
+        ++m_stats.number_of_repeated_parameter_sets;
+        return;
+    }
+
     /* Parse SPS */
     SpsNalInfo sps;
     if (!at_h264_get_sps_info(nal, size, sps)) {
@@ -245,17 +645,15 @@ void H264StreamParser::handle_sps_nal(const unsigned char *nal, size_t size)
     int sps_id = sps.seq_parameter_set_id;
 
     /* OK, update SPS at sps_id */
-    if (m_sequence_parameter_sets[sps_id].update(nal, size, -1, sps)) {
-        /* Check currently active SPS */
-        int pps_id = m_current_picture_slice_header.pic_parameter_set_id;
-        const NALParameterSet<PpsNalInfo> &pps = m_picture_parameter_sets[pps_id];
-        if (pps.get_referred_index() == sps_id) {
-            /* Will have to reactivate SPS, as currently active one got replaced
-             with different content. Technically this should only happend on
-             video sequence boundary, but it doesn't hurt to handle it this way */
-            m_current_picture_slice_header.pic_parameter_set_id = -1;
-        } /* Just keep that SPS, nothing changes */
-    }
+    m_sequence_parameter_sets.update(sps_id, nal, size, hash, -1, sps);
+    /* Check currently active SPS */
+    int pps_id = m_current_picture_slice_header.pic_parameter_set_id;
+    if ((pps_id >= 0) && (m_picture_parameter_sets[pps_id].get_referred_index() == sps_id)) {
+        /* Will have to reactivate SPS, as currently active one got replaced
+         with different content. Technically this should only happend on
+         video sequence boundary, but it doesn't hurt to handle it this way */
+        m_current_picture_slice_header.pic_parameter_set_id = -1;
+    } /* Just keep that SPS, nothing changes */
 }
 
 /* See comments about SPS above and also, H264 standard: 7.4.2.2 on PPS:
@@ -268,6 +666,12 @@ void H264StreamParser::handle_sps_nal(const unsigned char *nal, size_t size)
  IMPORTANT: same as with SPS, we save PPS regardless of sync status */
 void H264StreamParser::handle_pps_nal(const unsigned char *nal, size_t size)
 {
+    uint64_t hash = hash_nal(nal, size);
+    if (m_picture_parameter_sets.contains(nal, size, hash)) {
+        ++m_stats.number_of_repeated_parameter_sets;
+        return;
+    }
+
     /* Parse PPS */
     PpsNalInfo pps;
     if (!at_h264_get_pps_info(nal, size, pps)) {
@@ -283,12 +687,11 @@ void H264StreamParser::handle_pps_nal(const unsigned char *nal, size_t size)
     int pps_id = pps.pic_parameter_set_id;
 
     /* OK, update PPS at pps_id */
-    if (m_picture_parameter_sets[pps_id].update(nal, size, sps_id, pps)) {
-        /* PPS changed, see if it was active one */
-        if (m_current_picture_slice_header.pic_parameter_set_id == pps_id) {
-            /* Active PPS changed, next reference will require re-activation */
-            m_current_picture_slice_header.pic_parameter_set_id = -1;
-        }
+    m_picture_parameter_sets.update(pps_id, nal, size, hash, sps_id, pps);
+    /* PPS changed, see if it was active one */
+    if (m_current_picture_slice_header.pic_parameter_set_id == pps_id) {
+        /* Active PPS changed, next reference will require re-activation */
+        m_current_picture_slice_header.pic_parameter_set_id = -1;
     }
 }
 
@@ -310,7 +713,7 @@ void H264StreamParser::handle_pps_nal(const unsigned char *nal, size_t size)
  in decoding order can be decoded without inter prediction from any picture
  decoded prior to the IDR picture. The first picture of each coded video
  sequence is an IDR picture" */
-void H264StreamParser::handle_slice_nal(const std::shared_ptr<FrameMetaData> &meta,
+void H264StreamParser::handle_slice_nal(const FrameMeta &meta,
                                         const unsigned char *nal, size_t size,
                                         NalType slice_type)
 {
@@ -333,9 +736,12 @@ void H264StreamParser::handle_slice_nal(const std::shared_ptr<FrameMetaData> &me
     int sps_id = pps.get_referred_index();
     const NALParameterSet<SpsNalInfo> &sps = m_sequence_parameter_sets[sps_id];
     const char *description;
-    if (at_h264_are_different_pictures(m_current_picture_slice_header,
-                                       slice_header_info)) {
+    bool first_slice = at_h264_are_different_pictures(m_current_picture_slice_header,
+                                                      slice_header_info);
+    check_low_latency(slice_header_info, sps.get_info(), first_slice);
+    if (first_slice) {
         /* FIRST SLICE of new frame, gotta switch frames */
+        int previous_pps_id = m_current_picture_slice_header.pic_parameter_set_id;
         m_current_picture_slice_header = slice_header_info;
         /* Start a new frame */
         m_frames.push_new_pack();
@@ -347,37 +753,63 @@ void H264StreamParser::handle_slice_nal(const std::shared_ptr<FrameMetaData> &me
         // TODO: write down description about how it is enough to have as many,
         // and how our decoder wants +2
         m_frames.back().m_maximum_number_of_reference_frames = sps.get_info().num_ref_frames + 2;
+        m_frames.back().m_max_coded_frame_size = at_h264_get_max_coded_picture_size(sps.get_info());
         m_frames.back().m_can_be_dropped = slice_header_info.ref_nal_idc ? false : true;
         m_frames.back().m_is_complete = false;
         m_frames.back().meta = meta;
         // TODO: use profile from SPS to set this properly! Right now setting
         // reordering for all H264 streams which is far from optimal. Have override
         // to disable reordering for realtime streaming as well!
-        m_frames.back().m_needs_reordering = m_force_disable_reordering ? false : true;
+        m_frames.back().m_needs_reordering
+            = (m_force_disable_reordering || m_low_latency_sequence) ? false : true;
+        m_frames.back().m_low_latency = m_low_latency_sequence;
         m_frames.back().m_needs_flushing = false;
+        m_frames.back().m_coalesce_chunks = m_coalesce_slices;
+        m_frames.back().m_has_pic_order_cnt = compute_pic_order_cnt(
+            slice_header_info, sps.get_info(), m_frames.back().m_pic_order_cnt);
         if (NalType::IDR_SLICE == slice_type) {
             /* IDR slice can reopen the decoder */
             m_frames.back().m_can_reopen_decoding = true;
+            m_frames.back().m_is_keyframe = true;
             /* Note that we ALWAYS add SPS and PPS to FIRST IDR slice. This is
              because we are not sure when decoder will decide to reopen itself,
              we are just generating stream of frame packs. So always equip IDR
              frame with both parameter sets */
-            m_frames.push_chunk(sps.get_data(), sps.get_size(), "SPS");
-            m_frames.push_chunk(pps.get_data(), pps.get_size(), "PPS");
+            push_parameter_set(sps, "SPS");
+            push_parameter_set(pps, "PPS");
             description = "First IDR slice";
+        } else if (m_pending_recovery_point) {
+            /* Picture is the recovery point - it and the ones after can be
+             decoded with none before, and their content is right (at
+             latest) recovery_frame_cnt frames later. Frames until then are
+             shown as decoded, which is what intra refresh looks like anyway.
+             Decoder opened here needs parameter sets, same as for IDR. Note
+             that this is a new sequence as far as PPS switching below is
+             concerned too */
+            m_frames.back().m_can_reopen_decoding = true;
+            m_frames.back().m_can_be_dropped = false;
+            push_parameter_set(sps, "SPS");
+            push_parameter_set(pps, "PPS");
+            ++m_stats.number_of_recovery_points;
+            description = "First recovery point slice";
         } else {
             m_frames.back().m_can_reopen_decoding = false;
             /* NON-IDR slices can only switch PPSes, see if it does so. Even if
              it does, standard says that this PPS has to refer currently active
              SPS so feed PPS only */
-            if (m_current_picture_slice_header.pic_parameter_set_id
-                    != slice_header_info.pic_parameter_set_id) {
-                m_frames.push_chunk(pps.get_data(), pps.get_size(), "PPS");
+            if (previous_pps_id != slice_header_info.pic_parameter_set_id) {
+                push_parameter_set(pps, "PPS");
+                /* Following pictures rely on this PPS, so pack can't be
+                 dropped anymore, even if it isn't a reference one */
+                m_frames.back().m_can_be_dropped = false;
             }
             description = "First slice";
         }
+        /* Recovery point SEI applies to the picture following it only */
+        m_pending_recovery_point = false;
     } else {
         /* Not first slice of a frame */
+        ++m_stats.number_of_continuation_slices;
         description = (NalType::IDR_SLICE == slice_type) ? "IDR slice" : "slice";
         /* IMPORTANT: if frame is spread across multiple input video buffers,
          they can have multiple metadata. This code will naturally use metadata
@@ -392,7 +824,147 @@ void H264StreamParser::handle_slice_nal(const std::shared_ptr<FrameMetaData> &me
          probably makes most sense anyway.
          */
     }
-    m_frames.push_chunk(nal, size, description);
+    push_chunk(nal, size, description);
+    /* Queue may be empty here, see PackQueue::push_chunk() */
+    if (!m_frames.empty()) {
+        ++m_frames.back().m_number_of_slices;
+    }
+}
+
+/* Only frames are handled, and memory management operation 5 (which resets
+ POC like IDR picture does) isn't looked for, dec_ref_pic_marking() is not
+ parsed. State is kept from picture to picture, including those that POC
+ can't be told for, so that it is right again from next IDR picture on */
+bool H264StreamParser::compute_pic_order_cnt(const SliceHeaderInfo &slice_header_info,
+                                             const SpsNalInfo &sps, int32_t &pic_order_cnt)
+{
+    bool reference = slice_header_info.ref_nal_idc ? true : false;
+    if (slice_header_info.IdrPicFlag) {
+        m_previous_pic_order_cnt_msb = 0;
+        m_previous_reference_pic_order_cnt_lsb = 0;
+        m_previous_frame_num_offset = 0;
+    }
+    /* Frame number offset counts frame_num wrap-arounds (types 1 and 2) */
+    uint32_t max_frame_num = 1u << (sps.log2_max_frame_num_minus4 + 4);
+    uint32_t frame_num_offset = m_previous_frame_num_offset;
+    if (!slice_header_info.IdrPicFlag && (m_previous_frame_num > slice_header_info.frame_num)) {
+        frame_num_offset += max_frame_num;
+    }
+    m_previous_frame_num = slice_header_info.frame_num;
+    m_previous_frame_num_offset = frame_num_offset;
+
+    int32_t top = 0;
+    int32_t bottom = 0;
+    if (0 == sps.pic_order_cnt_type) {
+        int32_t max_lsb = 1 << (sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+        int32_t lsb = (int32_t)slice_header_info.pic_order_cnt_lsb;
+        int32_t previous_lsb = (int32_t)m_previous_reference_pic_order_cnt_lsb;
+        int32_t msb = m_previous_pic_order_cnt_msb;
+        if ((lsb < previous_lsb) && (previous_lsb - lsb >= max_lsb / 2)) {
+            msb += max_lsb;
+        } else if ((lsb > previous_lsb) && (lsb - previous_lsb > max_lsb / 2)) {
+            msb -= max_lsb;
+        }
+        if (reference) {
+            m_previous_pic_order_cnt_msb = msb;
+            m_previous_reference_pic_order_cnt_lsb = lsb;
+        }
+        top = msb + lsb;
+        bottom = top + (int32_t)slice_header_info.delta_pic_order_cnt_bottom;
+    } else if (1 == sps.pic_order_cnt_type) {
+        uint32_t cycle_length = sps.num_ref_frames_in_pic_order_cnt_cycle;
+        uint32_t absolute_frame_num = cycle_length ? frame_num_offset + slice_header_info.frame_num
+                                                   : 0;
+        if (!reference && absolute_frame_num) {
+            --absolute_frame_num;
+        }
+        int32_t expected = 0;
+        if (absolute_frame_num) {
+            int32_t expected_delta_per_cycle = 0;
+            for (uint32_t i = 0; i < cycle_length; ++i) {
+                expected_delta_per_cycle += (int32_t)sps.offset_for_ref_frame[i];
+            }
+            uint32_t cycle = (absolute_frame_num - 1) / cycle_length;
+            uint32_t frame_in_cycle = (absolute_frame_num - 1) % cycle_length;
+            expected = (int32_t)cycle * expected_delta_per_cycle;
+            for (uint32_t i = 0; i <= frame_in_cycle; ++i) {
+                expected += (int32_t)sps.offset_for_ref_frame[i];
+            }
+        }
+        if (!reference) {
+            expected += (int32_t)sps.offset_for_non_ref_pic;
+        }
+        top = expected + (int32_t)slice_header_info.delta_pic_order_cnt[0];
+        bottom = top + (int32_t)sps.offset_for_top_to_bottom_field
+            + (int32_t)slice_header_info.delta_pic_order_cnt[1];
+    } else {
+        /* Type 2 is decoding order, non-reference pictures just before the
+         reference one of the same frame_num */
+        top = slice_header_info.IdrPicFlag
+            ? 0 : 2 * (int32_t)(frame_num_offset + slice_header_info.frame_num) - !reference;
+        bottom = top;
+    }
+    pic_order_cnt = (top < bottom) ? top : bottom;
+    /* Stream may start with no IDR picture, then MSB and offset above are
+     relative to whatever came first. That is fine for telling the order,
+     as long as it doesn't go over the next IDR picture */
+    return !slice_header_info.field_pic_flag;
+}
+
+/* Low latency mode is entered at IDR picture, if at all - only frame coded
+ streams with POC type 0 or 2 are considered (type 1 would need full POC
+ calculation to tell). Then, for every picture, POC has to advance, and no
+ B-slices can show up. Otherwise, decoder without reordering would give frames
+ out in the wrong order and we have to fall back - but not right away, because
+ switching reordering means reopening of the decoder, and it can only reopen on
+ the pack that can reopen decoding: IDR picture, or recovery point one (see
+ handle_sei_nal()), whichever comes first. Until then frames are decoded
+ fine, just some of them will be displayed out of order */
+void H264StreamParser::check_low_latency(const SliceHeaderInfo &slice_header_info,
+                                         const SpsNalInfo &sps, bool first_slice)
+{
+    if (first_slice && slice_header_info.IdrPicFlag) {
+        m_low_latency_sequence = m_low_latency && !m_low_latency_fallback
+            && sps.frame_mbs_only_flag && (1 != sps.pic_order_cnt_type);
+        m_previous_pic_order_cnt_lsb = slice_header_info.pic_order_cnt_lsb;
+        return;
+    }
+
+    if (first_slice && m_pending_recovery_point && m_low_latency_fallback) {
+        /* Streams with intra refresh may have no IDR picture for a long time,
+         if ever. Low latency is only entered at IDR picture, as POC checks
+         begin there */
+        m_low_latency_sequence = false;
+        return;
+    }
+
+    if (!m_low_latency_sequence || m_low_latency_fallback) {
+        return;
+    }
+
+    if (H264SliceType::B == slice_header_info.h264_slice_type) {
+        codec_log_warn(m_logger, "B-slice in low latency mode, falling back to "
+                                 "normal mode on next reopen point");
+        m_low_latency_fallback = true;
+        return;
+    }
+
+    if (!first_slice || (0 != sps.pic_order_cnt_type)) {
+        /* POC type 2 is output order by definition */
+        return;
+    }
+
+    /* POC lsb wraps around, and so we check if (modulo) difference is in the
+     "forward" half of the range */
+    uint32_t max_pic_order_cnt_lsb = 1u << (sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+    uint32_t difference = (slice_header_info.pic_order_cnt_lsb - m_previous_pic_order_cnt_lsb)
+        & (max_pic_order_cnt_lsb - 1);
+    m_previous_pic_order_cnt_lsb = slice_header_info.pic_order_cnt_lsb;
+    if (!difference || (difference >= max_pic_order_cnt_lsb / 2)) {
+        codec_log_warn(m_logger, "Picture out of output order in low latency mode, "
+                                 "falling back to normal mode on next reopen point");
+        m_low_latency_fallback = true;
+    }
 }
 
 /* This is just partition slice B or C, which continue from previous partition A
@@ -402,9 +974,9 @@ void H264StreamParser::handle_bc_partition_nal(const unsigned char *nal, size_t
                                                NalType partition_type)
 {
     /* Append NAL to frame */
-    m_frames.push_chunk(nal, size,
-                        (NalType::PARTITION_B_SLICE == partition_type)
-                            ? "Partition B" : "Partition C");
+    push_chunk(nal, size,
+               (NalType::PARTITION_B_SLICE == partition_type)
+                   ? "Partition B" : "Partition C");
 }
 
 /* Standard page 50:
@@ -424,7 +996,13 @@ void H264StreamParser::handle_bc_partition_nal(const unsigned char *nal, size_t
  So it looks like SEIs could be thrown away. Especially so that I was not able
  to find the stream which contained buffering period SEI and most of the stream
  seem to be without SEIs at all or contains SEI types irrelevant for our work
- (like some kind of markers). */
+ (like some kind of markers).
+
+ The one exception is recovery point SEI. Streams using intra refresh (which
+ low latency encoders like for their even frame sizes) may have no IDR pictures
+ after the first one at all, and recovery point is the only place other than
+ IDR where decoding can be started. So it is remembered here and the picture
+ that follows gets marked in handle_slice_nal() */
 void H264StreamParser::handle_sei_nal(const unsigned char *nal, size_t size)
 {
     /* So in the latest version of stream parsing the problem is this:
@@ -439,8 +1017,10 @@ void H264StreamParser::handle_sei_nal(const unsigned char *nal, size_t size)
      elements like SEIs or reserved NALs, and add those to the cache, and put
      that cache in front of frame every time begin of frame is detected. But
      we can also throw these away */
-    (void)nal;
-    (void)size;
+    RecoveryPointInfo recovery_point_info;
+    if (at_h264_get_recovery_point_info(nal, size, recovery_point_info)) {
+        m_pending_recovery_point = true;
+    }
 }
 
 /* H264 standard: on the SEI, AUD, filler, ends of sequence, and end of stream:
@@ -508,20 +1088,24 @@ void H264StreamParser::handle_unspecified_nal(const unsigned char *nal, size_t s
     (void)nal;
 }
 
-/* This function returnes parser success/failure status */
+/* This function returnes parser success/failure status. Header is parsed in
+ one pass: initial part gets us the PPS (and through it SPS) to use, and then
+ the same bitstream is carried on with these to read the rest of the fields
+ at_h264_are_different_pictures() needs, and nothing beyond that */
 bool H264StreamParser::parse_slice_header(const unsigned char *slice_nal, size_t size,
                                           SliceHeaderInfo &slice_header_info)
 {
-    ::memset(&slice_header_info, 0, sizeof(slice_header_info));
-    if (!at_h264_get_initial_slice_header_info(slice_nal, size, slice_header_info)) {
-        codec_log_error(m_logger, "Initial slice header parsing failed!");
+    ++m_stats.number_of_slice_headers_parsed;
+    H264Bitstream bs_parser(slice_nal, size);
+    if (!at_h264_get_initial_slice_header_info(bs_parser, slice_header_info)) {
+        codec_log_error_limited(m_logger, "Initial slice header parsing failed!");
         return false;
     }
 
     int pps_id = slice_header_info.pic_parameter_set_id;
     const NALParameterSet<PpsNalInfo> &pps = m_picture_parameter_sets[pps_id];
     if (!pps.get_size()) {
-        codec_log_error(m_logger, "Slice header wants to activate unknown PPS");
+        codec_log_error_limited(m_logger, "Slice header wants to activate unknown PPS");
         return false;
     }
 
@@ -529,12 +1113,11 @@ bool H264StreamParser::parse_slice_header(const unsigned char *slice_nal, size_t
      so no need for extra checks */
     int sps_id = pps.get_referred_index();
 
-    /* Now we can do full slice header parsing */
-    if (!at_h264_get_full_slice_header_info(slice_nal, size,
-                                            m_sequence_parameter_sets[sps_id].get_info(),
-                                            m_picture_parameter_sets[pps_id].get_info(),
-                                            slice_header_info)) {
-        codec_log_error(m_logger, "Full slice header parsing failed!");
+    /* Now we can do the rest of slice header parsing */
+    if (!at_h264_get_remaining_slice_header_info(bs_parser,
+                                                 m_sequence_parameter_sets[sps_id].get_info(),
+                                                 pps.get_info(), slice_header_info)) {
+        codec_log_error_limited(m_logger, "Full slice header parsing failed!");
         return false;
     }
     return true;
@@ -7,7 +7,10 @@
 
 #pragma once
 
+#include <assert.h>
 #include <string.h>
+#include <atomic>
+#include <vector>
 
 #include "codec_logger.hpp"
 #include "h264_nal.hpp"
@@ -15,62 +18,122 @@
 
 namespace airtame {
 
+/* No zero bytes in there, so no start code can be formed using these */
+#define H264_CARRY_STATE_RESET 0xdeadbeef
+
+/* How much of slice NAL (start code included) is copied for parsing, when it
+ can't be parsed in place. Fields up to the last one that
+ at_h264_get_remaining_slice_header_info() reads take less than 600 bits even
+ with the longest codes, so this covers the header along with any emulation
+ prevention bytes in it */
+#define H264_SLICE_HEADER_PARSE_SIZE 256
+
 class H264StreamParser {
 private:
     /* This is simple class we use for keeping and updating H264 parameter sets,
-     (SPS and PPS) */
+     (SPS and PPS), together with their parsed info. Streams normally resend
+     them unchanged (before every IDR, or even every frame), so data goes
+     into storage that is kept and reused, and each update gets new version
+     (see VideoChunk::parameter_set_version) only when content changes.
+
+     Chunks pushed into the queue point straight at the data, so each version
+     has storage of its own, and chunks of packs still queued hold a reference
+     to the one they point into (see push_parameter_set()) - later versions
+     can't overwrite it */
+    class ParameterSetStorage {
+    public:
+        std::vector<unsigned char> data;
+
+        ParameterSetStorage(const unsigned char *nal, size_t s)
+            : data(nal, nal + s)
+        {
+        }
+
+        /* Counted by hand rather than by shared_ptr, so that free callback
+         holding a reference captures just a pointer, which std::function
+         stores without allocating */
+        void acquire()
+        {
+            ++m_references;
+        }
+
+        void release()
+        {
+            if (!--m_references) {
+                delete this;
+            }
+        }
+
+    private:
+        std::atomic<size_t> m_references{ 1 };
+    };
+
     template <typename InfoType>
     class NALParameterSet {
     protected:
-        unsigned char *m_data = nullptr;
-        size_t m_size = 0;
+        ParameterSetStorage *m_data = nullptr;
+        uint64_t m_hash = 0;
+        uint64_t m_version = 0;
         int m_referred_index = -1; /* PPSes have to "refer" to proper SPS, here
                                     we keep this index. Will be set to -1 for
                                     SPSes */
         InfoType m_info;
     public:
+        NALParameterSet()
+        {
+        }
+
         ~NALParameterSet()
         {
-            delete[] m_data;
+            if (m_data) {
+                m_data->release();
+            }
         }
 
-        void reset()
+        NALParameterSet(const NALParameterSet &) = delete;
+        NALParameterSet &operator=(const NALParameterSet &) = delete;
+
+        bool is_same(const unsigned char *nal, size_t s, uint64_t hash) const
         {
-            delete[] m_data;
-            m_data = nullptr;
-            m_size = 0;
-            m_referred_index = -1;
+            return (m_hash == hash) && (get_size() == s) && !::memcmp(get_data(), nal, s);
         }
 
-        /* Given new NAL with same index, see if it is really different and
-         replace. Return bool indicating if something has changed */
-        bool update(const unsigned char *nal, size_t s, int referred_index,
+        /* Given new NAL with same index that is_same() told is different,
+         replace. Previous version stays as long as packs refer to it, so this
+         allocates - parameter sets resent as they were don't get here */
+        void update(const unsigned char *nal, size_t s, uint64_t hash, int referred_index,
                     const InfoType &info)
         {
-            if ((m_size == s) && !::memcmp(m_data, nal, s)) {
-                /* Not updated, NALs are equal */
-                return false;
-            }
-            /* Otherwise update */
             if (m_data) {
-                delete[] m_data;
+                m_data->release();
             }
-            m_data = new uint8_t[s];
-            ::memcpy(m_data, nal, s);
-            m_size = s;
+            m_data = new ParameterSetStorage(nal, s);
+            m_hash = hash;
+            m_version = next_parameter_set_version();
             m_referred_index = referred_index;
             m_info = info;
-            return true;
         }
 
         const unsigned char *get_data() const
         {
-            return m_data;
+            return m_data ? m_data->data.data() : nullptr;
         }
 
         size_t get_size() const
         {
-            return m_size;
+            return m_data ? m_data->data.size() : 0;
+        }
+
+        /* Storage of current version, with reference taken for the caller */
+        ParameterSetStorage *acquire_storage() const
+        {
+            m_data->acquire();
+            return m_data;
+        }
+
+        uint64_t get_version() const
+        {
+            return m_version;
         }
 
         int get_referred_index() const
@@ -84,6 +147,50 @@ private:
         }
     };
 
+    /* Fixed table of parameter sets, which also knows the slots in use, so
+     that resent NAL can be found by its hash without being parsed for its id */
+    template <typename InfoType, size_t Size>
+    class NALParameterSetStore {
+    private:
+        NALParameterSet<InfoType> m_sets[Size];
+        std::vector<int> m_in_use;
+    public:
+        NALParameterSetStore()
+        {
+            m_in_use.reserve(Size);
+        }
+
+        NALParameterSet<InfoType> &operator[](int index)
+        {
+            return m_sets[index];
+        }
+
+        const NALParameterSet<InfoType> &operator[](int index) const
+        {
+            return m_sets[index];
+        }
+
+        /* True if NAL is one of the stored, as is */
+        bool contains(const unsigned char *nal, size_t s, uint64_t hash) const
+        {
+            for (int index : m_in_use) {
+                if (m_sets[index].is_same(nal, s, hash)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void update(int index, const unsigned char *nal, size_t s, uint64_t hash,
+                    int referred_index, const InfoType &info)
+        {
+            if (!m_sets[index].get_size()) {
+                m_in_use.push_back(index);
+            }
+            m_sets[index].update(nal, s, hash, referred_index, info);
+        }
+    };
+
     CodecLogger &m_logger;
 
     /* Frame list */
@@ -92,41 +199,202 @@ private:
     /* Force disable reordering flag */
     bool m_force_disable_reordering;
 
+    /* Make decoder feed all slices of the picture at once */
+    bool m_coalesce_slices = false;
+
+    /* Low latency mode, see set_low_latency(). Stream is checked on the fly
+     and mode is only used for coded video sequences (from IDR picture on)
+     that don't need reordering. Once stream shows it does, fallback is set,
+     and normal mode is used from next IDR or recovery point picture on */
+    bool m_low_latency = false;
+    bool m_low_latency_fallback = false;
+    bool m_low_latency_sequence = false;
+    /* POC of previous picture, to check that output order follows decoding
+     order */
+    uint32_t m_previous_pic_order_cnt_lsb = 0;
+
+    /* Picture order count state, see compute_pic_order_cnt(): of the
+     previous reference picture for POC type 0, and frame number offset of the
+     previous picture for types 1 and 2 */
+    int32_t m_previous_pic_order_cnt_msb = 0;
+    uint32_t m_previous_reference_pic_order_cnt_lsb = 0;
+    uint32_t m_previous_frame_num = 0;
+    uint32_t m_previous_frame_num_offset = 0;
+
+    /* Recovery point SEI came since last picture, so the next one is where
+     decoding can start, see handle_sei_nal() */
+    bool m_pending_recovery_point = false;
+
     /* SPS and PPS tables. H264 standard allows transmitting a number of these
      and activating them on per-slice basis, so proper handling on our side
      requires keeping them and sending to decoder when slice activates them */
-    NALParameterSet<SpsNalInfo> m_sequence_parameter_sets[H264_NUMBER_OF_SPS_ALLOWED];
-    NALParameterSet<PpsNalInfo> m_picture_parameter_sets[H264_NUMBER_OF_PPS_ALLOWED];
+    NALParameterSetStore<SpsNalInfo, H264_NUMBER_OF_SPS_ALLOWED> m_sequence_parameter_sets;
+    NALParameterSetStore<PpsNalInfo, H264_NUMBER_OF_PPS_ALLOWED> m_picture_parameter_sets;
 
     /* Last seen slice header info */
     SliceHeaderInfo m_current_picture_slice_header;
 
+    /* Fragmented input state, see process_fragment(). NAL that is not known
+     to be complete yet is kept as a list of pieces pointing straight into the
+     fragments it came in, together with free callbacks of those fragments */
+    class NALPiece {
+    public:
+        const unsigned char *data;
+        size_t size;
+        /* Set only for the last piece of a fragment that is already done */
+        VideoBuffer::FreeCallback free_callback;
+    };
+    std::vector<NALPiece> m_nal_pieces;
+    /* Set when there is NAL being assembled */
+    bool m_have_pending_nal = false;
+    /* Number of start code bytes that came before the first piece, in previous
+     fragment(s). These are always zeros and 0x01, so they are not kept */
+    size_t m_nal_prefix_size = 0;
+    FrameMeta m_nal_meta;
+    /* Free callbacks of fragments whose pieces got trimmed away */
+    std::vector<VideoBuffer::FreeCallback> m_orphaned_free_callbacks;
+    /* Last three bytes of input, to detect start codes split by fragment
+     boundary */
+    uint32_t m_carry_state;
+    /* Set when NAL from pieces is being handled, so push_chunk() knows to
+     push the pieces and not the NAL pointer it was given */
+    bool m_handling_pieces = false;
+    /* Contiguous copy of pieces for NAL parsing (and only parsing) */
+    std::vector<unsigned char> m_parse_buffer;
+
+    /* Length prefixed input, see set_avcc_config(). Size of the length field
+     in bytes, zero for Annex B */
+    size_t m_nal_length_size = 0;
+    /* Payload of length prefixed NAL being handled, so push_chunk() knows to
+     push start code and the payload instead of the parsing copy */
+    const unsigned char *m_prefixed_nal = nullptr;
+    size_t m_prefixed_nal_size = 0;
+
+    /* NAL handling timing and slice header counters */
+    ParsingStats m_stats;
+
 public:
     H264StreamParser(CodecLogger &logger, PackQueue &frames,
                      bool force_disable_reordering)
         : m_logger(logger)
         , m_frames(frames)
         , m_force_disable_reordering(force_disable_reordering)
+        , m_current_picture_slice_header()
+        , m_carry_state(H264_CARRY_STATE_RESET)
     {
+        /* No picture yet, same as after reset(). Parameter set handlers look
+         at this too, so it can't be left uninitialized */
+        m_current_picture_slice_header.pic_parameter_set_id = -1;
     }
+    ~H264StreamParser();
 
     /* Call this with data buffer, which should contain whole NALs (so no
      division on buffer boundary, etc). Parser will handle filler or thrash at
      begin of the buffer (as long as start code is not emulated by random
      garbage). Status is returned, if true then NAL(s) were found and added to
-     frame queue */
+     frame queue. In length prefixed mode (see set_avcc_config()) buffer has
+     whole length prefixed NALs instead, and no garbage */
     void process_buffer(const VideoBuffer &buffer);
 
+    /* Alternative to process_buffer() for input that comes in arbitrary pieces
+     (RTP packets, TCP reads, and so on), so NALs and even start codes may be
+     split between buffers. Split NALs are pushed as several chunks pointing
+     into buffers they came in, nothing gets copied (save for a copy of first
+     few bytes some NALs need for parsing). Buffer free callback fires only
+     after all the chunks referring to that buffer are consumed.
+
+     Because NAL end is only known when next start code shows up, last NAL seen
+     is held back until then. Call flush_fragments() when it is known that no
+     more data will come for it (end of stream, RTP marker, etc).
+
+     Don't mix with process_buffer() without calling flush_fragments() first.
+     Annex B only, length prefixed mode (see below) doesn't apply here */
+    void process_fragment(const VideoBuffer &buffer);
+    void flush_fragments();
+
+    /* Makes process_buffer() take length prefixed NALs, as MP4 files (AVCC)
+     and WebRTC depacketizers have them, instead of Annex B. Record is avcC
+     decoder configuration (ISO/IEC 14496-15, 5.2.4.1): NAL length size is
+     taken from it, and SPSes and PPSes in it are handled as if they came
+     in the stream. Buffers are then split into NALs by their lengths, with
+     no start code scanning, and every NAL goes into the pack as a chunk with
+     start code (the same static one for all) followed by a chunk pointing at
+     the payload in the buffer, so that payload is not copied - save for the
+     first few bytes needed for parsing, as with fragments.
+
+     Returns false, with the mode left as it was, if record is broken */
+    bool set_avcc_config(const unsigned char *record, size_t size);
+
+    /* Same for input with no avcC record, where parameter sets come in band.
+     NAL length size is 1, 2 or 4 bytes, 0 goes back to Annex B */
+    void set_nal_length_size(size_t nal_length_size)
+    {
+        assert((nal_length_size <= 4) && (3 != nal_length_size));
+        m_nal_length_size = nal_length_size;
+    }
+
+    size_t get_nal_length_size() const
+    {
+        return m_nal_length_size;
+    }
+
+    /* Forgets the picture being parsed, so that next slice starts new pack
+     even if it looks like continuation of it. For starting over from other
+     place in the stream, after the queue got cleared. Parameter sets are kept,
+     as the stream stays the same. Not for use with fragments pending */
+    void reset();
+
     void set_force_disable_reordering(bool force_disable_reordering)
     {
         m_force_disable_reordering = force_disable_reordering;
     }
 
+    /* VPU decodes multislice pictures slowly when every slice NAL gets its own
+     bitstream buffer update. When this is set, packs are marked so that
+     decoder feeds whole picture (parameter sets and all slices) as one
+     contiguous region. Off by default, because VPU is picky about how NALs
+     get into bitstream buffer and not all the streams were tried this way */
+    void set_coalesce_slices(bool coalesce_slices)
+    {
+        m_coalesce_slices = coalesce_slices;
+    }
+
+    /* For realtime streams (like screen mirroring) without B-slices and with
+     pictures coming in output order. In that mode packs are marked so that
+     decoder opens without reordering and with low latency display frame
+     count (see VPUDecoder::set_low_latency_display_frames()), and gives
+     every frame out from the same step() that fed it. Stream is checked on
+     the fly and if it turns out to need reordering after all, parser falls
+     back to normal mode starting with next picture that can reopen the
+     decoder (IDR or recovery point one) */
+    void set_low_latency(bool low_latency)
+    {
+        m_low_latency = low_latency;
+        m_low_latency_fallback = false;
+    }
+
+    bool is_low_latency_active() const
+    {
+        return m_low_latency_sequence;
+    }
+
+    const ParsingStats &get_stats() const
+    {
+        return m_stats;
+    }
+
+    void reset_stats()
+    {
+        m_stats = ParsingStats();
+    }
+
 private:
-    void handle_nal(const std::shared_ptr<FrameMetaData> &meta, const unsigned char *nal, size_t size);
+    /* Times handle_nal() into m_stats */
+    void parse_nal(const FrameMeta &meta, const unsigned char *nal, size_t size);
+    void handle_nal(const FrameMeta &meta, const unsigned char *nal, size_t size);
     void handle_sps_nal(const unsigned char *nal, size_t size);
     void handle_pps_nal(const unsigned char *nal, size_t size);
-    void handle_slice_nal(const std::shared_ptr<FrameMetaData> &meta, const unsigned char *nal,
+    void handle_slice_nal(const FrameMeta &meta, const unsigned char *nal,
                           size_t size, NalType slice_type);
     void handle_bc_partition_nal(const unsigned char *nal, size_t size,
                                  NalType slice_type);
@@ -136,8 +404,38 @@ private:
     void handle_reserved_nal(const unsigned char *nal, size_t size);
     void handle_unspecified_nal(const unsigned char *nal, size_t size);
     /* Utilities */
+    /* Versions are unique across parsers, so decoder never mistakes parameter
+     set of another stream for one it has already fed */
+    static uint64_t next_parameter_set_version();
+    static uint64_t hash_nal(const unsigned char *nal, size_t size);
+    template <typename InfoType>
+    void push_parameter_set(const NALParameterSet<InfoType> &set, const char *description)
+    {
+        /* Chunk keeps the version it points into */
+        ParameterSetStorage *storage = set.acquire_storage();
+        m_frames.push_parameter_set(set.get_data(), set.get_size(), set.get_version(),
+                                    description, [storage]() { storage->release(); });
+    }
     void push_chunk(const unsigned char *nal, size_t size, const char *description);
-    /* Return false on error */
+    void process_length_prefixed_buffer(const VideoBuffer &buffer);
+    /* Parses NAL given without start code, see set_avcc_config() */
+    void parse_prefixed_nal(const FrameMeta &meta, const unsigned char *payload, size_t size);
+    void begin_pending_nal(const FrameMeta &meta, size_t prefix_size);
+    void append_to_pending_nal(const unsigned char *data, size_t size,
+                               const VideoBuffer::FreeCallback &free_callback);
+    void trim_pending_nal(size_t size);
+    void finish_pending_nal();
+    /* POC of the picture first slice belongs to (8.2.1 of H.264), false if
+     it can't be told */
+    bool compute_pic_order_cnt(const SliceHeaderInfo &slice_header_info,
+                               const SpsNalInfo &sps, int32_t &pic_order_cnt);
+    void check_low_latency(const SliceHeaderInfo &slice_header_info, const SpsNalInfo &sps,
+                           bool first_slice);
+    /* One pass over the NAL, both levels of at_h264_get_*_slice_header_info()
+     run for every slice - it isn't lazy. Second level reads just the fields
+     that tell pictures apart (up to redundant_pic_cnt), and continuation
+     slice needs all of them to be told from the first slice of next picture,
+     so there is nothing to defer. Return false on error */
     bool parse_slice_header(const unsigned char *slice_nal, size_t size,
                             SliceHeaderInfo &slice_header_info);
 };
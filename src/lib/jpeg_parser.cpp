@@ -7,10 +7,36 @@
 
 #include <stdint.h>
 
+#include "byte_scan.hpp"
 #include "jpeg_parser.hpp"
 
 const unsigned char *at_jpeg_next_marker(const unsigned char *ptr,
                                          const unsigned char *limit)
+{
+    /* Marker is two bytes, so last place where it can begin is limit - 2 */
+    if (limit - ptr < 2) {
+        return nullptr;
+    }
+    const unsigned char *last = limit - 1;
+    while (ptr < last) {
+        /* No marker can begin in a block without 0xff bytes */
+        ptr = at_skip_blocks_without_byte(ptr, last, 0xff);
+        const unsigned char *block_limit = ptr + AT_BYTE_SCAN_BLOCK_SIZE;
+        if (block_limit > last) {
+            block_limit = last;
+        }
+        for (; ptr < block_limit; ++ptr) {
+            if ((0xff == ptr[0]) && (0x00 != ptr[1]) && (0xff != ptr[1])) {
+                return ptr;
+            }
+        }
+    }
+    /* Not found */
+    return nullptr;
+}
+
+const unsigned char *at_jpeg_next_marker_scalar(const unsigned char *ptr,
+                                                const unsigned char *limit)
 {
     /* Make sure we have "safe" initial contents of marker state */
     bool had_0xff = false;
@@ -30,3 +56,39 @@ const unsigned char *at_jpeg_next_marker(const unsigned char *ptr,
     /* Not found */
     return nullptr;
 }
+
+const unsigned char *at_jpeg_image_end(const unsigned char *ptr, const unsigned char *limit)
+{
+    /* Skip SOI */
+    const unsigned char *marker = at_jpeg_next_marker(ptr, limit);
+    if (!marker || (MarkerType::SOI != (MarkerType)marker[1])) {
+        return nullptr;
+    }
+    marker = at_jpeg_next_marker(marker + 2, limit);
+    while (marker) {
+        MarkerType m = (MarkerType)marker[1];
+        if (MarkerType::EOI == m) {
+            return marker + 2;
+        }
+        if ((MarkerType::TEM == m)
+            || ((MarkerType::RST0 <= m) && (m <= MarkerType::RST7))) {
+            /* Markers without segment, RSTs come within entropy coded data */
+            marker = at_jpeg_next_marker(marker + 2, limit);
+            continue;
+        }
+        /* All the others are followed by two bytes of segment size, which
+         includes the size field itself but not the marker */
+        if (limit - marker < 4) {
+            return nullptr;
+        }
+        size_t segment_size = (size_t)marker[2] * 256 + marker[3];
+        if ((segment_size < 2) || ((size_t)(limit - marker) < 2 + segment_size)) {
+            return nullptr;
+        }
+        /* Entropy coded data following SOS segment is scanned for the next
+         marker, it can't contain one other than RSTs (0xff bytes there are
+         stuffed with 0x00) */
+        marker = at_jpeg_next_marker(marker + 2 + segment_size, limit);
+    }
+    return nullptr;
+}
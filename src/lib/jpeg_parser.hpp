@@ -64,4 +64,16 @@ enum class MarkerType {
     PROHIBITED255 = 0xff
 };
 
+/* Returns pointer to the first marker in [ptr, limit) or nullptr. Scalar
+ version is the original byte-by-byte one, kept as a reference for
+ benchmarking */
 const unsigned char *at_jpeg_next_marker(const unsigned char *ptr, const unsigned char *limit);
+const unsigned char *at_jpeg_next_marker_scalar(const unsigned char *ptr,
+                                                const unsigned char *limit);
+
+/* Returns pointer right after EOI marker of JPEG image beginning at ptr (with
+ SOI marker), so where next image of MJPEG stream starts, or nullptr if image
+ doesn't end before limit. Marker segments are skipped by their size fields,
+ so that for example thumbnail images embedded in APP segments don't end it
+ prematurely */
+const unsigned char *at_jpeg_image_end(const unsigned char *ptr, const unsigned char *limit);
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "timestamp.hpp"
+
+namespace airtame {
+
+/* Number of histogram buckets, enough for durations up to a minute when
+ counting microseconds */
+#define LATENCY_HISTOGRAM_BUCKETS 27
+
+/* Fixed bucket latency histogram, cheap enough to be updated on every
+ operation: no allocations, and adding a sample is just a bit count. Bucket 0
+ counts samples of value 0 or 1, every next bucket (up to the last one, which
+ counts everything bigger) covers values up to twice as big as previous one:
+ (1, 2], (2, 4], (4, 8] and so on. So percentiles are only given as the upper
+ bound of the bucket they fall into, which is plenty to tell where the time
+ goes.
+
+ Histogram doesn't care about the unit, users say what it is */
+class LatencyHistogram {
+private:
+    size_t m_buckets[LATENCY_HISTOGRAM_BUCKETS] = {};
+    size_t m_count = 0;
+    Timestamp m_total = 0;
+    Timestamp m_max = 0;
+
+public:
+    void add(Timestamp value)
+    {
+        if (value < 0) {
+            value = 0;
+        }
+        ++m_buckets[get_bucket(value)];
+        ++m_count;
+        m_total += value;
+        if (m_max < value) {
+            m_max = value;
+        }
+    }
+
+    /* Shortcut for the most common use, measuring time since given point in
+     microseconds */
+    Timestamp add_usec_since(std::chrono::steady_clock::time_point before)
+    {
+        Timestamp duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - before).count();
+        add(duration);
+        return duration;
+    }
+
+    void reset()
+    {
+        *this = LatencyHistogram();
+    }
+
+    size_t get_count() const
+    {
+        return m_count;
+    }
+
+    Timestamp get_total() const
+    {
+        return m_total;
+    }
+
+    Timestamp get_max() const
+    {
+        return m_max;
+    }
+
+    Timestamp get_average() const
+    {
+        return m_count ? m_total / (Timestamp)m_count : 0;
+    }
+
+    size_t get_bucket_count(size_t bucket) const
+    {
+        return (bucket < LATENCY_HISTOGRAM_BUCKETS) ? m_buckets[bucket] : 0;
+    }
+
+    /* Upper bound of values counted in given bucket */
+    static Timestamp get_bucket_limit(size_t bucket)
+    {
+        return (Timestamp)1 << bucket;
+    }
+
+    /* Value at most percentile (0-100) of samples are at or below, as bucket
+     upper bound - but never more than the biggest value actually seen */
+    Timestamp get_percentile(unsigned percentile) const
+    {
+        if (!m_count) {
+            return 0;
+        }
+        /* Rank of the sample we look for, rounded up */
+        size_t rank = (m_count * percentile + 99) / 100;
+        if (!rank) {
+            rank = 1;
+        }
+        size_t seen = 0;
+        for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS - 1; ++i) {
+            seen += m_buckets[i];
+            if (seen >= rank) {
+                Timestamp limit = get_bucket_limit(i);
+                return (limit < m_max) ? limit : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    /* Prints "name avg/p50/p99/max" summary the way snprintf() does, so
+     several can be chained to build one line */
+    int print_summary(char *buffer, size_t size, const char *name) const
+    {
+        return snprintf(buffer, size, "%s %" PRId64 "/%" PRId64 "/%" PRId64 "/%" PRId64,
+                        name, get_average(), get_percentile(50), get_percentile(99), m_max);
+    }
+
+private:
+    static size_t get_bucket(Timestamp value)
+    {
+        if (value <= 1) {
+            return 0;
+        }
+        /* Smallest bucket with limit not below the value, that is number of
+         bits needed to write (value - 1) */
+        size_t bucket = 64 - __builtin_clzll((uint64_t)value - 1);
+        return (bucket < LATENCY_HISTOGRAM_BUCKETS) ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1;
+    }
+};
+}
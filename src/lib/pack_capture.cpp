@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack_capture.hpp"
+
+namespace airtame {
+
+static size_t pad_record_size(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+bool PackCaptureWriter::open(const char *path)
+{
+    close();
+    m_file = ::fopen(path, "wb");
+    if (!m_file) {
+        codec_log_error(m_logger, "Cannot open capture %s: %s", path, strerror(errno));
+        return false;
+    }
+    PackCaptureHeader header;
+    ::memset(&header, 0, sizeof(header));
+    ::memcpy(header.magic, PACK_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = PACK_CAPTURE_VERSION;
+    header.header_size = sizeof(header);
+    if (1 != ::fwrite(&header, sizeof(header), 1, m_file)) {
+        codec_log_error(m_logger, "Cannot write capture %s", path);
+        ::fclose(m_file);
+        m_file = nullptr;
+        return false;
+    }
+    m_start = std::chrono::steady_clock::now();
+    m_number_of_packs = 0;
+    m_number_of_bytes = sizeof(header);
+    return true;
+}
+
+bool PackCaptureWriter::close()
+{
+    if (!m_file) {
+        return true;
+    }
+    bool closed = !::fclose(m_file);
+    m_file = nullptr;
+    return closed;
+}
+
+void PackCaptureWriter::capture(const Pack &pack)
+{
+    if (!m_file) {
+        return;
+    }
+    size_t table_size = sizeof(PackCaptureRecord) + pack.m_chunks.size() * sizeof(PackCaptureChunk);
+    size_t size = table_size;
+    for (auto &chunk : pack.m_chunks) {
+        size += chunk.size;
+    }
+    size = pad_record_size(size);
+    m_record.assign(size, 0);
+
+    PackCaptureRecord record;
+    ::memset(&record, 0, sizeof(record));
+    record.size = size;
+    record.number_of_chunks = pack.m_chunks.size();
+    record.arrival = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - m_start).count();
+    record.timestamp = pack.meta ? pack.meta.get_timestamp() : PACK_CAPTURE_NO_TIMESTAMP;
+    record.padded_width = pack.m_geometry.m_padded_width;
+    record.padded_height = pack.m_geometry.m_padded_height;
+    record.true_width = pack.m_geometry.m_true_width;
+    record.true_height = pack.m_geometry.m_true_height;
+    record.crop_left = pack.m_geometry.m_crop_left;
+    record.crop_top = pack.m_geometry.m_crop_top;
+    record.rotation_deg = (int32_t)pack.m_geometry.m_rotation_deg;
+    record.maximum_number_of_reference_frames = pack.m_maximum_number_of_reference_frames;
+    record.max_coded_frame_size = pack.m_max_coded_frame_size;
+    record.number_of_slices = pack.m_number_of_slices;
+    record.codec_type = (uint32_t)pack.m_codec_type;
+    record.flags = (pack.m_can_reopen_decoding ? PackCaptureRecord::CAN_REOPEN_DECODING : 0)
+        | (pack.m_can_be_dropped ? PackCaptureRecord::CAN_BE_DROPPED : 0)
+        | (pack.m_needs_reordering ? PackCaptureRecord::NEEDS_REORDERING : 0)
+        | (pack.m_needs_flushing ? PackCaptureRecord::NEEDS_FLUSHING : 0)
+        | (pack.m_ends_stream ? PackCaptureRecord::ENDS_STREAM : 0)
+        | (pack.m_low_latency ? PackCaptureRecord::LOW_LATENCY : 0)
+        | (pack.m_coalesce_chunks ? PackCaptureRecord::COALESCE_CHUNKS : 0)
+        | (pack.m_is_keyframe ? PackCaptureRecord::KEYFRAME : 0);
+    ::memcpy(m_record.data(), &record, sizeof(record));
+
+    size_t offset = table_size;
+    unsigned char *table = m_record.data() + sizeof(record);
+    for (auto &chunk : pack.m_chunks) {
+        PackCaptureChunk entry;
+        entry.parameter_set_version = chunk.parameter_set_version;
+        entry.offset = offset;
+        entry.size = chunk.size;
+        ::memcpy(table, &entry, sizeof(entry));
+        table += sizeof(entry);
+        /* Zero-copy producers write their chunks the same way they would
+         write them into bitstream buffer */
+        if (chunk.write_callback) {
+            chunk.write_callback(m_record.data() + offset, 0, chunk.size);
+        } else if (chunk.size) {
+            ::memcpy(m_record.data() + offset, chunk.data, chunk.size);
+        }
+        offset += chunk.size;
+    }
+
+    if (1 != ::fwrite(m_record.data(), m_record.size(), 1, m_file)) {
+        codec_log_error(m_logger, "Cannot write capture, stopping after %zu packs",
+                        m_number_of_packs);
+        ::fclose(m_file);
+        m_file = nullptr;
+        return;
+    }
+    ++m_number_of_packs;
+    m_number_of_bytes += m_record.size();
+}
+
+bool PackCaptureReader::open(const char *path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        codec_log_error(m_logger, "Cannot open capture %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat status;
+    if ((::fstat(fd, &status) < 0) || ((size_t)status.st_size < sizeof(PackCaptureHeader))) {
+        codec_log_error(m_logger, "Capture %s is too short", path);
+        ::close(fd);
+        return false;
+    }
+    void *data = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == data) {
+        codec_log_error(m_logger, "Cannot map capture %s: %s", path, strerror(errno));
+        return false;
+    }
+    const PackCaptureHeader *header = (const PackCaptureHeader *)data;
+    if (::memcmp(header->magic, PACK_CAPTURE_MAGIC, sizeof(header->magic))
+        || (PACK_CAPTURE_VERSION != header->version)
+        || (sizeof(PackCaptureHeader) != header->header_size)) {
+        codec_log_error(m_logger, "%s is not a pack capture, or of other version", path);
+        ::munmap(data, status.st_size);
+        return false;
+    }
+    m_data = (const unsigned char *)data;
+    m_size = status.st_size;
+    rewind();
+    return true;
+}
+
+void PackCaptureReader::close()
+{
+    if (m_data) {
+        ::munmap((void *)m_data, m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_offset = 0;
+}
+
+const PackCaptureRecord *PackCaptureReader::get_record() const
+{
+    if (!m_data || (m_offset + sizeof(PackCaptureRecord) > m_size)) {
+        return nullptr;
+    }
+    const PackCaptureRecord *record = (const PackCaptureRecord *)(m_data + m_offset);
+    /* Chunk table has to fit what is left of the capture, checked before
+     multiplying, so that damaged count can't wrap the size around */
+    size_t remaining = m_size - m_offset - sizeof(PackCaptureRecord);
+    if (record->number_of_chunks > remaining / sizeof(PackCaptureChunk)) {
+        codec_log_error(m_logger, "Capture record %zu is damaged", m_number_of_packs_read);
+        return nullptr;
+    }
+    size_t table_size
+        = sizeof(PackCaptureRecord) + (size_t)record->number_of_chunks * sizeof(PackCaptureChunk);
+    if ((record->size < table_size) || (record->size > m_size - m_offset)) {
+        codec_log_error(m_logger, "Capture record %zu is damaged", m_number_of_packs_read);
+        return nullptr;
+    }
+    return record;
+}
+
+bool PackCaptureReader::peek_arrival(Timestamp &arrival) const
+{
+    const PackCaptureRecord *record = get_record();
+    if (!record) {
+        return false;
+    }
+    arrival = record->arrival;
+    return true;
+}
+
+bool PackCaptureReader::read(PackQueue &queue)
+{
+    const PackCaptureRecord *record = get_record();
+    if (!record) {
+        return false;
+    }
+    const unsigned char *base = m_data + m_offset;
+    const PackCaptureChunk *table = (const PackCaptureChunk *)(base + sizeof(PackCaptureRecord));
+    for (uint32_t i = 0; i < record->number_of_chunks; i++) {
+        if ((table[i].offset > record->size) || (table[i].size > record->size - table[i].offset)) {
+            codec_log_error(m_logger, "Capture record %zu has chunk out of it",
+                            m_number_of_packs_read);
+            return false;
+        }
+    }
+
+    queue.push_new_pack();
+    for (uint32_t i = 0; i < record->number_of_chunks; i++) {
+        if (table[i].parameter_set_version) {
+            queue.push_parameter_set(base + table[i].offset, table[i].size,
+                                     table[i].parameter_set_version, "captured parameter set");
+        } else {
+            queue.push_chunk(base + table[i].offset, table[i].size, "captured");
+        }
+    }
+    Pack &pack = queue.back();
+    pack.m_geometry = FrameGeometry(record->padded_width, record->padded_height,
+                                    record->true_width, record->true_height, record->crop_left,
+                                    record->crop_top);
+    pack.m_geometry.m_rotation_deg = record->rotation_deg;
+    pack.m_maximum_number_of_reference_frames = record->maximum_number_of_reference_frames;
+    pack.m_max_coded_frame_size = record->max_coded_frame_size;
+    pack.m_number_of_slices = record->number_of_slices;
+    if (PACK_CAPTURE_NO_TIMESTAMP != record->timestamp) {
+        pack.meta = FrameMeta(record->timestamp);
+    }
+    pack.m_codec_type = (CodecType)record->codec_type;
+    pack.m_can_reopen_decoding = record->flags & PackCaptureRecord::CAN_REOPEN_DECODING;
+    pack.m_can_be_dropped = record->flags & PackCaptureRecord::CAN_BE_DROPPED;
+    pack.m_needs_reordering = record->flags & PackCaptureRecord::NEEDS_REORDERING;
+    pack.m_needs_flushing = record->flags & PackCaptureRecord::NEEDS_FLUSHING;
+    pack.m_ends_stream = record->flags & PackCaptureRecord::ENDS_STREAM;
+    pack.m_low_latency = record->flags & PackCaptureRecord::LOW_LATENCY;
+    pack.m_coalesce_chunks = record->flags & PackCaptureRecord::COALESCE_CHUNKS;
+    pack.m_is_keyframe = record->flags & PackCaptureRecord::KEYFRAME;
+    pack.m_is_complete = true;
+
+    m_offset += record->size;
+    ++m_number_of_packs_read;
+    return true;
+}
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "codec_logger.hpp"
+#include "pack_queue.hpp"
+#include "timestamp.hpp"
+
+namespace airtame {
+
+#define PACK_CAPTURE_MAGIC "VPUPACKS"
+#define PACK_CAPTURE_VERSION 2
+/* Record timestamp of packs without metadata */
+#define PACK_CAPTURE_NO_TIMESTAMP INT64_MIN
+
+/* Packs as they reached the decoder, recorded so that field issues that
+ depend on exact NAL grouping, timing and reopen sequences can be reproduced
+ without the stream parser, and decoder changes compared on the same input.
+ File is the header below followed by one record per pack, in queue order:
+ record header, its chunk table, then chunk data. Everything is in host byte
+ order, and records are padded to 8 bytes, so that reader can use them in
+ place from mmap() */
+struct PackCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    /* sizeof(PackCaptureHeader), records start right after */
+    uint32_t header_size;
+};
+
+struct PackCaptureRecord {
+    static constexpr uint32_t CAN_REOPEN_DECODING = 1 << 0;
+    static constexpr uint32_t CAN_BE_DROPPED = 1 << 1;
+    static constexpr uint32_t NEEDS_REORDERING = 1 << 2;
+    static constexpr uint32_t NEEDS_FLUSHING = 1 << 3;
+    static constexpr uint32_t ENDS_STREAM = 1 << 4;
+    static constexpr uint32_t LOW_LATENCY = 1 << 5;
+    static constexpr uint32_t COALESCE_CHUNKS = 1 << 6;
+    static constexpr uint32_t KEYFRAME = 1 << 7;
+
+    /* Whole record: this header, chunk table, data and padding */
+    uint32_t size;
+    uint32_t number_of_chunks;
+    /* When decoder was first given the pack, usec since capture started */
+    int64_t arrival;
+    /* Pack metadata timestamp, PACK_CAPTURE_NO_TIMESTAMP if it has none */
+    int64_t timestamp;
+    uint32_t padded_width;
+    uint32_t padded_height;
+    uint32_t true_width;
+    uint32_t true_height;
+    uint32_t crop_left;
+    uint32_t crop_top;
+    int32_t rotation_deg;
+    uint32_t maximum_number_of_reference_frames;
+    uint32_t max_coded_frame_size;
+    uint32_t number_of_slices;
+    /* CodecType */
+    uint32_t codec_type;
+    uint32_t flags;
+};
+
+struct PackCaptureChunk {
+    /* VideoChunk::parameter_set_version */
+    uint64_t parameter_set_version;
+    /* Data, from the start of the record */
+    uint32_t offset;
+    uint32_t size;
+};
+
+/* Writes packs PackQueue gives it (see PackQueue::set_capture()) to capture
+ file. To be used from the decoding thread only */
+class PackCaptureWriter : public PackCapture {
+private:
+    CodecLogger &m_logger;
+    FILE *m_file = nullptr;
+    std::chrono::steady_clock::time_point m_start;
+    /* Record is put together here, and written at once */
+    std::vector<unsigned char> m_record;
+    size_t m_number_of_packs = 0;
+    size_t m_number_of_bytes = 0;
+
+public:
+    PackCaptureWriter(CodecLogger &logger)
+        : m_logger(logger)
+    {
+    }
+    PackCaptureWriter(const PackCaptureWriter &) = delete;
+    PackCaptureWriter &operator=(const PackCaptureWriter &) = delete;
+
+    ~PackCaptureWriter()
+    {
+        close();
+    }
+
+    /* Arrival times count from here */
+    bool open(const char *path);
+    /* False if anything failed to be written */
+    bool close();
+
+    void capture(const Pack &pack) override;
+
+    size_t get_number_of_packs() const
+    {
+        return m_number_of_packs;
+    }
+
+    size_t get_number_of_bytes() const
+    {
+        return m_number_of_bytes;
+    }
+};
+
+/* Reads capture back, pushing its packs into queue the way stream parser
+ would, with chunks pointing right into the mapped file - so it has to stay
+ open while they are in the queue */
+class PackCaptureReader {
+private:
+    CodecLogger &m_logger;
+    const unsigned char *m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_offset = 0;
+    size_t m_number_of_packs_read = 0;
+
+public:
+    PackCaptureReader(CodecLogger &logger)
+        : m_logger(logger)
+    {
+    }
+    PackCaptureReader(const PackCaptureReader &) = delete;
+    PackCaptureReader &operator=(const PackCaptureReader &) = delete;
+
+    ~PackCaptureReader()
+    {
+        close();
+    }
+
+    bool open(const char *path);
+    void close();
+
+    /* Arrival time of the next pack, false at the end of capture */
+    bool peek_arrival(Timestamp &arrival) const;
+    /* Pushes the next pack (complete) into queue, false at the end of
+     capture or if the record is damaged */
+    bool read(PackQueue &queue);
+    /* Back to the first pack */
+    void rewind()
+    {
+        m_offset = sizeof(PackCaptureHeader);
+        m_number_of_packs_read = 0;
+    }
+
+    size_t get_number_of_packs_read() const
+    {
+        return m_number_of_packs_read;
+    }
+
+private:
+    /* Record at current offset, nullptr if there is no valid one */
+    const PackCaptureRecord *get_record() const;
+};
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <limits>
+
+#include "pack_drop_policy.hpp"
+
+namespace airtame {
+
+void LatencyDropPolicy::apply(PackQueue &queue, DecodingStats &stats)
+{
+    Timestamp latency = queue.get_latency();
+    if (latency <= m_latency_target) {
+        return;
+    }
+
+    if (m_drop_non_reference) {
+        /* Gentle part - anything that is older than target relative to newest
+         pack and is not used for reference by other frames can go */
+        Timestamp oldest = 0;
+        Timestamp newest = 0;
+        queue.get_timestamp_range(oldest, newest);
+        size_t dropped = queue.drop_non_reference_packs(newest - m_latency_target);
+        if (dropped) {
+            Timestamp latency_after = queue.get_latency();
+            stats.number_of_non_reference_packs_dropped += dropped;
+            stats.latency_recovered_by_non_reference_drops += latency - latency_after;
+            latency = latency_after;
+        }
+    }
+
+    if (m_jump_to_reopen_point && (latency > m_latency_target)) {
+        /* Still lagging behind, so make a jump in playback */
+        size_t dropped = queue.drop_packs_before_newest_reopen_point();
+        if (dropped) {
+            Timestamp latency_after = queue.get_latency();
+            ++stats.number_of_jumps;
+            stats.number_of_packs_dropped_by_jumps += dropped;
+            stats.latency_recovered_by_jumps += latency - latency_after;
+        }
+    }
+}
+
+void DeadlineDropPolicy::apply(PackQueue &queue, DecodingStats &stats)
+{
+    Timestamp position;
+    if (!m_clock(position)) {
+        return;
+    }
+    Timestamp lateness = get_lateness(queue, position);
+    if (lateness <= m_tolerance) {
+        return;
+    }
+
+    size_t dropped = queue.drop_non_reference_packs(position - m_tolerance);
+    if (dropped) {
+        Timestamp lateness_after = get_lateness(queue, position);
+        stats.number_of_non_reference_packs_dropped += dropped;
+        stats.latency_recovered_by_non_reference_drops += lateness - lateness_after;
+        lateness = lateness_after;
+    }
+
+    if (m_jump_to_reopen_point && (lateness > m_tolerance)) {
+        dropped = queue.drop_packs_before_newest_reopen_point();
+        if (dropped) {
+            ++stats.number_of_jumps;
+            stats.number_of_packs_dropped_by_jumps += dropped;
+            stats.latency_recovered_by_jumps += lateness - get_lateness(queue, position);
+        }
+    }
+}
+
+Timestamp DeadlineDropPolicy::get_lateness(const PackQueue &queue, Timestamp position)
+{
+    Timestamp oldest;
+    Timestamp newest;
+    if (!queue.get_timestamp_range(oldest, newest) || (oldest >= position)) {
+        return 0;
+    }
+    return position - oldest;
+}
+
+void TrickPlayDropPolicy::apply(PackQueue &queue, DecodingStats &stats)
+{
+    if (m_preroll) {
+        stats.number_of_preroll_packs_dropped += queue.drop_non_reference_packs(m_preroll_target);
+    }
+
+    if (m_rate > TRICK_PLAY_MAX_NON_REFERENCE_RATE) {
+        stats.number_of_fast_forward_packs_dropped += queue.drop_non_keyframe_packs();
+    } else if (m_rate > 1.0) {
+        stats.number_of_fast_forward_packs_dropped
+            += queue.drop_non_reference_packs(std::numeric_limits<Timestamp>::max());
+    }
+
+    Timestamp position;
+    if ((m_rate > 1.0) && m_clock && m_clock(position)) {
+        /* Packs before reopen point that is due would only be presented
+         late */
+        size_t dropped = queue.drop_packs_before_newest_reopen_point(position);
+        if (dropped) {
+            ++stats.number_of_fast_forward_jumps;
+            stats.number_of_fast_forward_packs_dropped += dropped;
+        }
+    }
+
+    if (m_next) {
+        m_next->apply(queue, stats);
+    }
+}
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "codec_common.hpp"
+#include "pack_queue.hpp"
+
+namespace airtame {
+
+/* Implements "before decode" dropping algorithm described at PackQueue: when
+ queue latency (see PackQueue::get_latency()) exceeds the target, first drop
+ non-reference packs that are too old, and if that wasn't enough, jump to the
+ newest pack that can reopen decoding. Used for live streams, where network
+ can deliver a burst of frames and it is better to catch up to real time than
+ to decode frames that will be late for display anyway.
+
+ Latency target is in timestamp units, so it is up to the user what these
+ units are (and they have to be carried by packs metadata) */
+class LatencyDropPolicy : public PackDropPolicy {
+private:
+    Timestamp m_latency_target;
+    bool m_drop_non_reference;
+    bool m_jump_to_reopen_point;
+
+public:
+    LatencyDropPolicy(Timestamp latency_target, bool drop_non_reference = true,
+                      bool jump_to_reopen_point = true)
+        : m_latency_target(latency_target)
+        , m_drop_non_reference(drop_non_reference)
+        , m_jump_to_reopen_point(jump_to_reopen_point)
+    {
+    }
+
+    void set_latency_target(Timestamp latency_target)
+    {
+        m_latency_target = latency_target;
+    }
+
+    Timestamp get_latency_target() const
+    {
+        return m_latency_target;
+    }
+
+    void apply(PackQueue &queue, DecodingStats &stats) override;
+};
+
+/* Current playback position in timestamp units, for DeadlineDropPolicy.
+ Returns false while there is no position yet (playback didn't start) */
+using PlaybackClock = std::function<bool(Timestamp &position)>;
+
+/* "Before decode" dropping for paced playback of files, where packs are
+ parsed just ahead of decode and queue latency says nothing. Instead, packs
+ are checked against playback clock: ones with timestamp behind it by more
+ than tolerance would only be displayed late, so non-reference ones are
+ dropped and, if allowed and still behind, playback jumps to the newest pack
+ that can reopen decoding.
+
+ Lateness removed is accounted for in the same stats as LatencyDropPolicy
+ does with latency */
+class DeadlineDropPolicy : public PackDropPolicy {
+private:
+    PlaybackClock m_clock;
+    Timestamp m_tolerance;
+    bool m_jump_to_reopen_point;
+
+public:
+    DeadlineDropPolicy(const PlaybackClock &clock, Timestamp tolerance,
+                       bool jump_to_reopen_point = false)
+        : m_clock(clock)
+        , m_tolerance(tolerance)
+        , m_jump_to_reopen_point(jump_to_reopen_point)
+    {
+    }
+
+    void apply(PackQueue &queue, DecodingStats &stats) override;
+
+private:
+    /* How far oldest droppable pack is behind given position, zero if it
+     isn't */
+    static Timestamp get_lateness(const PackQueue &queue, Timestamp position);
+};
+
+/* Playback rate up to which fast forward drops non-reference packs only,
+ above it just reopen points are decoded */
+#define TRICK_PLAY_MAX_NON_REFERENCE_RATE 4.0
+
+/* "Before decode" dropping for trick play, see "FASTER PLAYBACK" and "SEEK"
+ algorithms at PackQueue. Fast forward (rate above 1) drops all non-reference
+ packs, and past TRICK_PLAY_MAX_NON_REFERENCE_RATE everything but reopen
+ points - whatever a stream allows, frames presented at the rate are then
+ fewer. With playback clock given (running at the rate, see
+ PresentationScheduler::set_rate()), once a reopen point is due all the packs
+ before it are dropped too, which is how streams without non-reference
+ frames (VP8) keep up at any rate. Pre-roll of precise seek drops
+ non-reference packs before seek target: frames before it are only decoded
+ as reference for the ones after, and the rest would not be presented
+ anyway.
+
+ Other policy (LatencyDropPolicy or DeadlineDropPolicy) can be chained
+ after, so that rate 1 plays the same as without trick play */
+class TrickPlayDropPolicy : public PackDropPolicy {
+private:
+    double m_rate = 1.0;
+    PlaybackClock m_clock;
+    std::shared_ptr<PackDropPolicy> m_next;
+    bool m_preroll = false;
+    Timestamp m_preroll_target = 0;
+
+public:
+    TrickPlayDropPolicy(std::shared_ptr<PackDropPolicy> next = nullptr)
+        : m_next(next)
+    {
+    }
+
+    /* Takes effect on the next step, with packs already queued */
+    void set_rate(double rate)
+    {
+        m_rate = rate;
+    }
+
+    double get_rate() const
+    {
+        return m_rate;
+    }
+
+    /* Empty clock disables jumping */
+    void set_clock(const PlaybackClock &clock)
+    {
+        m_clock = clock;
+    }
+
+    void set_next(const std::shared_ptr<PackDropPolicy> &next)
+    {
+        m_next = next;
+    }
+
+    /* Pre-roll lasts until end_preroll(), which consumer calls once it got
+     frame at the target. Target is in pack timestamp units */
+    void begin_preroll(Timestamp target)
+    {
+        m_preroll = true;
+        m_preroll_target = target;
+    }
+
+    void end_preroll()
+    {
+        m_preroll = false;
+    }
+
+    bool is_preroll() const
+    {
+        return m_preroll;
+    }
+
+    Timestamp get_preroll_target() const
+    {
+        return m_preroll_target;
+    }
+
+    void apply(PackQueue &queue, DecodingStats &stats) override;
+};
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "codec_common.hpp"
+#include "trace.hpp"
 
+#include <iterator>
+#include <limits>
 #include <list>
-#include <string>
-#include <vpu_lib.h>
+#include <memory>
+#include <string.h>
 
 namespace airtame {
 
@@ -21,29 +24,92 @@ enum class PackPurpose {
  the decoder to the output */
 class VideoChunk {
 public:
+    /* Small headers synthesized by stream parsers (like IVF headers for VP8)
+     are stored right inside the chunk, see PackQueue::push_chunk_copy() */
+    static constexpr size_t INLINE_DATA_SIZE = 32;
+
+    /* Zero-copy producers can give writer function instead of data pointer.
+     When the chunk gets fed, writer is called with a window of decoder
+     bitstream buffer (see VPUDecodingSession::reserve()) and has to fill it
+     with window_size bytes of chunk data, starting at chunk offset. For one
+     chunk it may be called twice, when bitstream buffer wraps around */
+    using WriteCallback
+        = std::function<void(unsigned char *window, size_t offset, size_t window_size)>;
+
     const unsigned char *data = nullptr;
     size_t size = 0;
     VideoBuffer::FreeCallback free_callback = 0;
-    std::string description;
+    WriteCallback write_callback = 0;
+    /* Only static strings here, so that pushing a chunk doesn't need to copy
+     (and allocate) anything */
+    const char *description = "";
+    /* Bytes of the chunk fed already, when bitstream buffer had no space for
+     all of it. Rest gets fed on later step, see PackQueue::mark_chunk_fed() */
+    size_t fed = 0;
+    /* Nonzero for parameter set chunks (H264 SPS/PPS), version of their
+     content. Decoder feeds every version once per session, see
+     VPUDecoder::skip_fed_parameter_sets() */
+    uint64_t parameter_set_version = 0;
+    unsigned char inline_data[INLINE_DATA_SIZE];
 
     VideoChunk()
         : data(nullptr)
         , size(0)
         , free_callback(0)
+        , write_callback(0)
     {
     }
     VideoChunk(const VideoChunk &c) = delete;
-    VideoChunk(VideoChunk &&c) = default;
+    VideoChunk(VideoChunk &&c)
+    {
+        *this = std::move(c);
+    }
     ~VideoChunk()
+    {
+        reset();
+    }
+
+    VideoChunk& operator=(const VideoChunk &) = delete;
+    VideoChunk& operator=(VideoChunk &&c)
+    {
+        if (this == &c) {
+            return *this;
+        }
+        reset();
+        size = c.size;
+        fed = c.fed;
+        parameter_set_version = c.parameter_set_version;
+        description = c.description;
+        write_callback = std::move(c.write_callback);
+        free_callback = std::move(c.free_callback);
+        c.free_callback = 0;
+        if (c.data == c.inline_data) {
+            /* Data pointer has to follow the inline data */
+            ::memcpy(inline_data, c.inline_data, size);
+            data = inline_data;
+        } else {
+            data = c.data;
+        }
+        c.reset();
+        return *this;
+    }
+
+    /* Releases chunk data and brings it back to just-constructed state, so that
+     chunk can be reused */
+    void reset()
     {
         /* Check for free callback, if it exists we should call it */
         if (free_callback) {
             free_callback();
+            free_callback = 0;
         }
+        write_callback = 0;
+        data = nullptr;
+        size = 0;
+        fed = 0;
+        parameter_set_version = 0;
+        description = "";
     }
-
-    VideoChunk& operator=(const VideoChunk &) = delete;
-    VideoChunk& operator=(VideoChunk &&) = default;
 };
 
 /* This class contains everything that is needed to decode single frame:
@@ -60,15 +126,22 @@ public:
     /* Geometry part */
     FrameGeometry m_geometry;
     size_t m_maximum_number_of_reference_frames = 0;
+    /* Upper bound of coded frame size stream parameters allow for (bytes),
+     zero if not known */
+    size_t m_max_coded_frame_size = 0;
 
     /* Metadata part */
-    std::shared_ptr<FrameMetaData> meta;
+    FrameMeta meta;
 
     /* Decoding flags */
     CodecType m_codec_type;
 
     /* Assigned by stream parser */
     bool m_can_reopen_decoding = false;
+    /* Decodes with no other frame at all (h264 IDR, VP8 keyframe). Recovery
+     point pictures can reopen decoding too, but are inter coded, and look
+     right only after some more frames */
+    bool m_is_keyframe = false;
     bool m_can_be_dropped = false; /* This can be also interpreted as "is a
                                     reference frame", because only non-reference
                                     frames can be dropped */
@@ -79,16 +152,73 @@ public:
                                       basis if you know (for example) h264
                                       profiles (and stream parser does) */
     bool m_needs_flushing = false;
+    /* Last pack of a stream that the next one follows in the same queue (see
+     StreamHandler::enqueue()). Decoder settles it before the pack is fed,
+     see settle_stream_end(): next stream either goes on in the same session,
+     if that fits it, or decoder gets flushed after this pack, the same way
+     as with m_needs_flushing */
+    bool m_ends_stream = false;
+    /* Stream parser made sure that frames of this pack's sequence come in
+     output order, so it can be decoded without reordering and with minimal
+     buffering, and it never needs flushing */
+    bool m_low_latency = false;
+    /* Feed all the chunks into bitstream buffer as single region, instead
+     of one by one */
+    bool m_coalesce_chunks = false;
+    /* Number of slices in the pack (h264 only, zero otherwise) */
+    size_t m_number_of_slices = 0;
+    /* Picture order count of h264 frame, which tells output order of the
+     pictures since the last IDR one. Not known for field pictures, and for
+     other codecs output order is decoding order */
+    bool m_has_pic_order_cnt = false;
+    int32_t m_pic_order_cnt = 0;
 
     /* Written to by the decoder */
     bool m_decoded = false;
+    /* Bytes of the pack that went into bitstream buffer so far */
+    size_t m_bytes_fed = 0;
+    /* Given to queue's PackCapture already */
+    bool m_captured = false;
+
+    /* Bytes still waiting to be fed */
+    size_t get_bytes_pending() const
+    {
+        size_t pending = 0;
+        for (auto &chunk : m_chunks) {
+            pending += chunk.size - chunk.fed;
+        }
+        return pending;
+    }
 };
 
-/* This class serves to restrict pack queue operations to few sane ones. In
- future we will probably want to have stuff like pluggable dropping policies
- here, and I guess then it will be possible to extend it with stuff like
- adding decode times on pop, or keeping info about how fast/slow decoding is.
- But right now it is pretty simple...
+class PackQueue;
+
+/* Pluggable "before decode" dropping, see set_drop_policy() below and
+ pack_drop_policy.hpp for implementations */
+class PackDropPolicy {
+public:
+    virtual ~PackDropPolicy() {}
+    /* Called before every decoder step, drops packs from queue (using
+     PackQueue::drop_* functions) if it decides so and accounts for that in
+     stats */
+    virtual void apply(PackQueue &queue, DecodingStats &stats) = 0;
+};
+
+/* Pluggable recording of packs going to the decoder, see set_capture()
+ below and pack_capture.hpp for the implementation */
+class PackCapture {
+public:
+    virtual ~PackCapture() {}
+    /* Called once for each complete pack, in queue order, before decoder
+     works on it (so before any of its chunks were fed) */
+    virtual void capture(const Pack &pack) = 0;
+};
+
+/* This class serves to restrict pack queue operations to few sane ones. It can
+ be extended with stuff like adding decode times on pop, or keeping info about
+ how fast/slow decoding is. Dropping is done by pluggable policies, and queue
+ only gives them primitives that are safe to use, that is, which never drop
+ packs which are being received, fed or flushed.
 
  "BEFORE DECODE" DROPPING ALGORITHM EXAMPLE:
  Let's suppose we have some frames in queue, and some of them are "too old"
@@ -124,7 +254,45 @@ class PackQueue {
 private:
     std::list<Pack> m_packs;
     size_t m_number_of_packs_popped = 0;
+    size_t m_number_of_packs_dropped = 0;
+    /* Sum of Pack::get_bytes_pending() over all the packs */
+    size_t m_bytes_pending = 0;
+
+    /* Set once consumer started feeding or decoding front pack, such pack has
+     to be consumed to the end and never dropped */
+    bool m_front_started = false;
+
+    std::shared_ptr<PackDropPolicy> m_drop_policy;
+    std::shared_ptr<PackCapture> m_capture;
+
+    /* Pools of spare list nodes. Popped packs and chunks are spliced over
+     here instead of being freed, and spliced back when pushing, so once the
+     pools are warmed up pushing/popping does no heap allocations at all. It
+     is up to the pool sizes to hold as many packs/chunks as there normally
+     are in flight, whatever doesn't fit is freed as usual */
+    std::list<Pack> m_free_packs;
+    std::list<VideoChunk> m_free_chunks;
+    size_t m_max_pooled_packs;
+    size_t m_max_pooled_chunks;
+
+    /* Number of times pools ran dry and node had to be allocated, not counting
+     pre-allocation done in the ctor. In steady state these should not grow */
+    size_t m_number_of_pack_allocations = 0;
+    size_t m_number_of_chunk_allocations = 0;
+
 public:
+    /* Defaults are good for streams with ~20 packs in queue with up to ~10
+     slices each */
+    PackQueue(size_t max_pooled_packs = 32, size_t max_pooled_chunks = 256)
+        : m_max_pooled_packs(max_pooled_packs)
+        , m_max_pooled_chunks(max_pooled_chunks)
+    {
+        m_free_packs.resize(m_max_pooled_packs);
+        m_free_chunks.resize(m_max_pooled_chunks);
+    }
+    PackQueue(const PackQueue &) = delete;
+    PackQueue &operator=(const PackQueue &) = delete;
+
     bool has_pack_for_consumption() const
     {
         if (m_packs.empty()) {
@@ -156,11 +324,27 @@ public:
     /* To be called by pack producer */
     void push_new_pack()
     {
+        TRACE_INSTANT("pack_push", nullptr, (int64_t)m_packs.size());
         /* Automatically terminate previous pack, if any */
         if (!m_packs.empty()) {
             m_packs.back().m_is_complete = true;
         }
-        m_packs.push_back(Pack());
+        if (m_free_packs.empty()) {
+            m_packs.emplace_back();
+            ++m_number_of_pack_allocations;
+        } else {
+            /* Pooled packs are reset already when being put into the pool */
+            m_packs.splice(m_packs.end(), m_free_packs, m_free_packs.begin());
+        }
+    }
+
+    /* Used when handing complete packs over between queues, for example in
+     threaded decoding mode. Unlike push_new_pack() it doesn't terminate
+     previous pack, pack given should be complete already */
+    void push_pack(Pack &&pack)
+    {
+        m_bytes_pending += pack.get_bytes_pending();
+        m_packs.push_back(std::move(pack));
     }
 
     /* This is called with every chunk pushed. Note that buffer may contain
@@ -174,11 +358,57 @@ public:
              m_can_reopen_decoding set to false */
             return;
         }
-        m_packs.back().m_chunks.push_back(VideoChunk());
-        VideoChunk &chunk = m_packs.back().m_chunks.back();
+        VideoChunk &chunk = new_chunk();
         chunk.data = data;
         chunk.size = size;
         chunk.description = description;
+        m_bytes_pending += size;
+    }
+
+    /* Same as above, but for small (up to VideoChunk::INLINE_DATA_SIZE) chunks
+     that stream parser makes up on the fly - data is copied into the chunk
+     itself, so caller doesn't have to allocate (and free) it */
+    void push_chunk_copy(const void *data, size_t size, const char *description)
+    {
+        assert(size <= VideoChunk::INLINE_DATA_SIZE);
+        if (m_packs.empty()) {
+            return;
+        }
+        VideoChunk &chunk = new_chunk();
+        ::memcpy(chunk.inline_data, data, size);
+        chunk.data = chunk.inline_data;
+        chunk.size = size;
+        chunk.description = description;
+        m_bytes_pending += size;
+    }
+
+    /* Same as above, but chunk data is not in memory yet - instead it will be
+     written straight into decoder bitstream buffer by the writer when chunk
+     gets fed. Writer has to be able to produce exactly size bytes */
+    void push_chunk(VideoChunk::WriteCallback writer, size_t size, const char *description)
+    {
+        push_chunk((const unsigned char *)nullptr, size, description);
+        if (!m_packs.empty()) {
+            m_packs.back().m_chunks.back().write_callback = writer;
+        }
+    }
+
+    /* Same as push_chunk() above, for parameter set stream parser keeps, with
+     version of its content (see VideoChunk::parameter_set_version). Storage
+     may be replaced by the next version while the chunk is queued, so free
+     callback given (if any) is what keeps it, and goes with the chunk right
+     away - or gets called if there is no pack to push into */
+    void push_parameter_set(const unsigned char *data, size_t size, uint64_t version,
+                            const char *description,
+                            const VideoBuffer::FreeCallback &free_callback = nullptr)
+    {
+        push_chunk(data, size, description);
+        if (!m_packs.empty()) {
+            m_packs.back().m_chunks.back().parameter_set_version = version;
+            m_packs.back().m_chunks.back().free_callback = free_callback;
+        } else if (free_callback) {
+            free_callback();
+        }
     }
 
     /* This is called when all the chunks from the buffer were pushed and buffer
@@ -215,6 +445,12 @@ public:
         return m_packs.empty();
     }
 
+    /* Number of packs in the queue, including incomplete one (if any) */
+    size_t size() const
+    {
+        return m_packs.size();
+    }
+
     /* To be called by pack consumer */
     const Pack &front() const
     {
@@ -222,28 +458,365 @@ public:
         return m_packs.front();
     }
 
-    void pop_chunk()
+    /* Pack following the front one by given number of packs, nullptr if
+     there is none. Decoder feeds these ahead of decoding, see
+     VPUDecoder::set_feed_ahead() */
+    const Pack *get_pack(size_t index) const
     {
-        assert(!m_packs.empty());
-        m_packs.front().m_chunks.pop_front();
+        for (const Pack &pack : m_packs) {
+            if (!index--) {
+                return &pack;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Decides on Pack::m_ends_stream of the pack at given index, for the
+     decoder. Flag is cleared, and flushing is set if next stream doesn't fit
+     the session */
+    void settle_stream_end(size_t index, bool needs_flushing)
+    {
+        auto it = m_packs.begin();
+        std::advance(it, index);
+        assert(it != m_packs.end());
+        it->m_ends_stream = false;
+        it->m_needs_flushing = needs_flushing;
+    }
+
+    /* Chunk functions below work with the front pack by default, or with one
+     given by index as above. Packs past the front one that got fed are never
+     dropped */
+    void pop_chunk(size_t index = 0)
+    {
+        Pack &pack = get_fed_pack(index);
+        std::list<VideoChunk> &chunks = pack.m_chunks;
+        assert(!chunks.empty());
+        pack.m_bytes_fed += chunks.front().size - chunks.front().fed;
+        recycle_chunk(chunks);
+    }
+
+    /* Part of the first chunk got fed, bitstream buffer had no space for the
+     rest. Chunk stays on until pop_chunk() */
+    void mark_chunk_fed(size_t size, size_t index = 0)
+    {
+        Pack &pack = get_fed_pack(index);
+        VideoChunk &chunk = pack.m_chunks.front();
+        assert(chunk.fed + size <= chunk.size);
+        chunk.fed += size;
+        pack.m_bytes_fed += size;
+        m_bytes_pending -= size;
     }
 
     void mark_front_as_decoded()
     {
         assert(!m_packs.empty());
+        m_front_started = true;
         m_packs.front().m_decoded = true;
     }
 
     void pop_front()
     {
         assert(!m_packs.empty());
-        m_packs.pop_front();
+        TRACE_INSTANT("pack_pop", nullptr, (int64_t)m_packs.size());
+        recycle_pack(m_packs.begin());
+        m_front_started = false;
         ++m_number_of_packs_popped;
     }
 
+    /* Counterpart of push_pack(), moves front pack out of the queue */
+    Pack take_front()
+    {
+        assert(!m_packs.empty());
+        m_bytes_pending -= m_packs.front().get_bytes_pending();
+        Pack pack(std::move(m_packs.front()));
+        pop_front();
+        return pack;
+    }
+
     size_t get_number_of_packs_popped() const
     {
         return m_number_of_packs_popped;
     }
+
+    size_t get_number_of_packs_dropped() const
+    {
+        return m_number_of_packs_dropped;
+    }
+
+    /* Bytes pushed but not fed to the decoder yet. This is the backpressure
+     signal for producers - it grows when decoder doesn't keep up or waits
+     for bitstream buffer space, so producer can hold off reading (or, for
+     live streams, ask for lower bitrate) once it goes over what it considers
+     sane */
+    size_t get_bytes_pending() const
+    {
+        return m_bytes_pending;
+    }
+
+    /* Drop policy (if any) is applied by VPUDecoder before each step, give
+     nullptr to disable dropping */
+    void set_drop_policy(std::shared_ptr<PackDropPolicy> policy)
+    {
+        m_drop_policy = policy;
+    }
+
+    void apply_drop_policy(DecodingStats &stats)
+    {
+        if (m_drop_policy) {
+            m_drop_policy->apply(*this, stats);
+        }
+    }
+
+    /* Capture (if any) is given packs by VPUDecoder at the start of each
+     step, before drop policy is applied, so it sees what decoder was given
+     rather than what it decoded. nullptr disables capturing */
+    void set_capture(std::shared_ptr<PackCapture> capture)
+    {
+        m_capture = capture;
+    }
+
+    void capture_complete_packs()
+    {
+        if (!m_capture) {
+            return;
+        }
+        for (Pack &pack : m_packs) {
+            if (!pack.m_is_complete) {
+                break;
+            }
+            if (!pack.m_captured) {
+                m_capture->capture(pack);
+                pack.m_captured = true;
+            }
+        }
+    }
+
+    /* Gives timestamps of the oldest and newest complete pack waiting for
+     consumption (so not counting front one if consumer started with it), and
+     returns false if there are none. Packs without metadata are not taken
+     into account */
+    bool get_timestamp_range(Timestamp &oldest, Timestamp &newest) const
+    {
+        bool found = false;
+        bool skip = m_front_started;
+        for (const Pack &pack : m_packs) {
+            if (skip) {
+                skip = false;
+                continue;
+            }
+            if (!pack.m_is_complete) {
+                break;
+            }
+            if (!pack.meta) {
+                continue;
+            }
+            if (!found) {
+                oldest = pack.meta.get_timestamp();
+                found = true;
+            }
+            newest = pack.meta.get_timestamp();
+        }
+        return found;
+    }
+
+    /* How far (in timestamp units) newest complete pack is ahead of the
+     oldest one */
+    Timestamp get_latency() const
+    {
+        Timestamp oldest;
+        Timestamp newest;
+        if (!get_timestamp_range(oldest, newest) || (newest < oldest)) {
+            return 0;
+        }
+        return newest - oldest;
+    }
+
+    /* First pack past the front one that can reopen decoding (complete or
+     not, stream parameters are known from the start), or nullptr */
+    const Pack *find_next_reopen_point() const
+    {
+        if (m_packs.empty()) {
+            return nullptr;
+        }
+        for (auto it = std::next(m_packs.begin()); it != m_packs.end(); ++it) {
+            if (it->m_can_reopen_decoding) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Drops all the packs, including the one consumer started with and the
+     one still being received, to start over from other place in the stream
+     (see "SEEK" algorithm above). Decoder has to be closed first, as it may
+     still refer to chunks of the front pack */
+    void clear()
+    {
+        while (!m_packs.empty()) {
+            drop(m_packs.begin());
+        }
+        m_front_started = false;
+    }
+
+    /* Drops non-reference (m_can_be_dropped) packs with timestamp older than
+     given one. Returns number of packs dropped */
+    size_t drop_non_reference_packs(Timestamp older_than)
+    {
+        size_t dropped = 0;
+        auto it = first_droppable();
+        while ((it != m_packs.end()) && is_droppable(*it)) {
+            if (it->m_can_be_dropped && it->meta
+                && (it->meta.get_timestamp() < older_than)) {
+                it = drop(it);
+                ++dropped;
+            } else {
+                ++it;
+            }
+        }
+        return dropped;
+    }
+
+    /* Finds the newest pack that can reopen decoding and drops everything
+     before it. Jump is only done to the pack with same codec and geometry as
+     the front one - some parsers (VP8) put sequence headers into the first
+     pack with changed geometry only, so jumping over that would lose them.
+     With not_after given, only packs with timestamp not after it are jumped
+     to. Returns number of packs dropped */
+    size_t drop_packs_before_newest_reopen_point(
+        Timestamp not_after = std::numeric_limits<Timestamp>::max())
+    {
+        auto begin = first_droppable();
+        auto target = m_packs.end();
+        for (auto it = begin; (it != m_packs.end()) && is_droppable(*it); ++it) {
+            if (it->m_can_reopen_decoding
+                && ((std::numeric_limits<Timestamp>::max() == not_after)
+                    || (it->meta && (it->meta.get_timestamp() <= not_after)))
+                && (it->m_codec_type == m_packs.front().m_codec_type)
+                && !(it->m_geometry != m_packs.front().m_geometry)) {
+                target = it;
+            }
+        }
+        size_t dropped = 0;
+        if (target == m_packs.end()) {
+            return dropped;
+        }
+        while (begin != target) {
+            begin = drop(begin);
+            ++dropped;
+        }
+        return dropped;
+    }
+
+    /* Drops complete packs that aren't keyframes (see m_is_keyframe and
+     VPUDecoder::set_keyframes_only()). Packs carrying flushing flag go too,
+     as without inter frames nothing is buffered in decoder to flush. Stops
+     at the first pack still being received, and at the last pack of a stream
+     decoder hasn't settled yet (see m_ends_stream), so that it gets the
+     chance to. Returns number of packs dropped */
+    size_t drop_non_keyframe_packs()
+    {
+        size_t dropped = 0;
+        auto it = first_droppable();
+        while ((it != m_packs.end()) && it->m_is_complete && !it->m_ends_stream) {
+            if (!it->m_is_keyframe) {
+                it = drop(it);
+                ++dropped;
+            } else {
+                ++it;
+            }
+        }
+        return dropped;
+    }
+
+    size_t get_number_of_pack_allocations() const
+    {
+        return m_number_of_pack_allocations;
+    }
+
+    size_t get_number_of_chunk_allocations() const
+    {
+        return m_number_of_chunk_allocations;
+    }
+
+private:
+    Pack &get_fed_pack(size_t index)
+    {
+        assert(index < m_packs.size());
+        if (!index) {
+            m_front_started = true;
+        }
+        return *std::next(m_packs.begin(), index);
+    }
+
+    VideoChunk &new_chunk()
+    {
+        std::list<VideoChunk> &chunks = m_packs.back().m_chunks;
+        if (m_free_chunks.empty()) {
+            chunks.emplace_back();
+            ++m_number_of_chunk_allocations;
+        } else {
+            chunks.splice(chunks.end(), m_free_chunks, m_free_chunks.begin());
+        }
+        return chunks.back();
+    }
+
+    void recycle_chunk(std::list<VideoChunk> &chunks)
+    {
+        m_bytes_pending -= chunks.front().size - chunks.front().fed;
+        chunks.front().reset();
+        if (m_free_chunks.size() < m_max_pooled_chunks) {
+            m_free_chunks.splice(m_free_chunks.end(), chunks, chunks.begin());
+        } else {
+            chunks.pop_front();
+        }
+    }
+
+    /* Releases all the chunks pack may still have (if it is being dropped),
+     resets it and moves into the pool */
+    void recycle_pack(std::list<Pack>::iterator pack)
+    {
+        while (!pack->m_chunks.empty()) {
+            recycle_chunk(pack->m_chunks);
+        }
+        if (m_free_packs.size() < m_max_pooled_packs) {
+            /* Moving empty pack in doesn't allocate, and leaves node with
+             default-initialized pack ready for reuse */
+            *pack = Pack();
+            m_free_packs.splice(m_free_packs.end(), m_packs, pack);
+        } else {
+            m_packs.erase(pack);
+        }
+    }
+
+    std::list<Pack>::iterator drop(std::list<Pack>::iterator pack)
+    {
+        auto next = std::next(pack);
+        recycle_pack(pack);
+        ++m_number_of_packs_dropped;
+        return next;
+    }
+
+    /* Front pack is off limits once consumer started with it, and so are the
+     ones fed ahead after it, as they are in decoder bitstream buffer already */
+    std::list<Pack>::iterator first_droppable()
+    {
+        auto it = m_packs.begin();
+        if (m_front_started && (it != m_packs.end())) {
+            ++it;
+        }
+        while ((it != m_packs.end()) && it->m_bytes_fed) {
+            ++it;
+        }
+        return it;
+    }
+
+    /* Droppable packs end at first one that is still being received, or that
+     carries flushing (end of sequence) flag, or ends stream and wasn't settled
+     yet - dropping it would leave decoder with no idea the next stream began,
+     and frames of the previous one it buffers would never be flushed */
+    static bool is_droppable(const Pack &pack)
+    {
+        return pack.m_is_complete && !pack.m_needs_flushing && !pack.m_ends_stream;
+    }
 };
 }
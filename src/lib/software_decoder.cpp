@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "software_decoder.hpp"
+
+#ifdef HAVE_LIBAVCODEC
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+#include "ivf.h"
+#include "vpu_decoding_session.hpp"
+
+namespace airtame {
+
+/* Interleaves one row of planar chroma into NV12 one */
+static void interleave_chroma_row(unsigned char *destination, const unsigned char *u,
+                                  const unsigned char *v, size_t width)
+{
+    size_t x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t uv;
+        uv.val[0] = vld1q_u8(u + x);
+        uv.val[1] = vld1q_u8(v + x);
+        vst2q_u8(destination + 2 * x, uv);
+    }
+#endif
+    for (; x < width; x++) {
+        destination[2 * x] = u[x];
+        destination[2 * x + 1] = v[x];
+    }
+}
+
+SoftwareDecoder::~SoftwareDecoder()
+{
+    close();
+}
+
+VPUOutputFrame SoftwareDecoder::step(PackQueue &queue)
+{
+    return step_implementation(queue, PackPurpose::CONSUMPTION);
+}
+
+VPUOutputFrame SoftwareDecoder::try_to_step(PackQueue &queue)
+{
+    return step_implementation(queue, PackPurpose::FEEDING);
+}
+
+VPUOutputFrame SoftwareDecoder::flush_step()
+{
+    if (!m_context) {
+        return VPUOutputFrame();
+    }
+    if (m_decoded.empty()) {
+        /* Draining, what libavcodec buffered comes out */
+        avcodec_send_packet(m_context, nullptr);
+        receive_frames();
+        avcodec_flush_buffers(m_context);
+    }
+    return give_decoded_frame();
+}
+
+bool SoftwareDecoder::has_frame_for_decoding() const
+{
+    if (!m_context) {
+        return true;
+    }
+    for (auto &frame : m_frames) {
+        if (!frame.given_for_display) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SoftwareDecoder::return_output_frame(long physical_address)
+{
+    auto before = std::chrono::steady_clock::now();
+    for (auto &frame : m_frames) {
+        if ((long)frame.dma->phy_addr == physical_address) {
+            frame.given_for_display = false;
+            break;
+        }
+    }
+    m_stats.frame_return_latency.add_usec_since(before);
+}
+
+void SoftwareDecoder::close()
+{
+    for (AVFrame *frame : m_decoded) {
+        av_frame_free(&frame);
+    }
+    m_decoded.clear();
+    m_meta.clear();
+    if (m_packet) {
+        av_packet_free(&m_packet);
+    }
+    if (m_context) {
+        avcodec_free_context(&m_context);
+    }
+    /* Frames still displayed stay valid until user lets go of them */
+    m_frames.clear();
+    m_codec_type = CodecType::NONE;
+    m_stats.current_dma_allocation_size = 0;
+}
+
+VPUOutputFrame SoftwareDecoder::step_implementation(PackQueue &queue, PackPurpose purpose)
+{
+    /* Same as VPUDecoder, capture and queue policy go first */
+    queue.capture_complete_packs();
+    queue.apply_drop_policy(m_stats);
+    m_stats.update_queue_depth(queue.size());
+
+    if (!has_frame_for_decoding()) {
+        return VPUOutputFrame();
+    }
+    /* Frames that came out of a drain are given before anything else gets
+     decoded */
+    if (!m_decoded.empty()) {
+        return give_decoded_frame();
+    }
+    if (!queue.has_pack_for(purpose)) {
+        return VPUOutputFrame();
+    }
+
+    if (needs_reopening(queue.front())) {
+        close();
+    }
+    if (!m_context) {
+        while (queue.has_pack_for(PackPurpose::CONSUMPTION)
+               && !queue.front().m_can_reopen_decoding) {
+            queue.pop_front();
+        }
+        if (!queue.has_pack_for(purpose)) {
+            return VPUOutputFrame();
+        }
+        if (!open(queue.front())) {
+            close();
+            queue.pop_front();
+            return VPUOutputFrame();
+        }
+        ++m_stats.number_of_session_opens;
+    }
+
+    if (m_busy_callback) {
+        /* Nothing runs in the background here, so work done meanwhile is
+         done before the decode */
+        auto before = std::chrono::steady_clock::now();
+        m_busy_callback();
+        m_stats.busy_work_latency.add_usec_since(before);
+    }
+
+    if (queue.front().m_ends_stream) {
+        /* libavcodec goes on into the next stream by itself, unless frames
+         have to be allocated anew for it */
+        const Pack *next = queue.get_pack(1);
+        bool fits = next && next->m_is_complete && !needs_reopening(*next);
+        if (fits) {
+            ++m_stats.number_of_seamless_transitions;
+        } else {
+            ++m_stats.number_of_flushed_transitions;
+        }
+        queue.settle_stream_end(0, !fits);
+    }
+    bool needs_flushing = queue.front().m_needs_flushing;
+    bool decoded = decode(queue.front());
+    queue.pop_front();
+    if (!decoded) {
+        close();
+        return VPUOutputFrame();
+    }
+    if (needs_flushing) {
+        avcodec_send_packet(m_context, nullptr);
+        receive_frames();
+        avcodec_flush_buffers(m_context);
+    }
+    return give_decoded_frame();
+}
+
+bool SoftwareDecoder::needs_reopening(const Pack &pack) const
+{
+    if (!m_context) {
+        return false;
+    }
+    /* libavcodec copes with geometry changes, but frames are sized for it */
+    return pack.m_can_reopen_decoding
+        && ((pack.m_codec_type != m_codec_type) || (pack.m_geometry != m_geometry));
+}
+
+bool SoftwareDecoder::open(const Pack &pack)
+{
+    AVCodecID codec_id;
+    switch (pack.m_codec_type) {
+    case CodecType::H264:
+        codec_id = AV_CODEC_ID_H264;
+        break;
+    case CodecType::VP8:
+        codec_id = AV_CODEC_ID_VP8;
+        break;
+    default:
+        codec_log_error(m_logger, "Software decoder can't decode this codec");
+        return false;
+    }
+    const AVCodec *codec = avcodec_find_decoder(codec_id);
+    if (!codec) {
+        codec_log_error(m_logger, "libavcodec has no decoder for this codec");
+        return false;
+    }
+    m_context = avcodec_alloc_context3(codec);
+    m_packet = av_packet_alloc();
+    if (!m_context || !m_packet) {
+        codec_log_error(m_logger, "Cannot allocate libavcodec context");
+        return false;
+    }
+    /* Slices are spread among cores, frame threading would add whole frames
+     of latency */
+    m_context->thread_count = 0;
+    m_context->thread_type = FF_THREAD_SLICE;
+    if (avcodec_open2(m_context, codec, nullptr) < 0) {
+        codec_log_error(m_logger, "Cannot open libavcodec decoder");
+        return false;
+    }
+    if (!allocate_frames(pack.m_geometry)) {
+        return false;
+    }
+    m_codec_type = pack.m_codec_type;
+    m_geometry = pack.m_geometry;
+    m_next_pts = 0;
+    return true;
+}
+
+bool SoftwareDecoder::allocate_frames(const FrameGeometry &geometry)
+{
+    FrameBuffer layout = VPUDecodingSession::prepare_nv12_frame_buffer_template(geometry);
+    size_t frame_size = layout.bufMvCol;
+    m_frames.resize(m_display_frames);
+    for (auto &frame : m_frames) {
+        if (m_pool) {
+            frame.dma = m_pool->borrow(frame_size, m_account);
+        } else {
+            frame.dma = VPUDecodingSession::allocate_dma(frame_size);
+        }
+        /* CPU writes these, so they have to be mapped */
+        if (!frame.dma || (!frame.dma->virt_uaddr && (IOGetVirtMem(frame.dma.get()) <= 0))) {
+            codec_log_error(m_logger, "Cannot allocate software decoder frame");
+            m_frames.clear();
+            return false;
+        }
+    }
+    m_stats.update_dma_allocation_size(m_frames.size() * frame_size);
+    return true;
+}
+
+bool SoftwareDecoder::decode(const Pack &pack)
+{
+    auto before = std::chrono::steady_clock::now();
+    /* libavcodec wants packets in one piece, and padded */
+    m_buffer.clear();
+    for (auto &chunk : pack.m_chunks) {
+        size_t offset = m_buffer.size();
+        m_buffer.resize(offset + chunk.size);
+        if (chunk.write_callback) {
+            chunk.write_callback(m_buffer.data() + offset, 0, chunk.size);
+        } else {
+            ::memcpy(m_buffer.data() + offset, chunk.data, chunk.size);
+        }
+    }
+    size_t begin = 0;
+    if (CodecType::VP8 == pack.m_codec_type) {
+        /* Parser wraps VP8 frames in IVF for the VPU, see VP8StreamParser */
+        if ((m_buffer.size() >= 32) && !::memcmp(m_buffer.data(), IVF_MAGIC_NUMBER, 4)) {
+            begin += *(uint16_t *)(m_buffer.data() + 6);
+        }
+        begin += 12;
+        if (begin > m_buffer.size()) {
+            codec_log_error(m_logger, "VP8 pack without frame");
+            return false;
+        }
+    }
+    size_t size = m_buffer.size() - begin;
+    m_buffer.resize(m_buffer.size() + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+    m_stats.feed_latency.add_usec_since(before);
+    m_stats.update_bytes_fed(size);
+
+    auto decode_start = std::chrono::steady_clock::now();
+    m_packet->data = m_buffer.data() + begin;
+    m_packet->size = size;
+    m_packet->pts = m_next_pts;
+    m_meta[m_next_pts++] = pack.meta;
+    int result = avcodec_send_packet(m_context, m_packet);
+    if ((result < 0) && (AVERROR(EAGAIN) != result)) {
+        codec_log_error(m_logger, "libavcodec decode failed (%d)", result);
+        return false;
+    }
+    receive_frames();
+
+    auto duration = std::chrono::steady_clock::now() - decode_start;
+    m_stats.decode_latency.add(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    ++m_stats.number_of_decode_operations;
+    m_stats.update_decode_timing(
+        std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+    m_stats.update_slice_count(pack.m_number_of_slices);
+    return true;
+}
+
+void SoftwareDecoder::receive_frames()
+{
+    for (;;) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame || (avcodec_receive_frame(m_context, frame) < 0)) {
+            av_frame_free(&frame);
+            return;
+        }
+        m_decoded.push_back(frame);
+    }
+}
+
+VPUOutputFrame SoftwareDecoder::give_decoded_frame()
+{
+    VPUOutputFrame output;
+    if (m_decoded.empty()) {
+        return output;
+    }
+    Frame *free_frame = nullptr;
+    for (auto &frame : m_frames) {
+        if (!frame.given_for_display) {
+            free_frame = &frame;
+            break;
+        }
+    }
+    if (!free_frame) {
+        return output;
+    }
+
+    AVFrame *decoded = m_decoded.front();
+    m_decoded.pop_front();
+    FrameGeometry geometry;
+    bool copied = copy_frame(decoded, *free_frame, geometry);
+
+    /* Metadata of the pack goes. Packs decoded before it may come out later
+     (reordering), so theirs stays, unless it is too old for that - then
+     these are packs that gave no frame */
+    FrameMeta meta;
+    auto it = m_meta.find(decoded->pts);
+    if (it != m_meta.end()) {
+        meta = it->second;
+        m_meta.erase(it);
+    }
+    while (!m_meta.empty()
+           && (m_meta.begin()->first + SOFTWARE_DECODER_META_WINDOW < m_next_pts)) {
+        m_meta.erase(m_meta.begin());
+    }
+    av_frame_free(&decoded);
+    if (!copied) {
+        return output;
+    }
+
+    free_frame->given_for_display = true;
+    output.dma = free_frame->dma;
+    output.size = free_frame->dma->size;
+    output.meta = meta;
+    output.geometry = geometry;
+    ++m_frames_given;
+    return output;
+}
+
+bool SoftwareDecoder::copy_frame(const AVFrame *source, Frame &frame, FrameGeometry &geometry)
+{
+    if ((AV_PIX_FMT_YUV420P != source->format) && (AV_PIX_FMT_YUVJ420P != source->format)) {
+        codec_log_error(m_logger, "Software decoder can't convert pixel format %d",
+                        source->format);
+        return false;
+    }
+    geometry = FrameGeometry(source->width, source->height);
+    FrameBuffer layout = VPUDecodingSession::prepare_nv12_frame_buffer_template(geometry);
+    if ((size_t)layout.bufMvCol > (size_t)frame.dma->size) {
+        /* Stream changed geometry without reopen point */
+        codec_log_error(m_logger, "Decoded frame doesn't fit in %zux%zu one",
+                        m_geometry.m_true_width, m_geometry.m_true_height);
+        return false;
+    }
+
+    unsigned char *base = (unsigned char *)frame.dma->virt_uaddr;
+    unsigned char *luma = base + layout.bufY;
+    for (int y = 0; y < source->height; y++) {
+        ::memcpy(luma + y * layout.strideY, source->data[0] + y * source->linesize[0],
+                 source->width);
+    }
+    unsigned char *chroma = base + layout.bufCb;
+    for (int y = 0; y < (source->height + 1) / 2; y++) {
+        interleave_chroma_row(chroma + y * layout.strideC, source->data[1] + y * source->linesize[1],
+                              source->data[2] + y * source->linesize[2], (source->width + 1) / 2);
+    }
+    return true;
+}
+
+std::unique_ptr<DecodeBackend> create_software_decoder(CodecLogger &logger, size_t display_frames)
+{
+    return std::unique_ptr<DecodeBackend>(new SoftwareDecoder(logger, display_frames));
+}
+}
+
+#else
+
+namespace airtame {
+
+std::unique_ptr<DecodeBackend> create_software_decoder(CodecLogger &logger, size_t display_frames)
+{
+    (void)logger;
+    (void)display_frames;
+    return nullptr;
+}
+}
+
+#endif
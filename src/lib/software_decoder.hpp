@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "decode_backend.hpp"
+#include "vpu_dma_pointer.hpp"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+namespace airtame {
+
+/* Biggest stream (in macroblocks) CPU decodes in real time by default. Four
+ Cortex-A9 cores do 30 frames/s of about 640x480 h264 with libavcodec */
+#define SOFTWARE_DECODER_MAX_MACROBLOCKS (40 * 30)
+
+/* Packs whose metadata is kept waiting for their frame. libavcodec gives
+ frames out in presentation order, which is at most 16 (h264 DPB) packs behind
+ decode order, so metadata older than this is of packs that gave no frame */
+#define SOFTWARE_DECODER_META_WINDOW 32
+
+/* CPU decoder (libavcodec) for h264 and VP8 packs, for when VPU has no
+ capacity left, see DecoderPlacement. Only built when libavcodec is there
+ (WITH_LIBAVCODEC), use create_software_decoder() which tells if it is.
+
+ Frames are decoded by libavcodec into its own memory, and copied into DMA
+ frames converted to NV12 - the layout VPU decodes to - so that displaying
+ them needs no special handling. The copy is cheap compared to decoding for
+ the resolutions CPU can handle. libavcodec reorders and buffers frames
+ itself, and packs needing flushing get drained right away, so unlike
+ VPUDecoder this never keeps pack on the queue */
+class SoftwareDecoder : public DecodeBackend {
+private:
+    CodecLogger &m_logger;
+    size_t m_display_frames;
+
+    DecodingStats m_stats;
+    AVCodecContext *m_context = nullptr;
+    AVPacket *m_packet = nullptr;
+    CodecType m_codec_type = CodecType::NONE;
+    FrameGeometry m_geometry;
+
+    /* Packs get gathered in one piece for libavcodec, chunks may come in
+     pieces or as writer callbacks */
+    std::vector<unsigned char> m_buffer;
+    /* Metadata of packs decoded, by pts given to libavcodec, until their
+     frame comes out, or SOFTWARE_DECODER_META_WINDOW packs later */
+    std::map<int64_t, FrameMeta> m_meta;
+    int64_t m_next_pts = 0;
+    /* Decoded frames not given out yet, when more came out at once (drain) */
+    std::list<AVFrame *> m_decoded;
+
+    class Frame {
+    public:
+        VPUDMAPointer dma;
+        bool given_for_display = false;
+    };
+    std::vector<Frame> m_frames;
+    std::shared_ptr<VPUFramePool> m_pool;
+    std::shared_ptr<VPUFramePool::Account> m_account;
+
+    size_t m_frames_given = 0;
+    DecodeBusyCallback m_busy_callback;
+
+public:
+    SoftwareDecoder(CodecLogger &logger, size_t display_frames)
+        : m_logger(logger)
+        , m_display_frames(display_frames)
+    {
+    }
+    ~SoftwareDecoder();
+
+    SoftwareDecoder(const SoftwareDecoder &) = delete;
+    SoftwareDecoder &operator=(const SoftwareDecoder &) = delete;
+
+    /* Same contract as VPUDecoder::step(). Busy callback is called before
+     decode, as decode runs on the calling thread */
+    VPUOutputFrame step(PackQueue &queue) override;
+    VPUOutputFrame try_to_step(PackQueue &queue) override;
+    VPUOutputFrame flush_step() override;
+    bool has_frame_for_decoding() const override;
+    using DecodeBackend::return_output_frame;
+    void return_output_frame(long physical_address) override;
+    void close() override;
+
+    bool is_closed() const override
+    {
+        return !m_context;
+    }
+
+    void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool) override
+    {
+        m_pool = pool;
+        m_account.reset(pool ? new VPUFramePool::Account() : nullptr);
+    }
+
+    void set_busy_callback(const DecodeBusyCallback &callback) override
+    {
+        m_busy_callback = callback;
+    }
+
+    const DecodingStats &get_stats() const override
+    {
+        return m_stats;
+    }
+
+    void reset_stats() override
+    {
+        m_stats = DecodingStats();
+    }
+
+    size_t get_number_of_frames_given() const override
+    {
+        return m_frames_given;
+    }
+
+    bool is_hardware() const override
+    {
+        return false;
+    }
+
+private:
+    VPUOutputFrame step_implementation(PackQueue &queue, PackPurpose purpose);
+    bool open(const Pack &pack);
+    bool needs_reopening(const Pack &pack) const;
+    bool allocate_frames(const FrameGeometry &geometry);
+    bool decode(const Pack &pack);
+    void receive_frames();
+    VPUOutputFrame give_decoded_frame();
+    bool copy_frame(const AVFrame *source, Frame &frame, FrameGeometry &geometry);
+};
+
+/* SoftwareDecoder if libavcodec is there, nullptr otherwise */
+std::unique_ptr<DecodeBackend> create_software_decoder(CodecLogger &logger,
+                                                       size_t display_frames);
+}
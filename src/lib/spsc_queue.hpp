@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+
+namespace airtame {
+
+/* Bounded, lock-free queue for exactly one producer thread and exactly one
+ consumer thread. This is classic ring buffer with one slot always left empty,
+ so that "full" and "empty" can be told apart without extra shared state.
+ Producer only ever writes m_tail, consumer only ever writes m_head, and
+ acquire/release pairs make sure slot contents are visible before index
+ update is.
+
+ Items are moved in and out, so it works with move-only types like Pack. Slot
+ is reset to default-constructed value after pop, so that resources held by
+ popped item (for example chunk free callbacks) are not kept alive by the
+ queue itself */
+template <typename T>
+class SPSCQueue {
+private:
+    std::vector<T> m_slots;
+    /* Next slot to pop, written by consumer only */
+    std::atomic<size_t> m_head{ 0 };
+    /* Next slot to push, written by producer only */
+    std::atomic<size_t> m_tail{ 0 };
+
+public:
+    explicit SPSCQueue(size_t capacity)
+        : m_slots(capacity + 1)
+    {
+    }
+
+    SPSCQueue(const SPSCQueue &) = delete;
+    SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+    /* To be called by producer. Returns false (and leaves item alone) if the
+     queue is full */
+    bool push(T &&item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t next = increment(tail);
+        if (next == m_head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        m_slots[tail] = std::move(item);
+        m_tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T &item)
+    {
+        T copy(item);
+        return push(std::move(copy));
+    }
+
+    /* To be called by consumer. Returns false if the queue is empty */
+    bool pop(T &item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(m_slots[head]);
+        m_slots[head] = T();
+        m_head.store(increment(head), std::memory_order_release);
+        return true;
+    }
+
+    /* Both of these are only a snapshot when called from the "other" side,
+     but this is good enough for flow control */
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_acquire)
+            == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t size() const
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        return (tail >= head) ? (tail - head) : (tail + m_slots.size() - head);
+    }
+
+    size_t capacity() const
+    {
+        return m_slots.size() - 1;
+    }
+
+private:
+    size_t increment(size_t index) const
+    {
+        ++index;
+        return (index == m_slots.size()) ? 0 : index;
+    }
+};
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#ifdef VPU_DECODER_TRACING
+
+#include <atomic>
+#include <chrono>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "trace.hpp"
+
+namespace airtame {
+
+namespace {
+/* Sequence is the number of the event in the slot plus one, zero while it
+ is being written - so that dump can tell torn slots and skip them */
+struct TraceEvent {
+    std::atomic<uint64_t> sequence{ 0 };
+    const char *name = nullptr;
+    const char *detail = nullptr;
+    int64_t value = 0;
+    int64_t timestamp = 0;
+    uint32_t thread = 0;
+    TracePhase phase = TracePhase::INSTANT;
+};
+
+TraceEvent g_events[TRACE_RING_SIZE];
+std::atomic<uint64_t> g_next_event{ 0 };
+std::atomic<uint32_t> g_next_thread{ 1 };
+
+/* Small numbers read better in the viewer than pthread ids */
+uint32_t get_thread()
+{
+    static thread_local uint32_t thread = g_next_thread.fetch_add(1);
+    return thread;
+}
+}
+
+void trace_event(TracePhase phase, const char *name, const char *detail, int64_t value)
+{
+    uint64_t number = g_next_event.fetch_add(1, std::memory_order_relaxed);
+    TraceEvent &event = g_events[number % TRACE_RING_SIZE];
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name = name;
+    event.detail = detail;
+    event.value = value;
+    event.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    event.thread = get_thread();
+    event.phase = phase;
+    event.sequence.store(number + 1, std::memory_order_release);
+}
+
+bool trace_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    uint64_t end = g_next_event.load(std::memory_order_acquire);
+    uint64_t begin = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+    fprintf(file, "{\"traceEvents\":[");
+    bool first = true;
+    for (uint64_t number = begin; number < end; ++number) {
+        const TraceEvent &event = g_events[number % TRACE_RING_SIZE];
+        if (event.sequence.load(std::memory_order_acquire) != number + 1) {
+            continue;
+        }
+        TraceEvent copy;
+        copy.name = event.name;
+        copy.detail = event.detail;
+        copy.value = event.value;
+        copy.timestamp = event.timestamp;
+        copy.thread = event.thread;
+        copy.phase = event.phase;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (event.sequence.load(std::memory_order_relaxed) != number + 1) {
+            /* Overwritten while being copied */
+            continue;
+        }
+        fprintf(file,
+                "%s\n{\"name\":\"%s\",\"cat\":\"vpu\",\"ph\":\"%c\",\"ts\":%" PRId64
+                ",\"pid\":1,\"tid\":%" PRIu32,
+                first ? "" : ",", copy.name, (char)copy.phase, copy.timestamp, copy.thread);
+        if (TracePhase::INSTANT == copy.phase) {
+            fprintf(file, ",\"s\":\"t\"");
+        }
+        fprintf(file, ",\"args\":{\"value\":%" PRId64, copy.value);
+        if (copy.detail) {
+            fprintf(file, ",\"detail\":\"%s\"", copy.detail);
+        }
+        fprintf(file, "}}");
+        first = false;
+    }
+    fprintf(file, "\n]}\n");
+    return !fclose(file);
+}
+}
+
+#endif
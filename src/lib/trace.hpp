@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace airtame {
+
+/* Events kept by the tracing, once there is more of them the oldest ones
+ get overwritten */
+#define TRACE_RING_SIZE 65536
+
+enum class TracePhase : char {
+    BEGIN = 'B',
+    END = 'E',
+    INSTANT = 'i'
+};
+
+/* Timeline of the decode pipeline, for looking at what happened when stream
+ stuttered: parsing, queueing, feeding, VPU decode, session reopening, frame
+ output and return, display. Events go into ring buffer shared by all the
+ threads (taking slot is one atomic increment, so this is cheap enough to
+ leave on in the field), and trace_dump() writes the ring as Chrome trace
+ JSON, to be opened in chrome://tracing or Perfetto UI - VPU idle gaps
+ and streams waiting for each other are seen right away there.
+
+ Built in only with VPU_DECODER_TRACING defined (see WITH_TRACING build
+ option), otherwise TRACE_ macros are no-ops and trace_dump() fails.
+
+ Names and details have to be string literals (or otherwise live forever),
+ only pointers to them are kept. Value is free for the caller to use, it is
+ shown in event arguments */
+#ifdef VPU_DECODER_TRACING
+void trace_event(TracePhase phase, const char *name, const char *detail = nullptr,
+                 int64_t value = 0);
+
+/* Ends the event when going out of scope */
+class TraceScope {
+private:
+    const char *m_name;
+
+public:
+    TraceScope(const char *name, const char *detail = nullptr, int64_t value = 0)
+        : m_name(name)
+    {
+        trace_event(TracePhase::BEGIN, name, detail, value);
+    }
+
+    ~TraceScope()
+    {
+        trace_event(TracePhase::END, m_name);
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+/* Writes events in the ring (oldest first) into file at given path. Can be
+ called while other threads trace, events written meanwhile may be left
+ out. Not async-signal-safe, so signal handler should only ask for it */
+bool trace_dump(const char *path);
+
+#define TRACE_CONCAT_IMPLEMENTATION(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPLEMENTATION(a, b)
+#define TRACE_BEGIN(...) airtame::trace_event(airtame::TracePhase::BEGIN, __VA_ARGS__)
+#define TRACE_END(name) airtame::trace_event(airtame::TracePhase::END, name)
+#define TRACE_INSTANT(...) airtame::trace_event(airtame::TracePhase::INSTANT, __VA_ARGS__)
+#define TRACE_SCOPE(...) airtame::TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+inline bool trace_dump(const char *path)
+{
+    (void)path;
+    return false;
+}
+
+#define TRACE_BEGIN(...) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(...) ((void)0)
+#define TRACE_SCOPE(...) ((void)0)
+#endif
+}
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <string.h>
 #include "ivf.h"
+#include "trace.hpp"
 #include "vp8_stream_parser.hpp"
 
 
@@ -18,6 +19,7 @@ namespace airtame {
  to let us succesfully skip the frame without doing full decoding */
 void VP8StreamParser::process_buffer(const VideoBuffer &buffer)
 {
+    TRACE_SCOPE("process_buffer", nullptr, (int64_t)buffer.size);
     /* RFC 6386, 9.1, "Uncompressed Data Chunk" */
     if (buffer.size < 3) {
         codec_log_error(m_logger, "VP8 frame data truncated");
@@ -27,22 +29,18 @@ void VP8StreamParser::process_buffer(const VideoBuffer &buffer)
     uint32_t chunk = buffer.data[0] | (buffer.data[1] << 8) | (buffer.data[2] << 16);
     // WTF: it should by exact opposite! But works this way
     // See https://tools.ietf.org/html/rfc6386#section-19.1
-    std::string description("VP8 ");
     bool keyframe = (chunk & 0x1) ? false : true;
     chunk >>= 1;
-    size_t version = chunk & 0x7;
+    /* Skip version */
     chunk >>= 3;
     bool show_frame = (chunk & 0x1) ? true : false;
-    if (!show_frame) {
-        description += "invisible ";
-    }
+    /* Chunk descriptions have to be static strings */
+    const char *description;
     if (keyframe) {
-        description += "keyframe ";
+        description = show_frame ? "VP8 keyframe" : "VP8 invisible keyframe";
     } else {
-        description += "frame ";
+        description = show_frame ? "VP8 frame" : "VP8 invisible frame";
     }
-    description += "version ";
-    description += std::to_string(version);
     // TODO: support for "not showing frames"
     assert(show_frame);
     if (keyframe) {
@@ -66,6 +64,7 @@ void VP8StreamParser::process_buffer(const VideoBuffer &buffer)
         /* Start a new frame */
         m_frames.push_new_pack();
         m_frames.back().m_can_reopen_decoding = true;
+        m_frames.back().m_is_keyframe = true;
         if ((m_geometry.m_true_width != width) || (m_geometry.m_true_height != height)) {
             /* Need sequence header before keyframe when geometry changes, and
              ONLY then - feeding sequence header before every keyframe more or
@@ -101,7 +100,7 @@ void VP8StreamParser::process_buffer(const VideoBuffer &buffer)
 void VP8StreamParser::push_sequence_header(size_t width, size_t height)
 {
     constexpr size_t ivf_header_size = 32;
-    unsigned char *ivf_header = new unsigned char[ivf_header_size];
+    unsigned char ivf_header[ivf_header_size];
     ::memset(ivf_header, 0, ivf_header_size);
     /* Four bytes of magic number */
     ::memcpy(ivf_header, IVF_MAGIC_NUMBER, 4);
@@ -115,22 +114,20 @@ void VP8StreamParser::push_sequence_header(size_t width, size_t height)
     *(uint16_t *)(ivf_header + 12) = height;
     /* Rest of the stuff, including frame rate, number of frames, etc we leave
      zeroed out */
-    m_frames.push_chunk(ivf_header, ivf_header_size, "IVF sequence header");
-    m_frames.attach_free_callback([ivf_header]{ delete[] ivf_header;});
+    /* Header is copied into the chunk itself, no need to keep it around */
+    m_frames.push_chunk_copy(ivf_header, ivf_header_size, "IVF sequence header");
 }
 
-void VP8StreamParser::push_frame(const VideoBuffer &buffer, const std::string &description)
+void VP8StreamParser::push_frame(const VideoBuffer &buffer, const char *description)
 {
     constexpr size_t frame_header_size = 3;
-    uint32_t *header = new uint32_t[frame_header_size];
+    uint32_t header[frame_header_size];
     ::memset(header, 0, frame_header_size * 4);
     /* First four bytes is the size, and next eight is presentation timestamp
      which we leave zeroed */
     header[0] = buffer.size;
-    m_frames.push_chunk((const unsigned char *)header, frame_header_size * 4,
-                        "IVF frame header");
-    m_frames.attach_free_callback([header]{ delete[] header;});
-    m_frames.push_chunk(buffer.data, buffer.size, description.c_str());
+    m_frames.push_chunk_copy(header, frame_header_size * 4, "IVF frame header");
+    m_frames.push_chunk(buffer.data, buffer.size, description);
     m_frames.attach_free_callback(buffer.free_callback);
 }
 }
@@ -31,8 +31,16 @@ public:
     /* Call this with buffers containing complete, single VP8 (not IVF or other
      container!) frames */
     void process_buffer(const VideoBuffer &buffer);
+
+    /* Forgets the geometry sequence header was sent for, so that next
+     keyframe gets one again. For starting over from other place in the
+     stream, after the queue got cleared and decoder closed */
+    void reset()
+    {
+        m_geometry = FrameGeometry();
+    }
 private:
     void push_sequence_header(size_t width, size_t height);
-    void push_frame(const VideoBuffer &buffer, const std::string &description);
+    void push_frame(const VideoBuffer &buffer, const char *description);
 };
 }
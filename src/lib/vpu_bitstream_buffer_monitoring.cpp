@@ -11,14 +11,17 @@ namespace airtame {
  and buffered frames, and frame reordering...
 
  So we do this: each chunk of data copied into decoder input circular buffer is
- also added to m_chunks FIFO, with begin/end indices of that chunk in decoder
+ also added to m_chunks FIFO, with begin/end positions of that chunk in decoder
  bitstream buffer. And when we get notified about decoded (not displayed! just
  decoded, it may still sit inside decoder for some time if it is refence frame
- "in future") frame index, we scan s_nals queue popping off all chunks that
- (judging from hw decode read_idx) were consumed during decoding of that very
- frame. Of course we only take timestamps from these chunks that have them
- (H264 SPS and PPS as well as slice partition NALs do not have timestamps
- assigned cause they for sure cannot start a frame).
+ "in future") frame index, we pop off all chunks that (judging from hw decode
+ read_idx) were consumed during decoding of that very frame, and the frame gets
+ metadata of the first of them. Chunks of one pack all carry its metadata, so
+ that is the pack decoding started with.
+
+ FIFO is a fixed ring, as bitstream buffer is a ring of fixed size as well, so
+ the number of chunks in flight is bounded. With positions only growing, chunks
+ consumed are found with binary search.
 
  This, at least in theory lets us assign timestamps taken from very these chunks
  that make up frame just decoded. BTW this is one of the things original
@@ -27,88 +30,104 @@ namespace airtame {
 
 void VPUBitstreamBufferMonitoring::clear()
 {
-    m_chunks.clear();
+    pop_chunks(m_count);
+    m_first = 0;
+    m_last_read_idx_set = false;
 }
 
-void VPUBitstreamBufferMonitoring::push_chunk(size_t begin, size_t end, Timestamp timestamp,
-                                           bool is_frame)
+bool VPUBitstreamBufferMonitoring::push_chunk(size_t begin, size_t size, uint64_t feed,
+                                              const FrameMeta &meta)
 {
-    m_chunks.push_back(Chunk());
-    m_chunks.back().begin = begin;
-    m_chunks.back().end = end;
-    m_chunks.back().timestamp = timestamp;
-    m_chunks.back().is_frame = is_frame;
+    /* Chunks are expected right at write pointer. If they are not (first one,
+     or buffer was reset behind our back) move write position there, keeping it
+     growing */
+    size_t write_idx = m_write_position % m_buffer_size;
+    if (begin != write_idx) {
+        m_write_position += (begin + m_buffer_size - write_idx) % m_buffer_size;
+    }
+
+    uint64_t chunk_begin = m_write_position;
+    m_write_position += size;
+
+    if (m_count) {
+        Chunk &last = get_chunk(m_count - 1);
+        if ((last.feed == feed) && (last.end == chunk_begin)) {
+            /* Continuation of the same pack, just extend it */
+            last.end = m_write_position;
+            return true;
+        }
+    }
+
+    bool overflow = false;
+    if (m_count == m_chunks.size()) {
+        ++m_number_of_overflows;
+        pop_chunks(1);
+        overflow = true;
+    }
+    Chunk &chunk = get_chunk(m_count);
+    chunk.begin = chunk_begin;
+    chunk.end = m_write_position;
+    chunk.feed = feed;
+    chunk.meta = meta;
+    ++m_count;
+    return !overflow;
 }
 
-// TODO: redo code so that it won't assume taking frames off
-Timestamp VPUBitstreamBufferMonitoring::update_queue(CodecLogger &logger, size_t new_read_idx)
+FrameMeta VPUBitstreamBufferMonitoring::update_queue(CodecLogger &logger,
+                                                                      size_t new_read_idx)
 {
     if (m_last_read_idx_set && (m_last_read_idx == new_read_idx)) {
-        codec_log_error(logger, "Decoder read index not moving!");
+        codec_log_error_limited(logger, "Decoder read index not moving!");
     } else {
         m_last_read_idx_set = true;
     }
     m_last_read_idx = new_read_idx;
-    bool have_timestamp = false;
-    Timestamp timestamp = 0;
+
     /* Assumptions:
-     0) Chunk begin is first byte, and end is first byte after
-     the nal finished, that is: (begin + size) % circular_buffer_length
-     1) read_idx DOES END within some chunk put in the circular buffer, that is
-     read_index will lie somewhere in (begin, end> range for certain chunk, but
-     keep in mind this is circular buffer we're dealing with
-     2) Chunks are consumed in order, so if we see chunk that doesn't contain
-     new_read_idx in it, we assume it was consumed.
-     3) new_read_idx will never move more than buffer_size - 1 bytes, which makes
-     sense because we cannot put more data there anyway
-     4) This function won't be called if some chunks weren't taken off the queue,
-     that is it gets called only when H264VPU::WaitResult::DECODED_FRAME is
-     returned from H264VPU::wait_for_decoding, so we know for sure we have to
-     take off at least one */
-    bool stop = false;
-    while (!m_chunks.empty() && !stop) {
-        /* Process chunk timestamp. IMPORTANT: we take only first one. This is
-         because frame might be composed of several chunks (like when H264
-         frame has more than one slice NAL) and/or frame could have been
-         dropped by decoder and we are moving over more than one chunk. */
-        if (!have_timestamp && m_chunks.front().is_frame) {
-            /* We take ts only out of slice NALs, because these make frame
-             up and we want frame timestamp */
-            timestamp = m_chunks.front().timestamp;
-            have_timestamp = true;
+     0) Chunk begin is first byte, and end is first byte after the chunk
+     1) Read index never gets past write index, and so it is somewhere up to
+     buffer_size bytes behind it - which gives its position
+     2) Chunks are consumed in order, so all chunks starting before read
+     position were consumed, including the one read position lies inside. This
+     is because read_ptr sometimes stops not just after nal (at the end), but
+     some bytes short of it. I am guessing these NALs have fillers at the end or
+     start_code reading state machine needs this sometimes or whatever. Anyway,
+     chunk is consumed if read position is past its begin, so it should work
+     regardless */
+    size_t write_idx = m_write_position % m_buffer_size;
+    uint64_t behind = (write_idx + m_buffer_size - new_read_idx) % m_buffer_size;
+    uint64_t read_position = (behind < m_write_position) ? m_write_position - behind : 0;
+
+    /* First chunk not started yet */
+    size_t low = 0;
+    size_t high = m_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (get_chunk(middle).begin < read_position) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
-        /* Now be careful, read_ptr sometimes stops not just after nal (at the
-         end), but some bytes short of it. I am guessing these NALs have fillers
-         at the end or start_code reading state machine needs this sometimes or
-         whatever. Anyway, we stop if within range, so it should work regardless.
-         */
-        stop = is_read_index_inside_chunk(m_chunks.front(), new_read_idx);
-        /* Pop off NAL that we assume is consumed */
-        m_chunks.pop_front();
     }
-    if (!have_timestamp) {
-        codec_log_warn(logger, "No timestamped NAL found for decoded frame");
+
+    FrameMeta meta;
+    if (low) {
+        meta = get_chunk(0).meta;
+        pop_chunks(low);
+    } else {
+        codec_log_warn_limited(logger, "No chunk found for decoded frame");
     }
-    return timestamp;
+    return meta;
 }
 
-bool VPUBitstreamBufferMonitoring::is_read_index_inside_chunk(const Chunk &chunk, size_t read_idx)
+void VPUBitstreamBufferMonitoring::pop_chunks(size_t count)
 {
-    /* This is circular buffer we're dealing with and so chunk may be wrapped
-     around */
-    if (chunk.begin < chunk.end) {
-        /* This is nice, not wrapped around chunk. So the "inside" condition
-         for that chunk is just read_idx in (begin, end> range */
-        if ((chunk.begin < read_idx) && (read_idx <= chunk.end)) {
-            return true;
-        }
-    } else {
-        /* Two ranges to check, actually */
-        if ((chunk.begin < read_idx) /* Past begin */
-            || (read_idx <= chunk.end)) { /* Before end */
-            return true;
-        }
+    while (count--) {
+        /* Drop shared metadata (if any), the record itself stays for
+         reuse */
+        m_chunks[m_first].meta.reset();
+        m_first = (m_first + 1) % m_chunks.size();
+        --m_count;
     }
-    return false;
 }
 }
@@ -1,38 +1,90 @@
 /*
- * Copyright (c) 2018  AIRTAME ApS
+ * Copyright (c) 2018-2020  AIRTAME ApS
  * All Rights Reserved.
  *
  * See LICENSE.txt for further information.
  */
 
-#include <list>
+#pragma once
+
+#include <memory>
+#include <vector>
+
 #include <stddef.h>
 #include <stdint.h>
 
 #include "codec_logger.hpp"
-#include "timestamp.hpp"
+#include "frame_meta_data.hpp"
 
 namespace airtame {
+
+/* Number of chunk records kept. Adjacent chunks with the same metadata share
+ one record, so this is really number of packs in flight in bitstream buffer,
+ and the decoder never has more than few of these */
+#define VPU_BITSTREAM_BUFFER_MONITORING_CAPACITY 64
+
     class VPUBitstreamBufferMonitoring {
     private:
         /* To keep strict timestamping of frames we keep track of all data chunks
          (H264 NALs, VP8 frames, whatever) fed into bitstream input queue of
          the decoder, so we know which bytes were consumed for any given output
-         frame */
+         frame.
+
+         Positions are counted in bytes fed since the start, rather than as
+         offsets in the (circular) bitstream buffer, so they only grow and the
+         ring of records stays sorted by them */
         struct Chunk {
-            size_t begin, end;
-            Timestamp timestamp;
-            bool is_frame;
+            uint64_t begin, end;
+            /* Which feed (see VPUDecodingSession::set_feed_meta()) chunk came
+             from, as metadata carried by value can't tell packs apart */
+            uint64_t feed;
+            FrameMeta meta;
         };
-        typedef std::list<Chunk> ChunkList;
-        ChunkList m_chunks;
+        /* Preallocated ring, m_first is the oldest record */
+        std::vector<Chunk> m_chunks;
+        size_t m_first = 0;
+        size_t m_count = 0;
+        size_t m_buffer_size;
+        /* Position of the bitstream buffer write pointer */
+        uint64_t m_write_position = 0;
         bool m_last_read_idx_set = false;
-        size_t m_last_read_idx;
+        size_t m_last_read_idx = 0;
+        size_t m_number_of_overflows = 0;
+
     public:
+        VPUBitstreamBufferMonitoring(size_t buffer_size,
+                                     size_t capacity = VPU_BITSTREAM_BUFFER_MONITORING_CAPACITY)
+            : m_chunks(capacity)
+            , m_buffer_size(buffer_size)
+        {
+        }
+
         void clear();
-        void push_chunk(size_t begin, size_t end, Timestamp timestamp, bool is_frame);
-        Timestamp update_queue(CodecLogger &logger, size_t new_read_idx);
+        /* Size bytes of given feed, carrying given metadata, were committed to
+         the bitstream buffer at its offset begin. Never allocates; when ring
+         is full the oldest record is forgotten, and false returned */
+        bool push_chunk(size_t begin, size_t size, uint64_t feed, const FrameMeta &meta);
+        /* Called after decoding a frame with the decoder read index (offset in
+         bitstream buffer), pops off the chunks consumed and returns metadata of
+         the first one of them, so the frame decoded. Empty if there was
+         none. O(log n), records are binary searched */
+        FrameMeta update_queue(CodecLogger &logger, size_t new_read_idx);
+
+        size_t get_number_of_chunks() const
+        {
+            return m_count;
+        }
+
+        size_t get_number_of_overflows() const
+        {
+            return m_number_of_overflows;
+        }
+
     private:
-        bool is_read_index_inside_chunk(const Chunk &chunk, size_t read_idx);
+        Chunk &get_chunk(size_t index)
+        {
+            return m_chunks[(m_first + index) % m_chunks.size()];
+        }
+        void pop_chunks(size_t count);
     };
 }
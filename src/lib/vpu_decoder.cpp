@@ -1,10 +1,14 @@
+#include <algorithm>
 #include <chrono>
+#include <string.h>
 
 #include <vpu_lib.h>
 
 #include "pack_queue.hpp"
+#include "trace.hpp"
 #include "vpu_decoder.hpp"
 #include "vpu_decoding_session.hpp"
+#include "vpu_dmabuf.hpp"
 
 namespace airtame {
 
@@ -18,6 +22,42 @@ VPUOutputFrame VPUDecoder::try_to_step(PackQueue &queue)
     return step_implementation(queue, PackPurpose::FEEDING);
 }
 
+bool VPUDecoder::begin_step(PackQueue &queue, PackPurpose purpose)
+{
+    if (PendingDecode::NONE != m_pending) {
+        /* Already started */
+        return true;
+    }
+    if (begin_step_implementation(queue, purpose)) {
+        return true;
+    }
+    end_step(queue, VPUOutputFrame());
+    return false;
+}
+
+bool VPUDecoder::poll_step()
+{
+    return (PendingDecode::NONE == m_pending) || !m_session->is_busy();
+}
+
+VPUOutputFrame VPUDecoder::finish_step(PackQueue &queue)
+{
+    VPUOutputFrame output;
+    if (PendingDecode::NONE != m_pending) {
+        finish_step_implementation(queue, output);
+        end_step(queue, output);
+    }
+    return output;
+}
+
+Timestamp VPUDecoder::get_expected_step_duration() const
+{
+    if (!m_stats.decode_latency.get_count()) {
+        return VPU_DEFAULT_STEP_DURATION;
+    }
+    return m_stats.decode_latency.get_percentile(50);
+}
+
 bool VPUDecoder::has_frame_for_decoding() const
 {
     if (m_session) {
@@ -31,33 +71,80 @@ bool VPUDecoder::has_frame_for_decoding() const
 
 void VPUDecoder::return_output_frame(long physical_address)
 {
+    TRACE_INSTANT("frame_return", "by address");
     if (m_session) {
+        auto before = std::chrono::steady_clock::now();
         m_session->return_output_frame(physical_address);
+        m_stats.frame_return_latency.add_usec_since(before);
+    }
+    m_display_reserve.frame_returned(physical_address);
+}
+
+void VPUDecoder::return_output_frame(const VPUOutputFrame &frame)
+{
+    if (!frame.handle.is_valid()) {
+        if (!wait_for_dmabuf_idle(frame.dma, VPU_DMABUF_RETURN_TIMEOUT)) {
+            /* Holding it longer would stall decoding, consumer should have
+             waited for its GPU work before releasing the frame */
+            codec_log_warn_limited(m_logger, "Fences of returned frame did not signal in %d msec",
+                                   VPU_DMABUF_RETURN_TIMEOUT);
+        }
+        if (frame.dma) {
+            return_output_frame(frame.dma->phy_addr);
+        }
+        return;
     }
+    TRACE_INSTANT("frame_return", "by handle");
+    /* Could be on other thread, so nothing but the push here, full queue is
+     logged once returns are applied */
+    m_frames.queue_return(frame.handle, frame.dma);
 }
 
 VPUOutputFrame VPUDecoder::flush_step()
 {
+    /* Async step has to be finished first */
+    assert(PendingDecode::NONE == m_pending);
     VPUOutputFrame frame;
+    if (!begin_flush()) {
+        return frame;
+    }
+    m_session->run_busy_callback(m_busy_callback);
+    return finish_flush();
+}
+
+bool VPUDecoder::begin_flush()
+{
     if (!m_session) {
         /* Nothing to do */
-        return frame;
+        return false;
     }
 
     if (!m_session->feed_end_of_stream()) {
         close();
-        return frame;
+        return false;
     }
 
     if (!has_frame_for_decoding()) {
         /* Can't tell whether we can get a frame or not, because it is not
          safe to call decoder without frame for decoding, so assume we still
          need to call */
-        return frame;
+        return false;
     }
 
-    std::shared_ptr<FrameMetaData> fake_meta; /* This is never used */
-    VPUDecodeStatus status = m_session->decode_video(fake_meta, frame);
+    VPUDecodeStatus status;
+    if (!m_session->begin_decode_video(status)) {
+        /* Some kind of error, end flushing */
+        close();
+        return false;
+    }
+    return true;
+}
+
+VPUOutputFrame VPUDecoder::finish_flush()
+{
+    VPUOutputFrame frame;
+    FrameMeta fake_meta; /* This is never used */
+    VPUDecodeStatus status = m_session->finish_decode_video(fake_meta, frame);
     if (VPUDecodeStatus::ERROR & status) {
         /* Some kind of error, end flushing */
         close();
@@ -83,7 +170,16 @@ VPUOutputFrame VPUDecoder::flush_step()
 
 void VPUDecoder::close()
 {
+    /* Session takes care of decode still in progress, if any */
+    m_pending = PendingDecode::NONE;
+    m_feed_stalled = false;
+    m_previous_decode_finished = false;
     m_session.reset();
+    m_stats.current_dma_allocation_size = 0;
+    if (m_frames.get_pooled_size()) {
+        /* Let other decoders use the frames until we reopen */
+        m_frames.release();
+    }
 }
 
 // TODO: this function assumes video decoding now. But it would actually
@@ -93,30 +189,71 @@ void VPUDecoder::close()
 // 2) Efficiently decode MJPEG streams
 VPUOutputFrame VPUDecoder::step_implementation(PackQueue &queue, PackPurpose purpose)
 {
+    if (PendingDecode::NONE != m_pending) {
+        /* Async step was started, this one just finishes it */
+        return finish_step(queue);
+    }
+
     VPUOutputFrame output;
+    if (begin_step_implementation(queue, purpose)) {
+        /* VPU decodes now, let the user do something meanwhile */
+        m_session->run_busy_callback(m_busy_callback);
+        finish_step_implementation(queue, output);
+    }
+    end_step(queue, output);
+    return output;
+}
+
+bool VPUDecoder::begin_step_implementation(PackQueue &queue, PackPurpose purpose)
+{
+    /* Capture sees the packs before anything gets dropped. Then let the
+     queue drop whatever its policy finds too late for decoding before
+     picking the pack to work on */
+    queue.capture_complete_packs();
+    queue.apply_drop_policy(m_stats);
+    if (decodes_keyframes_only()) {
+        m_stats.number_of_inter_packs_skipped += queue.drop_non_keyframe_packs();
+    }
+    m_stats.update_queue_depth(queue.size());
 
     /* See if there is anything we can do for this type */
     if (!queue.has_pack_for(purpose)) {
-        return output; /* No input data, nothing can be done */
+        return false; /* No input data, nothing can be done */
     }
 
     /* We need to have at least one free frame to do anything useful */
     if (!has_frame_for_decoding()) {
-        return output; /* No output buffer, can't call decoder */
+        return false; /* No output buffer, can't call decoder */
     }
 
     /* Sometimes crucial parameters (like resolution) change from frame to frame
-     and then session has to be closed and then open again */
-    if (check_for_reopening(queue.front())) {
-        /* Gotta reopen the session */
-        m_session.reset();
+     and then session has to be closed and then open again. Not with pack
+     fed (in part, or ahead) though, it has to be decoded by the same session.
+     Stepping back up from memory pressure changes them too */
+    if (!m_feed_stalled && !queue.front().m_bytes_fed) {
+        step_memory_pressure_up(queue.front());
+        if (check_for_reopening(queue.front())) {
+            /* Gotta reopen the session */
+            m_session.reset();
+        }
     }
 
+    /* Failures to tell if session went away for lack of DMA memory */
+    size_t dma_failures = m_stats.number_of_dma_allocation_failures;
+
     /* Make sure we have decoding session */
     // TODO: session can probably be opened with any data (not metadata)
     // so incomplete frame packs can (and should) open decoding. VP8 frames
     // need to be complete, but they always come complete or not at all
     if (!m_session) {
+        /* Packs fed (in part or ahead) to the session that went away can't
+         be decoded */
+        while (!queue.empty() && queue.front().m_bytes_fed && !queue.front().m_decoded) {
+            queue.pop_front();
+        }
+        m_feed_stalled = false;
+        m_previous_decode_finished = false;
+
         /* This is super cheap, so we do a loop, so the user won't have to */
         while (queue.has_pack_for(PackPurpose::CONSUMPTION)
                && !queue.front().m_can_reopen_decoding) {
@@ -128,47 +265,245 @@ VPUOutputFrame VPUDecoder::step_implementation(PackQueue &queue, PackPurpose pur
         if (!queue.has_pack_for(purpose)) {
             /* Nothing remained after popping off packs that would allow for
              reopening */
-            return output; /* No more input, nothing can be done */
+            return false; /* No more input, nothing can be done */
+        }
+
+        /* Reserve can only change with frames allocated anew, and how the
+         consumer does with the one shrunk by memory pressure says nothing */
+        if (!uses_post_processing() && (VPUMemoryPressure::NONE == m_memory_pressure)) {
+            m_display_frames = m_display_reserve.decide(m_display_frames, m_logger, m_stats);
+        }
+
+        /* Frames idle in the pool are no use to anyone while this decoder
+         can't get its own */
+        if (m_memory_pressure >= VPUMemoryPressure::RECLAIMED) {
+            size_t reclaimed = m_frames.trim_pool();
+            if (reclaimed) {
+                ++m_stats.number_of_pool_reclaims;
+                m_stats.total_pool_memory_reclaimed += reclaimed;
+                codec_log_info(m_logger, "Freed %.2fMB of idle pool frames",
+                               (double)reclaimed / (1024 * 1024));
+            }
         }
 
         /* Try to open new session */
         m_session.reset(VPUDecodingSession::open_for_video(
             m_logger, m_stats, m_buffers, m_frames, queue.front().m_codec_type,
-            queue.front().m_geometry, queue.front().m_maximum_number_of_reference_frames,
-            m_display_frames, queue.front().m_needs_reordering
+            queue.front().m_geometry, get_session_reference_frames(queue.front()),
+            get_session_display_frames(queue.front()), get_session_reordering(queue.front()),
+            queue.front().m_max_coded_frame_size, m_frame_layout
         ));
 
+        /* Rotated frames are the ones user holds, plus one being rotated into */
+        if (m_session && uses_post_processing()
+            && !m_session->enable_rotation(m_rotation, get_display_frames(queue.front()) + 1)) {
+            m_session.reset();
+        }
+
         if (!m_session) {
             /* Opening failed for some reason, get rid of this frame to move
              forward. Note that here we DO return control to the user, because
              opening is costly - opening, subsequent allocation of DMA frames
              and a first decode can easily take 100ms or more */
+            if (m_stats.number_of_dma_allocation_failures > dma_failures) {
+                step_memory_pressure_down();
+            }
             queue.pop_front();
-            return output;
+            return false;
         }
+        ++m_stats.number_of_session_opens;
     }
 
     /* This is important - when we are decoding complete frames (this function
      is called with PackPurpose::CONSUMPTION we don't expect incomplete frame
      data at all */
-    bool allow_for_incomplete_data = PackPurpose::FEEDING == purpose;
+    m_allow_for_incomplete_data = PackPurpose::FEEDING == purpose;
+
+    /* Front pack ending its stream has to be settled before it gets fed,
+     with what is known by now */
+    if (!queue.front().m_bytes_fed) {
+        settle_stream_end(queue, 0, true);
+    }
 
     /* OK, so this is "steady state" operation. When session is opened and is
      compatible with incoming frame pack, and we have free frame for decoding */
-    if (!feed_and_decode(queue, output, allow_for_incomplete_data)) {
+    if (!feed_and_start_decode(queue)) {
         /* If we are here, then error occured. Cannot proceed with current decoding
-         session, so need to close and reopen in the future. */
+         session, so need to close and reopen in the future. Frames are
+         allocated by the first decode */
         m_session.reset();
+        if (m_stats.number_of_dma_allocation_failures > dma_failures) {
+            step_memory_pressure_down();
+        }
+    } else if (m_memory_pressure_step_up_pending) {
+        /* Level stepped up to holds, next step up waits the base period */
+        m_memory_pressure_step_up_pending = false;
+        m_memory_pressure_retry_period = VPU_MEMORY_PRESSURE_RETRY_PERIOD;
     }
 
+    return PendingDecode::NONE != m_pending;
+}
+
+void VPUDecoder::finish_step_implementation(PackQueue &queue, VPUOutputFrame &output)
+{
+    PendingDecode pending = m_pending;
+    m_pending = PendingDecode::NONE;
+    if (PendingDecode::FRAME == pending) {
+        if (!finish_decode(queue, output)) {
+            /* Same as above, error means this session is done */
+            m_session.reset();
+        }
+    } else {
+        /* Flushing pack which stays on the queue until no more frames come
+         out of the decoder. Note that flushing closes the session at the end
+         of the flush or on error */
+        assert(PendingDecode::FLUSH == pending);
+        output = finish_flush();
+        if (!output.has_data()) {
+            /* Had input frame but produced no output, this is it */
+            queue.pop_front();
+        }
+    }
+}
+
+void VPUDecoder::end_step(const PackQueue &queue, const VPUOutputFrame &output)
+{
     if (output.has_data()) {
         ++m_frames_given;
+        TRACE_INSTANT("frame_output", nullptr, (int64_t)m_frames_given);
+        m_display_reserve.frame_given(output.dma->phy_addr,
+                                      m_session && !m_session->has_frame_for_decoding());
+        if (m_display_reserve.is_enabled()) {
+            m_stats.display_hold_latency = m_display_reserve.get_hold_latency();
+        }
     }
 
-    return output;
+    if (m_session) {
+        prewarm_for_reopening(queue);
+    }
+}
+
+void VPUDecoder::step_memory_pressure_down()
+{
+    if (m_memory_pressure_step_up_pending) {
+        /* Memory is still held by others, don't keep closing working
+         sessions to find that out */
+        m_memory_pressure_step_up_pending = false;
+        m_memory_pressure_retry_period = std::min<Timestamp>(2 * m_memory_pressure_retry_period,
+                                                             VPU_MEMORY_PRESSURE_MAX_RETRY_PERIOD);
+        codec_log_info(m_logger, "Step up from memory pressure failed, next try in %.0f s",
+                       m_memory_pressure_retry_period / 1000000.0);
+    }
+    m_memory_pressure_retry = std::chrono::steady_clock::now()
+        + std::chrono::microseconds(m_memory_pressure_retry_period);
+    switch (m_memory_pressure) {
+    case VPUMemoryPressure::NONE:
+        m_memory_pressure = VPUMemoryPressure::SHRUNK_RESERVE;
+        ++m_stats.number_of_pressure_reserve_shrinks;
+        codec_log_warn(m_logger, "Out of DMA memory, display reserve goes down to %d frames",
+                       VPU_MEMORY_PRESSURE_DISPLAY_FRAMES);
+        TRACE_INSTANT("memory_pressure", "display reserve shrunk");
+        break;
+    case VPUMemoryPressure::SHRUNK_RESERVE:
+        m_memory_pressure = VPUMemoryPressure::RECLAIMED;
+        codec_log_warn(m_logger, "Out of DMA memory, idle pool frames get freed on opening");
+        TRACE_INSTANT("memory_pressure", "pool reclaimed");
+        break;
+    case VPUMemoryPressure::RECLAIMED:
+        m_memory_pressure = VPUMemoryPressure::KEYFRAMES_ONLY;
+        ++m_stats.number_of_pressure_keyframes_only_fallbacks;
+        codec_log_warn(m_logger, "Out of DMA memory, decoding keyframes only");
+        TRACE_INSTANT("memory_pressure", "keyframes only");
+        break;
+    case VPUMemoryPressure::KEYFRAMES_ONLY:
+        m_memory_pressure = VPUMemoryPressure::STARVED;
+        ++m_stats.number_of_memory_starvations;
+        codec_log_error(m_logger, "Out of DMA memory even for keyframes only");
+        TRACE_INSTANT("memory_pressure", "starved");
+        break;
+    case VPUMemoryPressure::STARVED:
+        /* Nowhere to go, keeps trying */
+        break;
+    }
+    m_stats.memory_pressure_level = (size_t)m_memory_pressure;
+}
+
+/* Only with pack that can reopen decoding, as session settings may change */
+void VPUDecoder::step_memory_pressure_up(const Pack &pack)
+{
+    if ((VPUMemoryPressure::NONE == m_memory_pressure) || !pack.m_can_reopen_decoding) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < m_memory_pressure_retry) {
+        return;
+    }
+    /* Failure takes it down again, and next try waits for another period */
+    m_memory_pressure = (VPUMemoryPressure)((int)m_memory_pressure - 1);
+    m_memory_pressure_retry = now + std::chrono::microseconds(m_memory_pressure_retry_period);
+    m_memory_pressure_step_up_pending = true;
+    ++m_stats.number_of_memory_pressure_recoveries;
+    m_stats.memory_pressure_level = (size_t)m_memory_pressure;
+    codec_log_info(m_logger, "Trying a step back up from memory pressure, to level %zu",
+                   m_stats.memory_pressure_level);
+    TRACE_INSTANT("memory_pressure", "step up", (int64_t)m_memory_pressure);
 }
 
-bool VPUDecoder::check_for_reopening(const Pack &pack) const
+/* Next stream (see Pack::m_ends_stream) goes on in the same session if it
+ starts with a pack that can reopen decoding and wouldn't need reopening,
+ and session doesn't reorder - then every frame decoded has been given out
+ already, so no tail frames can be lost, no flushing is needed and no frames
+ get allocated anew. Session that reorders may still hold frames of this
+ stream for output, and whether next IDR picture has them given out depends
+ on its no_output_of_prior_pics_flag (which isn't parsed), so pack gets
+ flushing flag then, as at the end of stream. Next stream has to have its
+ first pack complete to tell, returns false if it doesn't and decision can
+ wait */
+bool VPUDecoder::settle_stream_end(PackQueue &queue, size_t index, bool now)
+{
+    const Pack *pack = queue.get_pack(index);
+    if (!pack->m_ends_stream) {
+        return true;
+    }
+    const Pack *next = queue.get_pack(index + 1);
+    bool known = next && next->m_is_complete;
+    if (!known && !now) {
+        return false;
+    }
+    if (known && next->m_can_reopen_decoding && !check_for_reopening(*next, false)
+        && !m_session->get_reordering()) {
+        ++m_stats.number_of_seamless_transitions;
+        codec_log_info(m_logger, "Next stream fits the session, going on with it");
+        TRACE_INSTANT("stream_transition", "seamless");
+        queue.settle_stream_end(index, false);
+    } else {
+        ++m_stats.number_of_flushed_transitions;
+        codec_log_info(m_logger, "Next stream doesn't fit the session, flushing");
+        TRACE_INSTANT("stream_transition", "flushed");
+        queue.settle_stream_end(index, true);
+    }
+    return true;
+}
+
+/* Decoder can't be opened ahead of time, because it shares bitstream and
+ auxiliary buffers with current session, but the slowest part of reopening,
+ frame allocation, can be done in the meantime */
+void VPUDecoder::prewarm_for_reopening(const PackQueue &queue)
+{
+    /* Memory other decoders may need for their frames */
+    if (VPUMemoryPressure::NONE != m_memory_pressure) {
+        return;
+    }
+    const Pack *pack = queue.find_next_reopen_point();
+    if (!pack || !check_for_reopening(*pack, false)) {
+        return;
+    }
+    m_frames.prewarm(VPUDecodingSession::get_frame_size(pack->m_codec_type, pack->m_geometry,
+                                                        m_frame_layout),
+                     get_session_reference_frames(*pack) + get_session_display_frames(*pack));
+}
+
+bool VPUDecoder::check_for_reopening(const Pack &pack, bool verbose) const
 {
     /* No session, so we gotta open */
     if (!m_session) {
@@ -195,32 +530,75 @@ bool VPUDecoder::check_for_reopening(const Pack &pack) const
     /* Compatibility check - see if stream parameters aren't changed on the
      frame. If they have, we need to close this stream and reopen */
     if (pack.m_codec_type != m_session->get_codec_type()) {
-        codec_log_info(m_logger, "Codec type change, need to reopen");
+        if (verbose) {
+            codec_log_info(m_logger, "Codec type change, need to reopen");
+            TRACE_INSTANT("reopen", "codec type change");
+        }
         return true;
     }
 
-    size_t required_frames = pack.m_maximum_number_of_reference_frames
-        + m_display_frames;
+    size_t required_frames
+        = get_session_reference_frames(pack) + get_session_display_frames(pack);
     if (required_frames != m_session->get_number_of_frame_buffers()) {
-        codec_log_info(m_logger, "Buffering requirement change, need to reopen");
+        if (verbose) {
+            codec_log_info(m_logger, "Buffering requirement change, need to reopen");
+            TRACE_INSTANT("reopen", "buffering requirement change");
+        }
+        return true;
+    }
+
+    if (get_session_reordering(pack) != m_session->get_reordering()) {
+        if (verbose) {
+            codec_log_info(m_logger, "Reordering requirement change, need to reopen");
+            TRACE_INSTANT("reopen", "reordering requirement change");
+        }
+        return true;
+    }
+
+    /* Same as buffers below, rotation change waits for pack that can reopen */
+    if (pack.m_can_reopen_decoding
+        && ((m_rotation != m_session->get_rotation())
+            || (uses_post_processing()
+                && (get_display_frames(pack) + 1
+                    != m_session->get_number_of_rotated_frames())))) {
+        if (verbose) {
+            codec_log_info(m_logger, "Rotation change, need to reopen");
+            TRACE_INSTANT("reopen", "rotation change");
+        }
         return true;
     }
 
-    if (pack.m_needs_reordering != m_session->get_reordering()) {
-        codec_log_info(m_logger, "Reordering requirement change, need to reopen");
+    if (pack.m_can_reopen_decoding && (m_frame_layout != m_session->get_frame_layout())) {
+        if (verbose) {
+            codec_log_info(m_logger, "Frame layout change, need to reopen");
+            TRACE_INSTANT("reopen", "frame layout change");
+        }
         return true;
     }
 
     if (pack.m_geometry != m_session->get_frame_geometry()) {
-        codec_log_info(m_logger, "Frame geometry change, need to reopen");
+        if (verbose) {
+            codec_log_info(m_logger, "Frame geometry change, need to reopen");
+            TRACE_INSTANT("reopen", "frame geometry change");
+        }
+        return true;
+    }
+
+    /* Buffers can only be reallocated with decoder closed, but unlike above
+     this doesn't come with the pack that can reopen decoding by itself, so
+     wait for one */
+    if (pack.m_can_reopen_decoding && m_buffers.should_reallocate_bitstream_buffer()) {
+        if (verbose) {
+            codec_log_info(m_logger, "Bitstream buffer too small, need to reopen");
+            TRACE_INSTANT("reopen", "bitstream buffer too small");
+        }
         return true;
     }
 
     return false;
 }
 
-bool VPUDecoder::feed_and_decode(PackQueue &queue, VPUOutputFrame &output,
-                                 bool allow_for_incomplete_data)
+bool VPUDecoder::feed_and_start_decode(PackQueue &queue)
 {
     /* No sense to call this otherwise */
     assert(!queue.empty());
@@ -229,62 +607,42 @@ bool VPUDecoder::feed_and_decode(PackQueue &queue, VPUOutputFrame &output,
     /* Feed frame if it wasn't already fed (unfortunately we can't guarantee
      decode after every feed, because decoder may decide to return previously
      buffered frame back, and we might not have place for decode after that) */
-    if (!queue.front().m_chunks.empty() && !feed_frame(queue)) {
-        /* On error pop offending frame, otherwise we end up running into same
-         issue again */
-        queue.pop_front();
-        return false;
+    if (!queue.front().m_chunks.empty()) {
+        auto before = std::chrono::steady_clock::now();
+        if (!feed_frame(queue)) {
+            /* On error pop offending frame, otherwise we end up running into
+             same issue again */
+            queue.pop_front();
+            return false;
+        }
+        m_stats.feed_latency.add_usec_since(before);
+        if (m_feed_stalled) {
+            /* Rest of the pack waits for bitstream buffer space, and decode
+             can't start before all of it is in */
+            return true;
+        }
     }
 
     /* Frame might be decoded already - frames with the flush flag set stay
      on queue even after decode */
     if (!queue.front().m_decoded) {
         /* OK, have complete frame fed in bitstream buffer, can decode */
-        auto before = std::chrono::steady_clock::now();
-        VPUDecodeStatus status = m_session->decode_video(queue.front().meta, output);
-        auto duration = std::chrono::steady_clock::now() - before;
-
-        if (VPUDecodeStatus::ERROR & status) {
+        m_decode_start = std::chrono::steady_clock::now();
+        if (m_previous_decode_finished) {
+            m_stats.decode_gap_latency.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                m_decode_start - m_decode_end).count());
+        }
+        VPUDecodeStatus status;
+        if (!m_session->begin_decode_video(status)) {
             /* Decoding error, throw offending frame away or we will end up
              running into same problem again */
             queue.pop_front();
             return false;
         }
-        size_t duration_msec =
-            std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-
-        /* Let's see if decode was actually performed */
-        if (VPUDecodeStatus::OUTPUT_DECODED & status) {
-            /* Frame was decoded, can proceed */
-            ++m_stats.number_of_decode_operations;
-            m_stats.update_decode_timing(duration_msec);
-            queue.mark_front_as_decoded();
-            if (!queue.front().m_needs_flushing) {
-                /* No longer need this frame */
-                queue.pop_front();
-                return true;
-            }
-        } else if (VPUDecodeStatus::FRAME_GIVEN_FOR_DISPLAY & status) {
-            /* We got one of buffered frames instead, this is fine but do not
-             pop frame yet, data remained in bitstream buffer */
-            return true;
-        } else if (VPUDecodeStatus::NOT_ENOUGH_INPUT_DATA & status) {
-            ++m_stats.number_of_rolled_back_decodes;
-            /* This is "legal" only if allow_for_incomplete_data is true */
-            if (allow_for_incomplete_data) {
-                return true;
-            } else {
-                codec_log_error(m_logger, "Got NOT_ENOUGH_DATA but complete "
-                                          "frame was expected");
-                return false;
-            }
-        } else {
-            assert(VPUDecodeStatus::ERROR & status);
-            /* This means decode error. Pop off offending frame, or we may end
-             up going here again...and again and again */
-            queue.pop_front();
-            return false;
-        }
+        m_pending = PendingDecode::FRAME;
+        /* VPU decodes now, so next packs can go in meanwhile */
+        feed_ahead(queue);
+        return true;
     }
 
     /* If we got here, this frame needs flushing, which is special case at the
@@ -298,24 +656,115 @@ bool VPUDecoder::feed_and_decode(PackQueue &queue, VPUOutputFrame &output,
         return true;
     }
 
-    output = flush_step();
-    if (output.has_data()) {
-        /* Got yet another output frame, have to give it back */
+    if (!begin_flush()) {
+        /* Flushing got nowhere, this is it */
+        queue.pop_front();
         return true;
-    } else {
-        /* Had input frame but produced no output, this is it */
+    }
+    m_pending = PendingDecode::FLUSH;
+    return true;
+}
+
+bool VPUDecoder::finish_decode(PackQueue &queue, VPUOutputFrame &output)
+{
+    VPUDecodeStatus status = m_session->finish_decode_video(queue.front().meta, output);
+    m_decode_end = std::chrono::steady_clock::now();
+    m_previous_decode_finished = true;
+    auto duration = m_decode_end - m_decode_start;
+    m_stats.decode_latency.add(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+    if (VPUDecodeStatus::ERROR & status) {
+        /* Decoding error, throw offending frame away or we will end up
+         running into same problem again */
         queue.pop_front();
+        return false;
+    }
+    size_t duration_msec =
+        std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+
+    /* Let's see if decode was actually performed */
+    if (VPUDecodeStatus::OUTPUT_DECODED & status) {
+        /* Frame was decoded, can proceed */
+        ++m_stats.number_of_decode_operations;
+        m_stats.update_decode_timing(duration_msec);
+        m_stats.update_slice_count(queue.front().m_number_of_slices);
+        if (queue.front().m_coalesce_chunks) {
+            m_stats.update_coalesced_decode_timing(duration_msec);
+        }
+        queue.mark_front_as_decoded();
+        /* Low latency packs are decoded without reordering, so there is
+         nothing buffered in the decoder to be flushed */
+        if (!queue.front().m_needs_flushing || queue.front().m_low_latency) {
+            /* No longer need this frame */
+            queue.pop_front();
+        }
+        /* Otherwise pack stays on the queue, and next steps flush the
+         decoder */
+        return true;
+    } else if (VPUDecodeStatus::FRAME_GIVEN_FOR_DISPLAY & status) {
+        /* We got one of buffered frames instead, this is fine but do not
+         pop frame yet, data remained in bitstream buffer */
         return true;
+    } else if (VPUDecodeStatus::NOT_ENOUGH_INPUT_DATA & status) {
+        ++m_stats.number_of_rolled_back_decodes;
+        /* This is "legal" only if allow_for_incomplete_data is true */
+        if (m_allow_for_incomplete_data) {
+            return true;
+        } else {
+            codec_log_error(m_logger, "Got NOT_ENOUGH_DATA but complete "
+                                      "frame was expected");
+            return false;
+        }
+    } else {
+        assert(VPUDecodeStatus::ERROR & status);
+        /* This means decode error. Pop off offending frame, or we may end
+         up going here again...and again and again */
+        queue.pop_front();
+        return false;
     }
 }
 
 bool VPUDecoder::feed_frame(PackQueue &queue)
 {
+    TRACE_SCOPE("feed", nullptr, (int64_t)queue.front().get_bytes_pending());
     assert(!queue.empty());
+    skip_fed_parameter_sets(queue, 0);
     const Pack &pack = queue.front();
-    size_t total_size = 0;
-    for (auto &c : pack.m_chunks) {
-        total_size += c.size;
+    size_t pending_size = pack.get_bytes_pending();
+    size_t total_size = pack.m_bytes_fed + pending_size;
+
+    /* Bitstream buffer is sized from stream parameters, and stream may not
+     follow them */
+    if (m_buffers.demand_bitstream_buffer_size(total_size)) {
+        ++m_stats.number_of_bitstream_buffer_grows;
+        codec_log_warn(m_logger, "Frame of %zu bytes is too big for bitstream buffer "
+                                 "of %zu bytes, will grow it on reopening",
+                       total_size, (size_t)m_buffers.get_bitstream_buffer().size);
+    }
+
+    /* Rest of a pack fed in part goes in once packs decoded before it free
+     their space. Without feed-ahead, nothing but this pack would be there
+     to decode, so pack that doesn't fit now never will. It is refused
+     before any of it goes in */
+    if (!m_feed_ahead_packs && !pack.m_bytes_fed) {
+        size_t free_space;
+        if (!m_session->get_bitstream_buffer_free_space_available(free_space)) {
+            return false;
+        }
+        if (free_space < pending_size) {
+            codec_log_error(m_logger, "Frame of %zu bytes doesn't fit into %zu bytes of free "
+                                      "bitstream space, and no feed-ahead frees more",
+                            pending_size, free_space);
+            return false;
+        }
+    }
+
+    /* Whatever decoder makes out of these bytes gets pack metadata */
+    m_session->set_feed_meta(pack.meta);
+
+    if (pack.m_coalesce_chunks) {
+        return feed_frame_coalesced(queue, pending_size);
     }
 
     size_t total_fed = 0;
@@ -324,21 +773,263 @@ bool VPUDecoder::feed_frame(PackQueue &queue)
     while (!pack.m_chunks.empty()) {
         size_t size_fed;
 //        codec_log_info(m_logger, "PUSHING %s (%zu)",
-//                       pack.m_chunks.front().description.c_str(),
+//                       pack.m_chunks.front().description,
 //                       pack.m_chunks.front().size);
-        if (!m_session->feed(pack.m_chunks.front().data, pack.m_chunks.front().size, size_fed)) {
+        if (!feed_chunk(pack.m_chunks.front(), size_fed)) {
+            return false;
+        }
+        total_fed += size_fed;
+        if (pack.m_chunks.front().fed + size_fed != pack.m_chunks.front().size) {
+            if (size_fed) {
+                queue.mark_chunk_fed(size_fed);
+            }
+            m_stats.update_bytes_fed(total_fed);
+            return wait_for_bitstream_space(pack, total_fed);
+        }
+        m_session->parameter_set_fed(pack.m_chunks.front().parameter_set_version);
+        queue.pop_chunk();
+    }
+//    codec_log_info(m_logger, "FED %zu bytes", total_fed);
+    m_stats.update_bytes_fed(total_fed);
+    m_feed_stalled = false;
+    return true;
+}
+
+/* Same as above, but instead of updating bitstream buffer chunk by chunk
+ whole pack gets written and committed at once (or in two steps, when wrapping
+ around bitstream buffer end), so decoder sees all the slices of a picture
+ appear in one go */
+bool VPUDecoder::feed_frame_coalesced(PackQueue &queue, size_t total_size)
+{
+    const Pack &pack = queue.front();
+    size_t free_space;
+    if (!m_session->get_bitstream_buffer_free_space_available(free_space)) {
+        return false;
+    }
+    if (free_space < total_size) {
+        /* Don't feed anything if it won't fit - there is no way to feed the
+         rest later on without breaking it into more updates */
+        return wait_for_bitstream_space(pack, 0);
+    }
+
+    if (!write_coalesced(queue, 0, total_size)) {
+        return false;
+    }
+    m_stats.update_bytes_fed(total_size);
+    m_feed_stalled = false;
+    return true;
+}
+
+/* Writes all the chunks of pack with given index (see PackQueue::get_pack())
+ that have total_size bytes left, caller checked there is space for them */
+bool VPUDecoder::write_coalesced(PackQueue &queue, size_t index, size_t total_size)
+{
+    const Pack &pack = *queue.get_pack(index);
+    auto chunk = pack.m_chunks.begin();
+    size_t chunk_offset = chunk->fed;
+    size_t total_fed = 0;
+    while (total_fed < total_size) {
+        unsigned char *window;
+        size_t window_size;
+        if (!m_session->reserve(total_size - total_fed, window, window_size)) {
             return false;
         }
-        if (size_fed != pack.m_chunks.front().size) {
+        if (!window_size) {
+            /* Should not happen, we checked for space above */
             codec_log_error(m_logger, "End of bitstream space while feeding, "
                                       "%zu of total %zu fed",
-                            total_fed + size_fed, total_size);
+                            total_fed, total_size);
             return false;
         }
-        total_fed += pack.m_chunks.front().size;
-        queue.pop_chunk();
+        /* Fill the window with as many chunks (or their parts) as will fit */
+        size_t window_fill = 0;
+        while (window_fill < window_size) {
+            assert(chunk != pack.m_chunks.end());
+            size_t size = chunk->size - chunk_offset;
+            if (size > window_size - window_fill) {
+                size = window_size - window_fill;
+            }
+            if (chunk->write_callback) {
+                chunk->write_callback(window + window_fill, chunk_offset, size);
+            } else {
+                ::memcpy(window + window_fill, chunk->data + chunk_offset, size);
+            }
+            window_fill += size;
+            chunk_offset += size;
+            if (chunk_offset == chunk->size) {
+                m_session->parameter_set_fed(chunk->parameter_set_version);
+                ++chunk;
+                chunk_offset = 0;
+            }
+        }
+        if (!m_session->commit(window_size)) {
+            return false;
+        }
+        total_fed += window_size;
+    }
+
+    while (!pack.m_chunks.empty()) {
+        queue.pop_chunk(index);
+    }
+    return true;
+}
+
+/* Feeds complete packs following the front one into bitstream buffer, while
+ VPU decodes the front one, so that the next decode can start right away.
+ Feeding stops at the first pack that:
+ - would need the decoder reopened, as reopening loses bitstream buffer
+ - comes after the pack with flushing flag, as flushing feeds end of stream
+ - goes over the limits set with set_feed_ahead(), or doesn't fit into free
+ bitstream buffer space (non-coalesced pack is fed as far as it fits, rest
+ goes in once it gets to the front, see wait_for_bitstream_space())
+ Decoded frames still get metadata of the pack they were decoded from, that
+ is what VPUBitstreamBufferMonitoring is for */
+void VPUDecoder::feed_ahead(PackQueue &queue)
+{
+    if (!m_feed_ahead_packs || queue.front().m_needs_flushing) {
+        return;
+    }
+    TRACE_SCOPE("feed_ahead");
+    auto before = std::chrono::steady_clock::now();
+    size_t bytes_ahead = 0;
+    size_t total_fed = 0;
+    const Pack *pack = nullptr;
+    for (size_t index = 1; index <= m_feed_ahead_packs; index++) {
+        if (pack && pack->m_needs_flushing) {
+            break;
+        }
+        pack = queue.get_pack(index);
+        if (!pack || !pack->m_is_complete || check_for_reopening(*pack, false)
+            || !settle_stream_end(queue, index, false)) {
+            break;
+        }
+        /* Gets dropped on next step, unless fed ahead */
+        if (decodes_keyframes_only() && !pack->m_is_keyframe) {
+            break;
+        }
+        skip_fed_parameter_sets(queue, index);
+        size_t pending_size = pack->get_bytes_pending();
+        bytes_ahead += pack->m_bytes_fed + pending_size;
+        if (!pending_size) {
+            /* Fed already */
+            continue;
+        }
+        if (m_feed_ahead_bytes && (bytes_ahead > m_feed_ahead_bytes)) {
+            break;
+        }
+        m_session->set_feed_meta(pack->meta);
+        if (pack->m_coalesce_chunks) {
+            size_t free_space;
+            if (!m_session->get_bitstream_buffer_free_space_available(free_space)
+                || (free_space < pending_size) || !write_coalesced(queue, index, pending_size)) {
+                break;
+            }
+            total_fed += pending_size;
+            continue;
+        }
+        bool fed_whole_pack = true;
+        while (!pack->m_chunks.empty()) {
+            size_t size_fed;
+            if (!feed_chunk(pack->m_chunks.front(), size_fed)) {
+                fed_whole_pack = false;
+                break;
+            }
+            total_fed += size_fed;
+            if (pack->m_chunks.front().fed + size_fed != pack->m_chunks.front().size) {
+                if (size_fed) {
+                    queue.mark_chunk_fed(size_fed, index);
+                }
+                fed_whole_pack = false;
+                break;
+            }
+            m_session->parameter_set_fed(pack->m_chunks.front().parameter_set_version);
+            queue.pop_chunk(index);
+        }
+        if (!fed_whole_pack) {
+            break;
+        }
+    }
+    if (total_fed) {
+        m_stats.update_bytes_fed(total_fed);
+        m_stats.feed_ahead_latency.add_usec_since(before);
+    }
+}
+
+/* Pack didn't fit into free bitstream buffer space, and it is left with part
+ of its chunks (or just part of a chunk) to be fed. That works out only if
+ there is something in the buffer that decoding will consume, freeing space
+ for the rest, so returns false (same as for any other feeding error) if:
+ - buffer holds nothing but the part of this pack, so it is bigger than the
+ whole buffer. Note that decoder runs in rollback mode (see bitstreamMode in
+ VPUDecodingSession) and won't decode picture that isn't all in there
+ - bytes fed now are zero and free space didn't change since the previous
+ attempt - eg. nothing got decoded in between */
+bool VPUDecoder::wait_for_bitstream_space(const Pack &pack, size_t size_fed)
+{
+    size_t free_space;
+    if (!m_session->get_bitstream_buffer_free_space_available(free_space)) {
+        return false;
+    }
+    size_t total_size = pack.m_bytes_fed + pack.get_bytes_pending();
+    size_t used_space = m_buffers.get_bitstream_buffer().size - free_space;
+    if ((used_space <= pack.m_bytes_fed)
+        || (!size_fed && m_feed_stalled && (m_stalled_free_space == free_space))) {
+        codec_log_error(m_logger, "End of bitstream space while feeding, "
+                                  "%zu of total %zu fed",
+                        pack.m_bytes_fed, total_size);
+        m_feed_stalled = false;
+        return false;
+    }
+    ++m_stats.number_of_partial_feeds;
+    m_feed_stalled = true;
+    m_stalled_free_space = free_space;
+    return true;
+}
+
+/* Parameter sets pack starts with, that are unchanged since session got them,
+ are not fed again (see VPUDecodingSession::has_parameter_set()). These count
+ as fed - decoder has them. Only done before anything of the pack got fed, so
+ that parameter sets fed by this pack (and then remembered) are not taken for
+ the ones to skip when feeding continues */
+void VPUDecoder::skip_fed_parameter_sets(PackQueue &queue, size_t index)
+{
+    const Pack &pack = *queue.get_pack(index);
+    if (pack.m_bytes_fed) {
+        return;
+    }
+    while (!pack.m_chunks.empty() && pack.m_chunks.front().parameter_set_version
+           && m_session->has_parameter_set(pack.m_chunks.front().parameter_set_version)) {
+        queue.pop_chunk(index);
+        ++m_stats.number_of_parameter_sets_skipped;
+    }
+}
+
+bool VPUDecoder::feed_chunk(const VideoChunk &chunk, size_t &size_fed)
+{
+    if (!chunk.write_callback) {
+        /* Plain chunk, data has to be copied in */
+        return m_session->feed(chunk.data + chunk.fed, chunk.size - chunk.fed, size_fed);
+    }
+
+    /* Zero-copy chunk, let the writer fill bitstream buffer directly. This
+     takes two steps at most, second one only when wrapping around */
+    size_fed = 0;
+    while (chunk.fed + size_fed < chunk.size) {
+        unsigned char *window;
+        size_t window_size;
+        if (!m_session->reserve(chunk.size - chunk.fed - size_fed, window, window_size)) {
+            return false;
+        }
+        if (!window_size) {
+            /* Out of space, caller will handle the rest */
+            return true;
+        }
+        chunk.write_callback(window, chunk.fed + size_fed, window_size);
+        if (!m_session->commit(window_size)) {
+            return false;
+        }
+        size_fed += window_size;
     }
-//    codec_log_info(m_logger, "FED %zu bytes", total_fed);
     return true;
 }
 }
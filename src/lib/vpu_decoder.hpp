@@ -1,7 +1,11 @@
 #pragma once
 
+#include <chrono>
+
 #include "codec_common.hpp"
 #include "codec_logger.hpp"
+#include "decode_backend.hpp"
+#include "display_frame_reserve.hpp"
 #include "vpu_decoder_buffers.hpp"
 #include "vpu_frame_buffers.hpp"
 #include "vpu_decoding_session.hpp"
@@ -9,12 +13,44 @@
 
 namespace airtame {
 
+/* What get_expected_step_duration() says before any decode was timed (usec) */
+#define VPU_DEFAULT_STEP_DURATION 5000
+/* Display frames decoder keeps under memory pressure (see
+ VPUMemoryPressure), one being displayed and one being decoded into */
+#define VPU_MEMORY_PRESSURE_DISPLAY_FRAMES 2
+/* Time (usec) after which decoder under memory pressure tries a step back
+ up, with next pack that can reopen decoding */
+#define VPU_MEMORY_PRESSURE_RETRY_PERIOD 5000000
+/* Each step up that fails doubles the period before the next one, up to
+ this (usec) */
+#define VPU_MEMORY_PRESSURE_MAX_RETRY_PERIOD 80000000
+
+/* How far decoder went down after running out of DMA memory on (re)opening.
+ Several decoders share CMA, and memory one needs may be held by others for
+ a while, so instead of failing each reopen point the same way, each failure
+ takes decoder a step down, and once in a while it tries a step back up, see
+ VPUDecoder::get_memory_pressure() */
+enum class VPUMemoryPressure {
+    NONE,
+    /* Display reserve goes down to VPU_MEMORY_PRESSURE_DISPLAY_FRAMES */
+    SHRUNK_RESERVE,
+    /* Above, and idle frames of the shared pool are freed before opening */
+    RECLAIMED,
+    /* Above, and keyframes only, see VPUDecoder::set_keyframes_only() */
+    KEYFRAMES_ONLY,
+    /* Even that failed, decoder keeps trying, but stream is better off
+     decoded by other engine, if there is one */
+    STARVED
+};
+
 /* The purpose of this class is to use low level VPUDecodingSession to implement
  fully featured decoder. Hight level session/frame pack management is here */
-class VPUDecoder {
+class VPUDecoder : public DecodeBackend {
 private:
     CodecLogger &m_logger;
     size_t m_display_frames;
+    /* Used instead of above for packs marked with Pack::m_low_latency */
+    size_t m_low_latency_display_frames;
 
     VPUDecoderBuffers m_buffers;
     VPUFrameBuffers m_frames;
@@ -23,12 +59,50 @@ private:
     std::shared_ptr<VPUDecodingSession> m_session;
 
     size_t m_frames_given = 0;
+    VPUBusyCallback m_busy_callback;
+    /* Post-processing of sessions opened, see set_rotation() */
+    VPURotation m_rotation;
+    /* See set_frame_layout() */
+    VPUFrameLayout m_frame_layout = VPUFrameLayout::LINEAR;
+
+    /* State of async steps, see begin_step() */
+    enum class PendingDecode {
+        NONE,
+        FRAME, /* Decoding front pack of the queue */
+        FLUSH /* Getting buffered frames out for front pack needing flush */
+    };
+    PendingDecode m_pending = PendingDecode::NONE;
+    bool m_allow_for_incomplete_data = false;
+    /* Front pack is fed in part, waiting for bitstream buffer space. Free
+     space back then is kept to tell if nothing got freed since */
+    bool m_feed_stalled = false;
+    size_t m_stalled_free_space = 0;
+    std::chrono::steady_clock::time_point m_decode_start;
+    /* End of the last decode, for DecodingStats::decode_gap_latency */
+    std::chrono::steady_clock::time_point m_decode_end;
+    bool m_previous_decode_finished = false;
+    /* See set_feed_ahead() */
+    size_t m_feed_ahead_packs = 0;
+    size_t m_feed_ahead_bytes = 0;
+    /* See set_keyframes_only() */
+    bool m_keyframes_only = false;
+    /* See set_display_frame_bounds() */
+    DisplayFrameReserve m_display_reserve;
+    /* See get_memory_pressure(), and when to try a step back up */
+    VPUMemoryPressure m_memory_pressure = VPUMemoryPressure::NONE;
+    std::chrono::steady_clock::time_point m_memory_pressure_retry;
+    /* Backs off with failed steps up (usec), and whether the last step up
+     still has to decode a frame to count as one that didn't fail */
+    Timestamp m_memory_pressure_retry_period = VPU_MEMORY_PRESSURE_RETRY_PERIOD;
+    bool m_memory_pressure_step_up_pending = false;
 public:
     VPUDecoder(CodecLogger &logger, size_t display_frames)
         : m_logger(logger)
         , m_display_frames(display_frames)
+        , m_low_latency_display_frames(display_frames)
         , m_frames(logger)
     {
+        m_frames.set_display_reserve(&m_display_reserve);
     }
 
     /* It is safe to call this anyway, but for the step to actually do something
@@ -75,7 +149,7 @@ public:
      was) but decoder is being called to return all previously buffered and
      not given for display frames.
      */
-    VPUOutputFrame step(PackQueue &queue);
+    VPUOutputFrame step(PackQueue &queue) override;
 
     /* This function is like above, except it will also try to decode frame
      packs not marked as complete. You should AVOID USING it if you can,
@@ -94,15 +168,54 @@ public:
      Also, just like for step() decoder.has_frame_for_decoding() must be true,
      but unlike step queue.has_frame_for_consumption() is enough, frame doesn't
      have to be complete */
-    VPUOutputFrame try_to_step(PackQueue &queue);
+    VPUOutputFrame try_to_step(PackQueue &queue) override;
+
+    /* Non-blocking version of step()/try_to_step() (depending on purpose),
+     for event loops that need to do other stuff while VPU decodes - one decode
+     takes up to 15msec. Works in three parts:
+     - begin_step() does what step() does up to starting VPU decode, and
+     returns true if it did start it. If it returns false, step is over
+     already (for the same reasons step() would return an empty frame)
+     - poll_step() returns true once finish_step() won't block, this is
+     just a check and can be called as often as needed
+     - finish_step() completes the step, so gets whatever step() would
+     return. Queue must be the same as given to begin_step()
+
+     VPU library signals the end of decode only to vpu_WaitForInt() caller
+     and has no file descriptor one could give to poll()/epoll(), so
+     event loops are expected to poll at a fraction of
+     get_expected_step_duration(). Also, VPU decodes just one frame at a time
+     for all the decoders, so only one of them can have step in progress.
+     Calling step()/try_to_step() with async step in progress just finishes
+     it */
+    bool begin_step(PackQueue &queue, PackPurpose purpose = PackPurpose::CONSUMPTION);
+    bool poll_step();
+    VPUOutputFrame finish_step(PackQueue &queue);
+    bool is_step_in_progress() const
+    {
+        return PendingDecode::NONE != m_pending;
+    }
+    /* Typical time VPU takes to decode (usec), median of decodes so far */
+    Timestamp get_expected_step_duration() const;
 
     /* If that function returns true, decode is possible. If it doesn't, then
      frame must be returned first */
-    bool has_frame_for_decoding() const;
+    bool has_frame_for_decoding() const override;
 
     /* Frame with this physical_address finished displaying and can be reused
      by the decoder */
-    void return_output_frame(long physical_address);
+    void return_output_frame(long physical_address) override;
+    /* Same, for frame given out by step(), found by its handle rather than
+     looked up by address. Return is only queued, without locking, waiting
+     or logging, and applied in one batch right before next decode, so this
+     one can be called from other thread than the decoding one - display or
+     GPU thread - as long as it is one such thread at a time. Frames
+     allocated as dmabufs may still be read by GPU work the consumer queued,
+     so applying the returns waits for their fences (up to
+     VPU_DMABUF_RETURN_TIMEOUT), on the decoding thread. Frames without valid
+     handle (rotated ones) go back by address, waiting for the fences right
+     away, and only on the decoding thread */
+    void return_output_frame(const VPUOutputFrame &frame) override;
 
     /* Some uses expect decoder to have flush function. Problem with VPU decoder
      is that sometimes it needs to get display frames back even if flushing. And
@@ -111,34 +224,240 @@ public:
 
      WARNING: just like step()/try_to_step() it requires has_frame_for_decoding()
      to be true to actually do any useful work. So flushing only ends when
-     has_frame_for_decoding() is true and flush_step returns empty frame */
-    VPUOutputFrame flush_step();
+     has_frame_for_decoding() is true and flush_step returns empty frame.
+     Can't be called with async step in progress */
+    VPUOutputFrame flush_step() override;
 
     /* This should be called to finish current decoding, for example just before
      rewind operation. Right now flush is implemented internally, as a part of
      decode(), so no need for it */
-    void close();
+    void close() override;
+
+    /* Makes decoder borrow its frames from the pool, which may be shared with
+     other decoders. Has to be called before decoding starts */
+    void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool) override
+    {
+        m_frames.set_pool(pool);
+    }
+
+    /* Frames decoded in low latency mode (see H264StreamParser::set_low_latency())
+     are given out by the very step that fed them, so user may need less
+     display frames for these - typically one being displayed and one
+     being decoded into. Same as display_frames given to ctor by default.
+     Takes effect when the decoder (re)opens */
+    void set_low_latency_display_frames(size_t display_frames)
+    {
+        m_low_latency_display_frames = display_frames;
+    }
+
+    /* Adaptive display frame reserve: display_frames given to ctor is where
+     it starts, then each time decoder reopens it grows by a frame if
+     decoding got blocked too often waiting for the consumer to return one,
+     or shrinks by one if the consumer never held all of them, see
+     DisplayFrameReserve. Decisions are logged, and counted in the stats.
+     Stays within given bounds, zero max_frames (default) keeps reserve
+     fixed. Frames must be returned with return_output_frame() to be
+     tracked. Low latency reserve (see above) isn't adapted, and neither is
+     one with rotation enabled, where the rotator holds the frames */
+    void set_display_frame_bounds(size_t min_frames, size_t max_frames)
+    {
+        m_display_reserve.set_bounds(min_frames, max_frames);
+    }
+
+    size_t get_display_frame_reserve() const
+    {
+        return m_display_frames;
+    }
+
+    /* Frames given away get rotated by the VPU, so that display doesn't have
+     to (see VPURotator). Their geometry is rotated then, and frames held by
+     the user are rotated ones, decoder needs only one display frame of its
+     own. Off (zero angle, no mirroring) by default, takes effect when the
+     decoder (re)opens - and change reopens it with next pack that can reopen
+     decoding */
+    void set_rotation(const VPURotation &rotation)
+    {
+        m_rotation = rotation;
+    }
+
+    const VPURotation &get_rotation() const
+    {
+        return m_rotation;
+    }
+
+    /* Layout of decoder's own frames, see VPUFrameLayout. With TILED frames
+     given away are written out linear by the post-processing stage, same as
+     rotated ones above (and along with rotation, if any), so what the user
+     gets is NV12 either way. LINEAR by default, change takes effect the same
+     way rotation change does */
+    void set_frame_layout(VPUFrameLayout frame_layout)
+    {
+        m_frame_layout = frame_layout;
+    }
+
+    VPUFrameLayout get_frame_layout() const
+    {
+        return m_frame_layout;
+    }
+
+    /* Feed-ahead: while VPU decodes, up to number_of_packs complete packs
+     following the one decoded (and up to number_of_bytes of them, zero means
+     as many as bitstream buffer space allows) get fed into bitstream buffer,
+     so that next decode doesn't wait for feeding. Packs fed are past dropping,
+     so this adds to latency of dropping policies. Packs have to be there to
+     get fed, so producer should keep the queue number_of_packs + 1 complete
+     packs deep. Off (zero packs) by default.
+
+     Pack that doesn't fit into free bitstream buffer space is only fed in
+     part (and the rest on later steps) with feed-ahead on, as then packs
+     decoded before it free the space. Without feed-ahead, it is refused as
+     a feed error */
+    void set_feed_ahead(size_t number_of_packs, size_t number_of_bytes = 0)
+    {
+        m_feed_ahead_packs = number_of_packs;
+        m_feed_ahead_bytes = number_of_bytes;
+    }
 
-    bool is_closed() const
+    size_t get_feed_ahead() const
+    {
+        return m_feed_ahead_packs;
+    }
+
+    /* Keyframes only: packs that can't reopen decoding (inter frames) are
+     dropped before decode, and only keyframes (IDR frames in h264) get
+     decoded, by session with one reference frame and no reordering - for
+     thumbnails and such, which refresh once in a while and shouldn't hold
+     a full set of DMA frames. Session opened for the other mode doesn't
+     fit, so change reopens the decoder with next pack that can reopen
+     decoding. Off by default */
+    void set_keyframes_only(bool keyframes_only)
+    {
+        m_keyframes_only = keyframes_only;
+    }
+
+    bool is_keyframes_only() const
+    {
+        return m_keyframes_only;
+    }
+
+    /* Degradation ladder decoder is on: each DMA allocation failure on
+     (re)opening takes it a step down, first shrinking display reserve, then
+     freeing idle frames other decoders gave back to the shared pool, then
+     going keyframes only. Failure after that leaves it STARVED - it keeps
+     opening keyframes only sessions, but users having other engine (see
+     DecoderPlacement::migrate()) should move the stream there. Every
+     VPU_MEMORY_PRESSURE_RETRY_PERIOD it tries a step back up, with next pack
+     that can reopen decoding, so it gets back to full settings once memory
+     frees up. Step up closes the session that worked, so when it fails
+     (decoder can't open and decode at the level above) the period doubles,
+     up to VPU_MEMORY_PRESSURE_MAX_RETRY_PERIOD, until one succeeds. Steps are
+     logged and counted in the stats */
+    VPUMemoryPressure get_memory_pressure() const
+    {
+        return m_memory_pressure;
+    }
+
+    bool is_memory_starved() const
+    {
+        return VPUMemoryPressure::STARVED == m_memory_pressure;
+    }
+
+    /* Callback is called during each step, while VPU decodes the frame, so
+     that user can get some CPU work done meanwhile - for example parse data
+     of other streams, see VPUBusyCallback. Give nullptr to disable */
+    void set_busy_callback(const VPUBusyCallback &callback) override
+    {
+        m_busy_callback = callback;
+    }
+
+    bool is_closed() const override
     {
         return !m_session.get();
     }
 
-    const DecodingStats &get_stats() const
+    /* Counters and stage latency histograms, cheap enough to be kept up to
+     date all the time, so can be pulled whenever user needs them. See also
+     DecodingStats::print_summary() */
+    const DecodingStats &get_stats() const override
     {
         return m_stats;
     }
 
-    size_t get_number_of_frames_given() const
+    /* Starts stats over, for example to look at given period of playback.
+     Buffer sizes and DMA usage are only set again on reopening */
+    void reset_stats() override
+    {
+        m_stats = DecodingStats();
+        m_stats.memory_pressure_level = (size_t)m_memory_pressure;
+    }
+
+    size_t get_number_of_frames_given() const override
     {
         return m_frames_given;
     }
 
+    bool is_hardware() const override
+    {
+        return true;
+    }
+
 private:
     VPUOutputFrame step_implementation(PackQueue &queue, PackPurpose purpose);
-    bool check_for_reopening(const Pack &pack) const;
-    bool feed_and_decode(PackQueue &queue, VPUOutputFrame &output,
-                         bool allow_for_incomplete_data);
+    /* Split of the above for async steps */
+    bool begin_step_implementation(PackQueue &queue, PackPurpose purpose);
+    void finish_step_implementation(PackQueue &queue, VPUOutputFrame &output);
+    void end_step(const PackQueue &queue, const VPUOutputFrame &output);
+    bool begin_flush();
+    VPUOutputFrame finish_flush();
+    bool check_for_reopening(const Pack &pack, bool verbose = true) const;
+    void prewarm_for_reopening(const PackQueue &queue);
+    size_t get_display_frames(const Pack &pack) const
+    {
+        size_t frames = pack.m_low_latency ? m_low_latency_display_frames : m_display_frames;
+        if ((m_memory_pressure >= VPUMemoryPressure::SHRUNK_RESERVE)
+            && (frames > VPU_MEMORY_PRESSURE_DISPLAY_FRAMES)) {
+            return VPU_MEMORY_PRESSURE_DISPLAY_FRAMES;
+        }
+        return frames;
+    }
+    /* Set by user, or by memory pressure */
+    bool decodes_keyframes_only() const
+    {
+        return m_keyframes_only || (m_memory_pressure >= VPUMemoryPressure::KEYFRAMES_ONLY);
+    }
+    /* Rotation or tiled frames, either has frames given away written by
+     post-processing stage */
+    bool uses_post_processing() const
+    {
+        return m_rotation.is_enabled() || (VPUFrameLayout::TILED == m_frame_layout);
+    }
+    /* Display frames session itself needs, with post-processing frames given
+     away are rotator's and decoder's own ones are returned right away */
+    size_t get_session_display_frames(const Pack &pack) const
+    {
+        return uses_post_processing() ? 1 : get_display_frames(pack);
+    }
+    /* Keyframes refer to nothing, but VPU still needs a frame to decode
+     into */
+    size_t get_session_reference_frames(const Pack &pack) const
+    {
+        return decodes_keyframes_only() ? 1 : pack.m_maximum_number_of_reference_frames;
+    }
+    bool get_session_reordering(const Pack &pack) const
+    {
+        return !decodes_keyframes_only() && pack.m_needs_reordering;
+    }
+    void step_memory_pressure_down();
+    void step_memory_pressure_up(const Pack &pack);
+    bool settle_stream_end(PackQueue &queue, size_t index, bool now);
+    bool feed_and_start_decode(PackQueue &queue);
+    bool finish_decode(PackQueue &queue, VPUOutputFrame &output);
     bool feed_frame(PackQueue &queue);
+    bool feed_frame_coalesced(PackQueue &queue, size_t total_size);
+    bool write_coalesced(PackQueue &queue, size_t index, size_t total_size);
+    void feed_ahead(PackQueue &queue);
+    bool wait_for_bitstream_space(const Pack &pack, size_t size_fed);
+    bool feed_chunk(const VideoChunk &chunk, size_t &size_fed);
+    void skip_fed_parameter_sets(PackQueue &queue, size_t index);
 };
 }
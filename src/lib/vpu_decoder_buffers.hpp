@@ -8,6 +8,9 @@
 #pragma once
 
 #include <string.h>
+
+#include "codec_common.hpp"
+
 extern "C" {
 #include <vpu_io.h>
 #include <vpu_lib.h>
@@ -37,6 +40,9 @@ namespace airtame {
 
 #define VPU_DEC_VP8_MB_PRED_BUFFER_SIZE (68 * (1920 * 1088 / 256))
 
+/* Bitstream buffer sized from stream parameters is never smaller than this */
+#define VPU_MIN_BITSTREAM_BUFFER_SIZE (256 * 1024)
+
 // TODO: cleanup "growing" of bitstream buffer, maybe add panicking in the
 // decoding session instead
 
@@ -45,6 +51,10 @@ private:
     /* Size of bitstream buffer to create during next allocation */
     size_t m_wanted_bitstream_buffer_size;
 
+    /* Same, but for buffers sized from stream parameters - this one is only
+     set when stream turned out to need more than these parameters said */
+    size_t m_demanded_bitstream_buffer_size = 0;
+
     /* Bitstream buffer, commont to all decoders (H264, VP8, ...) */
     vpu_mem_desc m_bitstream_buffer;
 
@@ -73,57 +83,85 @@ public:
         get_rid_of_buffer(m_mb_prediction_buffer);
     }
 
-    // TODO: make sure that it is safe to call init_for_h264 and then init_for_vp8
-    // (release old buffers first)
-
+    /* These two allocate buffers for Full HD streams (or bigger bitstream
+     buffer, if update_wanted_bitstream_buffer_size() asked for it). Buffers
+     allocated before are reused if they are of right size, released
+     otherwise, so it is safe to call these one after another */
     bool init_for_h264()
     {
-        /* Make sure we release any VP8 buffers */
-        get_rid_of_buffer(m_mb_prediction_buffer);
         /* Make sure m_wanted_bitstream_buffer_size is padded - it cannot be
          just any size */
         m_wanted_bitstream_buffer_size = pad_buffer_size(m_wanted_bitstream_buffer_size);
-        /* Bitstream we need to allocate and map, because process needs to
-         feed video data there. */
-        get_and_map_buffer(m_bitstream_buffer, m_wanted_bitstream_buffer_size);
-
-        /* Remaining buffers just have to be allocated, VPU will use them,
-         CPU won't */
-        m_ps_save_buffer.size = VPU_PS_SAVE_BUFFER_SIZE;
-        if (RETCODE_FAILURE == IOGetPhyMem(&m_ps_save_buffer)) {
-            /* No ps save buffer, no h264 decoding */
-            return false;
-        }
-
-        m_slice_buffer.size = VPU_MAX_SLICE_BUFFER_SIZE;
-        if (RETCODE_FAILURE == IOGetPhyMem(&m_slice_buffer)) {
-            /* Again, cannot decode without ps save buffer */
-            return false;
-        }
-        return true;
+        return init_h264_buffers(m_wanted_bitstream_buffer_size, VPU_MAX_SLICE_BUFFER_SIZE);
     }
 
     bool init_for_vp8()
     {
-        /* Make sure we release any h264 buffers */
-        get_rid_of_buffer(m_ps_save_buffer);
-        get_rid_of_buffer(m_slice_buffer);
-        /* Make sure m_wanted_bitstream_buffer_size is padded - it cannot be
-         just any size */
         m_wanted_bitstream_buffer_size = pad_buffer_size(m_wanted_bitstream_buffer_size);
-        /* Bitstream we need to allocate and map, because process needs to
-         feed video data there. */
-        get_and_map_buffer(m_bitstream_buffer, m_wanted_bitstream_buffer_size);
+        return init_vp8_buffers(m_wanted_bitstream_buffer_size, VPU_DEC_VP8_MB_PRED_BUFFER_SIZE);
+    }
+
+    /* These size the buffers for given stream instead, and so save quite some
+     DMA memory for streams smaller than Full HD:
+     - Bitstream buffer follows the same idea as Full HD size above (no use
+     of video compression making things bigger than one decoded frame) but for
+     h264 it is also limited to two coded pictures of the biggest size SPS
+     level allows (see at_h264_get_max_coded_picture_size(), zero if not
+     known). Streams that don't follow their level can make it grow, see
+     demand_bitstream_buffer_size()
+     - Slice buffer is half a decoded frame size, as VPU documentation
+     recommends (see VPU_MAX_SLICE_BUFFER_SIZE)
+     - VP8 macroblock prediction buffer takes 68 bytes per macroblock
+     - PS save buffer doesn't depend on the frame size */
+    bool init_for_h264(const FrameGeometry &geometry, size_t max_coded_picture_size)
+    {
+        size_t frame_size = geometry.m_padded_width * geometry.m_padded_height * 3 / 2;
+        size_t bitstream_buffer_size = frame_size;
+        if (max_coded_picture_size && (2 * max_coded_picture_size < bitstream_buffer_size)) {
+            bitstream_buffer_size = 2 * max_coded_picture_size;
+        }
+        return init_h264_buffers(get_bitstream_buffer_size_for(bitstream_buffer_size),
+                                 pad_buffer_size(frame_size / 2));
+    }
+
+    bool init_for_vp8(const FrameGeometry &geometry)
+    {
+        size_t frame_size = geometry.m_padded_width * geometry.m_padded_height * 3 / 2;
+        size_t mbs = (geometry.m_padded_width / 16) * (geometry.m_padded_height / 16);
+        return init_vp8_buffers(get_bitstream_buffer_size_for(frame_size),
+                                pad_buffer_size(68 * mbs));
+    }
 
-        /* Remaining buffers just have to be allocated, VPU will use them,
-         CPU won't */
-        m_mb_prediction_buffer.size = VPU_DEC_VP8_MB_PRED_BUFFER_SIZE;
-        if (RETCODE_FAILURE == IOGetPhyMem(&m_mb_prediction_buffer)) {
+    /* Called with size of data that is about to be fed. If it could leave too
+     little space in bitstream buffer, buffer should be bigger on next
+     init_for_*(). Returns true if this demanded more than before */
+    bool demand_bitstream_buffer_size(size_t size)
+    {
+        if (2 * size <= (size_t)m_bitstream_buffer.size) {
+            return false;
+        }
+        size_t demanded_size = pad_buffer_size(4 * size);
+        if (demanded_size <= m_demanded_bitstream_buffer_size) {
             return false;
         }
+        m_demanded_bitstream_buffer_size = demanded_size;
         return true;
     }
 
+    bool should_reallocate_bitstream_buffer() const
+    {
+        return m_demanded_bitstream_buffer_size > (size_t)m_bitstream_buffer.size;
+    }
+
+    /* Sizes of all the buffers, for stats */
+    void update_stats(DecodingStats &stats) const
+    {
+        stats.bitstream_buffer_size = m_bitstream_buffer.size;
+        stats.slice_buffer_size = m_slice_buffer.size;
+        stats.ps_save_buffer_size = m_ps_save_buffer.size;
+        stats.mb_prediction_buffer_size = m_mb_prediction_buffer.size;
+    }
+
     void update_wanted_bitstream_buffer_size(size_t chunk_size)
     {
         /* Traditional "allocate twice as much" approach */
@@ -173,6 +211,54 @@ public:
     }
 
 private:
+    bool init_h264_buffers(size_t bitstream_buffer_size, size_t slice_buffer_size)
+    {
+        /* Make sure we release any VP8 buffers */
+        get_rid_of_buffer(m_mb_prediction_buffer);
+        /* Bitstream we need to allocate and map, because process needs to
+         feed video data there. Remaining buffers just have to be allocated,
+         VPU will use them, CPU won't. No h264 decoding without any of these */
+        return ensure_buffer(m_bitstream_buffer, bitstream_buffer_size, true)
+            && ensure_buffer(m_ps_save_buffer, VPU_PS_SAVE_BUFFER_SIZE, false)
+            && ensure_buffer(m_slice_buffer, slice_buffer_size, false);
+    }
+
+    bool init_vp8_buffers(size_t bitstream_buffer_size, size_t mb_prediction_buffer_size)
+    {
+        /* Make sure we release any h264 buffers */
+        get_rid_of_buffer(m_ps_save_buffer);
+        get_rid_of_buffer(m_slice_buffer);
+        return ensure_buffer(m_bitstream_buffer, bitstream_buffer_size, true)
+            && ensure_buffer(m_mb_prediction_buffer, mb_prediction_buffer_size, false);
+    }
+
+    size_t get_bitstream_buffer_size_for(size_t size) const
+    {
+        if (size < VPU_MIN_BITSTREAM_BUFFER_SIZE) {
+            size = VPU_MIN_BITSTREAM_BUFFER_SIZE;
+        }
+        if (size < m_demanded_bitstream_buffer_size) {
+            size = m_demanded_bitstream_buffer_size;
+        }
+        return pad_buffer_size(size);
+    }
+
+    /* Keeps buffer if it has the size already, otherwise gets new one */
+    bool ensure_buffer(vpu_mem_desc &buffer, size_t size, bool map)
+    {
+        if (buffer.phy_addr && ((size_t)buffer.size == size)) {
+            return true;
+        }
+        if (!get_rid_of_buffer(buffer)) {
+            return false;
+        }
+        if (map) {
+            return get_and_map_buffer(buffer, size);
+        }
+        buffer.size = size;
+        return RETCODE_FAILURE != IOGetPhyMem(&buffer);
+    }
+
     bool get_and_map_buffer(vpu_mem_desc &buffer, size_t size)
     {
         buffer.size = size;
@@ -202,12 +288,13 @@ private:
                 return false;
             }
         }
+        ::memset(&buffer, 0, sizeof(buffer));
         return true;
     }
     /* So I couldn't any authoritative source as what bitstream buffer size
      quant should be, but it works with 4K and it happens to be page size
      which is what mmap() can give us anyway... */
-    size_t pad_buffer_size(size_t size)
+    static size_t pad_buffer_size(size_t size)
     {
         size &= ~4095;
         return (size + 4096);
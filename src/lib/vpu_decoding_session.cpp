@@ -8,6 +8,7 @@
 #include <chrono>
 #include <assert.h>
 #include <string.h>
+#include "trace.hpp"
 #include "vpu_decoding_session.hpp"
 
 /* Milliseconds to wait for frame completion. Not sure what is sensible value
@@ -37,11 +38,14 @@ VPUDecodingSession::VPUDecodingSession(CodecLogger &logger, DecodingStats &stats
     , m_reordering(reordering)
     , m_handle(nullptr)
     , m_initial_info_retrieved(false)
+    , m_monitoring(buffers.get_bitstream_buffer().size)
 {
+    TRACE_INSTANT("session_open", nullptr, (int64_t)frame_geometry.m_true_width);
 }
 
 VPUDecodingSession::~VPUDecodingSession()
 {
+    TRACE_INSTANT("session_close");
     /* We log errors here but ignore them - this can be called with decoder
      in a mess state anyway, so what we can do? */
     if (m_handle) {
@@ -69,7 +73,9 @@ VPUDecodingSession *VPUDecodingSession::open_for_video(CodecLogger &logger,
                                                        const FrameGeometry &frame_geometry,
                                                        size_t number_of_reference_frame_buffers,
                                                        size_t number_of_display_frame_buffers,
-                                                       bool reordering)
+                                                       bool reordering,
+                                                       size_t max_coded_frame_size,
+                                                       VPUFrameLayout frame_layout)
 {
     /* Verify geometry. Specs say that i.mx6 can decode all video codecs "up to
      1920x1088". But this shouldn't be taken as width/height limit - we know for
@@ -92,35 +98,60 @@ VPUDecodingSession *VPUDecodingSession::open_for_video(CodecLogger &logger,
         return nullptr;
     }
 
+    /* Fast open: frames needed are known from the pack (our parsers get
+     geometry and reference frames out of SPS or VP8 keyframe), so their
+     allocation starts right away in the background (see
+     VPUFrameBuffers::prewarm()), while decoder buffers get allocated, decoder
+     opened and first pack fed. VPU still insists on initial info before
+     frames get registered, start_video_decoding() then only checks it */
+    auto opened = std::chrono::steady_clock::now();
+    if ((CodecType::H264 == codec_type) || (CodecType::VP8 == codec_type)) {
+        frames.prewarm(get_frame_size(codec_type, frame_geometry, frame_layout),
+                       number_of_reference_frame_buffers + number_of_display_frame_buffers);
+    }
+
     CodStd bitstream_format;
     const char *codec;
+    bool buffers_ready;
     if (CodecType::H264 == codec_type) {
         bitstream_format = STD_AVC;
         codec = "h264";
-        buffers.init_for_h264();
+        buffers_ready = buffers.init_for_h264(frame_geometry, max_coded_frame_size);
     } else if (CodecType::VP8 == codec_type) {
         bitstream_format = STD_VP8;
         codec = "VP8";
-        buffers.init_for_vp8();
+        buffers_ready = buffers.init_for_vp8(frame_geometry);
     } else {
         codec_log_error(logger, "Unknown codec type");
         codec = "unknown";
         return nullptr;
     }
 
+    if (!buffers_ready) {
+        ++stats.number_of_dma_allocation_failures;
+        codec_log_error(logger, "Couldn't allocate decoder buffers - exhausted "
+                                "DMA memory?");
+        return nullptr;
+    }
+    buffers.update_stats(stats);
+    codec_log_info(logger, "Bitstream buffer %.2fMB, slice buffer %.2fMB",
+                   (double)buffers.get_bitstream_buffer().size / (1024 * 1024),
+                   (double)buffers.get_slice_buffer().size / (1024 * 1024));
+
     /* We expect bitstream buffer to be mapped to process address space */
     assert(buffers.get_bitstream_buffer().virt_uaddr);
 
     /* First thing is to open decoder. This is where we decide on bitstream
      format, reordering and also pass in buffers */
     DecHandle handle = open_decoder(buffers, bitstream_format, frame_geometry,
-                                    reordering);
+                                    reordering, frame_layout);
     if (handle) {
         /* Previous version didn't have this log, but it really helps when looking
          for issues, so I am adding it back */
-        codec_log_info(logger, "Decoder opened in %s mode, true frame size %zux%zu%s",
+        codec_log_info(logger, "Decoder opened in %s mode, true frame size %zux%zu%s%s",
                        codec, frame_geometry.m_true_width, frame_geometry.m_true_height,
-                       reordering ? ", reordering enabled" : "");
+                       reordering ? ", reordering enabled" : "",
+                       (VPUFrameLayout::TILED == frame_layout) ? ", tiled frames" : "");
     } else {
         codec_log_error(logger, "Couldn't open new decoder instance. This "
                                 "usually meants that vpu_Init() wasn't called");
@@ -133,6 +164,8 @@ VPUDecodingSession *VPUDecodingSession::open_for_video(CodecLogger &logger,
                                  frame_geometry, number_of_reference_frame_buffers,
                                  number_of_display_frame_buffers, reordering);
     new_session->m_handle = handle;
+    new_session->m_open_time = opened;
+    new_session->m_frame_layout = frame_layout;
 
     /* That is all */
     return new_session;
@@ -142,6 +175,19 @@ bool VPUDecodingSession::decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstrea
                                      VPUDMAPointer frame,
                                      const FrameGeometry &frame_geometry,
                                      bool interleave)
+{
+    DecHandle handle = open_jpeg(logger, interleave);
+    if (!handle) {
+        return false;
+    }
+    bool decoded = start_jpeg(logger, handle, bitstream, bitstream->size, frame,
+                              frame_geometry, interleave)
+        && finish_jpeg(logger, handle);
+    vpu_DecClose(handle);
+    return decoded;
+}
+
+DecHandle VPUDecodingSession::open_jpeg(CodecLogger &logger, bool interleave)
 {
     DecHandle handle;
     DecOpenParam open_param;
@@ -154,15 +200,26 @@ bool VPUDecodingSession::decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstrea
     if (RETCODE_SUCCESS != vpu_DecOpen(&handle, &open_param)) {
         /* Now if that doesn't work, not much we can do */
         codec_log_error(logger, "vpu_DecOpen() failed");
-        return false;
+        return nullptr;
     }
+    return handle;
+}
 
+bool VPUDecodingSession::start_jpeg(CodecLogger &logger, DecHandle handle,
+                                    VPUDMAPointer bitstream, size_t size,
+                                    VPUDMAPointer frame,
+                                    const FrameGeometry &frame_geometry, bool interleave)
+{
     FrameBuffer frame_buffer = prepare_nv12_frame_buffer_template(frame_geometry);
-    size_t size = frame_buffer.bufMvCol;
-    if (size != (size_t)frame->size) {
+    size_t frame_size = frame_buffer.bufMvCol;
+    if (frame_size != (size_t)frame->size) {
         codec_log_error(logger, "Bad output JPEG frame size");
         return false;
     }
+    if (!size || (size > (size_t)bitstream->size)) {
+        codec_log_error(logger, "Bad JPEG bitstream size");
+        return false;
+    }
 
     frame_buffer.bufY += frame->phy_addr;
     /* Regardless of interleave or not, Cb starts in the same position */
@@ -193,7 +250,8 @@ bool VPUDecodingSession::decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstrea
 
     /* The framebuffer array isn't used when decoding motion JPEG data.
      * Instead, the user has to manually specify a framebuffer for the
-     * output by sending the SET_ROTATOR_OUTPUT command. */
+     * output by sending the SET_ROTATOR_OUTPUT command. This is done for
+     * every image, so that each can go to different frame */
     if (RETCODE_SUCCESS != vpu_DecGiveCommand(handle, SET_ROTATOR_OUTPUT,
                                               (void *)&frame_buffer)) {
         codec_log_error(logger, "Cant instruct rotator to use our frame for output");
@@ -211,8 +269,9 @@ bool VPUDecodingSession::decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstrea
 
     /* There is an error in the specification. It states that chunkSize
      * is not used in the i.MX6. This is untrue; for motion JPEG, this
-     * must be nonzero. */
-    params.chunkSize = bitstream->size;
+     * must be nonzero. Bitstream buffers can be reused for smaller images,
+     * so it is size of the image, not the buffer */
+    params.chunkSize = size;
 
     /* Set the virtual and physical memory pointers that point to the
      * start of the frame. These always point to the beginning of the
@@ -229,13 +288,15 @@ bool VPUDecodingSession::decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstrea
         DecOutputInfo output_info;
         ::memset(&output_info, 0, sizeof(output_info));
         vpu_DecGetOutputInfo(handle, &output_info);
-        vpu_DecClose(handle);
         return false;
     }
+    return true;
+}
 
+bool VPUDecodingSession::finish_jpeg(CodecLogger &logger, DecHandle handle)
+{
     int decoded_index, display_index; /* Not used here */
     VPUDecodeStatus status = wait_for_decode(logger, handle, decoded_index, display_index);
-    vpu_DecClose(handle);
     // TODO: perhaps should check if status flags are set properly - not sure
     // which ones should be for JPEG
     return (VPUDecodeStatus::ERROR & status) ? false : true;
@@ -303,24 +364,90 @@ FrameBuffer VPUDecodingSession::prepare_nv12_frame_buffer_template(const FrameGe
     return frame_buffer;
 }
 
+/* Frame map addresses VPU takes are 4KB pages, so planes start on page
+ boundaries. Luma rows go in tiles 32 lines high (two macroblock rows, chroma
+ tiles are half that), so padded height is made multiple of that. Strides are
+ still in bytes of a row, as for linear frames */
+FrameBuffer VPUDecodingSession::prepare_tiled_frame_buffer_template(const FrameGeometry &frame_geometry)
+{
+    FrameBuffer frame_buffer;
+    size_t height = (frame_geometry.m_padded_height + 31) & ~(size_t)31;
+    size_t y_size = (frame_geometry.m_padded_width * height + 0xfff) & ~(size_t)0xfff;
+    size_t cbcr_size = (frame_geometry.m_padded_width * height / 2 + 0xfff) & ~(size_t)0xfff;
+
+    ::memset(&frame_buffer, 0, sizeof(frame_buffer));
+    frame_buffer.strideY = frame_geometry.m_padded_width;
+    frame_buffer.strideC = frame_geometry.m_padded_width;
+    frame_buffer.bufY = 0;
+    frame_buffer.bufCb = y_size;
+    frame_buffer.bufCr = y_size;
+    frame_buffer.bufMvCol = y_size + cbcr_size;
+    return frame_buffer;
+}
+
+size_t VPUDecodingSession::get_frame_size(CodecType codec_type, const FrameGeometry &frame_geometry,
+                                          VPUFrameLayout frame_layout)
+{
+    /* Size of frame equals offset to colocated motion vector data, because
+     normal codecs don't use it */
+    size_t frame_size = (VPUFrameLayout::TILED == frame_layout)
+        ? prepare_tiled_frame_buffer_template(frame_geometry).bufMvCol
+        : prepare_nv12_frame_buffer_template(frame_geometry).bufMvCol;
+    if (CodecType::H264 == codec_type) {
+        /* Except for H264, where we also have to take collocated motion vector
+         data into account (technically only when B-frames are present, but only
+         for Baseline profile we have guarantee that there won't be any, also
+         buffer overrun in DMA memory is dangerous) */
+        frame_size += frame_geometry.m_padded_width * frame_geometry.m_padded_height / 4;
+    }
+    return frame_size;
+}
+
 VPUDMAPointer VPUDecodingSession::allocate_dma(size_t size)
 {
-    vpu_mem_desc *dma = new vpu_mem_desc();
+    vpu_mem_desc *dma = dma_allocate(size);
     if (!dma) {
         return VPUDMAPointer(nullptr);
     }
-    ::memset(dma, 0, sizeof(vpu_mem_desc));
-    dma->size = size;
-    if (RETCODE_FAILURE == IOGetPhyMem(dma)) {
-        delete dma;
-        return VPUDMAPointer(nullptr);
-    }
     return VPUDMAPointer(dma, dma_pointer_deleter);
 }
 
 /* Data comes in three parts, because for H264 we may want to feed SPS/PPS/Slice
- and for VP8 we feed IVF header/frame */
+ and for VP8 we feed IVF header/frame. This is the "memcpy" path, for data
+ that already sits somewhere in process memory, built on top of zero-copy
+ reserve()/commit() below */
 bool VPUDecodingSession::feed(const unsigned char *data, size_t size, size_t &size_fed)
+{
+    size_fed = 0;
+    /* Write the bytes to the bitstream buffer, either in one, or in two steps
+     (when wrapping around the end of buffer) */
+    while (size) {
+        unsigned char *window;
+        size_t window_size;
+        if (!reserve(size, window, window_size)) {
+            return false;
+        }
+        if (!window_size) {
+            /* No space left in buffer. Complain only if we managed to push
+             part of the data, this is when caller gets truncated chunk */
+            if (size_fed) {
+                codec_log_warn_limited(m_logger, "Not enough space on bitstream input buffer");
+            }
+            return true;
+        }
+        ::memcpy(window, data, window_size);
+        if (!commit(window_size)) {
+            return false;
+        }
+        size_fed += window_size;
+        data += window_size;
+        size -= window_size;
+    }
+
+    return true;
+}
+
+bool VPUDecodingSession::reserve(size_t size, unsigned char *&window, size_t &window_size)
 {
     PhysicalAddress read_ptr, write_ptr;
     Uint32 num_free_bytes;
@@ -330,46 +457,43 @@ bool VPUDecodingSession::feed(const unsigned char *data, size_t size, size_t &si
         return false;
     }
 
-    if (!num_free_bytes) {
-        /* No space left in buffer */
-        size_fed = 0;
-        return true;
+    /* Have to convert write_ptr, which is physical memory address into offset
+     we then can use to address logical memory */
+    size_t write_offset = write_ptr - m_buffers.get_bitstream_buffer().phy_addr;
+    size_t num_free_bytes_at_end = m_buffers.get_bitstream_buffer().size - write_offset;
+
+    /* Make sure we don't give away more than is free, or more than we have
+     until the end of the buffer */
+    window_size = size;
+    if (window_size > num_free_bytes) {
+        window_size = num_free_bytes;
     }
-
-    if (size > num_free_bytes) {
-        /* Make sure we don't try to push too much */
-        codec_log_warn(m_logger, "Not enough space on bitstream input buffer");
-        size = num_free_bytes;
+    if (window_size > num_free_bytes_at_end) {
+        window_size = num_free_bytes_at_end;
     }
 
-    size_t write_offset, num_free_bytes_at_end, num_bytes_to_push;
+    window = (unsigned char *)m_buffers.get_bitstream_buffer().virt_uaddr + write_offset;
+    m_reserved_size = window_size;
+    m_reserved_offset = write_offset;
+    return true;
+}
 
-    /* Have to convert write_ptr, which is physical memory address into offset
-     we then can use to address logical memory */
-    write_offset = write_ptr - m_buffers.get_bitstream_buffer().phy_addr;
-    num_free_bytes_at_end = m_buffers.get_bitstream_buffer().size - write_offset;
-    num_bytes_to_push = (num_free_bytes_at_end < size) ? num_free_bytes_at_end : size;
-
-    /* Write the bytes to the bitstream buffer, either in one, or in two steps */
-    ::memcpy((char *)m_buffers.get_bitstream_buffer().virt_uaddr + write_offset,
-             data, num_bytes_to_push);
-    if (RETCODE_SUCCESS != vpu_DecUpdateBitstreamBuffer(m_handle, num_bytes_to_push)) {
+bool VPUDecodingSession::commit(size_t size)
+{
+    assert(size <= m_reserved_size);
+    m_reserved_size = 0;
+    if (!size) {
+        /* Careful here - updating bitstream buffer with zero bytes means end
+         of stream to the decoder, and that is not what user wants */
+        return true;
+    }
+    if (RETCODE_SUCCESS != vpu_DecUpdateBitstreamBuffer(m_handle, size)) {
         codec_log_error(m_logger, "Failed vpu_DecUpdateBitstreamBuffer");
         return false;
     }
-    size_fed = num_bytes_to_push;
-    data += num_bytes_to_push;
-    size -= num_bytes_to_push;
-    if (size) {
-        /* Wrap-around, copy remaining part to the begin of bitstream buffer */
-        ::memcpy((void *)m_buffers.get_bitstream_buffer().virt_uaddr, data, size);
-        if (RETCODE_SUCCESS != vpu_DecUpdateBitstreamBuffer(m_handle, size)) {
-            codec_log_error(m_logger, "Failed vpu_DecUpdateBitstreamBuffer");
-            return false;
-        }
-        size_fed += size;
+    if (!m_monitoring.push_chunk(m_reserved_offset, size, m_feed, m_feed_meta)) {
+        codec_log_warn(m_logger, "Too many chunks in bitstream buffer, oldest one forgotten");
     }
-
     return true;
 }
 
@@ -399,8 +523,28 @@ bool VPUDecodingSession::get_bitstream_buffer_free_space_available(size_t &size)
     return true;
 }
 
+bool VPUDecodingSession::enable_rotation(const VPURotation &rotation, size_t number_of_frames)
+{
+    assert(!m_initial_info_retrieved);
+    if (!rotation.is_valid()) {
+        codec_log_error(m_logger, "Rotation by %d degrees not supported", rotation.angle);
+        return false;
+    }
+    m_rotator.reset(new VPURotator(m_logger, rotation, m_frame_geometry));
+    if (!m_rotator->allocate(number_of_frames)) {
+        ++m_stats.number_of_dma_allocation_failures;
+        m_rotator.reset();
+        return false;
+    }
+    return true;
+}
+
 bool VPUDecodingSession::has_frame_for_decoding() const
 {
+    if (m_rotator && !m_rotator->has_frame_for_decoding()) {
+        /* Decoder could decode, but nothing to give decoded frame away in */
+        return false;
+    }
     if (m_frames.get_number_of_display_frame_buffers()) {
         /* Already have allocated frames, can say how many are left */
         return m_frames.has_frame_for_decoding();
@@ -413,6 +557,9 @@ bool VPUDecodingSession::has_frame_for_decoding() const
 
 void VPUDecodingSession::return_output_frame(unsigned long physical_address)
 {
+    if (m_rotator && m_rotator->mark_frame_as_returned(physical_address)) {
+        return;
+    }
     m_frames.mark_frame_as_returned(physical_address);
 }
 
@@ -422,9 +569,21 @@ bool VPUDecodingSession::is_busy()
     return vpu_IsBusy();
 }
 
-VPUDecodeStatus VPUDecodingSession::decode_video(const std::shared_ptr<FrameMetaData> &meta,
-                                                 VPUOutputFrame &output_frame)
+VPUDecodeStatus VPUDecodingSession::decode_video(const FrameMeta &meta,
+                                                 VPUOutputFrame &output_frame,
+                                                 const VPUBusyCallback &busy_callback)
 {
+    VPUDecodeStatus status;
+    if (!begin_decode_video(status)) {
+        return status;
+    }
+    run_busy_callback(busy_callback);
+    return finish_decode_video(meta, output_frame);
+}
+
+bool VPUDecodingSession::begin_decode_video(VPUDecodeStatus &status)
+{
+    assert(!m_decoding);
     /* IMPORTANT: in theory, VPU should just return apropriate status when
      one starts decoding and no frame is available. BUT we found out (the hard
      way) that for some VP8 streams using more reference frames (not just
@@ -434,13 +593,25 @@ VPUDecodeStatus VPUDecodingSession::decode_video(const std::shared_ptr<FrameMeta
      one frame for decoding before entering decode. */
     if (!has_frame_for_decoding()) {
         /* This is not decoder error */
-        return VPUDecodeStatus::NO_FREE_OUTPUT_BUFFER;
+        status = VPUDecodeStatus::NO_FREE_OUTPUT_BUFFER;
+        return false;
     }
 
     /* Start the VPU decoding process */
     if (!start_video_decoding()) {
-        return VPUDecodeStatus::ERROR;
+        status = VPUDecodeStatus::ERROR;
+        return false;
     }
+    m_decoding = true;
+    status = VPUDecodeStatus::NOTHING;
+    return true;
+}
+
+VPUDecodeStatus VPUDecodingSession::finish_decode_video(const FrameMeta &meta,
+                                                        VPUOutputFrame &output_frame)
+{
+    assert(m_decoding);
+    m_decoding = false;
 
     /* Wait for decode to finish */
     /* IMPORTANT: note that status may contain FRAME_DECODED or not and both can
@@ -460,6 +631,21 @@ VPUDecodeStatus VPUDecodingSession::decode_video(const std::shared_ptr<FrameMeta
     return wait_for_video_decode(meta, output_frame);
 }
 
+void VPUDecodingSession::run_busy_callback(const VPUBusyCallback &busy_callback)
+{
+    /* Let the user do something useful while VPU is busy. If VPU was done
+     before the callback returned, it was idle for a while - worth knowing
+     when tuning how much work callback does */
+    if (busy_callback && is_busy()) {
+        auto before = std::chrono::steady_clock::now();
+        busy_callback();
+        m_stats.busy_work_latency.add_usec_since(before);
+        if (!is_busy()) {
+            ++m_stats.number_of_busy_work_overruns;
+        }
+    }
+}
+
 /* Instruct VPU to start decoding a frame.
  WARNING: decoding is asynchronous, and with bistream mode we set in
  open_decoder, it won't end if bistream buffer doesn't contain whole frame (or
@@ -501,18 +687,18 @@ bool VPUDecodingSession::start_video_decoding()
             return false;
         }
 
-        // TODO: not so simple, because we check number of reference frames in
-        // vpu_decoder. But we seem to get 2 frames less and stuff works...WTF?
-/*        if ((size_t)initial_info.minFrameBufferCount > m_number_of_reference_frame_buffers) {
-            codec_log_warn(m_logger, "Decoder wants %zu reference frames, we only "
-                                     "have %zu. Will correct it here but something's "
-                                     "fishy",
-                           initial_info.minFrameBufferCount, m_number_of_reference_frame_buffers);
-            m_number_of_reference_frame_buffers = initial_info.minFrameBufferCount;
-        }*/
+        if (!check_initial_info(initial_info)) {
+            return false;
+        }
+
+        /* vpu_DecRegisterFrameBuffer() refuses fewer frames (reference and
+         display ones together) than this. Stream parameters normally ask for
+         more anyway, but keyframes only sessions are opened with one
+         reference frame, see allocate_frames() */
+        m_minimum_number_of_frame_buffers = initial_info.minFrameBufferCount;
 
         /* Now that the decoder is happy we got initial info out of it, we can
-         allocate frames for the decoding */
+         register frames for the decoding (allocated by now, or nearly so) */
         if (!allocate_frames()) {
             return false;
         }
@@ -521,7 +707,8 @@ bool VPUDecodingSession::start_video_decoding()
     assert(!is_busy());
 
     /* Return frames now, because we are sure decoder isn't working. When it
-     works, it ignores returning of the frames. */
+     works, it ignores returning of the frames. Ones queued since last decode
+     (see VPUFrameBuffers::queue_return()) go along */
     if (!m_frames.return_frames_now(m_handle)) {
         return false;
     }
@@ -536,6 +723,15 @@ bool VPUDecodingSession::start_video_decoding()
         return false;
     }
 
+    if ((VPUFrameLayout::TILED == m_frame_layout) && !m_rotator) {
+        codec_log_error(m_logger, "Tiled frames can't be given for display without "
+                                  "post-processing, see enable_rotation()");
+        return false;
+    }
+    if (m_rotator && !m_rotator->start(m_handle)) {
+        return false;
+    }
+
     DecParam params;
     ::memset(&params, 0, sizeof(params));
 
@@ -548,6 +744,7 @@ bool VPUDecodingSession::start_video_decoding()
         vpu_DecGetOutputInfo(m_handle, &output_info);
         return false;
     }
+    TRACE_INSTANT("start_video_decoding");
 
     return true;
 }
@@ -556,16 +753,16 @@ bool VPUDecodingSession::start_video_decoding()
  of simple VPU interface, also translating integer indices into apropriate
  frames/flags. This version is used for video decoding - JPEG decoding has no
  need for buffer management */
-VPUDecodeStatus VPUDecodingSession::wait_for_video_decode(const std::shared_ptr<FrameMetaData> &meta,
+VPUDecodeStatus VPUDecodingSession::wait_for_video_decode(const FrameMeta &meta,
                                                           VPUOutputFrame &output_frame)
 {
     int decoded_frame_buffer_index;
     int display_frame_buffer_index;
     VPUDecodeStatus status = wait_for_decode(m_logger, m_handle, decoded_frame_buffer_index,
-                                             display_frame_buffer_index);
+                                             display_frame_buffer_index, &m_stats);
 
     if (VPUDecodeStatus::OUTPUT_DECODED & status) {
-        m_frames.frame_decoded(decoded_frame_buffer_index, meta);
+        m_frames.frame_decoded(decoded_frame_buffer_index, get_decoded_meta(meta));
     }
 
     if (VPUDecodeStatus::FRAME_GIVEN_FOR_DISPLAY & status) {
@@ -573,33 +770,78 @@ VPUDecodeStatus VPUDecodingSession::wait_for_video_decode(const std::shared_ptr<
          for display */
         m_frames.frame_to_be_given_for_display(display_frame_buffer_index,
                                                output_frame.dma,
-                                               output_frame.meta);
+                                               output_frame.meta,
+                                               output_frame.handle);
         output_frame.size = output_frame.dma->size;
         output_frame.geometry = m_frame_geometry;
+        if (!m_first_frame_given) {
+            m_first_frame_given = true;
+            m_stats.open_to_first_frame_latency.add_usec_since(m_open_time);
+        }
+        if (m_rotator) {
+            /* Rotated copy goes out instead, and decoder can have its frame
+             back right away */
+            m_frames.mark_frame_as_returned(output_frame.dma->phy_addr);
+            output_frame.handle = VPUFrameHandle();
+            if (!m_rotator->frame_given_for_display(output_frame)) {
+                codec_log_error(m_logger, "Frame given for display wasn't rotated");
+                output_frame.reset();
+                status |= VPUDecodeStatus::ERROR;
+            }
+        }
     }
 
     return status;
 }
 
+FrameMeta VPUDecodingSession::get_decoded_meta(
+    const FrameMeta &meta)
+{
+    PhysicalAddress read_ptr, write_ptr;
+    Uint32 num_free_bytes;
+    if (RETCODE_SUCCESS
+        != vpu_DecGetBitstreamBuffer(m_handle, &read_ptr, &write_ptr, &num_free_bytes)) {
+        codec_log_error(m_logger, "Failed vpu_DecGetBitstreamBuffer");
+        return meta;
+    }
+    FrameMeta consumed_meta
+        = m_monitoring.update_queue(m_logger, read_ptr - m_buffers.get_bitstream_buffer().phy_addr);
+    if (!consumed_meta) {
+        return meta;
+    }
+    if (consumed_meta != meta) {
+        /* Decoder didn't decode the pack it was given last, but something fed
+         before it */
+        ++m_stats.number_of_reattributed_frames;
+    }
+    return consumed_meta;
+}
+
 bool VPUDecodingSession::allocate_frames()
 {
     auto before = std::chrono::steady_clock::now();
-    FrameBuffer frame_buffer_template
-        = prepare_nv12_frame_buffer_template(m_frame_geometry);
-    /* Size of frame equals offset to colocated motion vector data, because
-     normal codecs don't use it */
-    size_t frame_size = frame_buffer_template.bufMvCol;
-    if (CodecType::H264 == m_codec_type) {
-        /* Except for H264, where we also have to take collocated motion vector
-         data into account (technically only when B-frames are present, but only
-         for Baseline profile we have guarantee that there won't be any, also
-         buffer overrun in DMA memory is dangerous) */
-        frame_size += m_frame_geometry.m_padded_width * m_frame_geometry.m_padded_height / 4;
-    }
+    bool tiled = (VPUFrameLayout::TILED == m_frame_layout);
+    FrameBuffer frame_buffer_template = tiled
+        ? prepare_tiled_frame_buffer_template(m_frame_geometry)
+        : prepare_nv12_frame_buffer_template(m_frame_geometry);
+    size_t frame_size = get_frame_size(m_codec_type, m_frame_geometry, m_frame_layout);
     size_t buffers_size = m_buffers.get_bitstream_buffer().size
         + m_buffers.get_slice_buffer().size + m_buffers.get_ps_save_buffer().size
         + m_buffers.get_mb_prediction_buffer().size;
-    size_t number_of_frame_buffers = m_number_of_reference_frame_buffers
+    /* Decoder won't take fewer than it asked for, and the frames that
+     makes up for are reference ones, as far as giving frames out goes */
+    size_t number_of_reference_frame_buffers = m_number_of_reference_frame_buffers;
+    if (number_of_reference_frame_buffers + m_number_of_display_frame_buffers
+        < m_minimum_number_of_frame_buffers) {
+        codec_log_info(m_logger, "Decoder needs at least %zu frames, registering %zu "
+                                 "reference frames instead of %zu",
+                       m_minimum_number_of_frame_buffers,
+                       m_minimum_number_of_frame_buffers - m_number_of_display_frame_buffers,
+                       number_of_reference_frame_buffers);
+        number_of_reference_frame_buffers
+            = m_minimum_number_of_frame_buffers - m_number_of_display_frame_buffers;
+    }
+    size_t number_of_frame_buffers = number_of_reference_frame_buffers
                                    + m_number_of_display_frame_buffers;
     codec_log_info(m_logger,
                    "Will need %zu buffers %.2fMB each (%.1fMB total allocation "
@@ -612,22 +854,45 @@ bool VPUDecodingSession::allocate_frames()
      m_frame_buffers as continuous array of FrameBuffer structures (this is what
      decoder needs anyway) */
     FrameBuffer *frames_array = nullptr;
-    if (!m_frames.reserve(frame_size, m_number_of_reference_frame_buffers,
+    if (!m_frames.reserve(frame_size, number_of_reference_frame_buffers,
                           m_number_of_display_frame_buffers, frames_array)) {
+        ++m_stats.number_of_dma_allocation_failures;
         return false;
     }
 
     /* Adjust offsets for new buffers */
     for (size_t i = 0; i < number_of_frame_buffers; i++) {
-        frames_array[i].bufCb += frame_buffer_template.bufCb;
-        frames_array[i].bufCr += frame_buffer_template.bufCr;
+        if (tiled) {
+            /* Frame map takes 20 bit page numbers of luma and chroma, for
+             top and bottom fields, packed across the three plane addresses.
+             In frame map bottom fields are never used, so these are the
+             same as the top ones */
+            unsigned long luma = frames_array[i].bufY >> 12;
+            unsigned long chroma = (frames_array[i].bufY + frame_buffer_template.bufCb) >> 12;
+            if (frames_array[i].bufY & 0xfff) {
+                codec_log_error(m_logger, "Frame memory isn't page aligned, can't be tiled");
+                return false;
+            }
+            frames_array[i].bufY = (luma << 12) | (chroma >> 8);
+            frames_array[i].bufCb = (chroma << 24) | (luma << 4) | (chroma >> 16);
+            frames_array[i].bufCr = chroma << 16;
+        } else {
+            frames_array[i].bufCb += frame_buffer_template.bufCb;
+            frames_array[i].bufCr += frame_buffer_template.bufCr;
+        }
         frames_array[i].bufMvCol += frame_buffer_template.bufMvCol;
     }
 
     /* Success! */
     // TODO: remove those stupid stats, it makes more sense to have them in
     // specific buffers now
-    m_stats.update_dma_allocation_size(frame_size * number_of_frame_buffers + buffers_size);
+    m_stats.update_dma_allocation_size(frame_size * number_of_frame_buffers + buffers_size
+                                       + (m_rotator ? m_rotator->get_allocation_size() : 0));
+    m_stats.max_pooled_frame_memory = m_frames.get_max_pooled_size();
+    if (m_frames.get_number_of_prewarmed_frames_used()) {
+        ++m_stats.number_of_prewarmed_reopens;
+        m_stats.total_prewarm_time_saved += m_frames.get_prewarm_time_saved();
+    }
 
     /* Finally, we have to let decoder know the buffers it can use */
     DecBufInfo buf_info;
@@ -655,6 +920,29 @@ bool VPUDecodingSession::allocate_frames()
     return true;
 }
 
+/* Frames were allocated for geometry of the pack session was opened with, and
+ before VPU had its say. Smaller picture fits them, bigger one would have VPU
+ write past their end */
+bool VPUDecodingSession::check_initial_info(const DecInitialInfo &initial_info)
+{
+    size_t width = ((size_t)initial_info.picWidth + 15) & ~15;
+    size_t height = ((size_t)initial_info.picHeight + 15) & ~15;
+    if ((width == m_frame_geometry.m_padded_width) && (height == m_frame_geometry.m_padded_height)) {
+        return true;
+    }
+    ++m_stats.number_of_initial_info_mismatches;
+    if ((width > m_frame_geometry.m_padded_width) || (height > m_frame_geometry.m_padded_height)) {
+        codec_log_error(m_logger, "Decoder found %dx%d picture, frames are for %zux%zu",
+                        initial_info.picWidth, initial_info.picHeight,
+                        m_frame_geometry.m_padded_width, m_frame_geometry.m_padded_height);
+        return false;
+    }
+    codec_log_warn(m_logger, "Decoder found %dx%d picture, parser %zux%zu",
+                   initial_info.picWidth, initial_info.picHeight,
+                   m_frame_geometry.m_padded_width, m_frame_geometry.m_padded_height);
+    return true;
+}
+
 bool VPUDecodingSession::get_initial_info(DecInitialInfo &initial_info)
 {
     /* Set the force escape flag first (see section 4.3.2.2
@@ -684,26 +972,39 @@ bool VPUDecodingSession::get_initial_info(DecInitialInfo &initial_info)
 /* Low - level "wait_for_decode", dealing directly with VPU interface */
 VPUDecodeStatus VPUDecodingSession::wait_for_decode(CodecLogger &logger, DecHandle handle,
                                                     int &decoded_frame_buffer_index,
-                                                    int &display_frame_buffer_index)
+                                                    int &display_frame_buffer_index,
+                                                    DecodingStats *stats)
 {
     /* Wait a few times, since sometimes, it takes more than
      * one vpu_WaitForInt() call to cover the decoding interval */
-    for (int cnt = 0; cnt < VPU_MAX_TIMEOUT_COUNTS; ++cnt) {
-        if (RETCODE_SUCCESS != vpu_WaitForInt(VPU_WAIT_TIMEOUT)) {
-            codec_log_error(logger, "Decode timed out, will reset decoder!");
-            vpu_SWReset(handle, 0);
-            return VPUDecodeStatus::ERROR | VPUDecodeStatus::DECODE_TIMEOUT;
-        } else {
-            break;
+    auto before = std::chrono::steady_clock::now();
+    {
+        TRACE_SCOPE("vpu_WaitForInt");
+        for (int cnt = 0; cnt < VPU_MAX_TIMEOUT_COUNTS; ++cnt) {
+            if (RETCODE_SUCCESS != vpu_WaitForInt(VPU_WAIT_TIMEOUT)) {
+                codec_log_error(logger, "Decode timed out, will reset decoder!");
+                vpu_SWReset(handle, 0);
+                return VPUDecodeStatus::ERROR | VPUDecodeStatus::DECODE_TIMEOUT;
+            } else {
+                break;
+            }
         }
     }
 
+    if (stats) {
+        stats->wait_for_interrupt_latency.add_usec_since(before);
+        before = std::chrono::steady_clock::now();
+    }
+
     DecOutputInfo output_info;
     ::memset(&output_info, 0, sizeof(output_info));
     if (RETCODE_SUCCESS != vpu_DecGetOutputInfo(handle, &output_info)) {
         codec_log_error(logger, "Failed vpu_DecGetOutputInfo");
         return VPUDecodeStatus::ERROR;
     }
+    if (stats) {
+        stats->output_info_latency.add_usec_since(before);
+    }
 
     if (output_info.notSufficientPsBuffer) {
         codec_log_error(logger, "Insufficient PS buffer");
@@ -766,7 +1067,8 @@ VPUDecodeStatus VPUDecodingSession::wait_for_decode(CodecLogger &logger, DecHand
 }
 
 DecHandle VPUDecodingSession::open_decoder(VPUDecoderBuffers &buffers, CodStd bitstream_format,
-                                           const FrameGeometry &frame_geometry, bool reordering)
+                                           const FrameGeometry &frame_geometry, bool reordering,
+                                           VPUFrameLayout frame_layout)
 {
     DecOpenParam open_param;
     ::memset(&open_param, 0, sizeof(open_param));
@@ -800,8 +1102,15 @@ DecHandle VPUDecodingSession::open_decoder(VPUDecoderBuffers &buffers, CodStd bi
      in case... */
     open_param.psSaveBuffer = buffers.get_ps_save_buffer().phy_addr;
     open_param.psSaveBufferSize = buffers.get_ps_save_buffer().size;
-    open_param.mapType = 0; /* Not sure what it is, but has to be 0 on i.MX6 */
-    open_param.tiled2LinearEnable = 0; /* Ditto - has to do with mapping sth */
+    /* Layout of frame buffers, see VPUFrameLayout. Tiled ones are turned
+     linear by post-processing when given for display */
+    if (VPUFrameLayout::TILED == frame_layout) {
+        open_param.mapType = TILED_FRAME_MB_RASTER_MAP;
+        open_param.tiled2LinearEnable = 1;
+    } else {
+        open_param.mapType = LINEAR_FRAME_MAP;
+        open_param.tiled2LinearEnable = 0;
+    }
 
     /* "bitstream mode" is how VPU reacts to end of data in the buffer during
      the decode:
@@ -6,7 +6,9 @@
  */
 
 #pragma once
+#include <chrono>
 #include <list>
+#include <memory>
 #include <vector>
 
 #include <assert.h>
@@ -19,12 +21,18 @@ extern "C" {
 
 #include "codec_common.hpp"
 #include "codec_logger.hpp"
+#include "vpu_bitstream_buffer_monitoring.hpp"
 #include "vpu_decoder_buffers.hpp"
 #include "vpu_frame_buffers.hpp"
 #include "vpu_output_frame.hpp"
+#include "vpu_rotator.hpp"
 
 namespace airtame {
 
+/* Parameter set versions session remembers as fed, older ones are forgotten
+ (and then just fed again) */
+#define VPU_SESSION_MAX_PARAMETER_SETS 64
+
 /* I read that for bitmasky things to work with class enum one has to define
  apropriate operators...talk about overkill, when it just worked in standard C
  */
@@ -54,10 +62,17 @@ inline constexpr VPUDecodeStatus operator | (const VPUDecodeStatus a, const VPUD
     return static_cast<VPUDecodeStatus>(static_cast<int>(a) | static_cast<int>(b));
 }
 
+/* Called by decode_video() once the VPU started decoding, and before waiting
+ for it to finish - so the CPU can do some other work (such as parsing of
+ other streams) meanwhile. Has to be short (decode takes few msec) and must not
+ call the VPU itself */
+using VPUBusyCallback = std::function<void(void)>;
+
 /* Purpose of this class is to encapsulate state and handling of VPU decoder to
  make it easier to use. And that's it. Unlike previous version of the code, it
- doesn't offer extra features like decoding state machine or bitstream buffer
- monitoring */
+ doesn't offer extra features like decoding state machine. Bitstream buffer is
+ monitored though, so that decoded frames get metadata of the data decoder
+ actually consumed, see VPUBitstreamBufferMonitoring */
 class VPUDecodingSession {
 protected:
     CodecLogger &m_logger;
@@ -75,13 +90,41 @@ protected:
     FrameGeometry m_frame_geometry;
     size_t m_number_of_reference_frame_buffers;
     size_t m_number_of_display_frame_buffers;
+    /* From decoder initial info, see allocate_frames() */
+    size_t m_minimum_number_of_frame_buffers = 0;
     bool m_reordering = false;
+    VPUFrameLayout m_frame_layout = VPUFrameLayout::LINEAR;
 
     /* Handle of the open decoder */
     DecHandle m_handle = nullptr;
 
     bool m_initial_info_retrieved = false;
 
+    /* When open_for_video() started, for
+     DecodingStats::open_to_first_frame_latency */
+    std::chrono::steady_clock::time_point m_open_time;
+    bool m_first_frame_given = false;
+
+    /* Set between begin_decode_video() and finish_decode_video() */
+    bool m_decoding = false;
+
+    /* Size of the bitstream buffer window given by last reserve() and not
+     committed yet, and its offset in bitstream buffer */
+    size_t m_reserved_size = 0;
+    size_t m_reserved_offset = 0;
+
+    /* Chunks fed and not consumed by decoder yet, and metadata of what is
+     being fed now. Every set_feed_meta() starts new feed */
+    VPUBitstreamBufferMonitoring m_monitoring;
+    FrameMeta m_feed_meta;
+    uint64_t m_feed = 0;
+
+    /* Post-processing stage, if enabled */
+    std::unique_ptr<VPURotator> m_rotator;
+
+    /* Versions of parameter sets fed, oldest first */
+    std::vector<uint64_t> m_parameter_sets;
+
     /* Disallow constructing session objects by the user */
     VPUDecodingSession(CodecLogger &logger, DecodingStats &stats, VPUDecoderBuffers &buffers,
                        VPUFrameBuffers &frames, CodecType codec_type, const FrameGeometry &frame_geometry,
@@ -97,7 +140,9 @@ public:
                                               CodecType codec_type, const FrameGeometry &frame_geometry,
                                               size_t number_of_reference_frame_buffers,
                                               size_t number_of_display_frame_buffers,
-                                              bool reordering);
+                                              bool reordering,
+                                              size_t max_coded_frame_size = 0,
+                                              VPUFrameLayout frame_layout = VPUFrameLayout::LINEAR);
     /* For JPEG one doesn't create permanent decoding session, as there is no
      "state" to carry from one decode operation to the next (same applies to
      MJPEG streams)
@@ -110,9 +155,28 @@ public:
     static bool decode_jpeg(CodecLogger &logger, VPUDMAPointer bitstream,
                             VPUDMAPointer frame, const FrameGeometry &frame_geometry,
                             bool interleave);
+    /* decode_jpeg() split up, for MJPEG streams (see VPUMJPEGDecoder) which
+     keep one decoder open for all their images. Decoder opened once can decode
+     any number of JPEGs, one at a time, of any geometry. start_jpeg() decodes
+     size bytes at the beginning of bitstream into frame and returns, so that
+     CPU is free to do other stuff while the VPU works, then finish_jpeg()
+     waits for it to complete. Both return false on error */
+    static DecHandle open_jpeg(CodecLogger &logger, bool interleave);
+    static bool start_jpeg(CodecLogger &logger, DecHandle handle, VPUDMAPointer bitstream,
+                           size_t size, VPUDMAPointer frame,
+                           const FrameGeometry &frame_geometry, bool interleave);
+    static bool finish_jpeg(CodecLogger &logger, DecHandle handle);
     /* These are public and static because one needs them to prepare DMA memory
      for JPEG bitstream and frame buffer */
     static FrameBuffer prepare_nv12_frame_buffer_template(const FrameGeometry &frame_geometry);
+    /* Same for VPUFrameLayout::TILED frames, offsets of luma and chroma
+     (bufY, bufCb, the only two VPU uses from frame map) and motion vectors.
+     These aren't the addresses VPU takes, see allocate_frames() */
+    static FrameBuffer prepare_tiled_frame_buffer_template(const FrameGeometry &frame_geometry);
+    /* Size of single frame buffer (including motion vectors, if needed) video
+     decoding will allocate for given codec, geometry and layout */
+    static size_t get_frame_size(CodecType codec_type, const FrameGeometry &frame_geometry,
+                                 VPUFrameLayout frame_layout = VPUFrameLayout::LINEAR);
     // TODO: this could be in more generic context, and could be used from
     // all "buffer" classes and so common code...
     static VPUDMAPointer allocate_dma(size_t size);
@@ -121,6 +185,28 @@ public:
     /* This function adds data to bitstream input buffer (input of the decoder
      chip */
     bool feed(const unsigned char *data, size_t size, size_t &size_fed);
+    /* Zero-copy feeding. feed() above has to memcpy() the data into bitstream
+     buffer, which is DMA memory mapped into our process space. Producers that
+     are able to write their data directly there (for example by receiving it
+     straight from the socket) can instead reserve() a window of that memory,
+     fill it, and then commit() the number of bytes actually written.
+
+     Window is always contiguous, so when free space wraps around the end of
+     bitstream buffer, window_size will be smaller than the size asked for and
+     another reserve()/commit() pair is needed for the remainder. window_size
+     of zero means there is no free space at all. Nothing written into the
+     window is seen by the decoder before commit(), and one can't commit more
+     than was reserved */
+    bool reserve(size_t size, unsigned char *&window, size_t &window_size);
+    bool commit(size_t size);
+    /* Metadata of data fed from now on (through either of the above), which
+     frame decoded out of it will get. Set by VPUDecoder to the metadata of the
+     pack it feeds */
+    void set_feed_meta(const FrameMeta &meta)
+    {
+        m_feed_meta = meta;
+        ++m_feed;
+    }
     /* This function feeds special "end of stream" marker, which is needed to
      retrieve remaining buffered frames out of the decoder (see decode()
      description below) */
@@ -128,6 +214,38 @@ public:
     /* Utility function for monitoring bitstream buffer state */
     bool get_bitstream_buffer_free_space_available(size_t &size);
 
+    /* Parameter sets (see VideoChunk::parameter_set_version) fed in this
+     session. VPU keeps the ones it got, so there is no need to feed them
+     again unless they change, which makes them new version */
+    bool has_parameter_set(uint64_t version) const
+    {
+        for (uint64_t fed : m_parameter_sets) {
+            if (fed == version) {
+                return true;
+            }
+        }
+        return false;
+    }
+    /* Zero version (chunk isn't parameter set) is ignored */
+    void parameter_set_fed(uint64_t version)
+    {
+        if (!version) {
+            return;
+        }
+        if (m_parameter_sets.size() == VPU_SESSION_MAX_PARAMETER_SETS) {
+            m_parameter_sets.erase(m_parameter_sets.begin());
+        }
+        m_parameter_sets.push_back(version);
+    }
+
+    /* Opt-in post-processing: frames given for display are rotated (and/or
+     mirrored) by the VPU into separate frames, number_of_frames of them, see
+     VPURotator. Those are what output frames are then, with geometry
+     rotated. Session opened with tiled frames needs it even with no rotation,
+     to give linear ones. Has to be called before the first decode, false on
+     error */
+    bool enable_rotation(const VPURotation &rotation, size_t number_of_frames);
+
     /* This should be called before starting decoding, to make sure that there
      is at least one free frame for decode. */
     bool has_frame_for_decoding() const;
@@ -164,20 +282,35 @@ public:
      bug here) when decode() is called without free frame, NO_FREE_FRAME will
      be ORed into status, and no action will be performed.
 
-     Arguments are - metadata to be assigned to decoded frame (if any), decoded
+     Arguments are - metadata to be assigned to decoded frame (if any, and if
+     bitstream buffer monitoring can't tell which data was decoded), decoded
      flag which will be true if actual decode taken place, given_for_display
      which will be true if any frame gets returned for display. Frame(s) given
-     for display will be added to output_frames list. */
-    VPUDecodeStatus decode_video(const std::shared_ptr<FrameMetaData> &meta,
-                                 VPUOutputFrame &output_frame);
-
-    /* TODO: async decoding interface.
-     Note that implementation of decoding is actually split into two private
-     functions below: start_decoding() and wait_for_decode(). These could be
-     exposed (either directly, or wrapped into some kind of interfaces) to allow
-     for "async decode" functionality, starting VPU decode first, and allowing
-     CPU do other stuff, then coming for results of the decode operation. There
-     is also is_busy() for checking if decode is still in progress. */
+     for display will be added to output_frames list. Busy callback (if
+     any) is called while the VPU works, see VPUBusyCallback */
+    VPUDecodeStatus decode_video(const FrameMeta &meta,
+                                 VPUOutputFrame &output_frame,
+                                 const VPUBusyCallback &busy_callback = nullptr);
+
+    /* Async decoding interface, decode_video() above split in two. First one
+     starts the VPU decode and returns, true if it started - otherwise status
+     says why not (NO_FREE_OUTPUT_BUFFER or ERROR). Then CPU is free to do
+     other stuff, is_busy() tells if decode is still in progress, and
+     finish_decode_video() (which blocks if VPU is still busy) gives the same
+     result decode_video() would. Note that VPU decodes one frame at a time, no
+     matter how many sessions there are, so only one decode can be in
+     flight */
+    bool begin_decode_video(VPUDecodeStatus &status);
+    VPUDecodeStatus finish_decode_video(const FrameMeta &meta,
+                                        VPUOutputFrame &output_frame);
+    bool is_decoding() const
+    {
+        return m_decoding;
+    }
+
+    /* Calls busy callback (if any) keeping stats of it, for use in between
+     the two above */
+    void run_busy_callback(const VPUBusyCallback &busy_callback);
 
     /* Accessors. Higher level code calls these and compares parameters required
      for decoding of subsequent frames. If any of these is not the same, session
@@ -192,10 +325,12 @@ public:
         return m_frame_geometry;
     }
 
+    /* Frames session was opened for. Decoder may have asked for more
+     reference ones (see allocate_frames()), which doesn't make the session
+     any different for the same stream */
     size_t get_number_of_frame_buffers() const
     {
-        return m_frames.get_number_of_reference_frame_buffers()
-            + m_frames.get_number_of_display_frame_buffers();
+        return m_number_of_reference_frame_buffers + m_number_of_display_frame_buffers;
     }
 
     bool get_reordering() const
@@ -203,23 +338,44 @@ public:
         return m_reordering;
     }
 
+    VPUFrameLayout get_frame_layout() const
+    {
+        return m_frame_layout;
+    }
+
+    VPURotation get_rotation() const
+    {
+        return m_rotator ? m_rotator->get_rotation() : VPURotation();
+    }
+
+    size_t get_number_of_rotated_frames() const
+    {
+        return m_rotator ? m_rotator->get_number_of_frames() : 0;
+    }
+
 protected:
-    /* Like described above, these could be made public in order to allow for
-     async decoding. Both functions used for video only */
+    /* Implementation of begin_decode_video() and finish_decode_video(). Both
+     functions used for video only */
     bool start_video_decoding();
-    VPUDecodeStatus wait_for_video_decode(const std::shared_ptr<FrameMetaData> &meta,
+    VPUDecodeStatus wait_for_video_decode(const FrameMeta &meta,
                                           VPUOutputFrame &output_frame);
     /* Other utilities */
+    /* Metadata of the frame just decoded, judging by the decoder read index,
+     or given one if that tells nothing */
+    FrameMeta get_decoded_meta(const FrameMeta &meta);
     bool allocate_frames();
     bool get_initial_info(DecInitialInfo &initial_info);
+    bool check_initial_info(const DecInitialInfo &initial_info);
 
     /* Static utilities - used before instance of DecodingSession is created, or
      also used when no instance is created (JPEG decoding) */
     static VPUDecodeStatus wait_for_decode(CodecLogger &logger, DecHandle handle,
                                            int &decoded_frame_buffer_index,
-                                           int &display_frame_buffer_index);
+                                           int &display_frame_buffer_index,
+                                           DecodingStats *stats = nullptr);
     static DecHandle open_decoder(VPUDecoderBuffers &buffers, CodStd bitstream_format,
-                                  const FrameGeometry &frame_geometry, bool reordering);
+                                  const FrameGeometry &frame_geometry, bool reordering,
+                                  VPUFrameLayout frame_layout);
 };
 } // namespace airtame
 
@@ -5,19 +5,45 @@
  * See LICENSE.txt for further information.
  */
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "vpu_dma_pointer.hpp"
+#include "vpu_dmabuf.hpp"
 
 namespace airtame {
+vpu_mem_desc *dma_allocate(size_t size)
+{
+    VPUDMAMemory *dma = new VPUDMAMemory();
+    dma->size = size;
+    bool allocated = is_dmabuf_allocation_enabled() ? dmabuf_allocate(*dma)
+                                                    : (RETCODE_FAILURE != IOGetPhyMem(dma));
+    if (!allocated) {
+        delete dma;
+        return nullptr;
+    }
+    return dma;
+}
+
 void dma_pointer_deleter(vpu_mem_desc *dma)
 {
+    /* Everything comes from dma_allocate() (or import_dmabuf()) */
+    VPUDMAMemory *memory = static_cast<VPUDMAMemory *>(dma);
     if (dma->virt_uaddr) {
         /* Gotta unmap */
         IOFreeVirtMem(dma);
     }
-    if (dma->phy_addr) {
+    void *mapping = memory->cpu_mapping.load();
+    if (mapping) {
+        ::munmap(mapping, dma->size);
+    }
+    if (memory->dmabuf_fd >= 0) {
+        /* Memory goes away with the last reference to dmabuf */
+        ::close(memory->dmabuf_fd);
+    } else if (dma->phy_addr) {
         /* Gotta release */
         IOFreePhyMem(dma);
     }
-    delete dma;
+    delete memory;
 }
 } // namespace airtame
@@ -12,9 +12,26 @@ extern "C" {
 #include <vpu_lib.h>
 }
 
+#include <atomic>
 #include <memory>
 
 namespace airtame {
+// DMA memory as allocated by dma_allocate(), which also knows the dmabuf it
+// came from (if it did, see vpu_dmabuf.hpp)
+struct VPUDMAMemory : public vpu_mem_desc {
+    int dmabuf_fd = -1;
+    // cached CPU mapping of the dmabuf, made on first map_dmabuf() and kept
+    // until memory goes away
+    std::atomic<void *> cpu_mapping{ nullptr };
+
+    VPUDMAMemory()
+        : vpu_mem_desc()
+    {
+    }
+};
+// allocates physically contiguous memory of given size from VPU driver (or
+// dma-heap), returns nullptr on failure. To be released with the deleter below
+vpu_mem_desc *dma_allocate(size_t size);
 // shared pointer "deleter", that is function that ensures proper release
 // of dma memory when last reference is removed
 void dma_pointer_deleter(vpu_mem_desc *dma);
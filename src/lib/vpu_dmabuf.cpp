@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+
+#include "vpu_decoding_session.hpp"
+#include "vpu_dmabuf.hpp"
+
+/* i.MX kernels only, not in mainline headers */
+#ifndef DMA_BUF_IOCTL_PHYS
+struct dma_buf_phys {
+    unsigned long phys;
+};
+#define DMA_BUF_IOCTL_PHYS _IOW(DMA_BUF_BASE, 10, struct dma_buf_phys)
+#endif
+
+namespace airtame {
+
+/* Heap fd, -1 when allocating from VPU driver */
+static std::atomic<int> s_heap_fd(-1);
+
+bool enable_dmabuf_allocation(CodecLogger &logger, const char *heap)
+{
+    int fd = ::open(heap, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        codec_log_error(logger, "Cannot open dma-heap %s: %s", heap, strerror(errno));
+        return false;
+    }
+    int previous = s_heap_fd.exchange(fd);
+    if (previous >= 0) {
+        ::close(previous);
+    }
+    return true;
+}
+
+void disable_dmabuf_allocation()
+{
+    int previous = s_heap_fd.exchange(-1);
+    if (previous >= 0) {
+        ::close(previous);
+    }
+}
+
+bool is_dmabuf_allocation_enabled()
+{
+    return s_heap_fd >= 0;
+}
+
+static bool get_dmabuf_physical_address(int fd, unsigned long &physical_address)
+{
+    struct dma_buf_phys phys;
+    ::memset(&phys, 0, sizeof(phys));
+    if (::ioctl(fd, DMA_BUF_IOCTL_PHYS, &phys) < 0) {
+        return false;
+    }
+    physical_address = phys.phys;
+    return true;
+}
+
+bool dmabuf_allocate(VPUDMAMemory &memory)
+{
+    struct dma_heap_allocation_data allocation;
+    ::memset(&allocation, 0, sizeof(allocation));
+    allocation.len = memory.size;
+    allocation.fd_flags = O_RDWR | O_CLOEXEC;
+    if (::ioctl(s_heap_fd, DMA_HEAP_IOCTL_ALLOC, &allocation) < 0) {
+        return false;
+    }
+    unsigned long physical_address;
+    if (!get_dmabuf_physical_address(allocation.fd, physical_address)) {
+        ::close(allocation.fd);
+        return false;
+    }
+    memory.dmabuf_fd = allocation.fd;
+    memory.phy_addr = physical_address;
+    return true;
+}
+
+vpu_mem_desc *import_dmabuf(CodecLogger &logger, int fd, size_t size)
+{
+    int own_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own_fd < 0) {
+        codec_log_error(logger, "Cannot duplicate dmabuf fd: %s", strerror(errno));
+        return nullptr;
+    }
+    /* Not all exporters can tell the size, but those that can must not be
+     smaller than what user wants to use */
+    off_t dmabuf_size = ::lseek(own_fd, 0, SEEK_END);
+    if ((dmabuf_size > 0) && ((size_t)dmabuf_size < size)) {
+        codec_log_error(logger, "dmabuf of %zu bytes is smaller than %zu bytes asked for",
+                        (size_t)dmabuf_size, size);
+        ::close(own_fd);
+        return nullptr;
+    }
+    unsigned long physical_address;
+    if (!get_dmabuf_physical_address(own_fd, physical_address)) {
+        codec_log_error(logger, "Cannot get physical address of dmabuf, "
+                                "not contiguous or kernel lacks DMA_BUF_IOCTL_PHYS?");
+        ::close(own_fd);
+        return nullptr;
+    }
+    VPUDMAMemory *memory = new VPUDMAMemory();
+    memory->size = size;
+    memory->phy_addr = physical_address;
+    memory->dmabuf_fd = own_fd;
+    return memory;
+}
+
+int get_dmabuf_fd(const VPUDMAPointer &dma)
+{
+    if (!dma) {
+        return -1;
+    }
+    return static_cast<const VPUDMAMemory *>(dma.get())->dmabuf_fd;
+}
+
+const unsigned char *map_dmabuf(CodecLogger &logger, const VPUDMAPointer &dma)
+{
+    int fd = get_dmabuf_fd(dma);
+    if (fd < 0) {
+        return nullptr;
+    }
+    VPUDMAMemory *memory = static_cast<VPUDMAMemory *>(dma.get());
+    void *mapping = memory->cpu_mapping.load();
+    if (mapping) {
+        return (const unsigned char *)mapping;
+    }
+    mapping = ::mmap(nullptr, dma->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == mapping) {
+        codec_log_error(logger, "Cannot map dmabuf of %d bytes: %s", dma->size, strerror(errno));
+        return nullptr;
+    }
+    /* Other thread may have mapped it meanwhile, then its mapping is used */
+    void *expected = nullptr;
+    if (!memory->cpu_mapping.compare_exchange_strong(expected, mapping)) {
+        ::munmap(mapping, dma->size);
+        mapping = expected;
+    }
+    return (const unsigned char *)mapping;
+}
+
+bool sync_dmabuf_for_reading(const VPUDMAPointer &dma, bool begin)
+{
+    int fd = get_dmabuf_fd(dma);
+    if (fd < 0) {
+        return false;
+    }
+    struct dma_buf_sync sync;
+    sync.flags = (begin ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_READ;
+    int result;
+    do {
+        result = ::ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while ((result < 0) && ((EINTR == errno) || (EAGAIN == errno)));
+    return result >= 0;
+}
+
+bool get_dmabuf_planes(const VPUOutputFrame &frame, VPUDMABufPlanes &planes)
+{
+    planes.fd = get_dmabuf_fd(frame.dma);
+    if (planes.fd < 0) {
+        return false;
+    }
+    /* Same layout VPU was told to decode with */
+    const FrameGeometry &geometry = frame.geometry;
+    FrameBuffer layout = VPUDecodingSession::prepare_nv12_frame_buffer_template(geometry);
+    planes.fourcc = VPU_DMABUF_FOURCC_NV12;
+    planes.width = geometry.m_padded_width;
+    planes.height = geometry.m_padded_height;
+    planes.crop_left = geometry.m_crop_left;
+    planes.crop_top = geometry.m_crop_top;
+    planes.crop_width = geometry.m_true_width;
+    planes.crop_height = geometry.m_true_height;
+    planes.number_of_planes = 2;
+    planes.offsets[0] = layout.bufY;
+    planes.strides[0] = layout.strideY;
+    planes.offsets[1] = layout.bufCb;
+    planes.strides[1] = layout.strideC;
+    return true;
+}
+
+bool wait_for_dmabuf_idle(const VPUDMAPointer &dma, int timeout_msec)
+{
+    int fd = get_dmabuf_fd(dma);
+    if (fd < 0) {
+        return true;
+    }
+    /* dmabuf polls writable once all the fences, readers' ones included,
+     have signalled */
+    struct pollfd poll_fd;
+    poll_fd.fd = fd;
+    poll_fd.events = POLLOUT;
+    poll_fd.revents = 0;
+    int result;
+    do {
+        result = ::poll(&poll_fd, 1, timeout_msec);
+    } while ((result < 0) && (EINTR == errno));
+    return (result > 0) && (poll_fd.revents & POLLOUT);
+}
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "vpu_dma_pointer.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* dma-heap physically contiguous frames are allocated from by default */
+#define VPU_DMABUF_DEFAULT_HEAP "/dev/dma_heap/linux,cma"
+
+/* DRM fourcc of frames decoded, as GPU/Wayland/GStreamer want it */
+#define VPU_DMABUF_FOURCC_NV12 0x3231564e /* 'N', 'V', '1', '2' */
+
+/* DMA memory allocated by VPU driver (IOGetPhyMem()) can't be shared with
+ other devices, so anything that isn't G2D (which takes physical addresses)
+ would have to copy frames. DMA memory that comes as dmabuf can be shared
+ though - with Vivante GPU (EGL_EXT_image_dma_buf_import), Wayland compositor
+ (zwp_linux_dmabuf_v1) or GStreamer (GstDmaBufAllocator).
+
+ So with this enabled, all the frames (decoder, frame pool, rotator and JPEG
+ ones, see dma_allocate()) are allocated from given dma-heap instead, and their
+ dmabuf can be exported with get_dmabuf_fd(). VPU still needs physical address
+ of the memory, and that is taken with DMA_BUF_IOCTL_PHYS, which i.MX kernels
+ have. Process wide, and has to be done before decoders start. Returns false
+ (and allocation stays as it was) if heap can't be opened */
+bool enable_dmabuf_allocation(CodecLogger &logger, const char *heap = VPU_DMABUF_DEFAULT_HEAP);
+void disable_dmabuf_allocation();
+bool is_dmabuf_allocation_enabled();
+
+/* Used by dma_allocate(), fills the memory given (size set) from the heap */
+bool dmabuf_allocate(VPUDMAMemory &memory);
+
+/* Wraps dmabuf allocated elsewhere (for example by the GPU, or by GStreamer
+ buffer pool) so that it can be used as any other DMA memory, that is with
+ physical address the VPU and G2D take. Buffer has to be physically contiguous.
+ Takes its own reference of the fd, so caller can close it. Memory isn't mapped
+ (virt_uaddr is zero), same as for IOGetPhyMem(). Decoders take it as frame
+ memory once it is given to their VPUFramePool with adopt(), otherwise it is
+ released with dma_pointer_deleter(), like dma_allocate() memory. nullptr on
+ error */
+vpu_mem_desc *import_dmabuf(CodecLogger &logger, int fd, size_t size);
+
+/* dmabuf of the memory, or -1 if it wasn't allocated as one. Stays owned by
+ the memory, importer has to dup() it if it outlives the frame */
+int get_dmabuf_fd(const VPUDMAPointer &dma);
+
+/* Cached CPU mapping of the whole dmabuf, made on first call and kept until
+ memory goes away. Unlike virt_uaddr of IOGetVirtMem(), which is uncached (so
+ each CPU read goes all the way to DRAM), reads through it are as fast as from
+ any other memory - but only between sync_dmabuf_for_reading() calls, that
+ invalidate CPU caches over it. nullptr if memory has no dmabuf or it can't be
+ mapped */
+const unsigned char *map_dmabuf(CodecLogger &logger, const VPUDMAPointer &dma);
+
+/* Brackets CPU reading of the mapping above: begin invalidates what CPU
+ caches hold of the memory (VPU or G2D may have written it since), end tells
+ the exporter that CPU is done with it. False if memory has no dmabuf or sync
+ failed */
+bool sync_dmabuf_for_reading(const VPUDMAPointer &dma, bool begin);
+
+/* How decoded frame lays out in its dmabuf, in the form dmabuf importers
+ take. Geometry is the one of VPUOutputFrame, so rotated if frame was */
+struct VPUDMABufPlanes {
+    int fd = -1;
+    uint32_t fourcc = VPU_DMABUF_FOURCC_NV12;
+    /* Whole padded frame, and picture (crop) inside */
+    size_t width = 0;
+    size_t height = 0;
+    size_t crop_left = 0;
+    size_t crop_top = 0;
+    size_t crop_width = 0;
+    size_t crop_height = 0;
+    /* Luma and interleaved chroma planes (bytes from the start of dmabuf) */
+    size_t number_of_planes = 2;
+    size_t offsets[2] = { 0, 0 };
+    size_t strides[2] = { 0, 0 };
+};
+
+/* False if frame has no dmabuf */
+bool get_dmabuf_planes(const VPUOutputFrame &frame, VPUDMABufPlanes &planes);
+
+/* Explicit release: frame given to the GPU or compositor is kept (both its
+ VPUOutputFrame and decoder ownership) until the consumer says it is done,
+ say with wl_buffer.release, and only then return_output_frame() is called.
+ Consumer may still have reading queued on the GPU at that point, so before
+ returning, this waits (up to timeout_msec, negative means forever) for all
+ the fences attached to frame dmabuf to signal - otherwise VPU could write
+ next frame over the one still being read. True when idle (or if frame has
+ no dmabuf, as only G2D could be reading then, and it is synchronous).
+ VPUDecoder::return_output_frame() does this itself */
+bool wait_for_dmabuf_idle(const VPUDMAPointer &dma, int timeout_msec);
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "vpu_decoding_session.hpp"
+#include "vpu_dmabuf.hpp"
+#include "vpu_frame_access.hpp"
+
+namespace airtame {
+
+bool VPUFrameAccess::begin(const VPUOutputFrame &frame)
+{
+    end();
+    if (!frame.has_data()) {
+        return false;
+    }
+    m_data = map_dmabuf(m_logger, frame.dma);
+    if (m_data) {
+        if (!sync_dmabuf_for_reading(frame.dma, true)) {
+            codec_log_error(m_logger, "Cannot sync dmabuf for CPU reading: %s", strerror(errno));
+            m_data = nullptr;
+            return false;
+        }
+        m_cached = true;
+    } else {
+        if (!frame.dma->virt_uaddr && (IOGetVirtMem(frame.dma.get()) <= 0)) {
+            codec_log_error(m_logger, "Cannot map frame for CPU reading");
+            return false;
+        }
+        m_data = (const unsigned char *)frame.dma->virt_uaddr;
+        m_cached = false;
+    }
+    m_dma = frame.dma;
+    return true;
+}
+
+void VPUFrameAccess::end()
+{
+    if (m_cached) {
+        sync_dmabuf_for_reading(m_dma, false);
+    }
+    m_dma.reset();
+    m_data = nullptr;
+    m_cached = false;
+}
+
+/* Same pixels, chroma (interleaved, half width) doubled to one pair per
+ pixel */
+static void upsample_chroma_row(unsigned char *u, unsigned char *v, const unsigned char *chroma,
+                                size_t width)
+{
+    size_t x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x2_t uv = vld2_u8(chroma + x);
+        uint8x8x2_t uu = vzip_u8(uv.val[0], uv.val[0]);
+        uint8x8x2_t vv = vzip_u8(uv.val[1], uv.val[1]);
+        vst1_u8(u + x, uu.val[0]);
+        vst1_u8(u + x + 8, uu.val[1]);
+        vst1_u8(v + x, vv.val[0]);
+        vst1_u8(v + x + 8, vv.val[1]);
+    }
+#endif
+    for (; x < width; x++) {
+        u[x] = chroma[x & ~(size_t)1];
+        v[x] = chroma[x | 1];
+    }
+}
+
+/* Half size: average of 2x2 luma pixels, chroma is at that size already */
+static void downscale_luma_row(unsigned char *destination, const unsigned char *row0,
+                               const unsigned char *row1, size_t width)
+{
+    size_t x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 8 <= width; x += 8) {
+        uint16x8_t sum
+            = vaddq_u16(vpaddlq_u8(vld1q_u8(row0 + 2 * x)), vpaddlq_u8(vld1q_u8(row1 + 2 * x)));
+        vst1_u8(destination + x, vrshrn_n_u16(sum, 2));
+    }
+#endif
+    for (; x < width; x++) {
+        destination[x]
+            = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+    }
+}
+
+static void deinterleave_chroma_row(unsigned char *u, unsigned char *v,
+                                    const unsigned char *chroma, size_t width)
+{
+    size_t x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t uv = vld2q_u8(chroma + 2 * x);
+        vst1q_u8(u + x, uv.val[0]);
+        vst1q_u8(v + x, uv.val[1]);
+    }
+#endif
+    for (; x < width; x++) {
+        u[x] = chroma[2 * x];
+        v[x] = chroma[2 * x + 1];
+    }
+}
+
+static unsigned char clamp_component(int value)
+{
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+/* BT.601 limited range, coefficients scaled by 64 so that NEON does it on 16
+ bits: R = 1.164 (Y - 16) + 1.596 (V - 128), G = 1.164 (Y - 16) - 0.392 (U - 128)
+ - 0.813 (V - 128), B = 1.164 (Y - 16) + 2.017 (U - 128) */
+static void convert_row_to_rgb(unsigned char *rgb, const unsigned char *y, const unsigned char *u,
+                               const unsigned char *v, size_t width)
+{
+    size_t x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x8_t luma_offset = vdup_n_u8(16);
+    const uint8x8_t luma_scale = vdup_n_u8(74);
+    const uint8x8_t chroma_offset = vdup_n_u8(128);
+    for (; x + 8 <= width; x += 8) {
+        int16x8_t luma = vreinterpretq_s16_u16(
+            vmull_u8(vqsub_u8(vld1_u8(y + x), luma_offset), luma_scale));
+        int16x8_t cb = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + x), chroma_offset));
+        int16x8_t cr = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + x), chroma_offset));
+        uint8x8x3_t pixels;
+        pixels.val[0] = vqrshrun_n_s16(vmlaq_n_s16(luma, cr, 102), 6);
+        pixels.val[1] = vqrshrun_n_s16(vmlsq_n_s16(vmlsq_n_s16(luma, cb, 25), cr, 52), 6);
+        /* Only blue can go past 16 bits */
+        pixels.val[2] = vqrshrun_n_s16(vqaddq_s16(luma, vmulq_n_s16(cb, 129)), 6);
+        vst3_u8(rgb + 3 * x, pixels);
+    }
+#endif
+    for (; x < width; x++) {
+        int luma = 74 * ((y[x] > 16) ? y[x] - 16 : 0);
+        int cb = u[x] - 128;
+        int cr = v[x] - 128;
+        rgb[3 * x] = clamp_component((luma + 102 * cr + 32) >> 6);
+        rgb[3 * x + 1] = clamp_component((luma - 25 * cb - 52 * cr + 32) >> 6);
+        rgb[3 * x + 2] = clamp_component((luma + 129 * cb + 32) >> 6);
+    }
+}
+
+bool convert_output_frame(CodecLogger &logger, const VPUOutputFrame &frame,
+                          VPUFrameAccessFormat format, size_t width, size_t height,
+                          unsigned char *output, size_t output_stride)
+{
+    const FrameGeometry &geometry = frame.geometry;
+    size_t left = geometry.m_crop_left;
+    size_t top = geometry.m_crop_top;
+    size_t crop_width = geometry.m_true_width;
+    size_t crop_height = geometry.m_true_height;
+    bool rgb = (VPUFrameAccessFormat::RGB24 == format);
+    if (!width || !height || (width > crop_width) || (height > crop_height)
+        || (output_stride < width * (rgb ? 3 : 1))) {
+        codec_log_error(logger, "Cannot convert %zux%zu frame to %zux%zu", crop_width,
+                        crop_height, width, height);
+        return false;
+    }
+    FrameBuffer layout = VPUDecodingSession::prepare_nv12_frame_buffer_template(geometry);
+    if (!frame.has_data() || ((size_t)frame.dma->size < (size_t)layout.bufMvCol)) {
+        codec_log_error(logger, "Frame is smaller than its geometry");
+        return false;
+    }
+
+    /* Chroma pairs up with luma only from even crop offsets */
+    bool aligned = !(left & 1) && !(top & 1);
+    bool same_size = (width == crop_width) && (height == crop_height);
+    bool half_size = (2 * width == crop_width) && (2 * height == crop_height);
+    /* Luma, U and V rows of RGB output before conversion */
+    std::vector<unsigned char> rows(rgb ? 3 * width : 0);
+    /* Source columns for nearest pixel scaling */
+    std::vector<size_t> columns;
+    if (!aligned || (!same_size && !half_size)) {
+        columns.resize(width);
+        for (size_t x = 0; x < width; x++) {
+            columns[x] = left + ((2 * x + 1) * crop_width) / (2 * width);
+        }
+    }
+
+    VPUFrameAccess access(logger);
+    if (!access.begin(frame)) {
+        return false;
+    }
+    const unsigned char *luma_plane = access.get_data() + layout.bufY;
+    const unsigned char *chroma_plane = access.get_data() + layout.bufCb;
+    size_t luma_stride = layout.strideY;
+    size_t chroma_stride = layout.strideC;
+    unsigned char *u = rgb ? rows.data() + width : nullptr;
+    unsigned char *v = rgb ? u + width : nullptr;
+    for (size_t y = 0; y < height; y++) {
+        unsigned char *row = output + y * output_stride;
+        unsigned char *luma = rgb ? rows.data() : row;
+        if (columns.empty() && same_size) {
+            size_t source = top + y;
+            ::memcpy(luma, luma_plane + source * luma_stride + left, width);
+            if (rgb) {
+                upsample_chroma_row(u, v, chroma_plane + (source / 2) * chroma_stride + left,
+                                    width);
+            }
+        } else if (columns.empty()) {
+            size_t source = top + 2 * y;
+            const unsigned char *luma_row = luma_plane + source * luma_stride + left;
+            downscale_luma_row(luma, luma_row, luma_row + luma_stride, width);
+            if (rgb) {
+                deinterleave_chroma_row(u, v, chroma_plane + (source / 2) * chroma_stride + left,
+                                        width);
+            }
+        } else {
+            size_t source = top + ((2 * y + 1) * crop_height) / (2 * height);
+            const unsigned char *luma_row = luma_plane + source * luma_stride;
+            const unsigned char *chroma_row = chroma_plane + (source / 2) * chroma_stride;
+            for (size_t x = 0; x < width; x++) {
+                luma[x] = luma_row[columns[x]];
+            }
+            if (rgb) {
+                for (size_t x = 0; x < width; x++) {
+                    u[x] = chroma_row[columns[x] & ~(size_t)1];
+                    v[x] = chroma_row[columns[x] | 1];
+                }
+            }
+        }
+        if (rgb) {
+            convert_row_to_rgb(row, luma, u, v, width);
+        }
+    }
+    return true;
+}
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "codec_logger.hpp"
+#include "vpu_dma_pointer.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* What convert_output_frame() produces */
+enum class VPUFrameAccessFormat {
+    /* Luma, byte per pixel */
+    GREY,
+    /* R, G and B bytes per pixel, from BT.601 limited range YUV */
+    RGB24,
+};
+
+/* CPU reading of decoded (NV12) frame memory, for snapshots and analytics.
+ Frames allocated as dmabufs (see enable_dmabuf_allocation()) are read
+ through cached mapping of the dmabuf, with CPU caches invalidated over it
+ in begin() - so reads cost what they cost from any other memory. Frames from
+ VPU allocator can only be read through uncached virt_uaddr (IOGetVirtMem()),
+ where every read goes to DRAM, so there is_cached() is false, and it pays to
+ read as little of the frame as possible, with wide loads.
+
+ Frame has to be held (not returned to the decoder) between begin() and
+ end(), and since every frame held is one the decoder can't decode into,
+ that should be kept short: convert_output_frame() below reads what it needs
+ into CPU memory and is done */
+class VPUFrameAccess {
+private:
+    CodecLogger &m_logger;
+    VPUDMAPointer m_dma;
+    const unsigned char *m_data = nullptr;
+    bool m_cached = false;
+
+public:
+    VPUFrameAccess(CodecLogger &logger)
+        : m_logger(logger)
+    {
+    }
+    VPUFrameAccess(const VPUFrameAccess &) = delete;
+    VPUFrameAccess &operator=(const VPUFrameAccess &) = delete;
+
+    ~VPUFrameAccess()
+    {
+        end();
+    }
+
+    /* False if frame memory can't be mapped */
+    bool begin(const VPUOutputFrame &frame);
+    void end();
+
+    /* Start of frame memory, planes are where
+     VPUDecodingSession::prepare_nv12_frame_buffer_template() puts them.
+     nullptr outside begin() and end() */
+    const unsigned char *get_data() const
+    {
+        return m_data;
+    }
+
+    bool is_cached() const
+    {
+        return m_cached;
+    }
+};
+
+/* Converts picture (crop) of the frame to width x height one of given format
+ in CPU memory, rows output_stride bytes apart. Downscaling only: 1:1 and
+ exactly half size (2x2 box filter) go the NEON way, other sizes take nearest
+ pixels. Frame is only read while this runs, so it can go back to the decoder
+ right after. False if frame can't be read, or sizes don't fit */
+bool convert_output_frame(CodecLogger &logger, const VPUOutputFrame &frame,
+                          VPUFrameAccessFormat format, size_t width, size_t height,
+                          unsigned char *output, size_t output_stride);
+}
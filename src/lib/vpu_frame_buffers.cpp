@@ -1,7 +1,10 @@
+#include <chrono>
 #include <list>
 
 #include "vpu_frame_buffers.hpp"
+#include "display_frame_reserve.hpp"
 #include "vpu_decoding_session.hpp"
+#include "vpu_dmabuf.hpp"
 
 namespace airtame {
 bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
@@ -13,6 +16,9 @@ bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
     m_number_of_reference_frame_buffers = number_of_reference_frame_buffers;
     m_number_of_display_frame_buffers = number_of_display_frame_buffers;
     m_decoder_buffers.clear();
+    m_number_of_prewarmed_frames_used = 0;
+    m_prewarm_time_saved = 0;
+    forget_given_frames();
 
     /* See if we can re-use current memory */
     if (frame_buffer_size > m_frame_buffer_size) {
@@ -46,6 +52,13 @@ bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
     }
 
     m_frames.clear();
+    if (m_pool) {
+        /* Spare frames are more useful to other decoders sharing the pool */
+        while (available > needed) {
+            allocations.pop_back();
+            --available;
+        }
+    }
     /* It is OK to, for example, recycle just 5 frame out of 7, or some such.
      This is because remaining 2 frames are in display, and we don't want to
      wait for it. We've been there, and it wasn't pretty. In fact, it was
@@ -53,9 +66,38 @@ bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
     codec_log_info(m_logger, "Managed to recycle %zu frames, have to allocate %zu",
                    available, needed - available);
 
+    if (m_prewarming.valid()) {
+        auto before = std::chrono::steady_clock::now();
+        PrewarmedFrames prewarmed = m_prewarming.get();
+        auto waited = std::chrono::steady_clock::now() - before;
+        /* Prewarmed frames may have been meant for different geometry, and
+         only bigger frames can be used in place of smaller ones */
+        if (prewarmed.frame_size >= m_frame_buffer_size) {
+            for (auto &dma : prewarmed.frames) {
+                if (available >= needed) {
+                    break;
+                }
+                allocations.push_back(dma);
+                ++available;
+                ++m_number_of_prewarmed_frames_used;
+            }
+        }
+        if (m_number_of_prewarmed_frames_used) {
+            Timestamp waited_msec
+                = std::chrono::duration_cast<std::chrono::milliseconds>(waited).count();
+            if (prewarmed.allocation_time > waited_msec) {
+                m_prewarm_time_saved = prewarmed.allocation_time - waited_msec;
+            }
+            codec_log_info(m_logger, "Used %zu prewarmed frames, saved %" PRId64 "ms",
+                           m_number_of_prewarmed_frames_used, m_prewarm_time_saved);
+        }
+        /* Remaining ones (if any) are released here */
+    }
+
     // TODO: measure time here?
     while (available < needed) {
-        VPUDMAPointer dma = VPUDecodingSession::allocate_dma(m_frame_buffer_size);
+        VPUDMAPointer dma = m_pool ? m_pool->borrow(m_frame_buffer_size, m_account)
+                                   : VPUDecodingSession::allocate_dma(m_frame_buffer_size);
         if (dma) {
             allocations.push_back(dma);
             ++available;
@@ -70,6 +112,7 @@ bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
     /* Finally, set up new vectors */
     m_decoder_buffers.reserve(available);
     m_frames.reserve(available);
+    m_pending_clears.reserve(available);
     for (auto dma : allocations) {
         m_decoder_buffers.push_back(FrameBuffer());
         /* Only set base addresses here, caller will add up proper offsets,
@@ -87,17 +130,75 @@ bool VPUFrameBuffers::reserve(size_t frame_buffer_size,
     return true;
 }
 
+void VPUFrameBuffers::prewarm(size_t frame_buffer_size, size_t number_of_frame_buffers)
+{
+    /* Frames bigger than current ones replace all of these, otherwise these
+     are of current size, so that all the frames stay the same size */
+    size_t missing = number_of_frame_buffers;
+    if (frame_buffer_size <= m_frame_buffer_size) {
+        frame_buffer_size = m_frame_buffer_size;
+        /* Frames given for display can't be recycled, but those usually come
+         back before reopening happens */
+        missing = number_of_frame_buffers > m_frames.size()
+            ? number_of_frame_buffers - m_frames.size() : 0;
+    }
+    /* Old frames are still held, these come on top of them */
+    if (missing * frame_buffer_size > VPU_FRAME_PREWARM_MAX_SIZE) {
+        missing = VPU_FRAME_PREWARM_MAX_SIZE / frame_buffer_size;
+    }
+    if (!missing) {
+        return;
+    }
+
+    if (m_prewarming.valid()) {
+        if ((m_prewarming_frame_size == frame_buffer_size)
+            && (m_prewarming_number_of_frames == missing)) {
+            /* Already on it */
+            return;
+        }
+        /* Geometry changed once again before reopening, previous frames are
+         of no use - but it is decoding thread that calls, so instead of
+         waiting for their allocation, next call gets to start over */
+        if (m_prewarming.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+        m_prewarming.get();
+    }
+
+    codec_log_info(m_logger, "Prewarming %zu frames %.2fMB each", missing,
+                   (double)frame_buffer_size / (1024 * 1024));
+    m_prewarming_frame_size = frame_buffer_size;
+    m_prewarming_number_of_frames = missing;
+    std::shared_ptr<VPUFramePool> pool = m_pool;
+    std::shared_ptr<VPUFramePool::Account> account = m_account;
+    m_prewarming = std::async(std::launch::async, [pool, account, frame_buffer_size, missing]() {
+        auto before = std::chrono::steady_clock::now();
+        PrewarmedFrames prewarmed;
+        prewarmed.frame_size = frame_buffer_size;
+        prewarmed.frames.reserve(missing);
+        while (prewarmed.frames.size() < missing) {
+            VPUDMAPointer dma = pool ? pool->borrow(frame_buffer_size, account)
+                                     : VPUDecodingSession::allocate_dma(frame_buffer_size);
+            if (!dma) {
+                /* reserve() will try again (and report the problem) */
+                break;
+            }
+            prewarmed.frames.push_back(dma);
+        }
+        auto duration = std::chrono::steady_clock::now() - before;
+        prewarmed.allocation_time
+            = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+        return prewarmed;
+    });
+}
+
 void VPUFrameBuffers::mark_frame_as_returned(unsigned long physical_address)
 {
     /* Now we have to identify which frame it was using the physical address */
     for (size_t idx = 0; idx < m_frames.size(); idx++) {
         if (m_frames[idx].dma->phy_addr == physical_address) {
             /* Frame found */
-            m_frames[idx].given_for_display = false;
-            m_frames[idx].clear_display_flag = true;
-            /* DO NOT clear flag here - we may have decoder running, and then
-             operation would be silently ignored, "leaking" frame in effect.
-             This way allows us to experiment with asynchronous decoding */
+            return_frame(idx);
         }
     }
 
@@ -110,18 +211,90 @@ void VPUFrameBuffers::mark_frame_as_returned(unsigned long physical_address)
      So do nothing if an invalid frame is given. */
 }
 
+bool VPUFrameBuffers::queue_return(const VPUFrameHandle &handle, const VPUDMAPointer &dma)
+{
+    /* Stale ones go through the queue too, display reserve still has to know
+     about them, but don't count as frames for decoding */
+    QueuedReturn queued;
+    queued.handle = handle;
+    queued.dma = dma;
+    queued.counted = (handle.generation == m_generation.load(std::memory_order_acquire));
+    /* Counted before it can be popped, so the count never goes below zero */
+    if (queued.counted) {
+        ++m_number_of_queued_returns;
+    }
+    if (!m_returned.push(queued)) {
+        if (queued.counted) {
+            --m_number_of_queued_returns;
+        }
+        ++m_number_of_lost_returns;
+        return false;
+    }
+    return true;
+}
+
+void VPUFrameBuffers::apply_queued_returns()
+{
+    size_t lost = m_number_of_lost_returns.exchange(0);
+    if (lost) {
+        codec_log_error(m_logger, "Frame return queue full, %zu frames lost until reopening",
+                        lost);
+    }
+    QueuedReturn queued;
+    while (m_returned.pop(queued)) {
+        if (!wait_for_dmabuf_idle(queued.dma, VPU_DMABUF_RETURN_TIMEOUT)) {
+            /* Holding it longer would stall decoding, consumer should have
+             waited for its GPU work before releasing the frame */
+            codec_log_warn_limited(m_logger, "Fences of returned frame did not signal in %d msec",
+                                   VPU_DMABUF_RETURN_TIMEOUT);
+        }
+        if (queued.counted) {
+            --m_number_of_queued_returns;
+        }
+        /* These are the frames given out by this generation, not returned
+         already */
+        const VPUFrameHandle &handle = queued.handle;
+        if ((handle.generation == m_generation.load(std::memory_order_relaxed))
+            && (handle.index < m_frames.size()) && m_frames[handle.index].given_for_display) {
+            return_frame(handle.index);
+        }
+        if (m_display_reserve && queued.dma) {
+            m_display_reserve->frame_returned(queued.dma->phy_addr);
+        }
+    }
+}
+
+void VPUFrameBuffers::return_frame(size_t index)
+{
+    VPUFrameMemoryAndMetadata &frame = m_frames[index];
+    if (frame.given_for_display) {
+        frame.given_for_display = false;
+        --m_number_of_frames_given_for_display;
+    }
+    /* DO NOT clear flag here - we may have decoder running, and then
+     operation would be silently ignored, "leaking" frame in effect.
+     This way allows us to experiment with asynchronous decoding */
+    if (!frame.clear_display_flag) {
+        frame.clear_display_flag = true;
+        m_pending_clears.push_back(index);
+    }
+}
+
 bool VPUFrameBuffers::return_frames_now(DecHandle decoder)
 {
-    for (size_t idx = 0; idx < m_frames.size(); idx++) {
-        if (m_frames[idx].clear_display_flag) {
-            if (RETCODE_SUCCESS != vpu_DecClrDispFlag(decoder, idx)) {
-                /* Not much we can do here, and it means that decoder will run out
-                 of memory soon, so... */
-                codec_log_fatal(m_logger, "Could not return displayed frame back to decoder");
-                return false;
-            }
-            m_frames[idx].clear_display_flag = false;
+    /* Queued returns go in one batch */
+    apply_queued_returns();
+
+    while (!m_pending_clears.empty()) {
+        size_t idx = m_pending_clears.back();
+        if (RETCODE_SUCCESS != vpu_DecClrDispFlag(decoder, idx)) {
+            /* Not much we can do here, and it means that decoder will run out
+             of memory soon, so... */
+            codec_log_fatal(m_logger, "Could not return displayed frame back to decoder");
+            return false;
         }
+        m_frames[idx].clear_display_flag = false;
+        m_pending_clears.pop_back();
     }
     return true;
 }
@@ -136,18 +309,14 @@ bool VPUFrameBuffers::has_frame_for_decoding() const
      of free frames into its place. And so proper way of checking "if there is
      a frame for decoding" is basically checking if we have given away less
      frames than display reserve */
-    size_t number_of_frame_buffers_given_out_for_display = 0;
-    for (auto f : m_frames) {
-        if (f.given_for_display) {
-            ++number_of_frame_buffers_given_out_for_display;
-        }
-    }
-    return number_of_frame_buffers_given_out_for_display
-        < m_number_of_display_frame_buffers;
+    size_t given = m_number_of_frames_given_for_display;
+    size_t queued = m_number_of_queued_returns.load(std::memory_order_acquire);
+    given -= (queued < given) ? queued : given;
+    return given < m_number_of_display_frame_buffers;
 }
 
 void VPUFrameBuffers::frame_decoded(size_t index,
-                                    const std::shared_ptr<FrameMetaData> &meta)
+                                    const FrameMeta &meta)
 {
     /* Have decoded frame, assign metadata. Note that decoding frame is not
      the same as giving it away for display - we may be operating codec
@@ -161,15 +330,21 @@ void VPUFrameBuffers::frame_decoded(size_t index,
 
 void VPUFrameBuffers::frame_to_be_given_for_display(size_t index,
                                                     VPUDMAPointer &dma_return,
-                                                    std::shared_ptr<FrameMetaData> &meta_return)
+                                                    FrameMeta &meta_return,
+                                                    VPUFrameHandle &handle_return)
 {
     assert(index < m_frames.size());
     assert(m_frames[index].meta);
     /* Give back DMA memory and frame metadata */
     dma_return = m_frames[index].dma;
     meta_return = m_frames[index].meta;
+    handle_return.generation = m_generation.load(std::memory_order_relaxed);
+    handle_return.index = index;
     /* Mark frame as given out for display, clear metadata */
-    m_frames[index].given_for_display = true;
+    if (!m_frames[index].given_for_display) {
+        m_frames[index].given_for_display = true;
+        ++m_number_of_frames_given_for_display;
+    }
     m_frames[index].meta.reset();
 }
 }
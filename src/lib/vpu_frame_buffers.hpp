@@ -7,18 +7,37 @@
 
 #pragma once
 
+#include <atomic>
+#include <future>
 #include <vector>
 
 #include "codec_common.hpp"
 #include "codec_logger.hpp"
+#include "spsc_queue.hpp"
 #include "vpu_dma_pointer.hpp"
+#include "vpu_frame_pool.hpp"
+#include "vpu_output_frame.hpp"
 
 namespace airtame {
+class DisplayFrameReserve;
+
+/* Frame returns queue_return() can hold until they are applied. Each frame
+ given out is returned once, so it only has to be bigger than the frames
+ decoder has */
+#define VPU_FRAME_RETURN_QUEUE_SIZE 64
+/* Time (msec) returns applied wait for the fences on dmabuf of frame
+ returned (see wait_for_dmabuf_idle()) before giving it back regardless */
+#define VPU_DMABUF_RETURN_TIMEOUT 100
+/* Most DMA memory (bytes) prewarm() allocates while frames of the current
+ session are still held, so that old and new frames together stay within
+ what is held plus this. Rest of the frames reserve() allocates, once old ones
+ are let go. Six Full HD frames */
+#define VPU_FRAME_PREWARM_MAX_SIZE (24 * 1024 * 1024)
 struct VPUFrameMemoryAndMetadata {
     VPUDMAPointer dma;
     /* Metadata is assigned on the decode, and removed when frame is given for
      display. Could also use it as "not yet displayed" flag */
-    std::shared_ptr<FrameMetaData> meta;
+    FrameMeta meta;
     /* This frame was given away for display ant not given back yet, it can't be
      used by decode. Note that inverse is not always true - when flag is false
      it doesn't mean that it is free, it might be a reference frame. This can be
@@ -56,6 +75,52 @@ private:
      infomation we need for respective frame buffers */
     std::vector <FrameBuffer> m_decoder_buffers;
     std::vector <VPUFrameMemoryAndMetadata> m_frames;
+
+    /* When set, frames are borrowed from (and go back to) the pool shared with
+     other decoders, instead of being allocated just for this instance */
+    std::shared_ptr<VPUFramePool> m_pool;
+    std::shared_ptr<VPUFramePool::Account> m_account;
+
+    /* Frames allocated in the background ahead of decoder reopening, see
+     prewarm() */
+    class PrewarmedFrames {
+    public:
+        size_t frame_size = 0;
+        std::vector<VPUDMAPointer> frames;
+        /* How long it took to allocate these (msec) */
+        Timestamp allocation_time = 0;
+    };
+    std::future<PrewarmedFrames> m_prewarming;
+    size_t m_prewarming_frame_size = 0;
+    size_t m_prewarming_number_of_frames = 0;
+    /* Outcome of last reserve() */
+    size_t m_number_of_prewarmed_frames_used = 0;
+    Timestamp m_prewarm_time_saved = 0;
+
+    /* Of frames in m_frames, changes when these are set up anew (see
+     VPUFrameHandle). Written by decoder thread only */
+    std::atomic<size_t> m_generation{ 0 };
+    /* Return by handle, as queue_return() got it. Holds on to the frame
+     memory, as its fences are waited for when applied */
+    struct QueuedReturn {
+        VPUFrameHandle handle;
+        VPUDMAPointer dma;
+        /* Handle was of current generation when queued, counted in
+         m_number_of_queued_returns */
+        bool counted = false;
+    };
+    /* Returns by handle, applied by apply_queued_returns() */
+    SPSCQueue<QueuedReturn> m_returned{ VPU_FRAME_RETURN_QUEUE_SIZE };
+    /* Of returns queued, those has_frame_for_decoding() counts as returned
+     already */
+    std::atomic<size_t> m_number_of_queued_returns{ 0 };
+    /* Returns queue_return() found no room for, logged when applying */
+    std::atomic<size_t> m_number_of_lost_returns{ 0 };
+    /* Told about returns once they are applied, if set */
+    DisplayFrameReserve *m_display_reserve = nullptr;
+    /* Frames returned whose display flag decoder still has to clear */
+    std::vector<size_t> m_pending_clears;
+    size_t m_number_of_frames_given_for_display = 0;
 public:
     VPUFrameBuffers(CodecLogger &logger)
         : m_logger(logger)
@@ -70,16 +135,111 @@ public:
     bool reserve(size_t frame_buffer_size, size_t number_of_reference_frame_buffers,
                  size_t number_of_display_frame_buffers, FrameBuffer *(&decoder_buffers));
 
+    /* Should be called before first reserve(), frames allocated before are
+     not moved to the pool */
+    void set_pool(const std::shared_ptr<VPUFramePool> &pool)
+    {
+        m_pool = pool;
+        m_account.reset(pool ? new VPUFramePool::Account() : nullptr);
+    }
+
+    /* Frame allocation is the slow part of decoder reopening (it can take
+     100ms and more for Full HD streams), so when it is known ahead of time
+     (for example upcoming frame pack in the queue has new geometry) that next
+     reserve() will need frames that can't be recycled, they can be allocated
+     in the background by calling this. Next reserve() uses them if they fit,
+     waiting for allocation to complete, if need be. Allocates at most
+     VPU_FRAME_PREWARM_MAX_SIZE. Never waits itself: when called for other
+     frames while allocation for the previous call still runs, it returns, and
+     the call after the allocation is done starts over */
+    void prewarm(size_t frame_buffer_size, size_t number_of_frame_buffers);
+
+    /* Frames in the background allocation, or allocated, and not used yet by
+     reserve() */
+    bool is_prewarming() const
+    {
+        return m_prewarming.valid();
+    }
+
+    /* Number of prewarmed frames last reserve() used, and allocation time
+     that saved (msec) */
+    size_t get_number_of_prewarmed_frames_used() const
+    {
+        return m_number_of_prewarmed_frames_used;
+    }
+
+    Timestamp get_prewarm_time_saved() const
+    {
+        return m_prewarm_time_saved;
+    }
+
+    /* Lets go of all the frames, so these can go back to the pool (those given
+     for display will go there once returned by the user). Decoder must not
+     be using them anymore */
+    void release()
+    {
+        /* Queued returns hold on to the frames too */
+        apply_queued_returns();
+        m_decoder_buffers.clear();
+        m_frames.clear();
+        m_frame_buffer_size = 0;
+        forget_given_frames();
+        if (m_prewarming.valid()) {
+            m_prewarming.get();
+        }
+    }
+
+    /* Frees idle frames of the pool, whichever decoder gave them back,
+     so that allocations outside of the pool get the memory. Returns size
+     freed (bytes), zero when no pool is used */
+    size_t trim_pool()
+    {
+        return m_pool ? m_pool->trim() : 0;
+    }
+
+    /* Borrowed from the pool right now and at most (bytes), zero when no pool
+     is used */
+    size_t get_pooled_size() const
+    {
+        return m_account ? m_account->current_size.load() : 0;
+    }
+
+    size_t get_max_pooled_size() const
+    {
+        return m_account ? m_account->max_size.load() : 0;
+    }
+
+    /* Reserve to tell about frames queue_return() got, once they are applied.
+     Must outlive this */
+    void set_display_reserve(DisplayFrameReserve *display_reserve)
+    {
+        m_display_reserve = display_reserve;
+    }
+
     /* Frame with given physical addres is no longer needed for display purposes
      */
     void mark_frame_as_returned(unsigned long physical_address);
+    /* Same, without looking the frame up, and deferred: return is only
+     pushed to the queue, without locking, waiting or logging, and applied
+     along with others by apply_queued_returns(). So unlike everything else
+     here it can be called from other thread than the decoding one (display,
+     GPU...), but from one such thread at a time. Returns false if queue is
+     full */
+    bool queue_return(const VPUFrameHandle &handle, const VPUDMAPointer &dma);
+    /* Applies returns queued so far: waits for the fences of each frame (up
+     to VPU_DMABUF_RETURN_TIMEOUT), gives back those of current generation
+     and tells display reserve about all of them. Decoding thread only,
+     return_frames_now() does it too */
+    void apply_queued_returns();
     // TODO: not really nice interface, as it is the only function that "knows"
     // about the decoder, think of other way
     bool return_frames_now(DecHandle decoder);
+    /* Frames queued for return count as returned already */
     bool has_frame_for_decoding() const;
-    void frame_decoded(size_t index, const std::shared_ptr<FrameMetaData> &meta);
+    void frame_decoded(size_t index, const FrameMeta &meta);
     void frame_to_be_given_for_display(size_t index, VPUDMAPointer &dma_return,
-                                       std::shared_ptr<FrameMetaData> &meta_return);
+                                       FrameMeta &meta_return,
+                                       VPUFrameHandle &handle_return);
     // Accessors
     size_t get_number_of_reference_frame_buffers() const
     {
@@ -90,5 +250,15 @@ public:
     {
         return m_number_of_display_frame_buffers;
     }
+
+private:
+    void return_frame(size_t index);
+    /* Frames set up anew, handles given out so far go stale */
+    void forget_given_frames()
+    {
+        ++m_generation;
+        m_pending_clears.clear();
+        m_number_of_frames_given_for_display = 0;
+    }
 };
 } // namespace airtame
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "vpu_frame_pool.hpp"
+
+namespace airtame {
+
+VPUFramePool::~VPUFramePool()
+{
+    /* No frames can be borrowed at this point - they keep the pool alive */
+    trim();
+}
+
+VPUDMAPointer VPUFramePool::borrow(size_t size, const std::shared_ptr<Account> &account)
+{
+    size_t bucket = (size + m_bucket_size - 1) / m_bucket_size * m_bucket_size;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    /* Smallest idle frame that fits, as long as it doesn't waste more than a
+     quarter of itself */
+    auto it = m_idle_frames.lower_bound(bucket);
+    while ((it != m_idle_frames.end()) && it->second.empty()) {
+        ++it;
+    }
+    if ((it != m_idle_frames.end()) && (it->first <= bucket + bucket / 4)) {
+        vpu_mem_desc *dma = it->second.back();
+        it->second.pop_back();
+        m_idle_size -= it->first;
+        ++account->number_of_reuses;
+        return wrap(dma, account);
+    }
+
+    if (!make_room(bucket)) {
+        return VPUDMAPointer(nullptr);
+    }
+
+    vpu_mem_desc *dma = dma_allocate(bucket);
+    if (!dma) {
+        /* Fragmented DMA memory perhaps, try again without idle frames */
+        bool trimmed = m_idle_size > 0;
+        free_idle_frames();
+        if (!trimmed || !(dma = dma_allocate(bucket))) {
+            return VPUDMAPointer(nullptr);
+        }
+    }
+    m_total_size += bucket;
+    if (m_max_total_size < m_total_size) {
+        m_max_total_size = m_total_size;
+    }
+    return wrap(dma, account);
+}
+
+bool VPUFramePool::adopt(vpu_mem_desc *dma)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!make_room(dma->size)) {
+        dma_pointer_deleter(dma);
+        return false;
+    }
+    m_idle_frames[dma->size].push_back(dma);
+    m_idle_size += dma->size;
+    m_total_size += dma->size;
+    if (m_max_total_size < m_total_size) {
+        m_max_total_size = m_total_size;
+    }
+    return true;
+}
+
+size_t VPUFramePool::trim()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t freed = m_idle_size;
+    free_idle_frames();
+    return freed;
+}
+
+size_t VPUFramePool::get_total_size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_total_size;
+}
+
+size_t VPUFramePool::get_idle_size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_idle_size;
+}
+
+size_t VPUFramePool::get_max_total_size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_max_total_size;
+}
+
+void VPUFramePool::give_back(vpu_mem_desc *dma, const std::shared_ptr<Account> &account)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    account->current_size -= dma->size;
+    m_idle_frames[dma->size].push_back(dma);
+    m_idle_size += dma->size;
+}
+
+/* Has to be called with mutex held */
+VPUDMAPointer VPUFramePool::wrap(vpu_mem_desc *dma, const std::shared_ptr<Account> &account)
+{
+    ++account->number_of_borrows;
+    account->current_size += dma->size;
+    if (account->max_size < account->current_size) {
+        account->max_size = account->current_size.load();
+    }
+    /* Frame keeps the pool alive, so it always has a place to go back to */
+    std::shared_ptr<VPUFramePool> pool = shared_from_this();
+    return VPUDMAPointer(dma, [pool, account](vpu_mem_desc *released) {
+        pool->give_back(released, account);
+    });
+}
+
+bool VPUFramePool::make_room(size_t size)
+{
+    if (!m_budget) {
+        return true;
+    }
+    /* Free idle frames, biggest first, until it fits */
+    auto it = m_idle_frames.rbegin();
+    while ((m_total_size + size > m_budget) && (it != m_idle_frames.rend())) {
+        if (it->second.empty()) {
+            ++it;
+            continue;
+        }
+        free_frame(it->second.back());
+        it->second.pop_back();
+    }
+    return m_total_size + size <= m_budget;
+}
+
+/* Has to be called with mutex held */
+void VPUFramePool::free_idle_frames()
+{
+    for (auto &idle : m_idle_frames) {
+        for (vpu_mem_desc *frame : idle.second) {
+            free_frame(frame);
+        }
+    }
+    m_idle_frames.clear();
+}
+
+/* Has to be called with mutex held */
+void VPUFramePool::free_frame(vpu_mem_desc *dma)
+{
+    m_total_size -= dma->size;
+    m_idle_size -= dma->size;
+    dma_pointer_deleter(dma);
+}
+} // namespace airtame
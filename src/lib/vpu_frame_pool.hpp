@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "vpu_dma_pointer.hpp"
+
+namespace airtame {
+
+/* Frame sizes are rounded up to this, so that frames of similar (but not
+ the same) geometry would still land in one bucket */
+#define VPU_FRAME_POOL_BUCKET_SIZE (64 * 1024)
+
+/* DMA frame memory pool that can be shared by several decoders, for example
+ when several streams are played at once and each of decoders would otherwise
+ keep allocations sized to its own peak. Frames are borrowed by
+ VPUFrameBuffers::reserve(), and come back to the pool automatically when
+ last reference to them goes away - so frames still held for display return
+ only once display is done with them, just like with plain allocations.
+
+ Pool keeps idle frames in buckets by (rounded up) size and reuses them for
+ requests of the same or slightly smaller size. Total size of frames allocated
+ through the pool (borrowed plus idle) is kept within the budget, idle frames
+ are freed to make room if needed.
+
+ Pool can be used from several threads at once, and it has to be created
+ with create(), because frames refer back to it */
+class VPUFramePool : public std::enable_shared_from_this<VPUFramePool> {
+public:
+    /* Each borrower (typically VPUDecoder) gets its own account, so that its
+     usage can be told apart from others */
+    class Account {
+    public:
+        /* Frame memory borrowed right now and at most (bytes) */
+        std::atomic<size_t> current_size;
+        std::atomic<size_t> max_size;
+        /* Number of frames borrowed, and part of these that were idle
+         frames reused (rest had to be allocated) */
+        std::atomic<size_t> number_of_borrows;
+        std::atomic<size_t> number_of_reuses;
+
+        Account()
+            : current_size(0)
+            , max_size(0)
+            , number_of_borrows(0)
+            , number_of_reuses(0)
+        {
+        }
+    };
+
+private:
+    /* Zero means no limit */
+    size_t m_budget;
+    size_t m_bucket_size;
+
+    mutable std::mutex m_mutex;
+    /* Idle frames by their allocation size */
+    std::map<size_t, std::vector<vpu_mem_desc *>> m_idle_frames;
+    size_t m_total_size = 0;
+    size_t m_idle_size = 0;
+    size_t m_max_total_size = 0;
+
+    VPUFramePool(size_t budget, size_t bucket_size)
+        : m_budget(budget)
+        , m_bucket_size(bucket_size)
+    {
+    }
+
+public:
+    static std::shared_ptr<VPUFramePool> create(size_t budget = 0,
+                                                size_t bucket_size = VPU_FRAME_POOL_BUCKET_SIZE)
+    {
+        return std::shared_ptr<VPUFramePool>(new VPUFramePool(budget, bucket_size));
+    }
+    ~VPUFramePool();
+
+    VPUFramePool(const VPUFramePool &) = delete;
+    VPUFramePool &operator=(const VPUFramePool &) = delete;
+
+    /* Returns nullptr if there is no way to get frame within the budget, or
+     if DMA memory is exhausted */
+    VPUDMAPointer borrow(size_t size, const std::shared_ptr<Account> &account);
+
+    /* Takes frame memory allocated elsewhere, typically by the GPU or other
+     dmabuf exporter and wrapped with import_dmabuf(), so that decoders get
+     their frames from it and share them as dmabufs with no copying. Frame
+     goes among idle ones by its own size, so it is borrowed for requests of
+     that size or slightly smaller - allocate it to the frame size decoders
+     ask for. Pool owns it from here on, it counts against the budget and
+     trim() frees it as any other idle frame. Returns false (and frees the
+     frame) if it doesn't fit into the budget */
+    bool adopt(vpu_mem_desc *dma);
+
+    /* Frees all the idle frames, returns their size (bytes) */
+    size_t trim();
+
+    size_t get_budget() const
+    {
+        return m_budget;
+    }
+
+    size_t get_total_size() const;
+    size_t get_idle_size() const;
+    size_t get_max_total_size() const;
+
+private:
+    void give_back(vpu_mem_desc *dma, const std::shared_ptr<Account> &account);
+    VPUDMAPointer wrap(vpu_mem_desc *dma, const std::shared_ptr<Account> &account);
+    /* Frees idle frames until size more fits into the budget, has to be called
+     with mutex held */
+    bool make_room(size_t size);
+    void free_idle_frames();
+    void free_frame(vpu_mem_desc *dma);
+};
+} // namespace airtame
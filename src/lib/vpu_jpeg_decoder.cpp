@@ -14,7 +14,7 @@
 
 namespace airtame {
     bool VPUJPEGDecoder::parse_jpeg_header(const unsigned char *jpeg, size_t size,
-                                           FrameGeometry &geometry)
+                                           FrameGeometry &geometry, size_t *header_size)
     {
         const unsigned char *limit = jpeg + size;
         const unsigned char *marker = at_jpeg_next_marker(jpeg, limit);
@@ -25,6 +25,18 @@ namespace airtame {
             MarkerType m = (MarkerType)marker[1];
             if (MarkerType::SOF0 == m) {
                 /* This is the one we understand and support */
+                if (limit - marker < 10) {
+                    fprintf(stderr, "End of stream within SOF0 marker\n");
+                    return false;
+                }
+                size_t segment_size = (size_t)marker[2] * 256 + marker[3];
+                if ((segment_size < 8 + 3 * 3) || ((size_t)(limit - marker) < 2 + segment_size)) {
+                    fprintf(stderr, "Bad SOF0 segment size %zu\n", segment_size);
+                    return false;
+                }
+                if (header_size) {
+                    *header_size = (marker - jpeg) + 2 + segment_size;
+                }
                 marker += 5; /* Skip two bytes of marker and two bytes of size
                               field and one byte of sample precision */
                 /* Read two bytes of height */
@@ -25,9 +25,11 @@ namespace airtame {
 class VPUJPEGDecoder {
 public:
     /* This is used to obtain width, height of the JPEG image in provided buffer.
-     Returns false on error or if the image is not Baseline 420 */
+     Returns false on error or if the image is not Baseline 420. If asked for,
+     header size is number of bytes up to the end of SOF0 segment, so all the
+     bytes geometry was read from */
     static bool parse_jpeg_header(const unsigned char *jpeg, size_t size,
-                                  FrameGeometry &geometry);
+                                  FrameGeometry &geometry, size_t *header_size = nullptr);
     /* Load bitstream into DMA memory */
     static VPUDMAPointer load_bitstream(const unsigned char *jpeg, size_t size);
     /* Produce NV12 frame (compatible with other frames produced by our decoders)
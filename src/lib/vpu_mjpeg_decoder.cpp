@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <string.h>
+
+#include "vpu_jpeg_decoder.hpp"
+#include "vpu_mjpeg_decoder.hpp"
+
+namespace airtame {
+
+VPUMJPEGDecoder::~VPUMJPEGDecoder()
+{
+    if (m_handle) {
+        if (m_decoding) {
+            /* Frames are going away with us, VPU mustn't write them after */
+            VPUDecodingSession::finish_jpeg(m_logger, m_handle);
+        }
+        vpu_DecClose(m_handle);
+    }
+}
+
+bool VPUMJPEGDecoder::load(const unsigned char *jpeg, size_t size,
+                           const FrameMeta &meta)
+{
+    if (m_loaded) {
+        codec_log_error(m_logger, "MJPEG image loaded already, decode it first");
+        return false;
+    }
+    if (!get_geometry(jpeg, size)) {
+        return false;
+    }
+
+    /* With two buffers and only one image loaded at a time, this one is never
+     the one VPU decodes from */
+    VPUDMAPointer &bitstream = m_bitstreams[m_next_bitstream];
+    if (!bitstream || ((size_t)bitstream->size < size)) {
+        bitstream.reset();
+        bitstream = VPUDecodingSession::allocate_dma(
+            size + size * VPU_MJPEG_DECODER_BITSTREAM_HEADROOM / 100);
+        if (!bitstream || (RETCODE_FAILURE == IOGetVirtMem(&*bitstream))) {
+            codec_log_error(m_logger, "Cannot allocate %zu bytes of MJPEG bitstream buffer",
+                            size);
+            bitstream.reset();
+            return false;
+        }
+        ++m_number_of_allocations;
+    }
+
+    ::memcpy((void *)bitstream->virt_uaddr, jpeg, size);
+    m_loaded = true;
+    m_loaded_size = size;
+    m_loaded_meta = meta;
+    return true;
+}
+
+bool VPUMJPEGDecoder::begin_decode()
+{
+    if (!m_loaded || m_decoding) {
+        codec_log_error(m_logger, "No MJPEG image to decode, or decoding already");
+        return false;
+    }
+    /* Image is consumed, whatever happens below */
+    m_loaded = false;
+    VPUDMAPointer &bitstream = m_bitstreams[m_next_bitstream];
+    m_next_bitstream = (m_next_bitstream + 1) % VPU_MJPEG_DECODER_NUMBER_OF_BITSTREAM_BUFFERS;
+
+    if (!m_handle) {
+        m_handle = VPUDecodingSession::open_jpeg(m_logger, m_interleave);
+        if (!m_handle) {
+            return false;
+        }
+    }
+
+    VPUDMAPointer frame = get_free_frame();
+    if (!frame) {
+        return false;
+    }
+    if (!VPUDecodingSession::start_jpeg(m_logger, m_handle, bitstream, m_loaded_size, frame,
+                                        m_geometry, m_interleave)) {
+        m_free_frames.push_back(frame);
+        return false;
+    }
+
+    m_decoding = true;
+    m_decoding_frame.dma = frame;
+    m_decoding_frame.size = frame->size;
+    m_decoding_frame.meta = m_loaded_meta;
+    m_decoding_frame.geometry = m_geometry;
+    m_loaded_meta.reset();
+    return true;
+}
+
+bool VPUMJPEGDecoder::finish_decode(VPUOutputFrame &output_frame)
+{
+    if (!m_decoding) {
+        return false;
+    }
+    m_decoding = false;
+    if (!VPUDecodingSession::finish_jpeg(m_logger, m_handle)) {
+        return_output_frame(m_decoding_frame.dma);
+        m_decoding_frame.reset();
+        return false;
+    }
+    ++m_number_of_images_decoded;
+    output_frame = m_decoding_frame;
+    m_decoding_frame.reset();
+    return true;
+}
+
+bool VPUMJPEGDecoder::decode(const unsigned char *jpeg, size_t size,
+                             VPUOutputFrame &output_frame,
+                             const FrameMeta &meta)
+{
+    return load(jpeg, size, meta) && begin_decode() && finish_decode(output_frame);
+}
+
+void VPUMJPEGDecoder::return_output_frame(const VPUDMAPointer &dma)
+{
+    /* Frames of old geometry are just let go */
+    if (dma && ((size_t)dma->size
+                == VPUDecodingSession::prepare_nv12_frame_buffer_template(m_geometry).bufMvCol)) {
+        m_free_frames.push_back(dma);
+    }
+}
+
+bool VPUMJPEGDecoder::get_geometry(const unsigned char *jpeg, size_t size)
+{
+    /* MJPEG sources repeat the same header for every image, and if so, it
+     was validated already */
+    if (!m_header.empty() && (size >= m_header.size())
+        && !::memcmp(jpeg, m_header.data(), m_header.size())) {
+        ++m_number_of_headers_reused;
+        return true;
+    }
+
+    FrameGeometry geometry;
+    size_t header_size = 0;
+    if (!VPUJPEGDecoder::parse_jpeg_header(jpeg, size, geometry, &header_size)) {
+        codec_log_error(m_logger, "Not Baseline 420 JPEG image, dropping it");
+        return false;
+    }
+    m_header.assign(jpeg, jpeg + header_size);
+
+    if ((geometry.m_padded_width != m_geometry.m_padded_width)
+        || (geometry.m_padded_height != m_geometry.m_padded_height)) {
+        codec_log_info(m_logger, "MJPEG resolution %zux%zu", geometry.m_true_width,
+                       geometry.m_true_height);
+        /* Frames of the old size go away as they get returned */
+        m_free_frames.clear();
+    }
+    m_geometry = geometry;
+    return true;
+}
+
+VPUDMAPointer VPUMJPEGDecoder::get_free_frame()
+{
+    if (!m_free_frames.empty()) {
+        VPUDMAPointer frame = m_free_frames.back();
+        m_free_frames.pop_back();
+        return frame;
+    }
+    /* Pool grows up to the number of frames held at once by the user, plus
+     the one decoded to */
+    VPUDMAPointer frame = VPUJPEGDecoder::produce_jpeg_frame(m_geometry);
+    if (!frame) {
+        codec_log_error(m_logger, "Cannot allocate MJPEG frame");
+        return frame;
+    }
+    ++m_number_of_allocations;
+    return frame;
+}
+}
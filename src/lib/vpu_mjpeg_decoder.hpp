@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <stddef.h>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "frame_meta_data.hpp"
+#include "vpu_decoding_session.hpp"
+#include "vpu_dma_pointer.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* One image is decoded while the next one gets loaded, so two of these are
+ enough */
+#define VPU_MJPEG_DECODER_NUMBER_OF_BITSTREAM_BUFFERS 2
+
+/* Bitstream buffers are allocated with this much (percent) headroom over the
+ image that needed them, so that slightly bigger images that follow still fit */
+#define VPU_MJPEG_DECODER_BITSTREAM_HEADROOM 25
+
+/* MJPEG (or any series of JPEGs) decoder. VPUJPEGDecoder opens the decoder
+ and allocates DMA memory for every image, and for 30 frames/s sources that
+ costs more than decoding itself. This one keeps the decoder open, and the
+ DMA bitstream and frame buffers around, for the whole stream:
+ - JPEG image is load()ed into one of the bitstream buffers, which is the
+ only copy done. If its header (everything up to the end of SOF0 segment) is
+ the same as the one of previous image, it isn't parsed again
+ - begin_decode() starts VPU decoding loaded image, and finish_decode() waits
+ for it to complete and gives decoded frame away. In between is the time to
+ load() the next image, into the other bitstream buffer - so that copy of
+ image N + 1 is done while VPU decodes image N
+ - Frames given away have to be returned with return_output_frame(), then
+ they get reused. Resolution change drops frames of the old size as they
+ come back.
+
+ Note that VPU decodes one thing at a time, so decode must not be in progress
+ in other decoders between begin_decode() and finish_decode() */
+class VPUMJPEGDecoder {
+private:
+    CodecLogger &m_logger;
+    bool m_interleave;
+    DecHandle m_handle = nullptr;
+
+    VPUDMAPointer m_bitstreams[VPU_MJPEG_DECODER_NUMBER_OF_BITSTREAM_BUFFERS];
+    /* Bitstream buffer next load() goes to */
+    size_t m_next_bitstream = 0;
+
+    /* Image loaded and waiting for begin_decode() */
+    bool m_loaded = false;
+    size_t m_loaded_size = 0;
+    FrameMeta m_loaded_meta;
+
+    /* Header of the last image parsed, and its geometry */
+    std::vector<unsigned char> m_header;
+    FrameGeometry m_geometry;
+
+    /* Frame being decoded to, if decoding */
+    bool m_decoding = false;
+    VPUOutputFrame m_decoding_frame;
+    /* Frames of current geometry to decode to */
+    std::vector<VPUDMAPointer> m_free_frames;
+
+    size_t m_number_of_images_decoded = 0;
+    size_t m_number_of_headers_reused = 0;
+    size_t m_number_of_allocations = 0;
+
+public:
+    VPUMJPEGDecoder(CodecLogger &logger, bool interleave = true)
+        : m_logger(logger)
+        , m_interleave(interleave)
+    {
+    }
+    ~VPUMJPEGDecoder();
+
+    VPUMJPEGDecoder(const VPUMJPEGDecoder &) = delete;
+    VPUMJPEGDecoder &operator=(const VPUMJPEGDecoder &) = delete;
+
+    /* Copies JPEG image (all of it, SOI to EOI) into DMA memory, frame
+     decoded out of it will get given metadata. Returns false if image is not
+     Baseline 420, or if there is loaded image already */
+    bool load(const unsigned char *jpeg, size_t size,
+              const FrameMeta &meta = FrameMeta());
+    bool has_loaded_image() const
+    {
+        return m_loaded;
+    }
+    /* Geometry of the last image loaded */
+    const FrameGeometry &get_frame_geometry() const
+    {
+        return m_geometry;
+    }
+
+    /* Starts decoding loaded image. On false image is dropped, and decoding
+     can go on with the next one */
+    bool begin_decode();
+    bool is_decoding() const
+    {
+        return m_decoding;
+    }
+    /* Blocks until decode completes, false on error */
+    bool finish_decode(VPUOutputFrame &output_frame);
+    /* All of the above in one go */
+    bool decode(const unsigned char *jpeg, size_t size, VPUOutputFrame &output_frame,
+                const FrameMeta &meta = FrameMeta());
+
+    /* Frame given away is no longer needed */
+    void return_output_frame(const VPUDMAPointer &dma);
+
+    size_t get_number_of_images_decoded() const
+    {
+        return m_number_of_images_decoded;
+    }
+
+    /* Images whose header matched previous one, so weren't parsed */
+    size_t get_number_of_headers_reused() const
+    {
+        return m_number_of_headers_reused;
+    }
+
+    /* DMA allocations done, both bitstream and frame buffers. Once stream
+     runs this stays put, unless images grow or resolution changes */
+    size_t get_number_of_allocations() const
+    {
+        return m_number_of_allocations;
+    }
+
+private:
+    bool get_geometry(const unsigned char *jpeg, size_t size);
+    VPUDMAPointer get_free_frame();
+};
+}
@@ -14,13 +14,30 @@
 #include "vpu_dma_pointer.hpp"
 
 namespace airtame {
+/* Frame given out by the decoder, so that it can be returned without
+ looking it up by physical address (see VPUFrameBuffers::queue_return()).
+ Generation changes each time decoder frames are set up anew, so handles of
+ frames that went away with previous session are told apart and ignored */
+struct VPUFrameHandle {
+    size_t generation = 0;
+    size_t index = 0;
+
+    bool is_valid() const
+    {
+        return generation != 0;
+    }
+};
+
 struct VPUOutputFrame {
     VPUDMAPointer dma;
     size_t size = 0;
-    std::shared_ptr<FrameMetaData> meta;
+    FrameMeta meta;
     FrameGeometry geometry;
+    /* Not valid for frames that aren't decoder's own (rotated ones, ones
+     decoded by other engines), these go back by physical address */
+    VPUFrameHandle handle;
 
-    bool has_data()
+    bool has_data() const
     {
         return (bool)dma;
     }
@@ -31,6 +48,7 @@ struct VPUOutputFrame {
         meta.reset();
         size = 0;
         geometry = FrameGeometry();
+        handle = VPUFrameHandle();
     }
 };
 
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "vpu_decoding_session.hpp"
+#include "vpu_rotator.hpp"
+
+namespace airtame {
+
+FrameGeometry VPURotation::get_output_geometry(const FrameGeometry &geometry) const
+{
+    FrameGeometry output = geometry;
+    /* Picture is cropped out of padded frame, so padding moves along with the
+     edge it was at */
+    size_t right = geometry.m_padded_width - geometry.m_crop_left - geometry.m_true_width;
+    size_t bottom = geometry.m_padded_height - geometry.m_crop_top - geometry.m_true_height;
+    if ((90 == angle) || (270 == angle)) {
+        output.m_padded_width = geometry.m_padded_height;
+        output.m_padded_height = geometry.m_padded_width;
+        output.m_true_width = geometry.m_true_height;
+        output.m_true_height = geometry.m_true_width;
+    }
+    switch (angle) {
+    case 90:
+        /* Counterclockwise, so top edge goes left, and right edge to the top */
+        output.m_crop_left = geometry.m_crop_top;
+        output.m_crop_top = right;
+        break;
+    case 180:
+        output.m_crop_left = right;
+        output.m_crop_top = bottom;
+        break;
+    case 270:
+        output.m_crop_left = bottom;
+        output.m_crop_top = geometry.m_crop_left;
+        break;
+    default:
+        break;
+    }
+
+    /* Mirroring applies to what got rotated */
+    if ((MIRDIR_HOR == mirror) || (MIRDIR_HOR_VER == mirror)) {
+        output.m_crop_left
+            = output.m_padded_width - output.m_crop_left - output.m_true_width;
+    }
+    if ((MIRDIR_VER == mirror) || (MIRDIR_HOR_VER == mirror)) {
+        output.m_crop_top
+            = output.m_padded_height - output.m_crop_top - output.m_true_height;
+    }
+    return output;
+}
+
+VPURotator::VPURotator(CodecLogger &logger, const VPURotation &rotation,
+                       const FrameGeometry &input_geometry)
+    : m_logger(logger)
+    , m_rotation(rotation)
+    , m_geometry(rotation.get_output_geometry(input_geometry))
+    , m_template(VPUDecodingSession::prepare_nv12_frame_buffer_template(m_geometry))
+{
+}
+
+bool VPURotator::allocate(size_t number_of_frames)
+{
+    m_frames.resize(number_of_frames);
+    for (auto &frame : m_frames) {
+        /* NV12 part of the frame only */
+        frame.dma = VPUDecodingSession::allocate_dma(m_template.bufMvCol);
+        if (!frame.dma) {
+            codec_log_error(m_logger, "Cannot allocate rotator frame");
+            m_frames.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VPURotator::has_frame_for_decoding() const
+{
+    for (auto &frame : m_frames) {
+        if (!frame.given_for_display) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VPURotator::start(DecHandle handle)
+{
+    if (!m_commands_given) {
+        /* the datatypes are int, see decode_jpeg() */
+        int rotation_angle = m_rotation.angle;
+        int mirror = m_rotation.mirror;
+        int stride = m_template.strideY;
+        if (RETCODE_SUCCESS != vpu_DecGiveCommand(handle, SET_ROTATOR_STRIDE, (void *)&stride)) {
+            codec_log_error(m_logger, "Cannot set up rotator");
+            return false;
+        }
+        /* Tiled to linear conversion alone needs rotator output and stride
+         only */
+        if (m_rotation.is_enabled()
+            && ((RETCODE_SUCCESS
+                 != vpu_DecGiveCommand(handle, SET_ROTATION_ANGLE, (void *)&rotation_angle))
+                || (RETCODE_SUCCESS
+                    != vpu_DecGiveCommand(handle, SET_MIRROR_DIRECTION, (void *)&mirror))
+                || (RETCODE_SUCCESS != vpu_DecGiveCommand(handle, ENABLE_ROTATION, nullptr))
+                || (RETCODE_SUCCESS != vpu_DecGiveCommand(handle, ENABLE_MIRRORING, nullptr)))) {
+            codec_log_error(m_logger, "Cannot set up rotator");
+            return false;
+        }
+        m_commands_given = true;
+    }
+
+    /* Rotator writes output only when decode gives frame for display, so
+     frame picked before may have not been used yet */
+    m_output = -1;
+    for (size_t idx = 0; idx < m_frames.size(); idx++) {
+        if (!m_frames[idx].given_for_display) {
+            m_output = idx;
+            break;
+        }
+    }
+    if (-1 == m_output) {
+        codec_log_error(m_logger, "No free rotator frame");
+        return false;
+    }
+
+    FrameBuffer frame_buffer = m_template;
+    const VPUDMAPointer &dma = m_frames[m_output].dma;
+    frame_buffer.bufY += dma->phy_addr;
+    frame_buffer.bufCb += dma->phy_addr;
+    frame_buffer.bufCr += dma->phy_addr;
+    /* No motion vectors to go there */
+    frame_buffer.bufMvCol = 0;
+    if (RETCODE_SUCCESS
+        != vpu_DecGiveCommand(handle, SET_ROTATOR_OUTPUT, (void *)&frame_buffer)) {
+        codec_log_error(m_logger, "Cant instruct rotator to use our frame for output");
+        return false;
+    }
+    return true;
+}
+
+bool VPURotator::frame_given_for_display(VPUOutputFrame &output_frame)
+{
+    if (-1 == m_output) {
+        return false;
+    }
+    Frame &frame = m_frames[m_output];
+    m_output = -1;
+    frame.given_for_display = true;
+    output_frame.dma = frame.dma;
+    output_frame.size = frame.dma->size;
+    output_frame.geometry = m_geometry;
+    return true;
+}
+
+bool VPURotator::mark_frame_as_returned(unsigned long physical_address)
+{
+    for (auto &frame : m_frames) {
+        if (frame.dma->phy_addr == physical_address) {
+            frame.given_for_display = false;
+            return true;
+        }
+    }
+    return false;
+}
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <vector>
+
+extern "C" {
+#include <vpu_lib.h>
+}
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "vpu_dma_pointer.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* What VPU rotator (post-processing stage of the decoder) does to frames
+ given for display. Angle is counterclockwise, one of 0, 90, 180 and 270 */
+class VPURotation {
+public:
+    int angle = 0;
+    MirrorDirection mirror = MIRDIR_NONE;
+
+    VPURotation(int rotation_angle = 0, MirrorDirection mirror_direction = MIRDIR_NONE)
+        : angle(rotation_angle)
+        , mirror(mirror_direction)
+    {
+    }
+
+    bool is_enabled() const
+    {
+        return angle || (MIRDIR_NONE != mirror);
+    }
+
+    bool is_valid() const
+    {
+        return (0 == angle) || (90 == angle) || (180 == angle) || (270 == angle);
+    }
+
+    bool operator==(const VPURotation &other) const
+    {
+        return (angle == other.angle) && (mirror == other.mirror);
+    }
+
+    bool operator!=(const VPURotation &other) const
+    {
+        return !(*this == other);
+    }
+
+    /* Geometry of the frame rotator makes out of frame of given one */
+    FrameGeometry get_output_geometry(const FrameGeometry &geometry) const;
+};
+
+/* How decoder's own frame buffers are laid out. LINEAR is NV12 as
+ prepare_nv12_frame_buffer_template() has it. TILED is VPU frame map of 16x16
+ luma (and 16x8 chroma) macroblocks stored whole, one after another
+ (TILED_FRAME_MB_RASTER_MAP), which is what motion compensation reads - so
+ reference fetches hit fewer DDR pages. Nothing else on i.MX6 the player uses
+ (G2D, CPU access) reads that map, so with TILED post-processing stage writes
+ frames given for display out linear, see VPURotator */
+enum class VPUFrameLayout {
+    LINEAR,
+    TILED,
+};
+
+/* Rotated frames. With rotation enabled, VPU still decodes to its own frame
+ buffers, which have to stay full size and unrotated as they are references
+ for next frames, but when frame is given for display it is written rotated to
+ the frame given as rotator output. That is what the user gets, and the
+ decoder's own display frame can be reused right away - so decoder needs just
+ one display frame, and these are the ones user holds on to. Unlike decoder
+ frames these have no space for motion vectors.
+
+ Same stage converts tiled frames (see VPUFrameLayout) to linear ones, and
+ then it runs with rotation disabled too - frames given away are copies either
+ way.
+
+ Note that VPU rotator can't scale, so these are never smaller than what was
+ decoded */
+class VPURotator {
+private:
+    CodecLogger &m_logger;
+    VPURotation m_rotation;
+    FrameGeometry m_geometry;
+    /* Frame buffer description, with offsets only, see
+     prepare_nv12_frame_buffer_template() */
+    FrameBuffer m_template;
+
+    class Frame {
+    public:
+        VPUDMAPointer dma;
+        bool given_for_display = false;
+    };
+    std::vector<Frame> m_frames;
+    /* Frame rotator writes to in decode in progress, -1 if none */
+    int m_output = -1;
+    /* Rotator commands are given once, before the first decode */
+    bool m_commands_given = false;
+
+public:
+    VPURotator(CodecLogger &logger, const VPURotation &rotation,
+               const FrameGeometry &input_geometry);
+
+    /* Allocates frames, false on error */
+    bool allocate(size_t number_of_frames);
+
+    /* True if there is frame to rotate into */
+    bool has_frame_for_decoding() const;
+
+    /* To be called just before decode starts, sets rotator output */
+    bool start(DecHandle handle);
+
+    /* Decoder gave frame for display, output frame (which has its memory)
+     gets rotated frame instead. Returns false if there was none */
+    bool frame_given_for_display(VPUOutputFrame &output_frame);
+
+    /* True if frame with given address was one of rotated ones */
+    bool mark_frame_as_returned(unsigned long physical_address);
+
+    const VPURotation &get_rotation() const
+    {
+        return m_rotation;
+    }
+
+    size_t get_number_of_frames() const
+    {
+        return m_frames.size();
+    }
+
+    size_t get_allocation_size() const
+    {
+        return m_frames.size() * m_template.bufMvCol;
+    }
+};
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <algorithm>
+#include <limits>
+
+#include "vpu_scheduler.hpp"
+
+namespace airtame {
+
+size_t VPUScheduler::add_stream(PackQueue &queue, const DecodingStats &stats,
+                                VPUStreamPriority priority, const PlaybackClock &clock)
+{
+    Stream stream;
+    stream.queue = &queue;
+    stream.stats = &stats;
+    stream.priority = priority;
+    stream.clock = clock;
+    stream.start = std::chrono::steady_clock::now();
+    m_streams.push_back(stream);
+    return m_streams.size() - 1;
+}
+
+std::vector<size_t> VPUScheduler::schedule(const std::vector<bool> &ready)
+{
+    update_load();
+
+    /* Deadline of every stream, and whether high priority one already
+     missed it */
+    std::vector<Timestamp> until_due(m_streams.size(), std::numeric_limits<Timestamp>::max());
+    bool high_priority_late = false;
+    for (size_t i = 0; i < m_streams.size(); ++i) {
+        Timestamp until;
+        if (is_ready(ready, i) && get_time_until_due(m_streams[i], until)) {
+            until_due[i] = until;
+            if ((VPUStreamPriority::HIGH == m_streams[i].priority) && (until < 0)) {
+                high_priority_late = true;
+            }
+        }
+    }
+    m_overloaded = high_priority_late || (m_load > m_max_load);
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < m_streams.size(); ++i) {
+        Stream &stream = m_streams[i];
+        if (!is_ready(ready, i)) {
+            /* Not a deferral, it gets its turn once it is ready */
+            continue;
+        }
+        if (m_overloaded && (VPUStreamPriority::LOW == stream.priority)
+            && has_higher_priority_work(stream.priority, ready)) {
+            /* Frames that nothing refers to go first, all of them that are
+             due by now, as their slot is taken by other streams anyway */
+            Timestamp position;
+            if (stream.clock && stream.clock(position)) {
+                stream.number_of_packs_shed
+                    += stream.queue->drop_non_reference_packs(position + 1);
+            }
+            if (stream.deferrals_in_row < VPU_SCHEDULER_MAX_DEFERRALS) {
+                ++stream.deferrals_in_row;
+                ++stream.number_of_deferrals;
+                continue;
+            }
+        }
+        stream.deferrals_in_row = 0;
+        order.push_back(i);
+    }
+
+    std::stable_sort(order.begin(), order.end(), [this, &until_due](size_t a, size_t b) {
+        if (m_streams[a].priority != m_streams[b].priority) {
+            return m_streams[a].priority > m_streams[b].priority;
+        }
+        return until_due[a] < until_due[b];
+    });
+    return order;
+}
+
+void VPUScheduler::begin_turn(size_t stream)
+{
+    m_streams[stream].turn_start = m_streams[stream].stats->decode_latency.get_total();
+}
+
+void VPUScheduler::end_turn(size_t stream)
+{
+    Stream &s = m_streams[stream];
+    Timestamp decode_time = s.stats->decode_latency.get_total();
+    /* Stats reset during the turn, what it took is not known */
+    if (decode_time >= s.turn_start) {
+        s.vpu_time += decode_time - s.turn_start;
+        m_period_vpu_time += decode_time - s.turn_start;
+    }
+    ++s.number_of_turns;
+}
+
+double VPUScheduler::get_utilization(size_t stream) const
+{
+    const Stream &s = m_streams[stream];
+    Timestamp elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - s.start).count();
+    return (elapsed > 0) ? (double)s.vpu_time / elapsed : 0;
+}
+
+void VPUScheduler::update_load()
+{
+    auto now = std::chrono::steady_clock::now();
+    Timestamp period
+        = std::chrono::duration_cast<std::chrono::microseconds>(now - m_period_start).count();
+    if (period < VPU_SCHEDULER_LOAD_PERIOD) {
+        return;
+    }
+    m_load = (double)m_period_vpu_time / period;
+    m_period_vpu_time = 0;
+    m_period_start = now;
+}
+
+bool VPUScheduler::get_time_until_due(const Stream &stream, Timestamp &until)
+{
+    Timestamp position;
+    if (!stream.clock || !stream.queue->has_pack_for_consumption()
+        || !stream.queue->front().meta || !stream.clock(position)) {
+        return false;
+    }
+    until = stream.queue->front().meta.get_timestamp() - position;
+    return true;
+}
+
+bool VPUScheduler::has_higher_priority_work(VPUStreamPriority priority,
+                                            const std::vector<bool> &ready) const
+{
+    for (size_t i = 0; i < m_streams.size(); ++i) {
+        const Stream &stream = m_streams[i];
+        if (is_ready(ready, i) && (stream.priority > priority) && !stream.queue->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+}
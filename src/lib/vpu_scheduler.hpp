@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "codec_common.hpp"
+#include "pack_drop_policy.hpp"
+#include "pack_queue.hpp"
+
+namespace airtame {
+
+/* VPU load (part of wall clock time spent decoding) above which scheduler
+ considers VPU overloaded */
+#define VPU_SCHEDULER_MAX_LOAD 0.9
+/* Period load is measured over (usec) */
+#define VPU_SCHEDULER_LOAD_PERIOD 250000
+/* Low priority stream gets a turn at least every that many rounds, even
+ when VPU is overloaded */
+#define VPU_SCHEDULER_MAX_DEFERRALS 4
+
+enum class VPUStreamPriority {
+    LOW, /* May slip under load, thumbnails and such */
+    NORMAL,
+    HIGH /* Must not miss its frames, the main stream */
+};
+
+/* Decides which of the streams sharing the VPU get to decode, and in which
+ order. VPU decodes one frame at a time for all the decoders, and when they
+ take turns in whatever order their owners call step(), every stream slips
+ equally once VPU has more work than time. With the scheduler, the user asks
+ schedule() for the streams to step in this round, and wraps each step in
+ begin_turn()/end_turn():
+ - streams are ordered by priority, and those of the same one by deadline,
+ that is by how soon front pack is due on the stream's playback clock (if
+ it has one, see PlaybackClock), earliest first
+ - VPU counts as overloaded when it was busy decoding for more than
+ VPU_SCHEDULER_MAX_LOAD of the time lately, or when a high priority stream
+ got behind its clock. Then non-reference packs of low priority streams are
+ shed (dropped before decode, the cheapest way of getting time back), and
+ low priority streams are left out of rounds - up to
+ VPU_SCHEDULER_MAX_DEFERRALS in a row, so they slip but never stall
+ - VPU time decoders spent in turns (from DecodingStats::decode_latency) is
+ kept per stream, see get_utilization()
+
+ Queues and stats given have to outlive the scheduler */
+class VPUScheduler {
+public:
+    class Stream {
+    public:
+        PackQueue *queue = nullptr;
+        const DecodingStats *stats = nullptr;
+        VPUStreamPriority priority = VPUStreamPriority::NORMAL;
+        PlaybackClock clock;
+        /* VPU decode time (usec) of turns, and when stream was added */
+        Timestamp vpu_time = 0;
+        std::chrono::steady_clock::time_point start;
+        size_t number_of_turns = 0;
+        size_t number_of_deferrals = 0;
+        size_t number_of_packs_shed = 0;
+        /* Rounds left out of in a row */
+        size_t deferrals_in_row = 0;
+        /* Decode time of the stats when turn began */
+        Timestamp turn_start = 0;
+    };
+
+private:
+    std::vector<Stream> m_streams;
+    double m_max_load;
+    /* Load measurement, see update_load() */
+    Timestamp m_period_vpu_time = 0;
+    std::chrono::steady_clock::time_point m_period_start;
+    double m_load = 0;
+    bool m_overloaded = false;
+
+public:
+    VPUScheduler(double max_load = VPU_SCHEDULER_MAX_LOAD)
+        : m_max_load(max_load)
+        , m_period_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    /* Returns id of the stream, for use with calls below. Clock (playback
+     position in pack timestamp units, usec) is optional */
+    size_t add_stream(PackQueue &queue, const DecodingStats &stats,
+                      VPUStreamPriority priority = VPUStreamPriority::NORMAL,
+                      const PlaybackClock &clock = nullptr);
+
+    void set_priority(size_t stream, VPUStreamPriority priority)
+    {
+        m_streams[stream].priority = priority;
+    }
+
+    void set_clock(size_t stream, const PlaybackClock &clock)
+    {
+        m_streams[stream].clock = clock;
+    }
+
+    /* Streams to step in this round, in order. Sheds packs under load.
+     Streams can be marked not ready (by id, empty for all ready) when their
+     queues are busy elsewhere: they are left out of the round, and their
+     queues aren't looked into */
+    std::vector<size_t> schedule(const std::vector<bool> &ready = std::vector<bool>());
+
+    void begin_turn(size_t stream);
+    void end_turn(size_t stream);
+
+    /* As of the last schedule() */
+    bool is_overloaded() const
+    {
+        return m_overloaded;
+    }
+
+    double get_load() const
+    {
+        return m_load;
+    }
+
+    /* Part of the time (0-1) since it was added VPU spent on the stream */
+    double get_utilization(size_t stream) const;
+
+    const Stream &get_stream(size_t stream) const
+    {
+        return m_streams[stream];
+    }
+
+    size_t get_number_of_streams() const
+    {
+        return m_streams.size();
+    }
+
+private:
+    void update_load();
+    /* Time (usec) until front pack of the stream is due, false if not known */
+    static bool get_time_until_due(const Stream &stream, Timestamp &until);
+    bool has_higher_priority_work(VPUStreamPriority priority,
+                                  const std::vector<bool> &ready) const;
+    static bool is_ready(const std::vector<bool> &ready, size_t stream)
+    {
+        return ready.empty() || ready[stream];
+    }
+};
+}
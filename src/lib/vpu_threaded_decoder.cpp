@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <chrono>
+
+#include "vpu_threaded_decoder.hpp"
+
+/* How long should worker sleep when there is no work for it (msec). Worker is
+ woken up on every submit/return anyway, so this is just for safety */
+#define VPU_WORKER_IDLE_TIMEOUT 10
+
+namespace airtame {
+
+VPUThreadedDecoder::VPUThreadedDecoder(CodecLogger &logger, size_t display_frames,
+                                       size_t max_queued_packs)
+    : m_logger(logger)
+    , m_decoder(logger, display_frames)
+    , m_input(max_queued_packs)
+    , m_output(display_frames + 1)
+    , m_returned(display_frames + 1)
+{
+}
+
+VPUThreadedDecoder::~VPUThreadedDecoder()
+{
+    stop();
+}
+
+bool VPUThreadedDecoder::start()
+{
+    if (m_worker.joinable()) {
+        /* Already running */
+        return true;
+    }
+    m_stop = false;
+    m_end_of_stream = false;
+    m_worker = std::thread(&VPUThreadedDecoder::worker, this);
+    return true;
+}
+
+void VPUThreadedDecoder::stop()
+{
+    if (!m_worker.joinable()) {
+        return;
+    }
+    m_stop = true;
+    wake_up();
+    m_worker.join();
+
+    /* Worker is gone, so queues can be emptied from here. Packs submitted
+     but not taken over would otherwise be decoded after next start() (maybe
+     from the middle of GOP), frames decoded but not picked up belong to the
+     session that is closed now, and so do the ones given back */
+    Pack pack;
+    while (m_input.pop(pack)) {
+        m_packs.push_pack(std::move(pack));
+    }
+    while (!m_packs.empty()) {
+        m_packs.pop_front();
+    }
+    VPUOutputFrame frame;
+    while (m_output.pop(frame)) {
+        frame.reset();
+    }
+    long physical_address;
+    while (m_returned.pop(physical_address)) ;
+}
+
+size_t VPUThreadedDecoder::submit(PackQueue &queue)
+{
+    size_t submitted = 0;
+    /* Only we push into input queue, so if there is space now, it will still
+     be there on push */
+    while (queue.has_pack_for_consumption() && m_input.size() < m_input.capacity()) {
+        m_input.push(queue.take_front());
+        ++submitted;
+    }
+    if (submitted) {
+        wake_up();
+    }
+    return submitted;
+}
+
+void VPUThreadedDecoder::end_of_stream()
+{
+    /* Under the mutex, so that worker doesn't publish idleness it found
+     before it knew */
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+    m_end_of_stream = true;
+    m_idle = false;
+    m_wake_pending = true;
+    m_wake.notify_one();
+}
+
+bool VPUThreadedDecoder::get_output_frame(VPUOutputFrame &frame)
+{
+    if (m_output.pop(frame)) {
+        /* There is place in output queue now, worker may have frame pending */
+        wake_up();
+        return true;
+    }
+    return false;
+}
+
+void VPUThreadedDecoder::return_output_frame(long physical_address)
+{
+    /* Queue is big enough for all the frames that can be out at the same time,
+     so this should never fail */
+    if (!m_returned.push(physical_address)) {
+        codec_log_error(m_logger, "Returned frames queue overflow, frame lost");
+    }
+    wake_up();
+}
+
+DecodingStats VPUThreadedDecoder::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    return m_stats;
+}
+
+size_t VPUThreadedDecoder::get_number_of_frames_given() const
+{
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    return m_frames_given;
+}
+
+void VPUThreadedDecoder::worker()
+{
+    while (!m_stop) {
+        if (worker_step()) {
+            continue;
+        }
+
+        /* Nothing to do right now. Done with everything, unless packs or
+         a frame wait for the consumer to give frames back - or something
+         came since the step above, which is then still pending */
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        if (!m_wake_pending) {
+            m_idle = m_packs.empty() && !m_pending_frame.has_data()
+                && (!m_end_of_stream || m_decoder.is_closed());
+        }
+
+        /* Sleep until woken up. Pending wake-up isn't missed */
+        m_wake.wait_for(lock, std::chrono::milliseconds(VPU_WORKER_IDLE_TIMEOUT),
+                        [this]() { return m_wake_pending || m_stop; });
+        m_wake_pending = false;
+    }
+
+    /* Throw away whatever is left, and close the session while we still are
+     on the thread that used it */
+    m_decoder.close();
+    while (!m_packs.empty()) {
+        m_packs.pop_front();
+    }
+    m_pending_frame.reset();
+    m_idle = true;
+}
+
+/* Returns true if anything was done, false if worker can go to sleep */
+bool VPUThreadedDecoder::worker_step()
+{
+    bool progress = false;
+
+    /* Return frames first, so they can be used for decode now */
+    long physical_address;
+    while (m_returned.pop(physical_address)) {
+        m_decoder.return_output_frame(physical_address);
+        progress = true;
+    }
+
+    /* Take over newly submitted packs. Not idle before they are out of
+     input queue, see is_idle() */
+    Pack pack;
+    if (!m_input.empty()) {
+        m_idle = false;
+    }
+    while (m_input.pop(pack)) {
+        m_packs.push_pack(std::move(pack));
+        progress = true;
+    }
+
+    /* Then try to get rid of frame that didn't fit last time */
+    if (m_pending_frame.has_data()) {
+        if (!m_output.push(m_pending_frame)) {
+            /* Consumer still didn't pick up anything, can't decode more */
+            return progress;
+        }
+        m_pending_frame.reset();
+        progress = true;
+    }
+
+    /* And finally, decode. See VPUDecoder::step() on why it makes sense to
+     call it just like that */
+    if (m_decoder.has_frame_for_decoding() && m_packs.has_pack_for_consumption()) {
+        VPUOutputFrame frame = m_decoder.step(m_packs);
+        if (frame.has_data() && !m_output.push(frame)) {
+            m_pending_frame = frame;
+        }
+        progress = true;
+
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        m_stats = m_decoder.get_stats();
+        m_frames_given = m_decoder.get_number_of_frames_given();
+    } else if (m_end_of_stream && m_packs.empty() && worker_flush_step()) {
+        progress = true;
+    }
+
+    return progress;
+}
+
+bool VPUThreadedDecoder::worker_flush_step()
+{
+    /* Flushing ends with decoder closed, and has to wait for frames to come
+     back just like decoding */
+    if (m_decoder.is_closed() || !m_decoder.has_frame_for_decoding()) {
+        return false;
+    }
+    VPUOutputFrame frame = m_decoder.flush_step();
+    if (frame.has_data() && !m_output.push(frame)) {
+        m_pending_frame = frame;
+    }
+
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    m_stats = m_decoder.get_stats();
+    m_frames_given = m_decoder.get_number_of_frames_given();
+    return true;
+}
+
+void VPUThreadedDecoder::wake_up()
+{
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+    m_wake_pending = true;
+    m_wake.notify_one();
+}
+}
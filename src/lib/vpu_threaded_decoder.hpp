@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "pack_queue.hpp"
+#include "spsc_queue.hpp"
+#include "vpu_decoder.hpp"
+#include "vpu_output_frame.hpp"
+
+namespace airtame {
+
+/* Optional threaded mode for VPUDecoder. Normally parsing, feeding and
+ decoding all happen on the thread that calls VPUDecoder::step(), which
+ means that this thread is blocked in vpu_WaitForInt() for the whole decode
+ (and for 100ms+ when the session is being opened). This class runs VPUDecoder
+ on its own worker thread instead, and talks to it through three lock-free
+ single producer/single consumer queues:
+ - complete packs go in (submit())
+ - decoded frames come out (get_output_frame())
+ - displayed frames go back (return_output_frame())
+
+ So it can be used like this:
+     decoder.start();
+     while (...) {
+        parser.process_buffer(buffer); // parser pushes into queue
+        decoder.submit(queue); // complete packs are handed over to worker
+        VPUOutputFrame frame;
+        if (decoder.get_output_frame(frame)) {
+            // display it, then return it back once it is free
+        }
+     }
+     decoder.end_of_stream(); // worker flushes out the frames left
+     while (!decoder.is_idle()) {
+        // get and return output frames as above
+     }
+
+ One thread may call submit() and another one get_output_frame() and
+ return_output_frame(), but each of these sides has to stay on one thread.
+ Output queue is bounded, but in practice it never holds more frames than
+ display reserve anyway, because decoder stops decoding when all display
+ frames are given away. Note that none of VPUDecoder directives change, so
+ reopening, flushing and dropping of packs before reopen point all happen
+ on the worker thread just as in single-threaded mode.
+
+ Player doesn't use this: DecodeScheduler keeps the VPU calls of all the
+ streams on one thread, so that VPUScheduler can order them, and overlaps
+ parsing with decoding through PipelineExecutor instead. This is for users
+ of one decoder whose own thread has better things to do than to wait for
+ the VPU */
+class VPUThreadedDecoder {
+private:
+    CodecLogger &m_logger;
+
+    /* Everything that worker thread owns exclusively */
+    VPUDecoder m_decoder;
+    PackQueue m_packs;
+    VPUOutputFrame m_pending_frame; /* Decoded, but output queue was full */
+
+    /* Communication with the worker */
+    SPSCQueue<Pack> m_input;
+    SPSCQueue<VPUOutputFrame> m_output;
+    SPSCQueue<long> m_returned;
+
+    /* Worker thread control. Mutex and condition variable are only used to
+     sleep when there is nothing to do, queues don't need them */
+    std::thread m_worker;
+    std::atomic<bool> m_stop{ false };
+    /* Published by worker, see is_idle() */
+    std::atomic<bool> m_idle{ true };
+    /* Set by end_of_stream(), worker flushes once it decoded all packs */
+    std::atomic<bool> m_end_of_stream{ false };
+    /* Set by wake_up() under the mutex, and cleared by worker when it wakes
+     up, so that wake-up that comes before worker waits isn't lost */
+    bool m_wake_pending = false;
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+
+    /* Snapshot of decoder stats, updated by worker after each step */
+    mutable std::mutex m_stats_mutex;
+    DecodingStats m_stats;
+    size_t m_frames_given = 0;
+
+public:
+    VPUThreadedDecoder(CodecLogger &logger, size_t display_frames,
+                       size_t max_queued_packs = 64);
+    ~VPUThreadedDecoder();
+
+    /* Start/stop worker thread. Stopping closes the decoder, and packs that
+     were not decoded yet are thrown away, along with frames not picked up
+     and ones returned but not taken back yet - so neither side may be in
+     its calls meanwhile, and frames still held are not to be returned after.
+     Start takes submits again after end_of_stream() */
+    bool start();
+    void stop();
+
+    /* To be called by pack producer. Moves all complete packs from the front of
+     queue over to the worker, returns number of packs moved. Packs that didn't
+     fit into input queue stay in the queue, so just call again later */
+    size_t submit(PackQueue &queue);
+
+    /* To be called by pack producer once it submitted the last pack. Worker
+     decodes what is left and flushes the decoder, frames still held in it
+     come out as well. No more submits until stop() and start() */
+    void end_of_stream();
+
+    /* To be called by frame consumer. Returns true if there was decoded frame
+     waiting */
+    bool get_output_frame(VPUOutputFrame &frame);
+
+    /* Same as VPUDecoder::return_output_frame(), but can be called while
+     decoding is in progress - frame is actually returned by the worker, just
+     before next decode */
+    void return_output_frame(long physical_address);
+
+    /* True when worker has nothing more to do with data submitted so far -
+     all packs are consumed (and decoder flushed, after end_of_stream()) and
+     all frames handed over to output queue. Packs waiting for returned
+     frames are not done. Input is looked at first: worker clears idle
+     before it takes packs over */
+    bool is_idle() const
+    {
+        return m_input.empty() && m_idle;
+    }
+
+    size_t get_number_of_queued_packs() const
+    {
+        return m_input.size();
+    }
+
+    DecodingStats get_stats() const;
+    size_t get_number_of_frames_given() const;
+
+private:
+    void worker();
+    bool worker_step();
+    /* Decodes what is left after end of stream, true if it did anything */
+    bool worker_flush_step();
+    void wake_up();
+};
+}
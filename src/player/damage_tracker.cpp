@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "damage_tracker.hpp"
+
+namespace airtame {
+
+DamageTracker::DamageTracker(size_t number_of_buffers, size_t number_of_cells)
+    : m_generations(number_of_cells, 1)
+    , m_buffers(number_of_buffers)
+{
+    for (auto &buffer : m_buffers) {
+        buffer.cells.resize(number_of_cells);
+    }
+}
+
+void DamageTracker::damage(size_t cell)
+{
+    ++m_generations[cell];
+}
+
+void DamageTracker::invalidate()
+{
+    for (auto &buffer : m_buffers) {
+        buffer.valid = false;
+    }
+}
+
+bool DamageTracker::begin_buffer(size_t buffer)
+{
+    BufferState &state = m_buffers[buffer];
+    if (state.valid) {
+        return false;
+    }
+    state.valid = true;
+    /* Generations start at 1, so every cell differs */
+    for (auto &cell : state.cells) {
+        cell = CellState();
+    }
+    return true;
+}
+
+bool DamageTracker::needs_blit(size_t buffer, size_t cell, const FrameGeometry &geometry,
+                               bool &clear_cell)
+{
+    CellState &state = m_buffers[buffer].cells[cell];
+    if ((state.generation == m_generations[cell]) && (state.width == geometry.m_true_width)
+        && (state.height == geometry.m_true_height)) {
+        ++m_number_of_blits_saved;
+        return false;
+    }
+    /* Nothing to clear if cell was never drawn, buffer clear did it */
+    clear_cell = state.generation
+        && ((state.width != geometry.m_true_width) || (state.height != geometry.m_true_height));
+    state.generation = m_generations[cell];
+    state.width = geometry.m_true_width;
+    state.height = geometry.m_true_height;
+    ++m_number_of_blits;
+    return true;
+}
+}
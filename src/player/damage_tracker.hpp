@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+
+#include "codec_common.hpp"
+
+namespace airtame {
+
+/* Keeps track of what every framebuffer back buffer shows in every cell of
+ the display matrix, so that cells whose stream didn't produce new frame since
+ that buffer was last drawn to don't have to be blitted again.
+
+ Cell content is identified by its generation, bumped with damage() every
+ time stream gets new frame on display, and by frame geometry - when that
+ changes image may not cover what was drawn before, so cell has to be cleared
+ first. Buffers whose content is unknown (never drawn to, or framebuffer was
+ reconfigured, see invalidate()) have to be cleared and drawn whole */
+class DamageTracker {
+private:
+    class CellState {
+    public:
+        size_t generation = 0;
+        size_t width = 0;
+        size_t height = 0;
+    };
+    class BufferState {
+    public:
+        bool valid = false;
+        std::vector<CellState> cells;
+    };
+    std::vector<size_t> m_generations;
+    std::vector<BufferState> m_buffers;
+
+    size_t m_number_of_blits = 0;
+    size_t m_number_of_blits_saved = 0;
+
+public:
+    DamageTracker(size_t number_of_buffers, size_t number_of_cells);
+
+    /* Cell got new frame */
+    void damage(size_t cell);
+    /* Content of all buffers is lost */
+    void invalidate();
+
+    /* To be asked when starting to draw buffer, true if whole of it has to
+     be cleared. It is then valid again, and all its cells need blit */
+    bool begin_buffer(size_t buffer);
+    /* Whether cell of given buffer needs blit of frame with given geometry,
+     and if so, whether cell has to be cleared first. When true, blit is
+     assumed to be done */
+    bool needs_blit(size_t buffer, size_t cell, const FrameGeometry &geometry,
+                    bool &clear_cell);
+
+    size_t get_number_of_blits() const
+    {
+        return m_number_of_blits;
+    }
+
+    /* Blits not done, because cell content in buffer was up to date */
+    size_t get_number_of_blits_saved() const
+    {
+        return m_number_of_blits_saved;
+    }
+};
+}
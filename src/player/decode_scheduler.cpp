@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "decode_scheduler.hpp"
+
+namespace airtame {
+
+DecodeScheduler::DecodeScheduler(const std::list<StreamHandler *> &handlers,
+                                 const std::shared_ptr<PipelineExecutor> &executor)
+    : m_handlers(handlers.begin(), handlers.end())
+{
+    if (executor && executor->get_number_of_workers()) {
+        m_executor = executor;
+    }
+    for (size_t i = 0; i < m_handlers.size(); ++i) {
+        StreamHandler *h = m_handlers[i];
+        /* Other cores parse while VPU decodes with executor */
+        if (!m_executor) {
+            h->set_busy_callback([this, h]() { prepare_other(h); });
+        }
+        m_slots.emplace_back(new Slot());
+        PackQueue *queue = h->get_pack_queue();
+        const DecodingStats *stats = h->get_decoding_stats();
+        if (queue && stats) {
+            m_streams.push_back(m_vpu_scheduler.add_stream(*queue, *stats));
+            m_stream_handlers.push_back(i);
+        } else {
+            m_streams.push_back(NO_STREAM);
+        }
+    }
+}
+
+DecodeScheduler::~DecodeScheduler()
+{
+    /* Tasks refer to us and the handlers */
+    if (m_executor) {
+        m_executor->wait();
+    }
+    for (auto h : m_handlers) {
+        h->set_busy_callback(nullptr);
+    }
+}
+
+bool DecodeScheduler::step()
+{
+    bool new_frame = false;
+    m_stepping = true;
+    for (size_t i = 0; i < m_handlers.size(); ++i) {
+        if ((NO_STREAM == m_streams[i]) && step_handler(i)) {
+            new_frame = true;
+        }
+    }
+    if (!m_executor) {
+        std::vector<size_t> streams = m_vpu_scheduler.schedule();
+        m_work_pending = streams.size() < m_stream_handlers.size();
+        for (size_t stream : streams) {
+            m_vpu_scheduler.begin_turn(stream);
+            if (step_handler(m_stream_handlers[stream])) {
+                new_frame = true;
+            }
+            m_vpu_scheduler.end_turn(stream);
+        }
+        m_stepping = false;
+        return new_frame;
+    }
+
+    /* Stream whose prepare() runs is not ready this round, instead of being
+     waited for - VPU decodes the others meanwhile. Only when every one of
+     them is busy there is nothing better to do than to wait */
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<bool> ready;
+    bool any_ready = false;
+    for (size_t handler : m_stream_handlers) {
+        locks.emplace_back(m_slots[handler]->mutex, std::try_to_lock);
+        ready.push_back(locks.back().owns_lock());
+        any_ready = any_ready || ready.back();
+    }
+    if (!any_ready) {
+        for (auto &lock : locks) {
+            lock.lock();
+        }
+        ready.assign(ready.size(), true);
+    }
+    std::vector<size_t> streams = m_vpu_scheduler.schedule(ready);
+    m_work_pending = streams.size() < m_stream_handlers.size();
+    /* Those left out of the round can be prepared while others decode */
+    std::vector<bool> scheduled(locks.size(), false);
+    for (size_t stream : streams) {
+        scheduled[stream] = true;
+    }
+    for (size_t stream = 0; stream < locks.size(); ++stream) {
+        if (!scheduled[stream] && locks[stream].owns_lock()) {
+            locks[stream].unlock();
+        }
+    }
+    for (size_t stream : streams) {
+        size_t handler = m_stream_handlers[stream];
+        m_vpu_scheduler.begin_turn(stream);
+        if (m_handlers[handler]->step()) {
+            new_frame = true;
+        }
+        m_vpu_scheduler.end_turn(stream);
+        locks[stream].unlock();
+        /* Queue has room for what step consumed */
+        submit_prepare(handler);
+    }
+    m_stepping = false;
+    return new_frame;
+}
+
+bool DecodeScheduler::step_handler(size_t handler)
+{
+    if (!m_executor) {
+        return m_handlers[handler]->step();
+    }
+    bool stepped;
+    {
+        std::lock_guard<std::mutex> lock(m_slots[handler]->mutex);
+        stepped = m_handlers[handler]->step();
+    }
+    /* Queue has room for what step consumed */
+    submit_prepare(handler);
+    return stepped;
+}
+
+void DecodeScheduler::submit_prepare(size_t handler)
+{
+    Slot &slot = *m_slots[handler];
+    if (slot.submitted.exchange(true)) {
+        return;
+    }
+    m_executor->submit([this, handler]() {
+        Slot &slot = *m_slots[handler];
+        slot.submitted = false;
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        if (m_handlers[handler]->prepare()) {
+            ++m_number_of_prepares;
+            if (m_stepping) {
+                ++m_number_of_overlapped_prepares;
+            }
+        }
+    });
+}
+
+void DecodeScheduler::set_priority(size_t handler, VPUStreamPriority priority)
+{
+    if (NO_STREAM != m_streams[handler]) {
+        m_vpu_scheduler.set_priority(m_streams[handler], priority);
+    }
+}
+
+void DecodeScheduler::set_clock(size_t handler, const PlaybackClock &clock)
+{
+    if (NO_STREAM != m_streams[handler]) {
+        m_vpu_scheduler.set_clock(m_streams[handler], clock);
+    }
+}
+
+bool DecodeScheduler::get_stream(size_t handler, size_t &stream) const
+{
+    stream = m_streams[handler];
+    return NO_STREAM != stream;
+}
+
+void DecodeScheduler::prepare_all()
+{
+    if (m_executor) {
+        for (size_t i = 0; i < m_handlers.size(); ++i) {
+            submit_prepare(i);
+        }
+        return;
+    }
+    for (auto h : m_handlers) {
+        if (h->prepare()) {
+            ++m_number_of_prepares;
+        }
+    }
+}
+
+void DecodeScheduler::prepare_other(StreamHandler *busy)
+{
+    /* Give each call to just one handler, decode of a frame only takes few
+     msec and we don't want VPU to wait for us. Handlers with nothing to parse
+     return right away, so look further if that happens */
+    for (size_t i = 0; i < m_handlers.size(); ++i) {
+        StreamHandler *h = m_handlers[m_next_to_prepare];
+        m_next_to_prepare = (m_next_to_prepare + 1) % m_handlers.size();
+        if ((h != busy) && h->prepare()) {
+            ++m_number_of_prepares;
+            ++m_number_of_overlapped_prepares;
+            return;
+        }
+    }
+}
+}
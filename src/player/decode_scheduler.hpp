@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "pipeline_executor.hpp"
+#include "stream_handler.hpp"
+#include "vpu_scheduler.hpp"
+
+namespace airtame {
+
+/* Interleaves work of several stream handlers sharing the one VPU. Decoding
+ itself has to be done one stream at a time, but while the VPU decodes frame
+ of one stream, CPU parses input of the other ones (see
+ StreamHandler::prepare() and VPUBusyCallback), so that when their turn
+ comes, they go straight to the VPU. Parsing can also be done while waiting
+ for something else, such as G2D blit, with prepare_all().
+
+ Which of the streams decode in a round, and in which order, is up to
+ VPUScheduler, by their priorities and deadlines.
+
+ With PipelineExecutor given, handlers are task producers instead: after
+ each step (and on prepare_all()) handler's prepare() is submitted as a task,
+ and runs on one of the other cores while this thread - the only one that
+ calls the VPU - goes on with the other streams. Handler and its queue are
+ then touched by one thread at a time. Handler whose prepare() runs sits
+ the round out (schedule() doesn't look into its queue either), so that
+ the VPU thread doesn't wait for parsing unless it has nothing else to do */
+class DecodeScheduler {
+private:
+    std::vector<StreamHandler *> m_handlers;
+    /* Round robin index of the handler to prepare next */
+    size_t m_next_to_prepare = 0;
+    /* Number of prepare() calls that did parse, while VPU decoded other
+     stream and otherwise. Executor tasks count these too */
+    std::atomic<size_t> m_number_of_overlapped_prepares{ 0 };
+    std::atomic<size_t> m_number_of_prepares{ 0 };
+    /* Set while handlers are stepped */
+    std::atomic<bool> m_stepping{ false };
+    /* Last step() left streams out of its round, see has_pending_work() */
+    bool m_work_pending = false;
+
+    std::shared_ptr<PipelineExecutor> m_executor;
+    /* Per handler, with executor only: held by whoever works with the
+     handler, and whether its prepare() is submitted and not started yet */
+    class Slot {
+    public:
+        std::mutex mutex;
+        std::atomic<bool> submitted{ false };
+    };
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    /* Handlers with video decoder are VPUScheduler streams, these are
+     their ids by handler position (NO_STREAM for the others, which are
+     stepped every round) and handlers by stream id */
+    static constexpr size_t NO_STREAM = (size_t)-1;
+    VPUScheduler m_vpu_scheduler;
+    std::vector<size_t> m_streams;
+    /* Handler positions by stream id */
+    std::vector<size_t> m_stream_handlers;
+
+public:
+    DecodeScheduler(const std::list<StreamHandler *> &handlers,
+                    const std::shared_ptr<PipelineExecutor> &executor = nullptr);
+    ~DecodeScheduler();
+
+    DecodeScheduler(const DecodeScheduler &) = delete;
+    DecodeScheduler &operator=(const DecodeScheduler &) = delete;
+
+    /* Steps all the handlers, returns true if at least one of them produced
+     new frame */
+    bool step();
+
+    /* Whether last step() left some of the streams out of its round - those
+     VPUScheduler deferred, or whose prepare() was running. These get their
+     turn in the rounds to come, so no new frame doesn't mean the streams ran
+     out of work as long as this is true */
+    bool has_pending_work() const
+    {
+        return m_work_pending;
+    }
+
+    /* Priority and clock (see VPUScheduler) of handler by its position in
+     the list given, ignored for handlers without video decoder */
+    void set_priority(size_t handler, VPUStreamPriority priority);
+    void set_clock(size_t handler, const PlaybackClock &clock);
+
+    const VPUScheduler &get_vpu_scheduler() const
+    {
+        return m_vpu_scheduler;
+    }
+
+    /* VPU stream id of handler by its position, false if it has no video
+     decoder */
+    bool get_stream(size_t handler, size_t &stream) const;
+
+    /* Lets every handler parse ahead - with executor, submits it */
+    void prepare_all();
+
+    size_t get_number_of_overlapped_prepares() const
+    {
+        return m_number_of_overlapped_prepares;
+    }
+
+    size_t get_number_of_prepares() const
+    {
+        return m_number_of_prepares;
+    }
+
+private:
+    /* Called while VPU decodes for the busy handler, prepares one of the
+     others */
+    void prepare_other(StreamHandler *busy);
+    /* Steps handler, waiting for its prepare() if it runs. For handlers
+     without video decoder, the others are stepped in step() itself */
+    bool step_handler(size_t handler);
+    /* Has executor run handler's prepare(), unless it is submitted already */
+    void submit_prepare(size_t handler);
+};
+}
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/ipu.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -27,26 +28,148 @@ namespace airtame {
 #ifdef DG1
 /* Technically 2 is recommended, and it is enough when FPS doesn't get bigger
  than 40+. But if very fast g2d blitting is used (as here) and decoder is
- effective enough, one gets artifacts when FPS is 50 or more. 4 buffers cure
- the problem. Also see "i.MX Graphics User’s Guide", page 36, FB_MULTI_BUFFER
- environment variable description - seems like 4 is ideal */
-#define NUMBER_OF_BUFFERS 4
+ effective enough, one gets artifacts when FPS is 50 or more - that was from
+ rendering into buffer pan hadn't left yet, which took 4 buffers to hide. Flip
+ thread knows which buffer is on screen and which waits for vblank now, so 3
+ are enough to never render into either */
+#define NUMBER_OF_BUFFERS 3
 #define ALIGN(v) (v)
 #else
-#define NUMBER_OF_BUFFERS 4
+#define NUMBER_OF_BUFFERS 3
 /* Again, technically this alignment would be necessary for "tiled" formats,
  which we don't use here, but for sake of safety */
 #define ALIGN(v) align_to_64(v)
 #endif
 
+G2DDisplay::G2DDisplay(const char *framebuffer_path)
+    : m_framebuffer_path(framebuffer_path)
+{
+    m_flip_thread = std::thread(&G2DDisplay::flip_thread, this);
+}
+
 G2DDisplay::~G2DDisplay()
 {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_flip_wanted.notify_all();
+    m_flip_thread.join();
     if (-1 != m_framebuffer_fd) {
         close(m_framebuffer_fd);
     }
 }
 
 bool G2DDisplay::prepare_render(g2d_surface &destination)
+{
+    m_have_back_buffer = false;
+    bool reopen = false;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_pan_failed) {
+            m_pan_failed = false;
+            reopen = true;
+        }
+        if (reopen || !m_have_screen_info) {
+            /* Framebuffer can only change under the flip thread when it has
+             nothing to flip */
+            m_flip_done.wait(lock, [this]() {
+                return (-1 == m_queued_buffer) && (-1 == m_flipping_buffer);
+            });
+        }
+    }
+    if (reopen) {
+        /* Close framebuffer because for the resolution change to take effect
+         we need to reopen it */
+        close(m_framebuffer_fd);
+        m_framebuffer_fd = -1;
+        m_have_screen_info = false;
+        ++m_number_of_resets;
+    }
+    if (!m_have_screen_info && !update_screen_info()) {
+        return false;
+    }
+
+    size_t buffer;
+    if (!wait_for_back_buffer(buffer)) {
+        return false;
+    }
+
+    /* Fill in destination description */
+    if (!framebuffer_format_to_g2d(m_vinfo, destination.format)) {
+        fprintf(stderr, "Framebuffer format not supported by g2d\n");
+        return false;
+    }
+
+    /* Plane 0 should contain back buffer address */
+    destination.planes[0]
+        = m_finfo.smem_start + (buffer * get_buffer_height() * m_finfo.line_length);
+    m_back_buffer = buffer;
+    m_have_back_buffer = true;
+
+    /* Planes 1 and 2 are used only by blit sources, not destinations */
+    destination.planes[1] = 0;
+    destination.planes[2] = 0;
+
+    /* Fill in full display rectangle */
+    destination.left = 0;
+    destination.top = 0;
+    destination.right = m_vinfo.xres; // not sure here - maybe -1
+    destination.bottom = m_vinfo.yres; // not sure here - maybe -1
+    destination.width = m_vinfo.xres;
+    destination.height = m_vinfo.yres;
+
+    /* g2d wants stride in pixels, framebuffer one is in bytes! */
+    destination.stride = m_finfo.line_length / (m_vinfo.bits_per_pixel / 8);
+
+    /* Safe defaults for blending, clear and rotation */
+    destination.blendfunc = G2D_ZERO;
+    destination.global_alpha = 0;
+    destination.clrcolor = 0;
+    destination.rot = G2D_ROTATION_0;
+    return true;
+}
+
+bool G2DDisplay::swap_buffers()
+{
+    if (!m_have_back_buffer) {
+        /* prepare_render() failed, nothing to show */
+        return true;
+    }
+    m_have_back_buffer = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pan_failed) {
+            /* Framebuffer is gone, next prepare_render() reopens it */
+            return true;
+        }
+        /* There is no buffer queued, wait_for_back_buffer() made sure about
+         that when this one was given out */
+        m_queued_buffer = (int)m_back_buffer;
+        m_queued_swap = ++m_number_of_swaps;
+    }
+    m_flip_wanted.notify_one();
+    return true;
+}
+
+size_t G2DDisplay::get_number_of_buffers()
+{
+    return NUMBER_OF_BUFFERS;
+}
+
+G2DDisplay::Presentation G2DDisplay::get_last_presentation()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last_presentation;
+}
+
+G2DDisplay::Clock::time_point G2DDisplay::get_last_vsync()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last_vsync;
+}
+
+bool G2DDisplay::update_screen_info()
 {
     fb_var_screeninfo vinfo;
     if (!get_vinfo(vinfo)) {
@@ -68,6 +191,7 @@ bool G2DDisplay::prepare_render(g2d_surface &destination)
         vinfo.yres_virtual = virtual_height;
         vinfo.yoffset = 0; /* Force this again to be at the begin */
         vinfo.nonstd = 0;
+        ++m_number_of_resets;
 
         /* Set new parameters */
         if (-1 == ioctl(m_framebuffer_fd, FBIOPUT_VSCREENINFO, &vinfo)) {
@@ -106,67 +230,24 @@ bool G2DDisplay::prepare_render(g2d_surface &destination)
         return false;
     }
 
-    /* Fill in destination description */
-    if (!framebuffer_format_to_g2d(vinfo, destination.format)) {
-        fprintf(stderr, "Framebuffer format not supported by g2d\n");
-        return false;
-    }
-
-    /* Plane 0 should contain next buffer address */
-    size_t next_offset = get_next_offset(vinfo);
-    destination.planes[0] = finfo.smem_start + (next_offset * finfo.line_length);
-
-    /* Planes 1 and 2 are used only by blit sources, not destinations */
-    destination.planes[1] = 0;
-    destination.planes[2] = 0;
-
-    /* Fill in full display rectangle */
-    destination.left = 0;
-    destination.top = 0;
-    destination.right = vinfo.xres; // not sure here - maybe -1
-    destination.bottom = vinfo.yres; // not sure here - maybe -1
-    destination.width = vinfo.xres;
-    destination.height = vinfo.yres;
+    m_vinfo = vinfo;
+    m_finfo = finfo;
+    m_have_screen_info = true;
 
-    /* g2d wants stride in pixels, framebuffer one is in bytes! */
-    destination.stride = finfo.line_length / (vinfo.bits_per_pixel / 8);
+    /* Pixel clock is in picoseconds, and a frame takes whole lines with
+     their blanking, over all the lines with their blanking */
+    uint64_t line = (uint64_t)vinfo.xres + vinfo.left_margin + vinfo.right_margin
+        + vinfo.hsync_len;
+    uint64_t lines = (uint64_t)vinfo.yres + vinfo.upper_margin + vinfo.lower_margin
+        + vinfo.vsync_len;
+    m_vsync_period_usec = (int64_t)((uint64_t)vinfo.pixclock * line * lines / 1000000);
 
-    /* Safe defaults for blending, clear and rotation */
-    destination.blendfunc = G2D_ZERO;
-    destination.global_alpha = 0;
-    destination.clrcolor = 0;
-    destination.rot = G2D_ROTATION_0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t front_buffer = vinfo.yoffset / wanted_height;
+    m_front_buffer = (front_buffer < NUMBER_OF_BUFFERS) ? (int)front_buffer : -1;
     return true;
 }
 
-bool G2DDisplay::swap_buffers()
-{
-    fb_var_screeninfo vinfo;
-    if (!get_vinfo(vinfo)) {
-        return false;
-    }
-
-    vinfo.yoffset = get_next_offset(vinfo);
-    /* Error here usually means "resolution change". We close framebuffer then
-     and re-open it on next prepare_render() */
-    if (-1 == ioctl(m_framebuffer_fd, FBIOPAN_DISPLAY, &vinfo)) {
-        // TODO: maybe investigate which errno is set then, and return true
-        // only on that errno, false otherwise?
-        fprintf(stderr, "Could not pan display, likely a resolution change");
-        /* Close framebuffer because for the resolution change to take effect
-         we need to reopen it */
-        close(m_framebuffer_fd);
-        m_framebuffer_fd = -1;
-        return true;
-    }
-    return true;
-}
-
-size_t G2DDisplay::get_number_of_buffers()
-{
-    return NUMBER_OF_BUFFERS;
-}
-
 bool G2DDisplay::get_vinfo(fb_var_screeninfo &vinfo)
 {
     if (-1 == m_framebuffer_fd) {
@@ -189,14 +270,91 @@ bool G2DDisplay::get_vinfo(fb_var_screeninfo &vinfo)
     return true;
 }
 
-size_t G2DDisplay::get_next_offset(const fb_var_screeninfo &vinfo)
+/* Takes buffers swapped one at a time, pans to each and waits for the vblank
+ it shows from, before taking the next one. Framebuffer and screen info are
+ only read here, and stay put while there is buffer queued or flipping */
+void G2DDisplay::flip_thread()
 {
-    size_t wanted_height = ALIGN(vinfo.yres);
-    size_t next_offset = vinfo.yoffset + wanted_height;
-    if (next_offset >= vinfo.yres_virtual) {
-        next_offset = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_flip_wanted.wait(lock, [this]() { return m_stop || (-1 != m_queued_buffer); });
+        if (m_stop) {
+            return;
+        }
+        int buffer = m_queued_buffer;
+        uint64_t swap = m_queued_swap;
+        m_queued_buffer = -1;
+        m_flipping_buffer = buffer;
+        fb_var_screeninfo vinfo = m_vinfo;
+        vinfo.yoffset = buffer * get_buffer_height();
+        bool wait_for_vsync = !m_vsync_unsupported;
+        lock.unlock();
+
+        /* Pan takes effect at next vblank */
+        bool panned = (-1 != ioctl(m_framebuffer_fd, FBIOPAN_DISPLAY, &vinfo));
+        int error = panned ? 0 : errno;
+        bool waited = false;
+        if (panned && wait_for_vsync) {
+            uint32_t screen = 0;
+            waited = (-1 != ioctl(m_framebuffer_fd, FBIO_WAITFORVSYNC, &screen));
+            error = waited ? 0 : errno;
+        }
+        Clock::time_point now = Clock::now();
+
+        lock.lock();
+        m_flipping_buffer = -1;
+        if (!panned) {
+            /* Error here usually means "resolution change". Framebuffer gets
+             reopened on next prepare_render() */
+            // TODO: maybe investigate which errno is set then, and reopen
+            // only on that errno?
+            fprintf(stderr, "Could not pan display, likely a resolution change: %s\n",
+                    strerror(error));
+            m_pan_failed = true;
+            m_front_buffer = -1;
+            m_queued_buffer = -1;
+        } else {
+            if (wait_for_vsync && !waited) {
+                fprintf(stderr, "Can't wait for vsync, flips are paced by pan only: %s\n",
+                        strerror(error));
+                m_vsync_unsupported = true;
+            }
+            if (waited) {
+                m_last_vsync = now;
+            }
+            m_front_buffer = buffer;
+            m_last_presentation.swap = swap;
+            m_last_presentation.time = now;
+        }
+        m_flip_done.notify_all();
+    }
+}
+
+bool G2DDisplay::wait_for_back_buffer(size_t &buffer)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        if (m_pan_failed) {
+            return false;
+        }
+        /* Going round from the previous one */
+        for (size_t i = 1; i <= NUMBER_OF_BUFFERS; ++i) {
+            int candidate = (int)((m_back_buffer + i) % NUMBER_OF_BUFFERS);
+            if ((candidate != m_front_buffer) && (candidate != m_queued_buffer)
+                && (candidate != m_flipping_buffer)) {
+                buffer = candidate;
+                return true;
+            }
+        }
+        /* One on screen, one waiting for vblank and one queued after it -
+         rendering is two frames ahead of display */
+        m_flip_done.wait(lock);
     }
-    return next_offset;
+}
+
+size_t G2DDisplay::get_buffer_height() const
+{
+    return ALIGN(m_vinfo.yres);
 }
 
 bool G2DDisplay::framebuffer_format_to_g2d(const fb_var_screeninfo &vinfo,
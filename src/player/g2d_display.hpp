@@ -7,27 +7,131 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <stddef.h>
+#include <stdint.h>
 #include <g2d.h>
 #include <linux/fb.h>
 
 namespace airtame {
+/* Framebuffer with its virtual screen split into buffers that G2D renders
+ into while another one is shown. Screen info is queried once and kept, until
+ pan fails (which is what resolution change looks like) and framebuffer gets
+ reopened.
+
+ Buffers shown are triple buffered: swap_buffers() only queues rendered buffer
+ for display and returns. Flip thread pans to it, and waits for the vblank
+ it goes on screen at (FBIO_WAITFORVSYNC), so that there is one flip per
+ vblank at most, and the time of that vblank is what get_last_presentation()
+ tells. One buffer is on screen, one can wait for its vblank, and the third is
+ rendered to meanwhile - prepare_render() blocks only when rendering gets
+ ahead of that */
 class G2DDisplay {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /* Buffer given to swap_buffers() going on screen */
+    class Presentation {
+    public:
+        /* Swap it was given with, counting from 1 (see get_number_of_swaps()),
+         0 if nothing was shown yet */
+        uint64_t swap = 0;
+        /* Vblank it was shown from, or when pan was done if driver can't wait
+         for vblank */
+        Clock::time_point time;
+    };
+
 private:
     const char *m_framebuffer_path;
     int m_framebuffer_fd = -1;
+    /* Screen info, valid while m_have_screen_info is */
+    bool m_have_screen_info = false;
+    fb_var_screeninfo m_vinfo;
+    fb_fix_screeninfo m_finfo;
+    /* Buffer prepare_render() set up for rendering */
+    size_t m_back_buffer = 0;
+    /* Times framebuffer was reconfigured or reopened, losing what buffers
+     showed */
+    size_t m_number_of_resets = 0;
+    uint64_t m_number_of_swaps = 0;
+
+    /* Flip thread state, all under m_mutex. Buffer indices are -1 if none */
+    std::mutex m_mutex;
+    /* Flip thread waits on it for buffers to show, and for stopping */
+    std::condition_variable m_flip_wanted;
+    /* prepare_render() waits on it for buffer to become free */
+    std::condition_variable m_flip_done;
+    std::thread m_flip_thread;
+    bool m_stop = false;
+    /* On screen */
+    int m_front_buffer = -1;
+    /* Swapped, flip thread hasn't taken it yet */
+    int m_queued_buffer = -1;
+    uint64_t m_queued_swap = 0;
+    /* Being panned to, waiting for vblank */
+    int m_flipping_buffer = -1;
+    /* Pan failed, flip thread waits for prepare_render() to reopen */
+    bool m_pan_failed = false;
+    /* FBIO_WAITFORVSYNC failed once, so it's not tried anymore */
+    bool m_vsync_unsupported = false;
+    Presentation m_last_presentation;
+    /* Previous vblank waited for */
+    Clock::time_point m_last_vsync;
+    /* From framebuffer timings, see update_screen_info() */
+    int64_t m_vsync_period_usec = 0;
+    /* prepare_render() set up m_back_buffer, and it wasn't swapped yet */
+    bool m_have_back_buffer = false;
+
 public:
-    G2DDisplay(const char *framebuffer_path)
-        : m_framebuffer_path(framebuffer_path)
-    {
-    }
+    G2DDisplay(const char *framebuffer_path);
     ~G2DDisplay();
+
+    G2DDisplay(const G2DDisplay &) = delete;
+    G2DDisplay &operator=(const G2DDisplay &) = delete;
+
     bool prepare_render(g2d_surface &destination);
+    /* Queues buffer prepare_render() set up for display, rendering has to be
+     finished by now */
     bool swap_buffers();
     size_t get_number_of_buffers();
+    /* Index (less than number of buffers) of buffer being rendered to */
+    size_t get_back_buffer() const
+    {
+        return m_back_buffer;
+    }
+    size_t get_number_of_resets() const
+    {
+        return m_number_of_resets;
+    }
+    /* Number of the swap swap_buffers() did last */
+    uint64_t get_number_of_swaps() const
+    {
+        return m_number_of_swaps;
+    }
+    Presentation get_last_presentation();
+    /* Refresh period (usec) from display timings, 0 if driver doesn't tell.
+     With the last vblank waited for this tells when the following ones come,
+     for scheduling frames against */
+    int64_t get_vsync_period_usec() const
+    {
+        return m_vsync_period_usec;
+    }
+    Clock::time_point get_last_vsync();
+
 private:
+    /* Opens framebuffer if needed, sets it up for buffers and gets screen
+     info. Called with flip thread idle */
+    bool update_screen_info();
     bool get_vinfo(fb_var_screeninfo &vinfo);
-    static size_t get_next_offset(const fb_var_screeninfo &vinfo);
+    void flip_thread();
+    /* Free buffer to render to, waits for flip if there is none. Returns
+     false if flip thread found framebuffer gone meanwhile */
+    bool wait_for_back_buffer(size_t &buffer);
+    size_t get_buffer_height() const;
     static bool framebuffer_format_to_g2d(const fb_var_screeninfo &vinfo,
                                           g2d_format &format);
     static size_t align_to_64(size_t value);
@@ -5,24 +5,31 @@
  * See LICENSE.txt for further information.
  */
 
+#include <algorithm>
+
 #include "h264_nal.hpp"
 #include "h264_stream_handler.hpp"
+#include "trace.hpp"
 
 namespace airtame {
 
 void H264StreamHandler::offset(size_t off)
 {
-    /* Super simple for h264, because of stream resync capabilities */
+    /* Super simple for h264, because of stream resync capabilities. Before
+     playback starts, so this can wait for live input */
+    m_stream.read_ahead(off, true);
     if (off > m_stream.get_size_left()) {
         off = m_stream.get_size_left();
     }
 
     m_stream.flush_bytes(off);
+    m_nal_searched = 0;
 }
 
 bool H264StreamHandler::init()
 {
-    m_fake_timestamp = 0;
+    m_input_timestamp = 0;
+    m_next_input_picture = m_next_output_picture = 0;
     return true;
 }
 
@@ -33,8 +40,21 @@ bool H264StreamHandler::step()
      zero to n frames out, several NALs may still not build single frame out,
      this is why this loop */
     while (!m_decoded_frame.has_data()) {
-        /* Create at least one frame pack loading subsequent NALs */
-        while (!m_packs.has_pack_for_consumption() && load_nal()) ;
+        /* Create at least one frame pack loading subsequent NALs, and enough
+         for the decoder to feed ahead - pack is complete once the next one
+         starts */
+        while ((!m_packs.has_pack_for_consumption()
+                || (m_packs.size() < m_decoder.get_feed_ahead() + 2)
+                || (!m_finished_streams.empty() && is_stream_end_pending()))
+               && load_nal()) ;
+        if (!m_finished_streams.empty()) {
+            release_finished_streams(m_packs);
+        }
+
+        if (!m_packs.has_pack_for_consumption() && m_stream.has_more_input()) {
+            /* Next picture hasn't come in whole yet */
+            return false;
+        }
 
         if (!m_packs.empty() && !m_packs.front().m_is_complete) {
             codec_log_error(m_logger, "Incomplete frame pack at the end of input");
@@ -43,27 +63,193 @@ bool H264StreamHandler::step()
         if (!m_packs.has_pack_for_consumption()) {
             codec_log_info(m_logger, "Fed %zu packs, was given %zu decoded frames",
                            m_packs.get_number_of_packs_popped(),
-                           m_decoder.get_number_of_frames_given());
+                           m_backend->get_number_of_frames_given());
             return false;
         }
 
+        place_decoder();
+
         /* OK, have complete frame pack, can try to decode */
-        while (!m_decoded_frame.has_data() && m_decoder.has_frame_for_decoding()
+        while (!m_decoded_frame.has_data() && m_backend->has_frame_for_decoding()
                && m_packs.has_pack_for_consumption()) {
-            m_decoded_frame = m_decoder.step(m_packs);
+            m_decoded_frame = m_backend->step(m_packs);
+            if (!m_decoded_frame.has_data()) {
+                continue;
+            }
+            size_t picture = m_next_output_picture;
+            if (m_decoded_frame.meta) {
+                picture = get_output_picture(
+                    get_picture_number(m_decoded_frame.meta.get_timestamp()));
+                m_decoded_frame.meta.set_timestamp(get_picture_timestamp(picture));
+            }
+            m_next_output_picture = picture + 1;
+            if (picture < m_skip_until_picture) {
+                /* Post-decode dropping, up to the frame seek asked for. Goes
+                 right back, so decoder has it to decode into */
+                m_backend->return_output_frame(m_decoded_frame);
+                m_decoded_frame.reset();
+            } else {
+                m_trick_play->end_preroll();
+            }
         }
     }
 
     return true;
 }
 
+bool H264StreamHandler::prepare()
+{
+    /* Parser only works on our own queue and never calls the VPU, so this
+     can run while other stream decodes. Queue size limit bounds the work done
+     in one call */
+    bool parsed = false;
+    while ((m_packs.size() < STREAM_HANDLER_PACKS_AHEAD)
+           && (m_packs.get_bytes_pending() < STREAM_HANDLER_BYTES_AHEAD) && load_nal()) {
+        parsed = true;
+    }
+    return parsed;
+}
+
+bool H264StreamHandler::seek_to_frame(size_t frame)
+{
+    const StreamIndex *index = m_stream.get_index();
+    if (!index || (frame >= index->get_number_of_entries())) {
+        return false;
+    }
+    /* No keyframe before it means stream starts with frames decoder skips
+     anyway, so just go there */
+    size_t keyframe = index->get_entry(frame).keyframe_index;
+    if (STREAM_INDEX_NO_KEYFRAME == keyframe) {
+        keyframe = frame;
+    }
+    const StreamIndexEntry &entry = index->get_entry(keyframe);
+    restart();
+    /* Parser needs parameter sets the IDR picture refers to. They are loaded
+     again unless access unit carries them itself */
+    if (entry.sps_offset < entry.offset) {
+        m_stream.seek(entry.sps_offset);
+        load_nal();
+    }
+    if (entry.pps_offset < entry.offset) {
+        m_stream.seek(entry.pps_offset);
+        load_nal();
+    }
+    m_stream.seek(entry.offset);
+    /* Pictures before IDR one are all displayed before it as well, so it has
+     the same number in both orders */
+    m_next_input_picture = m_next_output_picture = keyframe;
+    /* Index is in decoding order and frames come out in display order, so
+     with reordering this lands within the reorder window of the frame asked
+     for, not necessarily on it. Pack timestamps count pictures in decoding
+     order, so pre-roll drops non-reference ones before it */
+    m_skip_until_picture = frame;
+    m_trick_play->begin_preroll(get_picture_timestamp(frame));
+    return true;
+}
+
+void H264StreamHandler::set_decoder_placement(const std::shared_ptr<DecoderPlacement> &placement)
+{
+    m_placement = placement;
+    m_software_decoder = create_software_decoder(m_logger, m_number_of_display_frames);
+}
+
+void H264StreamHandler::place_decoder()
+{
+    if (!m_placement || !m_packs.has_pack_for_consumption()
+        || !m_packs.front().m_can_reopen_decoding) {
+        return;
+    }
+    if (m_placed) {
+        migrate_decoder(m_logger, *m_placement, m_decoder, m_software_decoder.get(),
+                        m_packs.front(), m_backend);
+        return;
+    }
+    m_placed = true;
+    /* CPU can't rotate */
+    if (m_software_decoder && !m_decoder.get_rotation().is_enabled()
+        && (DecoderPlacement::Engine::CPU == m_placement->place(m_packs.front()))) {
+        codec_log_info(m_logger, "VPU is busy, decoding stream on the CPU");
+        m_backend = m_software_decoder.get();
+    }
+    m_placement->add_decoder(*m_backend);
+}
+
+void H264StreamHandler::restart()
+{
+    m_backend->close();
+    m_packs.clear();
+    m_picture_sequences.clear();
+    m_parser.reset();
+    m_nal_searched = 0;
+    m_decoded_frame.reset();
+    if (m_last_frame.dma) {
+        /* Stays on display until next frame comes */
+        m_last_frame_is_stale = true;
+    }
+    m_skip_until_picture = 0;
+    m_trick_play->end_preroll();
+}
+
+void H264StreamHandler::add_parsed_picture(size_t picture, const Pack &pack)
+{
+    if (pack.m_is_keyframe || m_picture_sequences.empty()) {
+        /* Output numbers go on from the previous sequence, all of which is
+         parsed by now. With none, seek set where they start */
+        PictureSequence sequence;
+        sequence.first_output_picture = m_picture_sequences.empty()
+            ? m_next_output_picture
+            : m_picture_sequences.back().first_output_picture
+                + m_picture_sequences.back().number_of_pictures;
+        m_picture_sequences.push_back(sequence);
+    }
+    PictureSequence &sequence = m_picture_sequences.back();
+    int32_t pic_order_cnt
+        = pack.m_has_pic_order_cnt ? pack.m_pic_order_cnt : (int32_t)sequence.number_of_pictures;
+    sequence.pictures.push_back({ picture, pic_order_cnt });
+    ++sequence.number_of_pictures;
+}
+
+size_t H264StreamHandler::get_output_picture(size_t picture)
+{
+    for (size_t index = 0; index < m_picture_sequences.size(); ++index) {
+        PictureSequence &sequence = m_picture_sequences[index];
+        auto it = std::find_if(sequence.pictures.begin(), sequence.pictures.end(),
+                               [picture](const ParsedPicture &p) { return p.picture == picture; });
+        if (it == sequence.pictures.end()) {
+            continue;
+        }
+        /* Pictures that come before it in output order are shown before it,
+         or were dropped - either way, they are done with */
+        int32_t pic_order_cnt = it->pic_order_cnt;
+        size_t before = 0;
+        auto kept = sequence.pictures.begin();
+        for (auto p = sequence.pictures.begin(); p != sequence.pictures.end(); ++p) {
+            if (p->pic_order_cnt < pic_order_cnt) {
+                ++before;
+            } else if (p->pic_order_cnt > pic_order_cnt) {
+                *kept++ = *p;
+            }
+        }
+        size_t output = sequence.first_output_picture + sequence.number_of_pictures_passed + before;
+        sequence.number_of_pictures_passed += sequence.pictures.end() - kept;
+        sequence.pictures.erase(kept, sequence.pictures.end());
+        /* Output order goes sequence by sequence, earlier ones are over */
+        m_picture_sequences.erase(m_picture_sequences.begin(),
+                                  m_picture_sequences.begin() + index);
+        return output;
+    }
+    /* Not parsed here after all, guess it's the next one */
+    return m_next_output_picture;
+}
+
 void H264StreamHandler::swap()
 {
     if (m_decoded_frame.has_data()) {
-        if (m_last_frame.dma) {
+        if (m_last_frame.dma && !m_last_frame_is_stale) {
             /* We have next frame to display, can give old one back */
-            m_decoder.return_output_frame(m_last_frame.dma.get()->phy_addr);
+            m_backend->return_output_frame(m_last_frame);
         }
+        m_last_frame_is_stale = false;
 
         /* Update m_last_frame */
         m_last_frame = m_decoded_frame;
@@ -78,15 +264,20 @@ bool H264StreamHandler::is_interleaved()
 
 bool H264StreamHandler::load_nal()
 {
-    /* Make sure we are not on EOF */
-    if (!m_stream.get_size_left()) {
-        return false;
-    }
-
-    /* Make sure there is enough data for start code */
-    if (m_stream.get_size_left() < 4) {
-        codec_log_error(m_logger, "Unexpected end of stream");
-        return false;
+    TRACE_SCOPE("load_nal");
+    /* Make sure there is enough data for start code. Live input may not have
+     brought it yet, that is no NAL for now */
+    while (!m_stream.read_ahead(4)) {
+        if (m_stream.has_more_input()) {
+            return false;
+        }
+        /* Make sure we are not on EOF */
+        if (m_stream.get_size_left()) {
+            codec_log_error(m_logger, "Unexpected end of stream");
+        }
+        if (!begin_next_stream()) {
+            return false;
+        }
     }
 
     /* Can feed in next NAL - for all but first frame it is expected at the
@@ -97,6 +288,20 @@ bool H264StreamHandler::load_nal()
          perhaps after nonzero offset was skipped */
         const unsigned char *nal = at_h264_next_start_code(
             read_pointer, read_pointer + m_stream.get_size_left());
+        while (!nal && m_stream.is_live()) {
+            /* Not read in yet, maybe. Garbage can go, except for the last
+             bytes which may be start of start code */
+            size_t size_left = m_stream.get_size_left();
+            m_stream.flush_bytes((size_left > 3) ? size_left - 3 : 0);
+            if (!m_stream.read_more()) {
+                if (m_stream.has_more_input()) {
+                    return false;
+                }
+                break;
+            }
+            read_pointer = m_stream.get_read_pointer();
+            nal = at_h264_next_start_code(read_pointer, read_pointer + m_stream.get_size_left());
+        }
         if (nal) {
             /* OK, just skip all bytes before this start code */
             m_stream.flush_bytes(nal - read_pointer);
@@ -109,24 +314,61 @@ bool H264StreamHandler::load_nal()
         }
     }
 
-    /* Look for next start code in the stream _after_ current start code */
+    /* Look for next start code in the stream _after_ current start code.
+     With live input, it may be yet to be read. Search goes on from where
+     it ended (in earlier calls too), start code could have been cut off there */
+    size_t searched = m_nal_searched;
     const unsigned char *next_nal = at_h264_next_start_code(
-        read_pointer + 4, read_pointer + m_stream.get_size_left() - 4);
+        read_pointer + ((searched > 12) ? searched - 8 : 4),
+        read_pointer + m_stream.get_size_left() - 4);
+    while (!next_nal && m_stream.is_live()) {
+        searched = m_stream.get_size_left();
+        if (!m_stream.read_more()) {
+            break;
+        }
+        next_nal = at_h264_next_start_code(read_pointer + ((searched > 12) ? searched - 8 : 4),
+                                           read_pointer + m_stream.get_size_left() - 4);
+    }
+    if (!next_nal && m_stream.has_more_input()) {
+        /* Rest of the NAL is yet to come */
+        m_nal_searched = searched;
+        return false;
+    }
+    m_nal_searched = 0;
 
     /* Size is either to next code - if found - or all remaining bytes */
     size_t size = next_nal ? next_nal - read_pointer : m_stream.get_size_left();
 
+    /* First slice of a picture starts next timestamp. The start code is in
+     first 4 bytes, and first_mb_in_slice being zero is a single 1 bit */
+    const unsigned char *start_code = at_h264_next_start_code(read_pointer, read_pointer + 4);
+    bool picture_started = false;
+    if (start_code && (start_code + 4 < read_pointer + size)) {
+        NalType type = (NalType)(start_code[3] & 0x1f);
+        if (((NalType::NON_IDR_SLICE == type) || (NalType::IDR_SLICE == type))
+            && (start_code[4] & 0x80)) {
+            m_input_timestamp = get_picture_timestamp(m_next_input_picture++);
+            picture_started = true;
+        }
+    }
+
     /* Wrap it up and send for processing */
     VideoBuffer buffer;
     buffer.data = read_pointer;
     buffer.size = size;
-    buffer.meta.reset(new FrameMetaData(m_fake_timestamp++));
+    buffer.meta = FrameMeta(m_input_timestamp);
+    buffer.free_callback = m_stream.hold(size);
     m_parser.process_buffer(buffer);
+    /* Parser started pack for it, unless slice was broken */
+    if (picture_started && !m_packs.empty() && m_packs.back().meta
+        && (m_packs.back().meta.get_timestamp() == m_input_timestamp)) {
+        add_parsed_picture(m_next_input_picture - 1, m_packs.back());
+    }
 
     /* Move on stream */
     m_stream.flush_bytes(size);
 
-    if (!m_stream.get_size_left() && !m_packs.empty()
+    if (m_stream.at_end() && !has_next_stream() && !m_packs.empty()
         && (!m_packs.back().m_is_complete || !m_packs.back().m_needs_flushing)) {
         codec_log_warn(m_logger, "Terminating stream at the end of input, no EOS detected");
         m_packs.back().m_is_complete = true;
@@ -136,4 +378,40 @@ bool H264StreamHandler::load_nal()
     /* Mark end*/
     return true;
 }
+
+bool H264StreamHandler::begin_next_stream()
+{
+    if (!next_stream()) {
+        if (!m_packs.empty() && !m_packs.back().m_is_complete) {
+            /* Playlist didn't go on after all */
+            m_packs.back().m_is_complete = true;
+            m_packs.back().m_needs_flushing = true;
+        }
+        return false;
+    }
+    if (!m_packs.empty()) {
+        /* Decoder decides if it has to flush, even if stream ended with
+         end of sequence or stream NAL */
+        m_packs.back().m_is_complete = true;
+        m_packs.back().m_needs_flushing = false;
+        m_packs.back().m_ends_stream = true;
+    }
+    /* First slice of the next stream starts a picture, whatever the last
+     one of this stream was */
+    m_parser.reset();
+    return true;
+}
+
+/* Decoder can tell if next stream fits its session once the first pack of it
+ is complete, which is once the one after starts */
+bool H264StreamHandler::is_stream_end_pending() const
+{
+    for (size_t index = 0; index < m_packs.size(); ++index) {
+        if (m_packs.get_pack(index)->m_ends_stream) {
+            const Pack *next = m_packs.get_pack(index + 1);
+            return !next || !next->m_is_complete;
+        }
+    }
+    return false;
+}
 }
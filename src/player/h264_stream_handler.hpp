@@ -7,13 +7,21 @@
 
 #pragma once
 
+#include <deque>
+
+#include "decoder_placement.hpp"
 #include "h264_stream_parser.hpp"
+#include "pack_drop_policy.hpp"
 #include "pack_queue.hpp"
 #include "simple_logger.hpp"
 #include "stream_handler.hpp"
 #include "vpu_decoder.hpp"
 
 namespace airtame {
+
+/* Annex B carries no timestamps, so pictures get them at this frame rate */
+#define H264_STREAM_HANDLER_FRAME_RATE 30
+
 class H264StreamHandler : public StreamHandler {
 private:
     SimpleLogger m_logger;
@@ -21,8 +29,49 @@ private:
     PackQueue m_packs;
     H264StreamParser m_parser;
     VPUDecoder m_decoder;
+    /* With decoder placement, stream may be decoded by the CPU instead, or
+     move there once VPU runs out of DMA memory, see place_decoder().
+     Backend points to the decoder that does */
+    std::shared_ptr<DecoderPlacement> m_placement;
+    std::unique_ptr<DecodeBackend> m_software_decoder;
+    DecodeBackend *m_backend = &m_decoder;
+    bool m_placed = false;
     VPUOutputFrame m_decoded_frame;
-    size_t m_fake_timestamp = 0;
+    /* Timestamp NALs being loaded get, and number of the next picture in
+     decoding order */
+    Timestamp m_input_timestamp = 0;
+    size_t m_next_input_picture = 0;
+    /* Decoder gives pictures out in display order, so they are stamped again
+     on the way out with their number in that order, see
+     get_output_picture(). Packs dropped before decode are counted in where
+     they would have been shown, so that timeline doesn't slip */
+    size_t m_next_output_picture = 0;
+    /* Picture parsed, by its number in decoding order, and its POC (or
+     position in decoding order, if POC isn't known) */
+    class ParsedPicture {
+    public:
+        size_t picture;
+        int32_t pic_order_cnt;
+    };
+    /* Pictures from one IDR picture to the next, which POC orders. Those
+     before the last one given out (in display order) are only counted */
+    class PictureSequence {
+    public:
+        size_t first_output_picture = 0;
+        size_t number_of_pictures = 0;
+        size_t number_of_pictures_passed = 0;
+        std::deque<ParsedPicture> pictures;
+    };
+    std::deque<PictureSequence> m_picture_sequences;
+    /* Fast forward and seek pre-roll, with drop policy user set chained
+     after it */
+    std::shared_ptr<TrickPlayDropPolicy> m_trick_play;
+    /* Pictures before this one (in display order) are dropped as decoded,
+     to get to the frame seek asked for */
+    size_t m_skip_until_picture = 0;
+    /* Live input: bytes of the NAL at read pointer already searched for
+     the next start code, while the rest of it is yet to come */
+    size_t m_nal_searched = 0;
 
 public:
     H264StreamHandler(Stream &stream)
@@ -30,11 +79,16 @@ public:
         , m_number_of_display_frames(2)
         , m_parser(m_logger, m_packs, false)
         , m_decoder(m_logger, m_number_of_display_frames)
+        , m_trick_play(std::make_shared<TrickPlayDropPolicy>())
     {
+        m_packs.set_drop_policy(m_trick_play);
     }
 
     virtual ~H264StreamHandler()
     {
+        if (m_placement) {
+            m_placement->remove_decoder(*m_backend);
+        }
     }
 
     void offset(size_t off);
@@ -42,8 +96,111 @@ public:
     bool step();
     void swap();
     bool is_interleaved();
+    bool prepare() override;
+    bool seek_to_frame(size_t frame) override;
+    void set_busy_callback(const VPUBusyCallback &callback) override
+    {
+        m_decoder.set_busy_callback(callback);
+        if (m_software_decoder) {
+            m_software_decoder->set_busy_callback(callback);
+        }
+    }
+    void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool) override
+    {
+        m_decoder.set_frame_pool(pool);
+        if (m_software_decoder) {
+            m_software_decoder->set_frame_pool(pool);
+        }
+    }
+    const DecodingStats *get_decoding_stats() override
+    {
+        return &m_backend->get_stats();
+    }
+    double get_frame_rate() override
+    {
+        /* Annex B has no timestamps, pictures are stamped at fixed rate */
+        return H264_STREAM_HANDLER_FRAME_RATE;
+    }
+    PackQueue *get_pack_queue() override
+    {
+        return &m_packs;
+    }
+    const VPUOutputFrame *get_decoded_frame() override
+    {
+        return m_decoded_frame.has_data() ? &m_decoded_frame : nullptr;
+    }
+    void set_drop_policy(const std::shared_ptr<PackDropPolicy> &policy) override
+    {
+        m_trick_play->set_next(policy);
+    }
+    bool set_playback_rate(double rate, const PlaybackClock &clock) override
+    {
+        m_trick_play->set_rate(rate);
+        m_trick_play->set_clock(clock);
+        return true;
+    }
+    void set_rotation(const VPURotation &rotation) override
+    {
+        m_decoder.set_rotation(rotation);
+    }
+    void set_frame_layout(VPUFrameLayout frame_layout) override
+    {
+        m_decoder.set_frame_layout(frame_layout);
+    }
+    void set_feed_ahead(size_t number_of_packs) override
+    {
+        m_decoder.set_feed_ahead(number_of_packs);
+    }
+    void set_keyframes_only(bool keyframes_only) override
+    {
+        m_decoder.set_keyframes_only(keyframes_only);
+    }
+    void set_display_frame_bounds(size_t min_frames, size_t max_frames) override
+    {
+        m_decoder.set_display_frame_bounds(min_frames, max_frames);
+    }
+    void set_decoder_placement(const std::shared_ptr<DecoderPlacement> &placement) override;
+    bool enqueue(const std::string &path) override
+    {
+        m_playlist.push_back(path);
+        return true;
+    }
+    bool set_looping(bool looping) override
+    {
+        m_looping = looping;
+        return true;
+    }
+
+protected:
+    Timestamp get_index_timestamp(Timestamp timestamp) override
+    {
+        /* Index counts pictures */
+        return timestamp * H264_STREAM_HANDLER_FRAME_RATE / 1000000;
+    }
 
 private:
     bool load_nal();
+    /* Goes on with the next stream of the playlist, if any, see
+     Pack::m_ends_stream */
+    bool begin_next_stream();
+    bool is_stream_end_pending() const;
+    /* Picks decoder for the stream once its first pack can open it */
+    void place_decoder();
+    /* Closes decoder and drops everything parsed so far */
+    void restart();
+    /* Keeps output order of the picture pack starts */
+    void add_parsed_picture(size_t picture, const Pack &pack);
+    /* Number in display order of the picture, by its number in decoding
+     order. Takes it and the ones shown before it off the parsed pictures */
+    size_t get_output_picture(size_t picture);
+    static Timestamp get_picture_timestamp(size_t picture)
+    {
+        return (Timestamp)picture * 1000000 / H264_STREAM_HANDLER_FRAME_RATE;
+    }
+    /* Inverse of the above, which rounds timestamps down */
+    static size_t get_picture_number(Timestamp timestamp)
+    {
+        return (size_t)((timestamp * H264_STREAM_HANDLER_FRAME_RATE + 999999) / 1000000);
+    }
 };
 }
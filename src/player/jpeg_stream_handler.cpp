@@ -1,10 +1,11 @@
 /*
- * Copyright (c) 2019  AIRTAME ApS
+ * Copyright (c) 2019-2020  AIRTAME ApS
  * All Rights Reserved.
  *
  * See LICENSE.txt for further information.
  */
 
+#include "jpeg_parser.hpp"
 #include "jpeg_stream_handler.hpp"
 #include "vpu_jpeg_decoder.hpp"
 
@@ -12,9 +13,20 @@ namespace airtame {
 
 void JPEGStreamHandler::offset(size_t off)
 {
-    if (off) {
-        codec_log_warn(m_logger,
-                       "JPEG decoder doesn't handle nonzero offsets, ignoring\n");
+    /* Skip whole images, starting with the one offset is in */
+    const unsigned char *start = m_stream.get_read_pointer();
+    const unsigned char *limit = start + m_stream.get_size_left();
+    while (off && m_stream.get_size_left()) {
+        const unsigned char *image = m_stream.get_read_pointer();
+        const unsigned char *end = at_jpeg_image_end(image, limit);
+        if (!end) {
+            m_stream.flush_bytes(m_stream.get_size_left());
+            return;
+        }
+        m_stream.flush_bytes(end - image);
+        if ((size_t)(end - start) > off) {
+            off = 0;
+        }
     }
 }
 
@@ -29,33 +41,74 @@ bool JPEGStreamHandler::init()
     codec_log_info(m_logger, "JPEG file %zux%zu\n",
                    m_last_frame.geometry.m_true_width,
                    m_last_frame.geometry.m_true_height);
-
-    m_last_frame.dma = VPUJPEGDecoder::produce_jpeg_frame(m_last_frame.geometry);
-    return m_last_frame.dma ? true : false;
+    return true;
 }
 
 bool JPEGStreamHandler::step()
 {
-    if (end()) {
-        /* Already decoded */
-        return false;
+    if (m_decoded_frame.has_data()) {
+        /* Not presented yet */
+        return true;
     }
 
-    /* Not decoded yet, need to load bitstream into DMA memory */
-    VPUDMAPointer bitstream = VPUJPEGDecoder::load_bitstream(m_stream.get_read_pointer(),
-                                                             m_stream.get_size_left());
-    m_stream.flush_bytes(m_stream.get_size_left());
-    return VPUJPEGDecoder::decode(m_logger, m_last_frame.geometry, bitstream,
-                                  m_last_frame.dma, m_interleave);
+    /* Image was loaded while the previous one decoded, unless this is the
+     first one */
+    while (m_decoder.has_loaded_image() || load_image()) {
+        if (!m_decoder.begin_decode()) {
+            /* Broken image, try the next one */
+            continue;
+        }
+        /* Copy the next image in while this one decodes, then let other
+         streams parse */
+        load_image();
+        if (m_busy_callback) {
+            m_busy_callback();
+        }
+        if (m_decoder.finish_decode(m_decoded_frame)) {
+            return true;
+        }
+    }
+
+    codec_log_info(m_logger, "Decoded %zu images, %zu headers reused, %zu DMA allocations",
+                   m_decoder.get_number_of_images_decoded(),
+                   m_decoder.get_number_of_headers_reused(),
+                   m_decoder.get_number_of_allocations());
+    return false;
 }
 
 void JPEGStreamHandler::swap()
 {
-    // no-op
+    if (m_decoded_frame.has_data()) {
+        /* Have the next image to display, old one can be reused */
+        m_decoder.return_output_frame(m_last_frame.dma);
+        m_last_frame = m_decoded_frame;
+        m_decoded_frame.reset();
+    }
 }
 
 bool JPEGStreamHandler::is_interleaved()
 {
     return m_interleave;
 }
+
+bool JPEGStreamHandler::load_image()
+{
+    while (!m_decoder.has_loaded_image() && m_stream.get_size_left()) {
+        const unsigned char *image = m_stream.get_read_pointer();
+        const unsigned char *limit = image + m_stream.get_size_left();
+        const unsigned char *end = at_jpeg_image_end(image, limit);
+        if (!end) {
+            /* Truncated (or no EOI at all), give decoder what there is */
+            end = limit;
+        }
+        m_stream.flush_bytes(end - image);
+
+        FrameMeta meta((Timestamp)m_number_of_images * 1000000 / JPEG_STREAM_HANDLER_FRAME_RATE);
+        ++m_number_of_images;
+        if (m_decoder.load(image, end - image, meta)) {
+            return true;
+        }
+    }
+    return false;
+}
 }
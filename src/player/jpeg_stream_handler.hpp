@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2019  AIRTAME ApS
+ * Copyright (c) 2019-2020  AIRTAME ApS
  * All Rights Reserved.
  *
  * See LICENSE.txt for further information.
@@ -9,18 +9,30 @@
 
 #include "simple_logger.hpp"
 #include "stream_handler.hpp"
+#include "vpu_mjpeg_decoder.hpp"
 
 namespace airtame {
+
+/* MJPEG streams carry no timestamps, so images get these */
+#define JPEG_STREAM_HANDLER_FRAME_RATE 30
+
+/* Plays back JPEG file, or MJPEG stream - which is just JPEG images one after
+ another, as dumped by USB cameras for example */
 class JPEGStreamHandler : public StreamHandler {
 private:
     SimpleLogger m_logger;
-    VPUDMAPointer m_bitstream;
     bool m_interleave;
+    VPUMJPEGDecoder m_decoder;
+    VPUOutputFrame m_decoded_frame;
+    VPUBusyCallback m_busy_callback;
+    /* Number of images loaded so far, for timestamps */
+    size_t m_number_of_images = 0;
 
 public:
     JPEGStreamHandler(Stream &stream, bool interleave)
         : StreamHandler(stream)
         , m_interleave(interleave)
+        , m_decoder(m_logger, interleave)
     {
     }
 
@@ -33,5 +45,22 @@ public:
     bool step();
     void swap();
     bool is_interleaved();
+    void set_busy_callback(const VPUBusyCallback &callback) override
+    {
+        m_busy_callback = callback;
+    }
+    const VPUOutputFrame *get_decoded_frame() override
+    {
+        return m_decoded_frame.has_data() ? &m_decoded_frame : nullptr;
+    }
+    double get_frame_rate() override
+    {
+        return JPEG_STREAM_HANDLER_FRAME_RATE;
+    }
+
+private:
+    /* Loads next image of the stream into the decoder, false at the end of
+     stream (or if there is loaded image already) */
+    bool load_image();
 };
 }
@@ -5,13 +5,20 @@
  * See LICENSE.txt for further information.
  */
 
+#include <chrono>
+#include <deque>
 #include <list>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <math.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 extern "C" {
@@ -19,14 +26,42 @@ extern "C" {
 #include <vpu_lib.h>
 }
 
+#include "damage_tracker.hpp"
+#include "decode_scheduler.hpp"
 #include "g2d_display.hpp"
-#include "ivf.h"
-#include "jpeg_parser.hpp"
+#include "latency_histogram.hpp"
+#include "pack_capture.hpp"
+#include "pipeline_executor.hpp"
+#include "presentation_scheduler.hpp"
+#include "simple_logger.hpp"
 #include "stream.hpp"
-#include "h264_nal.hpp"
-#include "h264_stream_handler.hpp"
-#include "jpeg_stream_handler.hpp"
-#include "vp8_stream_handler.hpp"
+#include "stream_handler.hpp"
+#include "trace.hpp"
+#include "vpu_dmabuf.hpp"
+#include "vpu_frame_access.hpp"
+
+/* Where trace is dumped on SIGUSR1, when built with tracing */
+#define TRACE_DUMP_PATH "/tmp/vpu_playback_trace.json"
+
+/* Where -s saves snapshot of stream n, %zu being n */
+#define SNAPSHOT_PATH "/tmp/vpu_playback_snapshot%zu.ppm"
+
+/* When no stream had a new frame, but live input may bring more, main loop
+ waits for it at most this long (msec) on one of them before going on */
+#define LIVE_INPUT_WAIT_TIMEOUT 10
+
+/* Budget (MB) of the frame pool all the decoders share, unless -m gives
+ another one. VPU, G2D and framebuffer allocate from the same contiguous
+ memory, which is 256MB on our 512MB boards, so frames get at most this of it */
+#define FRAME_POOL_BUDGET_MB 160
+
+/* Set by the signal handler, trace is dumped from the main loop */
+volatile sig_atomic_t trace_dump_requested = 0;
+
+void request_trace_dump(int)
+{
+    trace_dump_requested = 1;
+}
 
 double get_timestamp()
 {
@@ -35,47 +70,6 @@ double get_timestamp()
     return (double)current.tv_sec + ((double)current.tv_usec / 1000000.0);
 }
 
-airtame::StreamHandler *produce_handler(airtame::Stream &stream)
-{
-    const unsigned char *read_pointer = stream.get_read_pointer();
-    /* Try to detect stream type */
-    /* VP8 IVF container has magic numbers at the beginning, so check for it
-     first (28 is last header byte we access) */
-    if ((stream.get_size_left() >= 28)
-        && !::memcmp(read_pointer, IVF_MAGIC_NUMBER, 4)) {
-        fprintf(stderr, "\tIVF magic number detected\n");
-        if (!::memcmp(read_pointer + 8, IVF_VP8_FOURCC, 4)) {
-            fprintf(stderr, "\tVP8 content detected\n");
-            return new airtame::VP8StreamHandler(stream);
-        } else {
-            fprintf(stderr, "\tFOURCC code in IVF stream is not VP8");
-            return nullptr;
-        }
-    }
-
-    /* JPEG JFIF also has magic number, so try that then */
-    const char * jfif = "JFIF";
-    if (stream.get_size_left() > 11) {
-        /* What is usually called "JPEG file" starts with SOI marker (so 0xff
-         and SOI bytes), then has APP0 marker (so 0xff and APP0), then two bytes
-         of APP0 marker size which we ignore here, and bytes 6-11 contain ASCII
-         string "JFIF", including terminating zero */
-        if ((0xff == read_pointer[0]) && (MarkerType::SOI == (MarkerType)read_pointer[1])
-            && (0xff == read_pointer[2]) && (MarkerType::APP0 == (MarkerType)read_pointer[3])
-            && !::memcmp(read_pointer + 6, jfif, 5)) {
-            return new airtame::JPEGStreamHandler(stream, true);
-        }
-    }
-
-    /* OK, finally try scanning for h264 start code */
-    if (at_h264_next_start_code(read_pointer, read_pointer + stream.get_size_left())) {
-        return new airtame::H264StreamHandler(stream);
-    }
-
-    /* Couldn't recognize stream type */
-    return nullptr;
-}
-
 /* Here we are using interpretation of g2d_surface as described in
  "i.MX Graphics User’s Guide" page 9, namely that surface itself spreads from
  0 to width and from 0 to height (horizontally/vertically), and the area of
@@ -105,17 +99,24 @@ void compute_scaling(size_t image_width, size_t image_height,
 }
 
 bool start_display(void *g2d, airtame::G2DDisplay &display,
-                   std::list<airtame::StreamHandler *> &handlers)
+                   std::list<airtame::StreamHandler *> &handlers,
+                   airtame::DamageTracker &damage, size_t &number_of_resets)
 {
     g2d_surface surface;
     if (!display.prepare_render(surface)) {
         return false;
     }
 
-    /* Limit the number of clears because they affect the performance */
-    static size_t clear_counter = display.get_number_of_buffers();
-    if (clear_counter) {
-        --clear_counter;
+    if (number_of_resets != display.get_number_of_resets()) {
+        /* Framebuffer got reconfigured, nothing of what was drawn is there */
+        number_of_resets = display.get_number_of_resets();
+        damage.invalidate();
+    }
+
+    /* Clears affect the performance, so buffer is cleared only when its
+     content is unknown */
+    size_t buffer = display.get_back_buffer();
+    if (damage.begin_buffer(buffer)) {
         if (g2d_clear(g2d, &surface)) {
             fprintf(stderr, "G2D clear failed");
             return false;
@@ -141,8 +142,15 @@ bool start_display(void *g2d, airtame::G2DDisplay &display,
         /* Compute matrix coordinates of this handler first */
         size_t j = n / side;
         size_t i = n - (j * side);
+        size_t cell_index = n;
         ++n;
 
+        /* Cell of this buffer may show the last frame already */
+        bool clear_cell = false;
+        if (!damage.needs_blit(buffer, cell_index, h->get_last_frame().geometry, clear_cell)) {
+            continue;
+        }
+
         /* Source frame description (NV12 data from VPU decoder) */
         g2d_surface src;
         src.format = h->is_interleaved() ? G2D_NV12 : G2D_I420;
@@ -175,6 +183,14 @@ bool start_display(void *g2d, airtame::G2DDisplay &display,
         cell.top = j * cell.height / side;
         cell.bottom = (j + 1) * cell.height / side;
 
+        if (clear_cell) {
+            /* Frame size changed, and it may not cover all of the old one */
+            if (g2d_clear(g2d, &cell)) {
+                fprintf(stderr, "G2D clear failed");
+                return false;
+            }
+        }
+
         /* Scale our frame to sit within the cell, but with proper aspect ratio */
         compute_scaling(h->get_last_frame().geometry.m_true_width,
                         h->get_last_frame().geometry.m_true_height,
@@ -182,6 +198,7 @@ bool start_display(void *g2d, airtame::G2DDisplay &display,
 
         /* blit frame data into framebuffer. This is async operation - blitter
          will continue working in the background, while we'll do other stuff */
+        TRACE_SCOPE("g2d_blit");
         if (g2d_blit(g2d, &src, &cell)) {
             fprintf(stderr, "G2D blit failure\n");
             return false;
@@ -193,9 +210,12 @@ bool start_display(void *g2d, airtame::G2DDisplay &display,
 
 bool end_display(void *g2d, airtame::G2DDisplay &display)
 {
-    if (g2d_finish(g2d)) {
-        fprintf(stderr, "G2D finish failed\n");
-        return false;
+    {
+        TRACE_SCOPE("g2d_finish");
+        if (g2d_finish(g2d)) {
+            fprintf(stderr, "G2D finish failed\n");
+            return false;
+        }
     }
 
     if (!display.swap_buffers()) {
@@ -205,11 +225,352 @@ bool end_display(void *g2d, airtame::G2DDisplay &display)
     return true;
 }
 
+/* Blit is left running over decode steps until the next vblank is closer
+ than the previous step took plus this margin (usec), leaving time to finish
+ it and swap */
+#define DISPLAY_DEADLINE_MARGIN 2000
+
+/* True if the next vblank comes within the given time (usec). False if
+ display can't tell, steps running out of work end the blit then */
+bool is_display_deadline_near(airtame::G2DDisplay &display, int64_t within)
+{
+    int64_t period = display.get_vsync_period_usec();
+    airtame::G2DDisplay::Clock::time_point last = display.get_last_vsync();
+    if (!period || (last == airtame::G2DDisplay::Clock::time_point())) {
+        return false;
+    }
+
+    int64_t since = std::chrono::duration_cast<std::chrono::microseconds>(
+        airtame::G2DDisplay::Clock::now() - last).count();
+    return (period - (since % period)) <= within;
+}
+
+/* Frames late for display are dropped before decode when they are behind
+ the presentation clock by more than this (usec) */
+#define LATE_FRAME_DROP_TOLERANCE 40000
+
+/* Time (usec) until the earliest of frames decoded and waiting to be
+ presented is due, zero if one is due already or there are none */
+airtame::Timestamp get_time_until_due(std::list<airtame::StreamHandler *> &handlers,
+                                      const airtame::PresentationScheduler &presentation)
+{
+    bool found = false;
+    airtame::Timestamp earliest = 0;
+    size_t n = 0;
+    for (auto h : handlers) {
+        const airtame::VPUOutputFrame *frame = h->get_decoded_frame();
+        if (frame && frame->meta) {
+            airtame::Timestamp until = presentation.get_time_until_due(
+                n, frame->meta.get_timestamp());
+            if (!found || (until < earliest)) {
+                earliest = until;
+                found = true;
+            }
+        }
+        ++n;
+    }
+    return (earliest > 0) ? earliest : 0;
+}
+
+/* Swaps handlers whose decoded frames are due, all of them if not paced.
+ Cells of the ones that got new frame on display are damaged, and number of
+ these is returned */
+size_t present(std::list<airtame::StreamHandler *> &handlers,
+               airtame::PresentationScheduler *presentation, airtame::DamageTracker &damage)
+{
+    size_t presented = 0;
+    size_t n = 0;
+    for (auto h : handlers) {
+        const airtame::VPUOutputFrame *frame = h->get_decoded_frame();
+        if (!presentation || !frame || !frame->meta) {
+            h->swap();
+            if (frame) {
+                damage.damage(n);
+                ++presented;
+            }
+        } else {
+            airtame::Timestamp timestamp = frame->meta.get_timestamp();
+            if (presentation->get_time_until_due(n, timestamp) <= 0) {
+                presentation->presented(n, timestamp);
+                h->swap();
+                damage.damage(n);
+                ++presented;
+            }
+        }
+        ++n;
+    }
+    return presented;
+}
+
+/* Buffer swapped with new frames in it, and when the newest of these was
+ decoded */
+class PendingPresentation {
+public:
+    uint64_t swap;
+    std::chrono::steady_clock::time_point decoded;
+};
+
+/* Adds decode to display latency of swaps that went on screen since the
+ previous call. Swaps that never made it there (framebuffer got reopened
+ meanwhile) are just dropped */
+void update_display_latency(airtame::G2DDisplay &display,
+                            std::deque<PendingPresentation> &pending,
+                            airtame::LatencyHistogram &display_latency)
+{
+    airtame::G2DDisplay::Presentation presentation = display.get_last_presentation();
+    while (!pending.empty() && (pending.front().swap <= presentation.swap)) {
+        if (pending.front().swap == presentation.swap) {
+            display_latency.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                presentation.time - pending.front().decoded).count());
+        }
+        pending.pop_front();
+    }
+}
+
+/* Per stream part of the time VPU spent decoding it, and what scheduler
+ did to keep higher priority streams on time */
+void print_vpu_utilization(const airtame::DecodeScheduler &scheduler, size_t number_of_handlers)
+{
+    const airtame::VPUScheduler &vpu_scheduler = scheduler.get_vpu_scheduler();
+    for (size_t n = 0; n < number_of_handlers; ++n) {
+        size_t id;
+        if (!scheduler.get_stream(n, id)) {
+            continue;
+        }
+        const airtame::VPUScheduler::Stream &stream = vpu_scheduler.get_stream(id);
+        fprintf(stderr, "Stream %zu used %.1f%% of VPU time in %zu turns, deferred %zu times, "
+                        "%zu packs shed\n",
+                n, 100 * vpu_scheduler.get_utilization(id), stream.number_of_turns,
+                stream.number_of_deferrals, stream.number_of_packs_shed);
+    }
+}
+
+/* Blit latency, decode to display latency (up to the vblank frame went on
+ screen at) and presentation jitter (if paced), then one line per decoder:
+ stage latencies, bitrate, queue depth and DMA usage. Latencies are
+ avg/p50/p99/max usec */
+void print_stats(std::list<airtame::StreamHandler *> &handlers,
+                 const airtame::LatencyHistogram &blit_latency,
+                 const airtame::LatencyHistogram &display_latency,
+                 const airtame::PresentationScheduler *presentation)
+{
+    char line[512];
+    int length = blit_latency.print_summary(line, sizeof(line), "blit");
+    if ((length >= 0) && ((size_t)length < sizeof(line))) {
+        length += snprintf(line + length, sizeof(line) - length, ", ");
+    }
+    if ((length >= 0) && ((size_t)length < sizeof(line))) {
+        length += display_latency.print_summary(line + length, sizeof(line) - length,
+                                                "display");
+    }
+    if (presentation && (length >= 0) && ((size_t)length < sizeof(line))) {
+        length += snprintf(line + length, sizeof(line) - length, ", ");
+        presentation->get_jitter().print_summary(line + length, sizeof(line) - length,
+                                                 "jitter");
+    }
+    fprintf(stderr, "\t%s\n", line);
+
+    size_t n = 0;
+    for (auto h : handlers) {
+        const airtame::DecodingStats *stats = h->get_decoding_stats();
+        if (stats) {
+            stats->print_summary(line, sizeof(line));
+            fprintf(stderr, "\t%zu: %s\n", n, line);
+        }
+        ++n;
+    }
+}
+
+/* CPU time used by the main thread (the VPU owner), and when, as of the
+ last report */
+class MainThreadUsage {
+public:
+    int64_t cpu_usec = 0;
+    double time = 0;
+};
+
+int64_t get_thread_cpu_usec()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Part of the time the main thread was on CPU (waits for VPU, blit and
+ vblank are not), and each executor worker (pinned to its core) spent on
+ tasks, since the last report */
+void print_pipeline_utilization(airtame::PipelineExecutor &executor, MainThreadUsage &main_usage)
+{
+    char line[512];
+    int64_t cpu_usec = get_thread_cpu_usec();
+    double now = get_timestamp();
+    double elapsed = now - main_usage.time;
+    size_t length = snprintf(line, sizeof(line), "main core %d %.1f%%", ::sched_getcpu(),
+                             (elapsed > 0) ? (cpu_usec - main_usage.cpu_usec) / (elapsed * 10000)
+                                           : 0.0);
+    main_usage.cpu_usec = cpu_usec;
+    main_usage.time = now;
+    for (const auto &worker : executor.get_utilization()) {
+        if (length >= sizeof(line)) {
+            break;
+        }
+        length += snprintf(line + length, sizeof(line) - length,
+                           "%score %d %.1f%% (%zu tasks, %zu stolen)", length ? ", " : "",
+                           worker.core, 100 * worker.busy, worker.number_of_tasks,
+                           worker.number_of_steals);
+    }
+    fprintf(stderr, "\tcores: %s\n", line);
+}
+
+/* Half size RGB snapshot of the frame each stream shows, as binary PPM.
+ Frames stay with their handlers, conversion only reads them */
+void save_snapshots(airtame::CodecLogger &logger, std::list<airtame::StreamHandler *> &handlers)
+{
+    std::vector<unsigned char> image;
+    size_t n = 0;
+    for (auto h : handlers) {
+        size_t stream = n++;
+        const airtame::VPUOutputFrame &frame = h->get_last_frame();
+        /* Converter reads NV12 only */
+        if (!frame.has_data() || !h->is_interleaved()) {
+            continue;
+        }
+        size_t width = (frame.geometry.m_true_width + 1) / 2;
+        size_t height = (frame.geometry.m_true_height + 1) / 2;
+        image.resize(3 * width * height);
+        if (!airtame::convert_output_frame(logger, frame, airtame::VPUFrameAccessFormat::RGB24,
+                                           width, height, image.data(), 3 * width)) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), SNAPSHOT_PATH, stream);
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+            fprintf(stderr, "Couldn't save snapshot to %s\n", path);
+            continue;
+        }
+        fprintf(file, "P6\n%zu %zu\n255\n", width, height);
+        fwrite(image.data(), 1, image.size(), file);
+        fclose(file);
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage:\n%s /dev/fd? file0[@offset] [file1[@offset]]...\n",
-                argv[0]);
+    /* Frames are presented by their timestamps, unless -f asks for free
+     running display, as fast as they decode. -r has video frames rotated
+     (counterclockwise) by the VPU, rather than given to G2D as they are. -a
+     has decoders feed that many packs ahead while VPU decodes. -d has frames
+     allocated as dmabufs, as they would be for sharing with GPU. -c has
+     streams decoded on the CPU when VPU is busy and they are small enough.
+     -p makes the first stream the main one, which VPU scheduler keeps on
+     time at the expense of the other ones. -k has streams after the first
+     one decode keyframes only, as thumbnails. -b has display frame reserve
+     of decoders adapt to how frames are held, within given bounds. Files
+     joined with + play one after the other in the same cell (playlist), -l
+     has them start over once the last one ends. -s saves snapshot of what
+     each stream shows every that many seconds. -w records packs given to
+     decoder of stream n into prefix<n>.packs, for pack_replay. -x plays
+     streams that many times faster, dropping frames before decode. -e has
+     streams parsed on worker threads, one per core other than this one
+     (see PipelineExecutor), rather than all on this thread. -t has
+     VPU decode into tiled frames, which post-processing gives out linear, so
+     G2D gets NV12 as ever (see VPUFrameLayout). -m sets budget (MB) of
+     the frame pool decoders share, 0 for none */
+    bool paced = true;
+    bool dmabuf = false;
+    airtame::VPURotation rotation;
+    airtame::VPUFrameLayout frame_layout = airtame::VPUFrameLayout::LINEAR;
+    size_t feed_ahead = 0;
+    bool cpu_fallback = false;
+    bool executor_enabled = false;
+    bool prioritized = false;
+    bool thumbnails = false;
+    size_t min_display_frames = 0;
+    size_t max_display_frames = 0;
+    bool looping = false;
+    double snapshot_period = 0;
+    const char *capture_prefix = nullptr;
+    double rate = 1.0;
+    size_t frame_pool_budget_mb = FRAME_POOL_BUDGET_MB;
+    const char *program = argv[0];
+    while (argc > 1) {
+        if (!strcmp(argv[1], "-f")) {
+            paced = false;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-r")) {
+            rotation.angle = ::atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-e")) {
+            executor_enabled = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-t")) {
+            frame_layout = airtame::VPUFrameLayout::TILED;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-d")) {
+            dmabuf = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-p")) {
+            prioritized = true;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-k")) {
+            thumbnails = true;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-b")) {
+            if (2 != sscanf(argv[2], "%zu:%zu", &min_display_frames, &max_display_frames)) {
+                max_display_frames = 0;
+            }
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-l")) {
+            looping = true;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-s")) {
+            snapshot_period = ::atof(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && !strcmp(argv[1], "-x")) {
+            rate = ::atof(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && !strcmp(argv[1], "-m")) {
+            frame_pool_budget_mb = ::atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && !strcmp(argv[1], "-w")) {
+            capture_prefix = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-c")) {
+            cpu_fallback = true;
+            --argc;
+            ++argv;
+        } else if ((argc > 2) && !strcmp(argv[1], "-a")) {
+            feed_ahead = ::atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    if ((argc < 3) || !rotation.is_valid() || (min_display_frames > max_display_frames)
+        || (rate < 1.0)) {
+        fprintf(stderr,
+                "Usage:\n%s [-f] [-d] [-t] [-e] [-c] [-p] [-k] [-l] [-r 0|90|180|270] [-a packs] "
+                "[-b min:max] [-m megabytes] [-s seconds] [-w prefix] [-x rate] /dev/fd? "
+                "file0[@offset|#frame|#seconds s][+next...] "
+                "[file1[@offset|#frame|#seconds s][+next...]]...\n"
+                "(file can be -, pipe, socket or tcp:host:port too)\n",
+                program);
         return -1;
     }
 
@@ -221,18 +582,55 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    airtame::SimpleLogger logger;
+    if (dmabuf && !airtame::enable_dmabuf_allocation(logger)) {
+        fprintf(stderr, "Could not allocate frames as dmabufs, using VPU allocator\n");
+    }
+
     std::list<airtame::StreamHandler *> handlers;
+    /* All the decoders share DMA frames, so that each of them doesn't have to
+     keep allocations sized to its own peak. Budget keeps them from taking all
+     of the contiguous memory G2D and framebuffer need too - decoders short of
+     frames go by memory pressure then */
+    std::shared_ptr<airtame::VPUFramePool> frame_pool
+        = airtame::VPUFramePool::create(frame_pool_budget_mb * 1024 * 1024);
+    /* Streams started when VPU is busy may go to the CPU */
+    std::shared_ptr<airtame::DecoderPlacement> placement;
+    if (cpu_fallback) {
+        placement.reset(new airtame::DecoderPlacement());
+    }
 
     /* Iterate over provided files, trying to create handlers for them */
     for (int i = 2; i < argc; i++) {
 
-        /* Notation name@offset is accepted */
+        /* Notation name@offset is accepted, and name#frame for precise seek
+         using stream index, or name#seconds followed by s */
         std::string name = argv[i];
+        /* Playlist, first one is opened here and the rest gets enqueued */
+        std::vector<std::string> playlist;
+        size_t plus;
+        while (std::string::npos != (plus = name.rfind('+'))) {
+            playlist.insert(playlist.begin(), name.substr(plus + 1));
+            name = name.substr(0, plus);
+        }
         size_t offset = 0;
         size_t oo = name.find('@');
+        bool seek = false;
+        size_t frame = 0;
+        /* Seek target is presentation timestamp (usec) instead of frame */
+        bool seek_by_time = false;
+        airtame::Timestamp seek_timestamp = 0;
 
         if (std::string::npos != oo) {
-            offset = ::atoi(argv[i] + oo + 1);
+            offset = ::atoi(name.c_str() + oo + 1);
+            name = name.substr(0, oo);
+        } else if (std::string::npos != (oo = name.find('#'))) {
+            seek = true;
+            frame = ::atoi(name.c_str() + oo + 1);
+            if ('s' == name.back()) {
+                seek_by_time = true;
+                seek_timestamp = (airtame::Timestamp)(::atof(name.c_str() + oo + 1) * 1000000);
+            }
             name = name.substr(0, oo);
         }
 
@@ -242,11 +640,46 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        airtame::StreamHandler *handler = produce_handler(stream);
+        airtame::StreamHandler *handler = airtame::produce_stream_handler(stream);
         if (handler) {
             handler->offset(offset);
+            if (placement) {
+                handler->set_decoder_placement(placement);
+            }
+            handler->set_frame_pool(frame_pool);
+            handler->set_rotation(rotation);
+            handler->set_frame_layout(frame_layout);
+            handler->set_feed_ahead(feed_ahead);
+            handler->set_keyframes_only(thumbnails && !handlers.empty());
+            handler->set_display_frame_bounds(min_display_frames, max_display_frames);
+            if (looping && !handler->set_looping(true)) {
+                fprintf(stderr, "Can't loop %s, stream type can't do playlists\n",
+                        name.c_str());
+            }
+            for (const std::string &next : playlist) {
+                if (!handler->enqueue(next)) {
+                    fprintf(stderr, "Can't play %s after %s, stream type can't do playlists\n",
+                            next.c_str(), name.c_str());
+                    break;
+                }
+            }
+            if (capture_prefix && handler->get_pack_queue()) {
+                std::string path
+                    = capture_prefix + std::to_string(handlers.size()) + ".packs";
+                std::shared_ptr<airtame::PackCaptureWriter> capture(
+                    new airtame::PackCaptureWriter(logger));
+                if (capture->open(path.c_str())) {
+                    handler->get_pack_queue()->set_capture(capture);
+                }
+            }
             /* Success, stream recognized */
             if (handler->init()) {
+                if (seek && seek_by_time && !handler->seek_to_timestamp(seek_timestamp)) {
+                    fprintf(stderr, "Couldn't seek %s to %.3fs\n", name.c_str(),
+                            seek_timestamp / 1000000.0);
+                } else if (seek && !seek_by_time && !handler->seek_to_frame(frame)) {
+                    fprintf(stderr, "Couldn't seek %s to frame %zu\n", name.c_str(), frame);
+                }
                 handlers.push_back(handler);
             } else {
                 fprintf(stderr, "Couldn't init the decoder\n");
@@ -254,7 +687,7 @@ int main(int argc, char *argv[])
             }
         } else {
             fprintf(stderr, "Couldn't recognize stream type of %s. Most likely "
-                            "neither raw h264, vp8 ivf or jpeg jfif\n",
+                            "neither raw h264, vp8 ivf or jpeg/mjpeg\n",
                     argv[i]);
         }
     }
@@ -264,6 +697,28 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    /* Every stream gets its own timeline, in the same order as handlers */
+    airtame::PresentationScheduler presentation;
+    if (paced) {
+        for (auto h : handlers) {
+            size_t stream = presentation.add_stream();
+            presentation.set_rate(stream, rate);
+            h->set_drop_policy(std::make_shared<airtame::DeadlineDropPolicy>(
+                presentation.get_clock(stream), LATE_FRAME_DROP_TOLERANCE));
+        }
+    }
+    if (rate > 1.0) {
+        size_t n = 0;
+        for (auto h : handlers) {
+            if (!h->set_playback_rate(rate, paced ? presentation.get_clock(n)
+                                                  : airtame::PlaybackClock())) {
+                fprintf(stderr, "Stream %zu can't drop frames, decoding all of them at %.1fx\n",
+                        n, rate);
+            }
+            ++n;
+        }
+    }
+
     /* Now need to init G2D */
     void *g2d;
     if (g2d_open(&g2d)) {
@@ -278,54 +733,195 @@ int main(int argc, char *argv[])
 
     /* Display loop */
     airtame::G2DDisplay display(argv[1]);
+    /* Parsing of the streams goes to the other cores, VPU stays with this
+     thread */
+    std::shared_ptr<airtame::PipelineExecutor> executor;
+    if (executor_enabled) {
+        size_t workers = airtame::PipelineExecutor::get_default_number_of_workers();
+        if (workers) {
+            executor.reset(new airtame::PipelineExecutor(workers));
+            fprintf(stderr, "Parsing on %zu worker threads\n", workers);
+        } else {
+            fprintf(stderr, "Single core, parsing stays on the main thread\n");
+        }
+    }
+    /* Scheduler hooks into handlers, so has to go away before they do */
+    std::unique_ptr<airtame::DecodeScheduler> scheduler(
+        new airtame::DecodeScheduler(handlers, executor));
+    for (size_t n = 0; n < handlers.size(); ++n) {
+        if (paced) {
+            scheduler->set_clock(n, presentation.get_clock(n));
+        }
+        if (prioritized) {
+            scheduler->set_priority(n, n ? airtame::VPUStreamPriority::LOW
+                                         : airtame::VPUStreamPriority::HIGH);
+        }
+    }
     double start = get_timestamp();
     double decode_sum = 0, decode_partial_sum = 0;
     double display_sum = 0, display_partial_sum = 0;
     size_t frames = 0;
     size_t start_frames = 0;
+    /* Frame rate counts frames that went on display, decoded ones may still
+     wait for being due, or get dropped at seek */
+    size_t presented_frames = 0;
+    size_t start_presented_frames = 0;
     bool new_frame = true;
+    /* Some live input hasn't ended, even if no new frame came */
+    bool waiting_for_input = false;
+    /* Scheduler left streams out of the round, they still have work */
+    bool work_pending = false;
     bool do_display = false;
+    /* Blit started and not finished yet, and how long it took so far */
+    bool blit_pending = false;
+    std::chrono::steady_clock::duration blit_duration{};
+    /* Time spent blitting (submitting and finishing), usec */
+    airtame::LatencyHistogram blit_latency;
+    /* From decode of the newest frame in a buffer to vblank it was shown at,
+     usec */
+    airtame::LatencyHistogram display_latency;
+    std::deque<PendingPresentation> pending_presentations;
+    /* Newest frame decoded, and the same as of the last present() - if that
+     was since the previous swap, next swap has these frames in it */
+    std::chrono::steady_clock::time_point last_decoded;
+    std::chrono::steady_clock::time_point presented_decoded;
+    bool presented_since_swap = false;
+    uint64_t last_swap = 0;
+    bool refresh_reported = false;
+    /* Cells are redrawn only in buffers that don't show their last frame */
+    airtame::DamageTracker damage(display.get_number_of_buffers(), handlers.size());
+    size_t number_of_resets = display.get_number_of_resets();
+    size_t start_blits_saved = 0;
+    double next_snapshot = get_timestamp() + snapshot_period;
+    MainThreadUsage main_usage;
+    main_usage.cpu_usec = get_thread_cpu_usec();
+    main_usage.time = get_timestamp();
+
+    ::signal(SIGUSR1, request_trace_dump);
+    while (new_frame || waiting_for_input || work_pending) {
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            if (airtame::trace_dump(TRACE_DUMP_PATH)) {
+                fprintf(stderr, "Trace dumped to %s\n", TRACE_DUMP_PATH);
+            } else {
+                fprintf(stderr, "Couldn't dump trace, is tracing built in?\n");
+            }
+        }
 
-    while (new_frame) {
         /* Start display process for already decoded frames (if any). Display
          process itself is asynchronous, and will continue after return from
-         start_display() call */
+         start_display() call, over as many decode steps as display deadline
+         lets it */
         double display_start = get_timestamp();
-        if (do_display) {
-            start_display(g2d, display, handlers);
+        if (do_display && !blit_pending) {
+            auto blit_start = std::chrono::steady_clock::now();
+            if (!start_display(g2d, display, handlers, damage, number_of_resets)) {
+                /* Whatever was drawn before failure, buffer is not what we think */
+                damage.invalidate();
+            }
+            blit_duration = std::chrono::steady_clock::now() - blit_start;
+            blit_pending = true;
         }
 
         /* Start decode for next set of frames */
         double decode_start = get_timestamp();
 
         /* Try to step all handlers, and see if at least one new frame is
-         produced */
-        new_frame = false;
-        for (auto h : handlers) {
-            if (h->step()) {
-                new_frame = true;
-            }
-        }
+         produced. VPU decodes one stream at a time, scheduler gets the
+         others parsed meanwhile */
+        new_frame = scheduler->step();
+        work_pending = scheduler->has_pending_work();
+        int64_t step_usec = (get_timestamp() - decode_start) * 1000000;
 
         if (new_frame) {
+            last_decoded = std::chrono::steady_clock::now();
             double decode_end = get_timestamp();
             decode_sum += decode_end - decode_start;
             decode_partial_sum += decode_end - decode_start;
             ++frames;
         }
 
-        /* Phase III: wait for the blit operation to finish */
-        if (do_display) {
-            end_display(g2d, display);
-        } else {
-            /* Only first iteration skips display */
-            do_display = true;
+        /* Steps don't wait for live input, it is waited for below once
+         nothing else is left to do */
+        waiting_for_input = false;
+        for (auto h : handlers) {
+            if (h->is_waiting_for_input()) {
+                waiting_for_input = true;
+            }
         }
 
-        /* Now we can get rid of displayed buffers. Interestingly so, this is
-         not costless - it can take 1ms+ */
-        for (auto h : handlers) {
-            h->swap();
+        /* Blit may still be running, use that time to parse ahead, so that
+         next decodes won't wait for it */
+        scheduler->prepare_all();
+
+        /* Keep decoding while the blit runs, other streams may have frames to
+         decode still. Blit is waited for once steps ran out of work (handlers
+         hold decoded frames until these are presented), or when another step
+         could make the buffer miss the next vblank */
+        bool idle = !new_frame && !work_pending;
+        if (!blit_pending || idle
+            || is_display_deadline_near(display, step_usec + DISPLAY_DEADLINE_MARGIN)) {
+            /* Phase III: wait for the blit operation to finish */
+            if (blit_pending) {
+                auto finish_start = std::chrono::steady_clock::now();
+                end_display(g2d, display);
+                blit_duration += std::chrono::steady_clock::now() - finish_start;
+                blit_latency.add(
+                    std::chrono::duration_cast<std::chrono::microseconds>(blit_duration).count());
+                blit_pending = false;
+                /* Display may have swapped nothing, if it couldn't prepare */
+                uint64_t swap = display.get_number_of_swaps();
+                if (presented_since_swap && (swap != last_swap)) {
+                    pending_presentations.push_back({ swap, presented_decoded });
+                    presented_since_swap = false;
+                }
+                last_swap = swap;
+                if (!refresh_reported && display.get_vsync_period_usec()) {
+                    fprintf(stderr, "Display refreshes every %.2fms\n",
+                            display.get_vsync_period_usec() / 1000.0);
+                    refresh_reported = true;
+                }
+            } else {
+                /* Only first iteration skips display */
+                do_display = true;
+            }
+
+            /* Wait for live input, if there was nothing else to do. It is the one
+             waited on that ends the wait early, the others are read once it is
+             over */
+            if (idle) {
+                for (auto h : handlers) {
+                    if (h->is_waiting_for_input()) {
+                        h->wait_for_input(LIVE_INPUT_WAIT_TIMEOUT);
+                        break;
+                    }
+                }
+            }
+
+            /* Wait for the next frame to be due, if pacing */
+            if (paced) {
+                airtame::Timestamp until = get_time_until_due(handlers, presentation);
+                if (until > 0) {
+                    ::usleep(until);
+                }
+            }
+
+            /* Now we can get rid of displayed buffers - blit is over, so frames
+             it read from can go. Interestingly so, this used to be not costless - it
+             could take 1ms+. Decoder frames go back by handle now, and decoder
+             applies returns right before next decode */
+            size_t presented = present(handlers, paced ? &presentation : nullptr, damage);
+            if (presented) {
+                presented_frames += presented;
+                presented_decoded = last_decoded;
+                presented_since_swap = true;
+            }
+            update_display_latency(display, pending_presentations, display_latency);
+        }
+
+        if ((snapshot_period > 0) && (get_timestamp() >= next_snapshot)) {
+            save_snapshots(logger, handlers);
+            next_snapshot += snapshot_period;
         }
 
         double display_end = get_timestamp();
@@ -334,23 +930,44 @@ int main(int argc, char *argv[])
 
         /* FPS counter */
         double now = get_timestamp();
-        if (((int)start != (int)now) || !new_frame) {
-            double fps = (double)(frames - start_frames) / display_partial_sum;
+        if (((int)start != (int)now) || (!new_frame && !waiting_for_input && !work_pending)) {
+            double fps = (double)(presented_frames - start_presented_frames) / display_partial_sum;
             double avg_decode = decode_partial_sum / (frames - start_frames);
-            double avg_display = display_partial_sum / (frames - start_frames);
-            fprintf(stderr, "FPS=%.2f (%.2fms), average decode %.2fms\n", fps,
-                    avg_display * 1000, avg_decode * 1000);
+            double avg_display = display_partial_sum / (presented_frames - start_presented_frames);
+            double blits_saved = (double)(damage.get_number_of_blits_saved() - start_blits_saved)
+                / display_partial_sum;
+            fprintf(stderr, "FPS=%.2f (%.2fms), average decode %.2fms, blits saved %.1f/s\n",
+                    fps, avg_display * 1000, avg_decode * 1000, blits_saved);
+            print_stats(handlers, blit_latency, display_latency,
+                        paced ? &presentation : nullptr);
+            if (executor) {
+                print_pipeline_utilization(*executor, main_usage);
+            }
             start = now;
             start_frames = frames;
+            start_presented_frames = presented_frames;
+            start_blits_saved = damage.get_number_of_blits_saved();
             decode_partial_sum = 0.0;
             display_partial_sum = 0.0;
         }
     }
 
     /* Final stats */
-    fprintf(stderr, "Decoded %zu frames, average FPS=%.2f (%.2fms), average "
-                    "decode %.2fms\n", frames, (double)frames / display_sum,
-            1000 * display_sum / frames, 1000 * decode_sum / frames);
+    fprintf(stderr, "Decoded %zu frames, presented %zu, average FPS=%.2f (%.2fms), average "
+                    "decode %.2fms\n", frames, presented_frames,
+            (double)presented_frames / display_sum, 1000 * display_sum / presented_frames,
+            1000 * decode_sum / frames);
+    fprintf(stderr, "Parsed ahead %zu times, %zu of these while VPU was busy\n",
+            scheduler->get_number_of_prepares(), scheduler->get_number_of_overlapped_prepares());
+    fprintf(stderr, "Blitted %zu cells, %zu blits saved\n", damage.get_number_of_blits(),
+            damage.get_number_of_blits_saved());
+    print_vpu_utilization(*scheduler, handlers.size());
+    if (paced) {
+        fprintf(stderr, "Presented %zu frames, %zu of these late\n",
+                presentation.get_number_of_frames_presented(),
+                presentation.get_number_of_late_frames());
+    }
+    scheduler.reset();
 
     /* Get rid of open stream handlers */
     while (!handlers.empty()) {
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "pipeline_executor.hpp"
+
+namespace airtame {
+
+/* Worker thread runs on, so that tasks submitted from it stay local */
+static thread_local const PipelineExecutor *t_executor = nullptr;
+static thread_local int t_worker = -1;
+
+PipelineExecutor::PipelineExecutor(size_t number_of_workers, size_t first_core)
+    : m_reported(std::chrono::steady_clock::now())
+{
+    size_t cores = std::thread::hardware_concurrency();
+    for (size_t i = 0; i < number_of_workers; ++i) {
+        m_workers.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < number_of_workers; ++i) {
+        Worker &worker = *m_workers[i];
+        worker.thread = std::thread(&PipelineExecutor::worker, this, i);
+        if (!cores) {
+            continue;
+        }
+        int core = (first_core + i) % cores;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        if (!pthread_setaffinity_np(worker.thread.native_handle(), sizeof(set), &set)) {
+            worker.core = core;
+        }
+    }
+}
+
+PipelineExecutor::~PipelineExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &worker : m_workers) {
+        worker->thread.join();
+    }
+}
+
+size_t PipelineExecutor::get_default_number_of_workers()
+{
+    size_t cores = std::thread::hardware_concurrency();
+    return (cores > 1) ? cores - 1 : 0;
+}
+
+void PipelineExecutor::submit(Task task)
+{
+    if (m_workers.empty()) {
+        /* Nobody to hand it to */
+        task();
+        return;
+    }
+    int current = get_current_worker();
+    size_t index = (current >= 0) ? (size_t)current
+                                  : m_next_worker.fetch_add(1) % m_workers.size();
+    ++m_unfinished;
+    {
+        std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+        m_workers[index]->tasks.push_back(std::move(task));
+    }
+    {
+        /* Under the mutex sleeping workers check it with, so that none misses
+         the wake up */
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        ++m_queued;
+    }
+    m_wake.notify_one();
+}
+
+void PipelineExecutor::wait()
+{
+    std::unique_lock<std::mutex> lock(m_wake_mutex);
+    m_finished.wait(lock, [this]() { return !m_unfinished; });
+}
+
+std::vector<PipelineExecutor::Utilization> PipelineExecutor::get_utilization()
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed_usec
+        = std::chrono::duration_cast<std::chrono::microseconds>(now - m_reported).count();
+    m_reported = now;
+    std::vector<Utilization> utilization(m_workers.size());
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        Worker &worker = *m_workers[i];
+        uint64_t busy_usec = worker.busy_usec;
+        size_t tasks = worker.number_of_tasks;
+        size_t steals = worker.number_of_steals;
+        utilization[i].core = worker.core;
+        utilization[i].busy
+            = (elapsed_usec > 0) ? (busy_usec - worker.reported_busy_usec) / elapsed_usec : 0.0;
+        utilization[i].number_of_tasks = tasks - worker.reported_tasks;
+        utilization[i].number_of_steals = steals - worker.reported_steals;
+        worker.reported_busy_usec = busy_usec;
+        worker.reported_tasks = tasks;
+        worker.reported_steals = steals;
+    }
+    return utilization;
+}
+
+void PipelineExecutor::worker(size_t index)
+{
+    t_executor = this;
+    t_worker = index;
+    Worker &own = *m_workers[index];
+    while (true) {
+        Task task;
+        bool stolen = false;
+        if (take_task(index, task, stolen)) {
+            auto start = std::chrono::steady_clock::now();
+            task();
+            own.busy_usec += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            ++own.number_of_tasks;
+            if (stolen) {
+                ++own.number_of_steals;
+            }
+            if (!--m_unfinished) {
+                std::lock_guard<std::mutex> lock(m_wake_mutex);
+                m_finished.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wake_mutex);
+        m_wake.wait(lock, [this]() { return m_stop || (m_queued > 0); });
+        if (m_stop) {
+            return;
+        }
+    }
+}
+
+bool PipelineExecutor::take_task(size_t index, Task &task, bool &stolen)
+{
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        Worker &worker = *m_workers[(index + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) {
+            continue;
+        }
+        if (!i) {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        } else {
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+            stolen = true;
+        }
+        --m_queued;
+        return true;
+    }
+    return false;
+}
+
+int PipelineExecutor::get_current_worker() const
+{
+    return (this == t_executor) ? t_worker : -1;
+}
+}
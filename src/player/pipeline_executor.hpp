@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace airtame {
+
+/* Small work-stealing thread pool for pipeline work of many streams played
+ in one process - parsing and pack assembly (see StreamHandler::prepare()),
+ which only touch stream's own input and pack queue. VPU calls stay with the
+ single thread that owns the VPU (see DecodeScheduler), so that submission
+ remains serialized.
+
+ Each worker has its own task deque, pinned to its own core. Tasks submitted
+ from a worker go to its deque (and run newest first, while what they touch
+ is still in cache), tasks from other threads are spread over the workers
+ round robin. Worker that runs out of tasks steals the oldest one of another
+ worker before going to sleep, so that one stream with a lot of input to
+ parse doesn't leave the other cores idle.
+
+ Tasks are small and short (one handler's prepare() is), so deques just take
+ a mutex each, which is never contended for long */
+class PipelineExecutor {
+public:
+    using Task = std::function<void(void)>;
+
+    /* Busy time of a worker since previous get_utilization() */
+    struct Utilization {
+        /* Core worker is pinned to, -1 if it couldn't be */
+        int core = -1;
+        double busy = 0.0;
+        size_t number_of_tasks = 0;
+        size_t number_of_steals = 0;
+    };
+
+private:
+    class Worker {
+    public:
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+        int core = -1;
+        /* Totals, read by get_utilization() */
+        std::atomic<uint64_t> busy_usec{ 0 };
+        std::atomic<size_t> number_of_tasks{ 0 };
+        std::atomic<size_t> number_of_steals{ 0 };
+        /* As of the previous get_utilization() */
+        uint64_t reported_busy_usec = 0;
+        size_t reported_tasks = 0;
+        size_t reported_steals = 0;
+    };
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_next_worker{ 0 };
+
+    /* Tasks submitted and not finished yet, and waiting for those */
+    std::atomic<size_t> m_unfinished{ 0 };
+    /* Tasks in the deques, what sleeping workers wait for. Task can be taken
+     before submit() counts it in, so this may go below zero for a while */
+    std::atomic<long> m_queued{ 0 };
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_finished;
+    bool m_stop = false;
+    std::chrono::steady_clock::time_point m_reported;
+
+public:
+    /* Starts number_of_workers threads, pinned to cores from first_core on
+     (wrapping around the cores there are) */
+    PipelineExecutor(size_t number_of_workers, size_t first_core = 1);
+    /* Tasks not run yet are thrown away */
+    ~PipelineExecutor();
+
+    PipelineExecutor(const PipelineExecutor &) = delete;
+    PipelineExecutor &operator=(const PipelineExecutor &) = delete;
+
+    /* Cores other than the one VPU owner thread runs on, zero on single
+     core */
+    static size_t get_default_number_of_workers();
+
+    /* Can be called from any thread, including tasks themselves */
+    void submit(Task task);
+
+    /* Blocks until every task submitted so far has finished */
+    void wait();
+
+    size_t get_number_of_workers() const
+    {
+        return m_workers.size();
+    }
+
+    /* One per worker. To be called from one thread only */
+    std::vector<Utilization> get_utilization();
+
+private:
+    void worker(size_t index);
+    /* Own newest task, or oldest one of another worker. False if there is
+     none anywhere */
+    bool take_task(size_t index, Task &task, bool &stolen);
+    /* Index of the worker calling, -1 for other threads */
+    int get_current_worker() const;
+};
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include "presentation_scheduler.hpp"
+
+namespace airtame {
+
+size_t PresentationScheduler::add_stream()
+{
+    m_timelines.push_back(Timeline());
+    return m_timelines.size() - 1;
+}
+
+void PresentationScheduler::restart(size_t stream)
+{
+    m_timelines[stream].started = false;
+}
+
+void PresentationScheduler::set_rate(size_t stream, double rate)
+{
+    m_timelines[stream].rate = rate;
+    restart(stream);
+}
+
+Timestamp PresentationScheduler::get_time_until_due(size_t stream, Timestamp timestamp) const
+{
+    const Timeline &timeline = m_timelines[stream];
+    if (!timeline.started) {
+        return 0;
+    }
+    auto due = timeline.start
+        + std::chrono::microseconds(
+            (Timestamp)((timestamp - timeline.first_timestamp) / timeline.rate));
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        due - std::chrono::steady_clock::now()).count();
+}
+
+void PresentationScheduler::presented(size_t stream, Timestamp timestamp)
+{
+    Timeline &timeline = m_timelines[stream];
+    if (!timeline.started) {
+        timeline.started = true;
+        timeline.first_timestamp = timestamp;
+        timeline.start = std::chrono::steady_clock::now();
+    }
+    Timestamp lateness = -get_time_until_due(stream, timestamp);
+    m_jitter.add(lateness);
+    ++m_number_of_frames_presented;
+    if (lateness > m_late_threshold) {
+        ++m_number_of_late_frames;
+    }
+}
+
+bool PresentationScheduler::get_position(size_t stream, Timestamp &position) const
+{
+    const Timeline &timeline = m_timelines[stream];
+    if (!timeline.started) {
+        return false;
+    }
+    position = timeline.first_timestamp
+        + (Timestamp)(timeline.rate
+                      * std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - timeline.start).count());
+    return true;
+}
+}
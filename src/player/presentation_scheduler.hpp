@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "latency_histogram.hpp"
+#include "pack_drop_policy.hpp"
+#include "timestamp.hpp"
+
+namespace airtame {
+
+/* Frames up to this late (usec) are still presented on time as far as
+ stats go */
+#define PRESENTATION_LATE_THRESHOLD 5000
+
+/* Paces presentation of decoded frames by their timestamps (usec) against
+ one monotonic clock. Every stream has its own timeline, which starts when its
+ first frame gets presented, and from then on frame is due when as much time
+ as its timestamp is past the first one has passed on the clock (divided
+ by stream playback rate, see set_rate()).
+
+ Clock is the master one: stream position it gives (see get_clock()) is what
+ pre-decode dropping works against, so that frames that would be late anyway
+ are not decoded, and what audio output would slave to, had we one. Jitter is
+ how late (usec) frames got presented against their due time */
+class PresentationScheduler {
+private:
+    class Timeline {
+    public:
+        bool started = false;
+        /* Timestamp of the first frame, and clock time it was due at */
+        Timestamp first_timestamp = 0;
+        std::chrono::steady_clock::time_point start;
+        /* Timestamps pass this many times faster than the clock */
+        double rate = 1.0;
+    };
+    std::vector<Timeline> m_timelines;
+    Timestamp m_late_threshold;
+
+    LatencyHistogram m_jitter;
+    size_t m_number_of_frames_presented = 0;
+    size_t m_number_of_late_frames = 0;
+
+public:
+    PresentationScheduler(Timestamp late_threshold = PRESENTATION_LATE_THRESHOLD)
+        : m_late_threshold(late_threshold)
+    {
+    }
+
+    /* Returns id of new stream timeline, for use with calls below */
+    size_t add_stream();
+
+    /* Starts stream timeline over with the next frame presented, after seek
+     for example */
+    void restart(size_t stream);
+
+    /* Playback rate of the stream, fast forward above 1 (see
+     TrickPlayDropPolicy). Timeline starts over, so that frames presented
+     before are not held against the new rate */
+    void set_rate(size_t stream, double rate);
+
+    double get_rate(size_t stream) const
+    {
+        return m_timelines[stream].rate;
+    }
+
+    /* Time (usec) until given frame of the stream is due, zero or less if it
+     is due already. First frame of the timeline is always due */
+    Timestamp get_time_until_due(size_t stream, Timestamp timestamp) const;
+
+    /* To be called as frame gets presented, starts timeline if needed and
+     accounts for jitter */
+    void presented(size_t stream, Timestamp timestamp);
+
+    /* Stream position on the clock now, false if timeline didn't start yet */
+    bool get_position(size_t stream, Timestamp &position) const;
+
+    /* Clock of given stream, for DeadlineDropPolicy. Has to be used only while
+     the scheduler exists */
+    PlaybackClock get_clock(size_t stream)
+    {
+        return [this, stream](Timestamp &position) { return get_position(stream, position); };
+    }
+
+    const LatencyHistogram &get_jitter() const
+    {
+        return m_jitter;
+    }
+
+    size_t get_number_of_frames_presented() const
+    {
+        return m_number_of_frames_presented;
+    }
+
+    /* Frames presented later than the threshold */
+    size_t get_number_of_late_frames() const
+    {
+        return m_number_of_late_frames;
+    }
+};
+}
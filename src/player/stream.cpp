@@ -5,17 +5,114 @@
  * See LICENSE.txt for further information.
  */
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "stream.hpp"
 
 namespace airtame {
+
+/* Ring buffer of live input. Positions are counted from the start of input,
+ and are where they are in the ring modulo its capacity. Free callbacks of
+ held data may come from other threads (and after the stream is gone - they
+ keep the ring) */
+class StreamRing {
+public:
+    unsigned char *m_base = nullptr;
+    size_t m_capacity = 0;
+    /* Input read in up to here, and stream read pointer is here */
+    uint64_t m_write = 0;
+    uint64_t m_read = 0;
+    /* Set by read_more(), which may run on a pipeline worker, and read by
+     has_more_input() on the main thread */
+    std::atomic<bool> m_end{ false };
+
+    class Hold {
+    public:
+        uint64_t begin;
+        bool released;
+    };
+    std::mutex m_mutex;
+    /* In the order of begin */
+    std::deque<Hold> m_holds;
+
+    ~StreamRing()
+    {
+        if (m_base) {
+            ::munmap(m_base, 2 * m_capacity);
+        }
+    }
+
+    /* Same memory twice in a row, so that data wrapping around the end
+     continues past it */
+    bool map(size_t size)
+    {
+        size_t page_size = ::sysconf(_SC_PAGESIZE);
+        m_capacity = (size + page_size - 1) / page_size * page_size;
+        int fd = ::memfd_create("stream", 0);
+        if (-1 == fd) {
+            return false;
+        }
+        void *base = MAP_FAILED;
+        if (!::ftruncate(fd, m_capacity)) {
+            base = ::mmap(0, 2 * m_capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (MAP_FAILED != base) {
+            m_base = (unsigned char *)base;
+            if ((MAP_FAILED == ::mmap(m_base, m_capacity, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_FIXED, fd, 0))
+                || (MAP_FAILED == ::mmap(m_base + m_capacity, m_capacity, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_FIXED, fd, 0))) {
+                ::munmap(m_base, 2 * m_capacity);
+                m_base = nullptr;
+            }
+        }
+        ::close(fd);
+        return m_base != nullptr;
+    }
+
+    /* Space that can be read into, all that isn't held or still to be read
+     by the stream */
+    size_t get_free_space()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t in_use = m_holds.empty() ? m_read : m_holds.front().begin;
+        return m_capacity - (size_t)(m_write - in_use);
+    }
+
+    void hold(uint64_t begin)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_holds.push_back({ begin, false });
+    }
+
+    void release(uint64_t begin)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &hold : m_holds) {
+            if (hold.begin == begin) {
+                hold.released = true;
+                break;
+            }
+        }
+        while (!m_holds.empty() && m_holds.front().released) {
+            m_holds.pop_front();
+        }
+    }
+};
+
 Stream::~Stream()
 {
     if (m_buffer) {
@@ -26,8 +123,52 @@ Stream::~Stream()
     }
 }
 
+/* Connects to "host:port" */
+static int connect_tcp(const char *address)
+{
+    std::string host = address;
+    size_t colon = host.rfind(':');
+    if (std::string::npos == colon) {
+        fprintf(stderr, "TCP address %s has no port\n", address);
+        return -1;
+    }
+    std::string port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+
+    struct addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    int error = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (error) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", address, gai_strerror(error));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a && (-1 == fd); a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if ((-1 != fd) && ::connect(fd, a->ai_addr, a->ai_addrlen)) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    if (-1 == fd) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", address, strerror(errno));
+    }
+    return fd;
+}
+
 bool Stream::open(const char *path)
 {
+    if (!::strcmp(path, "-")) {
+        return open_live(path, ::dup(STDIN_FILENO));
+    }
+    if (!::strncmp(path, "tcp:", 4)) {
+        return open_live(path, connect_tcp(path + 4));
+    }
+
     /* Open file */
     m_fd = ::open(path, O_RDONLY);
     if (-1 == m_fd) {
@@ -41,6 +182,12 @@ bool Stream::open(const char *path)
         fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
         return false;
     }
+    if (!S_ISREG(s.st_mode)) {
+        /* Pipe, socket or device, can't be mapped */
+        int fd = m_fd;
+        m_fd = -1;
+        return open_live(path, fd);
+    }
     m_total_size = m_size_left = s.st_size;
 
     /* mmap whole file */
@@ -50,6 +197,168 @@ bool Stream::open(const char *path)
         return false;
     }
     m_read_pointer = m_buffer;
+    m_path = path;
+    m_mtime = (int64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+    /* Stream is read front to back, pages behind read pointer can go */
+    ::madvise((void *)m_buffer, m_total_size, MADV_SEQUENTIAL);
+    m_readahead_offset = 0;
+    advise_readahead();
+    return true;
+}
+
+bool Stream::open_live(const char *path, int fd)
+{
+    if (-1 == fd) {
+        return false;
+    }
+    m_fd = fd;
+    /* Reads never block, read_more() and wait_for_input() wait in poll() -
+     only when asked to */
+    int flags = ::fcntl(m_fd, F_GETFL);
+    if ((-1 == flags) || (-1 == ::fcntl(m_fd, F_SETFL, flags | O_NONBLOCK))) {
+        fprintf(stderr, "Cannot make %s non-blocking: %s\n", path, strerror(errno));
+        return false;
+    }
+    std::shared_ptr<StreamRing> ring = std::make_shared<StreamRing>();
+    if (!ring->map(STREAM_RING_SIZE)) {
+        fprintf(stderr, "Cannot map ring buffer for %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    m_ring = ring;
+    m_read_pointer = m_ring->m_base;
+    m_total_size = m_size_left = 0;
+    m_path = path;
     return true;
 }
+
+bool Stream::read_more(bool wait)
+{
+    if (!m_ring || m_ring->m_end.load(std::memory_order_acquire)) {
+        return false;
+    }
+    while (true) {
+        size_t free_space = m_ring->get_free_space();
+        if (!free_space && (m_size_left == m_ring->m_capacity)) {
+            /* Nothing held, the stream itself needs more than fits */
+            fprintf(stderr, "Ring buffer of %s is full\n", m_path.c_str());
+            m_ring->m_end.store(true, std::memory_order_release);
+            return false;
+        }
+        if (!free_space) {
+            /* Decoding releases what it holds, so this passes */
+            if (!m_ring_full_reported) {
+                fprintf(stderr, "Ring buffer of %s is full, waiting for decoding\n",
+                        m_path.c_str());
+                m_ring_full_reported = true;
+            }
+            return false;
+        }
+        /* Ring is mapped twice, so free space is contiguous too */
+        ssize_t size
+            = ::read(m_fd, m_ring->m_base + m_ring->m_write % m_ring->m_capacity, free_space);
+        if (size > 0) {
+            m_ring_full_reported = false;
+            m_ring->m_write += size;
+            m_size_left += size;
+            m_total_size += size;
+            return true;
+        }
+        if (!size) {
+            m_ring->m_end.store(true, std::memory_order_release);
+            return false;
+        }
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+            if (!wait) {
+                return false;
+            }
+            struct pollfd pfd = { m_fd, POLLIN, 0 };
+            if ((-1 != ::poll(&pfd, 1, -1)) || (EINTR == errno)) {
+                continue;
+            }
+        } else if (EINTR == errno) {
+            continue;
+        }
+        fprintf(stderr, "Cannot read %s: %s\n", m_path.c_str(), strerror(errno));
+        m_ring->m_end.store(true, std::memory_order_release);
+        return false;
+    }
+}
+
+bool Stream::has_more_input() const
+{
+    return m_ring && !m_ring->m_end.load(std::memory_order_acquire);
+}
+
+bool Stream::wait_for_input(int timeout)
+{
+    if (!has_more_input()) {
+        return false;
+    }
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    /* End of input and errors poll as readable too, read_more() tells them */
+    return ::poll(&pfd, 1, timeout) > 0;
+}
+
+bool Stream::contains(const unsigned char *data) const
+{
+    if (m_ring) {
+        return (data >= m_ring->m_base) && (data < m_ring->m_base + 2 * m_ring->m_capacity);
+    }
+    return m_buffer && (data >= m_buffer) && (data < m_buffer + m_total_size);
+}
+
+VideoBuffer::FreeCallback Stream::hold(size_t size)
+{
+    if (!m_ring || !size) {
+        return 0;
+    }
+    /* Chunks point into the ring, so it has to outlive them anyway (see
+     StreamHandler::m_finished_streams). Plain pointer and offset is what
+     std::function stores without allocating - shared_ptr copy would have it
+     allocate for every NAL */
+    StreamRing *ring = m_ring.get();
+    uint64_t begin = ring->m_read;
+    ring->hold(begin);
+    return [ring, begin]() { ring->release(begin); };
+}
+
+void Stream::flush_live_bytes(size_t n)
+{
+    if (n > m_size_left) {
+        n = m_size_left;
+    }
+    m_size_left -= n;
+    std::lock_guard<std::mutex> lock(m_ring->m_mutex);
+    m_ring->m_read += n;
+    m_read_pointer = m_ring->m_base + m_ring->m_read % m_ring->m_capacity;
+}
+
+/* Kernel reads the mapping in ahead of read pointer anyway, this asks for the
+ next window to be read in while the current one gets parsed */
+void Stream::advise_readahead()
+{
+    if (!m_buffer || (m_readahead_offset >= m_total_size)) {
+        return;
+    }
+    size_t page_size = ::sysconf(_SC_PAGESIZE);
+    size_t begin = m_readahead_offset / page_size * page_size;
+    size_t size = STREAM_READAHEAD_SIZE;
+    if (size > m_total_size - begin) {
+        size = m_total_size - begin;
+    }
+    ::madvise((void *)(m_buffer + begin), size, MADV_WILLNEED);
+    m_readahead_offset = begin + size;
+}
+
+const StreamIndex *Stream::get_index()
+{
+    if (!m_index_tried && m_buffer) {
+        m_index_tried = true;
+        m_index.reset(new StreamIndex());
+        if (!m_index->open(m_path, m_buffer, m_total_size, m_mtime)) {
+            m_index.reset();
+        }
+    }
+    return m_index.get();
+}
 }
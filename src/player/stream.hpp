@@ -7,10 +7,35 @@
 
 #pragma once
 
+#include <memory>
+#include <string>
+
+#include "codec_common.hpp"
+#include "stream_index.hpp"
+
 namespace airtame {
 
+/* Live input is read into ring buffer of this size (rounded up to pages). It
+ has to hold everything parsed and not yet decoded, see
+ STREAM_HANDLER_BYTES_AHEAD, plus the biggest NAL or frame */
+#define STREAM_RING_SIZE (8 * 1024 * 1024)
+/* File mapping is asked to be read in ahead by this much */
+#define STREAM_READAHEAD_SIZE (2 * 1024 * 1024)
+
+class StreamRing;
+
 /* File mapping to process space. Because I am too lazy to deal with actual
- codec elements overlapping the I/O buffers :P */
+ codec elements overlapping the I/O buffers :P
+
+ Pipes, sockets, standard input ("-") and TCP connections ("tcp:host:port")
+ are live input instead, read into StreamRing: ring buffer mapped twice in a
+ row, so that whatever was read in is at read pointer in one piece, even
+ across the ring end. Only what was read in so far is there - handlers ask
+ for more with read_ahead()/read_more(). These only wait for input when asked
+ to: decoding steps read what has come and treat the rest as not there yet
+ (see has_more_input()), so that one quiet input doesn't stall the others
+ played along. Data given to parsers has to be held (see hold()) until parsed
+ chunks are consumed, the ring doesn't read over it before */
 class Stream {
 private:
     int m_fd = -1;
@@ -18,6 +43,18 @@ private:
     const unsigned char *m_read_pointer = nullptr;
     size_t m_total_size = 0;
     size_t m_size_left = 0;
+    std::string m_path;
+    /* Modification time (nsec), for telling if saved index still matches */
+    int64_t m_mtime = 0;
+    /* Built or loaded on first get_index() call */
+    std::unique_ptr<StreamIndex> m_index;
+    bool m_index_tried = false;
+    /* Set for live input */
+    std::shared_ptr<StreamRing> m_ring;
+    /* Offset up to which file mapping was asked to be read in */
+    size_t m_readahead_offset = 0;
+    /* Full ring was reported, and nothing was read since */
+    bool m_ring_full_reported = false;
 
 public:
     Stream()
@@ -32,6 +69,13 @@ public:
         , m_read_pointer(source.m_read_pointer)
         , m_total_size(source.m_total_size)
         , m_size_left(source.m_size_left)
+        , m_path(std::move(source.m_path))
+        , m_mtime(source.m_mtime)
+        , m_index(std::move(source.m_index))
+        , m_index_tried(source.m_index_tried)
+        , m_ring(std::move(source.m_ring))
+        , m_readahead_offset(source.m_readahead_offset)
+        , m_ring_full_reported(source.m_ring_full_reported)
     {
         /* Now we can't have two instances pointing out to the same open file
          mapping, because first dtor call fucks up the other as well, so make
@@ -39,26 +83,97 @@ public:
         source.m_fd = -1;
         source.m_buffer = source.m_read_pointer = nullptr;
         source.m_total_size = source.m_size_left = 0;
+        source.m_index_tried = false;
     }
     ~Stream();
     bool open(const char *path);
     void flush_bytes(size_t n)
     {
-        if (n < m_size_left) {
+        if (m_ring) {
+            flush_live_bytes(n);
+        } else if (n < m_size_left) {
             m_size_left -= n;
             m_read_pointer += n;
+            if ((size_t)(m_read_pointer - m_buffer) + STREAM_READAHEAD_SIZE > m_readahead_offset) {
+                advise_readahead();
+            }
+        } else {
+            m_size_left = 0;
+            m_read_pointer = nullptr;
+        }
+    }
+    /* Moves read pointer to given offset from the start of the stream. Live
+     input can't seek */
+    void seek(size_t offset)
+    {
+        if (m_ring) {
+            return;
+        }
+        if (offset < m_total_size) {
+            m_read_pointer = m_buffer + offset;
+            m_size_left = m_total_size - offset;
+            m_readahead_offset = offset;
+            advise_readahead();
         } else {
             m_size_left = 0;
             m_read_pointer = nullptr;
         }
     }
+    bool is_live() const
+    {
+        return m_ring != nullptr;
+    }
+    /* Reads live input until at least size bytes are at read pointer, true
+     if they are. Without wait, only what has come so far is read in. For
+     file it is all there already, so just tells */
+    bool read_ahead(size_t size, bool wait = false)
+    {
+        while ((m_size_left < size) && read_more(wait)) ;
+        return m_size_left >= size;
+    }
+    /* Reads in as much live input as there is, waiting for some if asked to.
+     False if nothing was read: on the end of input, when the ring is full
+     or, without wait, when nothing has come yet. Always false for file */
+    bool read_more(bool wait = false);
+    /* Whether live input may still bring more than what was read in. False
+     for file, which is all there */
+    bool has_more_input() const;
+    /* Never waits: true once nothing is left at read pointer and nothing more
+     is coming */
+    bool at_end()
+    {
+        return !read_ahead(1) && !has_more_input();
+    }
+    /* Waits up to timeout (msec) for live input to come, true if there is
+     some to read. For when decoding found nothing else to do */
+    bool wait_for_input(int timeout);
+    /* Free callback for VideoBuffer with size bytes at read pointer, which
+     keeps them from being read over until called. Empty for file, it is
+     mapped for as long as the stream is open */
+    VideoBuffer::FreeCallback hold(size_t size);
+    /* Frame index of the stream, see StreamIndex. Whole stream gets walked
+     the first time (unless there is index saved from before), so it is only
+     done once somebody needs it. Returns nullptr if stream can't be indexed */
+    const StreamIndex *get_index();
     const unsigned char *get_read_pointer() const
     {
         return m_read_pointer;
     }
+    /* For live input, just the part read in so far */
     size_t get_size_left() const
     {
         return m_size_left;
     }
+    const std::string &get_path() const
+    {
+        return m_path;
+    }
+    /* Whether data points into file mapping, or ring buffer, of this stream */
+    bool contains(const unsigned char *data) const;
+
+private:
+    bool open_live(const char *path, int fd);
+    void flush_live_bytes(size_t n);
+    void advise_readahead();
 };
 } // namespace airtame
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "h264_nal.hpp"
+#include "h264_stream_handler.hpp"
+#include "ivf.h"
+#include "jpeg_parser.hpp"
+#include "jpeg_stream_handler.hpp"
+#include "stream_handler.hpp"
+#include "vp8_stream_handler.hpp"
+#include "vpu_decoder.hpp"
+
+namespace airtame {
+
+bool StreamHandler::seek_to_timestamp(Timestamp timestamp)
+{
+    const StreamIndex *index = m_stream.get_index();
+    if (!index || !index->get_number_of_entries()) {
+        return false;
+    }
+    return seek_to_frame(index->find_by_timestamp(get_index_timestamp(timestamp)));
+}
+
+void StreamHandler::migrate_decoder(CodecLogger &logger, DecoderPlacement &placement,
+                                    VPUDecoder &decoder, DecodeBackend *software_decoder,
+                                    const Pack &pack, DecodeBackend *&backend)
+{
+    if ((backend != &decoder) || !decoder.is_memory_starved() || !software_decoder
+        || decoder.get_rotation().is_enabled() || !placement.migrate(pack)) {
+        return;
+    }
+    codec_log_warn(logger, "VPU is out of DMA memory, decoding stream on the CPU");
+    placement.remove_decoder(decoder);
+    decoder.close();
+    if (m_last_frame.dma) {
+        /* Stays on display until next frame comes, but isn't given back */
+        m_last_frame_is_stale = true;
+    }
+    backend = software_decoder;
+    placement.add_decoder(*backend);
+}
+
+bool StreamHandler::next_stream()
+{
+    if (m_looping && !m_stream.is_live()) {
+        m_playlist.push_back(m_stream.get_path());
+    }
+    while (!m_playlist.empty()) {
+        std::string path = m_playlist.front();
+        m_playlist.pop_front();
+        /* Takes over current stream, leaving it closed */
+        m_finished_streams.emplace_back(m_stream);
+        fprintf(stderr, "Playing %s next\n", path.c_str());
+        if (m_stream.open(path.c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void StreamHandler::release_finished_streams(const PackQueue &queue)
+{
+    auto it = m_finished_streams.begin();
+    while (it != m_finished_streams.end()) {
+        bool referred = false;
+        for (size_t index = 0; !referred && (index < queue.size()); ++index) {
+            for (const VideoChunk &chunk : queue.get_pack(index)->m_chunks) {
+                if (it->contains(chunk.data)) {
+                    referred = true;
+                    break;
+                }
+            }
+        }
+        it = referred ? std::next(it) : m_finished_streams.erase(it);
+    }
+}
+
+StreamHandler *produce_stream_handler(Stream &stream)
+{
+    /* Live input has only what was read in so far, enough to tell the type
+     (or all of it, if it ends before) */
+    stream.read_ahead(STREAM_HANDLER_PROBE_SIZE, true);
+    const unsigned char *read_pointer = stream.get_read_pointer();
+    /* Try to detect stream type */
+    /* VP8 IVF container has magic numbers at the beginning, so check for it
+     first (28 is last header byte we access) */
+    if ((stream.get_size_left() >= 28)
+        && !::memcmp(read_pointer, IVF_MAGIC_NUMBER, 4)) {
+        fprintf(stderr, "\tIVF magic number detected\n");
+        if (!::memcmp(read_pointer + 8, IVF_VP8_FOURCC, 4)) {
+            fprintf(stderr, "\tVP8 content detected\n");
+            return new VP8StreamHandler(stream);
+        } else {
+            fprintf(stderr, "\tFOURCC code in IVF stream is not VP8");
+            return nullptr;
+        }
+    }
+
+    /* JPEG also has magic number, so try that then. What is usually called
+     "JPEG file" starts with SOI marker (so 0xff and SOI bytes), then has APP0
+     marker with "JFIF" string. MJPEG from USB cameras often has no APP0 at
+     all, so just check that SOI is followed by some other marker */
+    if (stream.get_size_left() > 3) {
+        if ((0xff == read_pointer[0]) && (MarkerType::SOI == (MarkerType)read_pointer[1])
+            && (0xff == read_pointer[2])) {
+            if (stream.is_live()) {
+                /* Handler needs whole images in the stream */
+                fprintf(stderr, "\tJPEG is only supported from files\n");
+                return nullptr;
+            }
+            return new JPEGStreamHandler(stream, true);
+        }
+    }
+
+    /* OK, finally try scanning for h264 start code */
+    if (at_h264_next_start_code(read_pointer, read_pointer + stream.get_size_left())) {
+        return new H264StreamHandler(stream);
+    }
+
+    /* Couldn't recognize stream type */
+    return nullptr;
+}
+}
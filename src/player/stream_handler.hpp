@@ -7,16 +7,47 @@
 
 #pragma once
 
+#include <deque>
+#include <list>
+#include <string>
+
+#include "codec_common.hpp"
+#include "codec_logger.hpp"
+#include "decoder_placement.hpp"
+#include "pack_drop_policy.hpp"
+#include "pack_queue.hpp"
 #include "stream.hpp"
+#include "vpu_decoding_session.hpp"
+#include "vpu_frame_pool.hpp"
 #include "vpu_output_frame.hpp"
 
 namespace airtame {
+
+class VPUDecoder;
+
+/* Number of packs (including the one being parsed) prepare() parses ahead */
+#define STREAM_HANDLER_PACKS_AHEAD 4
+/* ...and stops early once that many bytes wait to be fed, see
+ PackQueue::get_bytes_pending(). Big intra pictures are what this is about */
+#define STREAM_HANDLER_BYTES_AHEAD (2 * 1024 * 1024)
+/* Bytes of live input read in before telling stream type */
+#define STREAM_HANDLER_PROBE_SIZE 4096
+
 class StreamHandler {
 protected:
     Stream m_stream;
     VPUOutputFrame m_last_frame;
+    /* Set when frame displayed came from decoder session closed by seek, so
+     it must not be given back to the new one */
+    bool m_last_frame_is_stale = false;
     size_t m_buffers_in;
     size_t m_buffers_out;
+    /* Paths of streams to play after the current one, see enqueue() */
+    std::deque<std::string> m_playlist;
+    bool m_looping = false;
+    /* Streams played before, kept open while chunks in the queue still point
+     into them */
+    std::list<Stream> m_finished_streams;
 
 public:
     StreamHandler(Stream &stream)
@@ -35,14 +66,184 @@ public:
     virtual bool step() = 0;
     virtual void swap() = 0;
     virtual bool is_interleaved() = 0;
+    /* Handlers with video decoder borrow their frames from given pool, so
+     that several streams played at once can share them */
+    virtual void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool)
+    {
+        (void)pool;
+    }
 
+    /* Parses input ahead of decoding, so that step() finds it ready. Doesn't
+     touch the VPU, so it is safe to call while other handler decodes. Returns
+     true if any input was parsed */
+    virtual bool prepare()
+    {
+        return false;
+    }
+    /* Handlers with video decoder will call this while the VPU decodes their
+     frame, see VPUBusyCallback */
+    virtual void set_busy_callback(const VPUBusyCallback &callback)
+    {
+        (void)callback;
+    }
+    /* Frame step() decoded and next swap() makes the last one, nullptr if
+     there is none. Its meta carries presentation timestamp (usec) */
+    virtual const VPUOutputFrame *get_decoded_frame()
+    {
+        return nullptr;
+    }
+    /* Pre-decode dropping, for handlers with video decoder */
+    virtual void set_drop_policy(const std::shared_ptr<PackDropPolicy> &policy)
+    {
+        (void)policy;
+    }
+    /* VPU rotation of decoded frames, for handlers with video decoder */
+    virtual void set_rotation(const VPURotation &rotation)
+    {
+        (void)rotation;
+    }
+    /* Layout of VPU frames, see VPUDecoder::set_frame_layout(), for handlers
+     with video decoder */
+    virtual void set_frame_layout(VPUFrameLayout frame_layout)
+    {
+        (void)frame_layout;
+    }
+    /* Packs fed into bitstream buffer while VPU decodes, see
+     VPUDecoder::set_feed_ahead(), for handlers with video decoder */
+    virtual void set_feed_ahead(size_t number_of_packs)
+    {
+        (void)number_of_packs;
+    }
+    /* Fast forward above rate 1, by dropping packs before decode (see
+     TrickPlayDropPolicy), with clock of presentation running at that rate
+     letting it jump between reopen points. For handlers with video decoder,
+     returns false if handler can't drop frames */
+    virtual bool set_playback_rate(double rate, const PlaybackClock &clock = PlaybackClock())
+    {
+        (void)rate;
+        (void)clock;
+        return false;
+    }
+    /* Decodes keyframes only, see VPUDecoder::set_keyframes_only(), for
+     handlers with video decoder */
+    virtual void set_keyframes_only(bool keyframes_only)
+    {
+        (void)keyframes_only;
+    }
+    /* Bounds of adaptive display frame reserve, see
+     VPUDecoder::set_display_frame_bounds(), for handlers with video
+     decoder */
+    virtual void set_display_frame_bounds(size_t min_frames, size_t max_frames)
+    {
+        (void)min_frames;
+        (void)max_frames;
+    }
+    /* Lets placement pick the engine decoding the stream, VPU or CPU, for
+     handlers with video decoder. Has to be set before first step() */
+    virtual void set_decoder_placement(const std::shared_ptr<DecoderPlacement> &placement)
+    {
+        (void)placement;
+    }
+    /* Playlist: stream at given path plays once the current one (and ones
+     enqueued before) ends, continuing in the same queue, so that decoder
+     doesn't have to be opened again for it if stream parameters stay the
+     same (see Pack::m_ends_stream). Has to be the same type of stream.
+     Returns false if handler can't play streams back to back */
+    virtual bool enqueue(const std::string &path)
+    {
+        (void)path;
+        return false;
+    }
+    /* Current stream and the ones enqueued start over once the last one
+     ends. Live input isn't played again. Returns false if handler can't
+     play streams back to back (see enqueue()), it plays the stream once
+     then */
+    virtual bool set_looping(bool looping)
+    {
+        (void)looping;
+        return false;
+    }
+    /* Precise seek, see "SEEK" algorithm in pack_queue.hpp: using the
+     stream index, goes to the keyframe at or before given frame (index entry,
+     so in decoding order) and decodes from there, dropping non-reference
+     packs before decode and other frames right after it, up to the frame
+     asked for - so that none of them are given out or held. Returns false if
+     handler or stream can't do that */
+    virtual bool seek_to_frame(size_t frame)
+    {
+        (void)frame;
+        return false;
+    }
+    /* Same, to the last frame with presentation timestamp (usec) not after
+     given one */
+    bool seek_to_timestamp(Timestamp timestamp);
+    /* Queue parser fills and video decoder consumes, nullptr for handlers
+     without one */
+    virtual PackQueue *get_pack_queue()
+    {
+        return nullptr;
+    }
+    /* Frame rate (frames/s) stream is meant to play at, by what it declares
+     or by the rate handler makes timestamps up at for streams that have
+     none, 0 if not known */
+    virtual double get_frame_rate()
+    {
+        return 0.0;
+    }
+    /* Stats of the video decoder, nullptr for handlers without one */
+    virtual const DecodingStats *get_decoding_stats()
+    {
+        return nullptr;
+    }
+
+protected:
+    /* Opens next stream of the playlist in place of the current one, which
+     is kept among finished ones. False if there is none left */
+    bool next_stream();
+    bool has_next_stream() const
+    {
+        return !m_playlist.empty() || (m_looping && !m_stream.is_live());
+    }
+    /* Moves the stream from VPU decoder that couldn't get DMA memory even for
+     keyframes only to software decoder, whose frames may still fit, if
+     placement lets it (pack is the one decoding would reopen with). VPU
+     decoder is closed and backend set to the software one then, which is
+     logged to logger of the handler */
+    void migrate_decoder(CodecLogger &logger, DecoderPlacement &placement, VPUDecoder &decoder,
+                         DecodeBackend *software_decoder, const Pack &pack,
+                         DecodeBackend *&backend);
+    /* Closes finished streams no chunk in the queue points into anymore */
+    void release_finished_streams(const PackQueue &queue);
+    /* Converts presentation timestamp (usec) to stream index one */
+    virtual Timestamp get_index_timestamp(Timestamp timestamp)
+    {
+        return timestamp;
+    }
+
+public:
     const VPUOutputFrame &get_last_frame()
     {
         return m_last_frame;
     }
+    /* Never waits for live input, see Stream::at_end() */
     bool end()
     {
-        return !m_stream.get_size_left() && (m_buffers_in == m_buffers_out);
+        return m_stream.at_end() && !has_next_stream() && (m_buffers_in == m_buffers_out);
+    }
+    /* Live input may bring more, so step() having produced nothing isn't the
+     end of it */
+    bool is_waiting_for_input() const
+    {
+        return m_stream.has_more_input();
+    }
+    /* Waits up to timeout (msec) for live input, see Stream::wait_for_input() */
+    bool wait_for_input(int timeout)
+    {
+        return m_stream.wait_for_input(timeout);
     }
 };
+
+/* Recognizes stream type (VP8 IVF, JPEG or MJPEG or raw h264) and makes handler
+ for it, nullptr if type wasn't recognized */
+StreamHandler *produce_stream_handler(Stream &stream);
 }
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "h264_nal.hpp"
+#include "ivf.h"
+#include "stream_index.hpp"
+
+namespace airtame {
+
+/* Stream data is not aligned in any way, and ARM doesn't like unaligned
+ 64-bit loads */
+template <typename T> static T read_le(const unsigned char *data)
+{
+    T value;
+    ::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+StreamIndex::~StreamIndex()
+{
+    if (m_mapping) {
+        ::munmap(m_mapping, m_mapping_size);
+    }
+}
+
+bool StreamIndex::open(const std::string &path, const unsigned char *data, size_t size,
+                       int64_t mtime)
+{
+    /* Same detection as produce_stream_handler() */
+    if ((size >= 32) && !::memcmp(data, IVF_MAGIC_NUMBER, 4)
+        && !::memcmp(data + 8, IVF_VP8_FOURCC, 4)) {
+        m_codec = StreamIndexCodec::VP8_IVF;
+    } else if (at_h264_next_start_code(data, data + size)) {
+        m_codec = StreamIndexCodec::H264_ANNEXB;
+    } else {
+        return false;
+    }
+
+    std::string index_path = path + STREAM_INDEX_SUFFIX;
+    if (load(index_path, size, mtime)) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (StreamIndexCodec::VP8_IVF == m_codec) {
+        build_ivf(data, size);
+    } else {
+        build_h264(data, size);
+    }
+    m_entries = m_built_entries.data();
+    m_number_of_entries = m_built_entries.size();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "Indexed %zu frames of %s in %.3fs\n", m_number_of_entries, path.c_str(),
+            duration.count());
+
+    save(index_path, size, mtime);
+    return true;
+}
+
+size_t StreamIndex::find_by_timestamp(Timestamp timestamp) const
+{
+    const StreamIndexEntry *end = m_entries + m_number_of_entries;
+    const StreamIndexEntry *after = std::upper_bound(
+        m_entries, end, timestamp,
+        [](Timestamp t, const StreamIndexEntry &entry) { return t < entry.timestamp; });
+    return (after != m_entries) ? (after - m_entries) - 1 : 0;
+}
+
+bool StreamIndex::load(const std::string &index_path, size_t size, int64_t mtime)
+{
+    int fd = ::open(index_path.c_str(), O_RDONLY);
+    if (-1 == fd) {
+        /* Most likely just not built yet */
+        return false;
+    }
+
+    struct stat s;
+    if ((-1 == ::fstat(fd, &s)) || ((size_t)s.st_size < sizeof(StreamIndexHeader))) {
+        ::close(fd);
+        return false;
+    }
+    void *mapping = ::mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* Mapping stays valid after close */
+    ::close(fd);
+    if (MAP_FAILED == mapping) {
+        return false;
+    }
+
+    const StreamIndexHeader *header = (const StreamIndexHeader *)mapping;
+    if (::memcmp(header->magic, STREAM_INDEX_MAGIC, 4) || (STREAM_INDEX_VERSION != header->version)
+        || (sizeof(StreamIndexEntry) != header->entry_size)
+        || ((uint32_t)m_codec != header->codec) || (size != header->source_size)
+        || (mtime != header->source_mtime)
+        || (header->number_of_entries
+            > (s.st_size - sizeof(StreamIndexHeader)) / sizeof(StreamIndexEntry))) {
+        fprintf(stderr, "Index %s is stale or broken, rebuilding\n", index_path.c_str());
+        ::munmap(mapping, s.st_size);
+        return false;
+    }
+
+    m_mapping = mapping;
+    m_mapping_size = s.st_size;
+    m_entries = (const StreamIndexEntry *)(header + 1);
+    m_number_of_entries = header->number_of_entries;
+    return true;
+}
+
+void StreamIndex::save(const std::string &index_path, size_t size, int64_t mtime) const
+{
+    StreamIndexHeader header;
+    ::memset(&header, 0, sizeof(header));
+    ::memcpy(header.magic, STREAM_INDEX_MAGIC, 4);
+    header.version = STREAM_INDEX_VERSION;
+    header.entry_size = sizeof(StreamIndexEntry);
+    header.codec = (uint32_t)m_codec;
+    header.source_size = size;
+    header.source_mtime = mtime;
+    header.number_of_entries = m_number_of_entries;
+
+    /* Written aside and renamed, so that other player opening the same stream
+     never maps half written index */
+    std::string temporary_path = index_path + ".tmp";
+    FILE *file = ::fopen(temporary_path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot save index %s: %s, keeping it in memory\n", index_path.c_str(),
+                strerror(errno));
+        return;
+    }
+    bool written = (1 == ::fwrite(&header, sizeof(header), 1, file))
+        && (m_number_of_entries
+            == ::fwrite(m_entries, sizeof(StreamIndexEntry), m_number_of_entries, file));
+    written = !::fclose(file) && written;
+    if (!written || (-1 == ::rename(temporary_path.c_str(), index_path.c_str()))) {
+        fprintf(stderr, "Cannot save index %s: %s, keeping it in memory\n", index_path.c_str(),
+                strerror(errno));
+        ::unlink(temporary_path.c_str());
+    }
+}
+
+void StreamIndex::build_ivf(const unsigned char *data, size_t size)
+{
+    /* Every frame has 12 byte header (32-bit frame size, not including the
+     header, and 64-bit timestamp), frames follow file header */
+    size_t offset = read_le<uint16_t>(data + 6);
+    uint32_t keyframe = STREAM_INDEX_NO_KEYFRAME;
+    while (offset + 12 <= size) {
+        size_t frame_size = read_le<uint32_t>(data + offset);
+        if (frame_size > size - offset - 12) {
+            /* Truncated frame, decoder wouldn't get to it either */
+            break;
+        }
+
+        StreamIndexEntry entry;
+        ::memset(&entry, 0, sizeof(entry));
+        entry.offset = offset;
+        entry.timestamp = read_le<int64_t>(data + offset + 4);
+        entry.sps_offset = entry.pps_offset = STREAM_INDEX_NO_OFFSET;
+        /* Lowest bit of VP8 frame tag is zero for keyframes */
+        if (frame_size && !(data[offset + 12] & 0x01)) {
+            entry.flags |= STREAM_INDEX_KEYFRAME;
+            keyframe = m_built_entries.size();
+        }
+        entry.keyframe_index = keyframe;
+        m_built_entries.push_back(entry);
+
+        offset += 12 + frame_size;
+    }
+}
+
+void StreamIndex::build_h264(const unsigned char *data, size_t size)
+{
+    const unsigned char *limit = data + size;
+    /* Offsets of the last parameter sets seen, by their ids, and SPS each of
+     the PPSes refers to */
+    uint64_t sps_offsets[H264_NUMBER_OF_SPS_ALLOWED];
+    uint64_t pps_offsets[H264_NUMBER_OF_PPS_ALLOWED];
+    uint8_t pps_sps_ids[H264_NUMBER_OF_PPS_ALLOWED] = {};
+    std::fill(sps_offsets, sps_offsets + H264_NUMBER_OF_SPS_ALLOWED, STREAM_INDEX_NO_OFFSET);
+    std::fill(pps_offsets, pps_offsets + H264_NUMBER_OF_PPS_ALLOWED, STREAM_INDEX_NO_OFFSET);
+    /* Start of the access unit being gathered, set by the first non-VCL NAL
+     that follows a slice, see 7.4.1.2.3 */
+    uint64_t access_unit_offset = STREAM_INDEX_NO_OFFSET;
+    uint32_t keyframe = STREAM_INDEX_NO_KEYFRAME;
+
+    const unsigned char *nal = at_h264_next_start_code(data, limit);
+    while (nal) {
+        const unsigned char *next_nal = at_h264_next_start_code(nal + 3, limit);
+        size_t nal_size = (next_nal ? next_nal : limit) - nal;
+        uint64_t offset = nal - data;
+        if (nal_size < 4) {
+            nal = next_nal;
+            continue;
+        }
+
+        NalType type = (NalType)(nal[3] & 0x1f);
+        switch (type) {
+        case NalType::SPS: {
+            SpsNalInfo sps;
+            if (at_h264_get_sps_info(nal, nal_size, sps)
+                && (sps.seq_parameter_set_id < H264_NUMBER_OF_SPS_ALLOWED)) {
+                sps_offsets[sps.seq_parameter_set_id] = offset;
+            }
+            break;
+        }
+        case NalType::PPS: {
+            PpsNalInfo pps;
+            if (at_h264_get_pps_info(nal, nal_size, pps)
+                && (pps.pic_parameter_set_id < H264_NUMBER_OF_PPS_ALLOWED)
+                && (pps.seq_parameter_set_id < H264_NUMBER_OF_SPS_ALLOWED)) {
+                pps_offsets[pps.pic_parameter_set_id] = offset;
+                pps_sps_ids[pps.pic_parameter_set_id] = pps.seq_parameter_set_id;
+            }
+            break;
+        }
+        case NalType::NON_IDR_SLICE:
+        case NalType::IDR_SLICE: {
+            SliceHeaderInfo slice;
+            if (at_h264_get_initial_slice_header_info(nal, nal_size, slice)
+                && !slice.first_mb_in_slice && (slice.pic_parameter_set_id >= 0)
+                && (slice.pic_parameter_set_id < H264_NUMBER_OF_PPS_ALLOWED)) {
+                /* First slice of a new picture. Arbitrary slice order would
+                 break this, but VPU doesn't support it anyway */
+                StreamIndexEntry entry;
+                ::memset(&entry, 0, sizeof(entry));
+                entry.offset
+                    = (STREAM_INDEX_NO_OFFSET != access_unit_offset) ? access_unit_offset : offset;
+                entry.timestamp = m_built_entries.size();
+                entry.sps_id = pps_sps_ids[slice.pic_parameter_set_id];
+                entry.sps_offset = sps_offsets[entry.sps_id];
+                entry.pps_offset = pps_offsets[slice.pic_parameter_set_id];
+                if (NalType::IDR_SLICE == type) {
+                    entry.flags |= STREAM_INDEX_KEYFRAME;
+                    keyframe = m_built_entries.size();
+                }
+                entry.keyframe_index = keyframe;
+                m_built_entries.push_back(entry);
+            }
+            access_unit_offset = STREAM_INDEX_NO_OFFSET;
+            /* Parameter sets and SEI can't come between slices of a picture,
+             so don't look for start of next access unit yet */
+            nal = next_nal;
+            continue;
+        }
+        default:
+            break;
+        }
+
+        /* AUD, SEI, parameter sets and reserved types 14-18 start new access
+         unit when they come after a slice */
+        int value = (int)type;
+        if ((STREAM_INDEX_NO_OFFSET == access_unit_offset)
+            && (((value >= (int)NalType::SUPPLEMENTAL_ENHANCED_INFORMATION)
+                 && (value <= (int)NalType::ACCESS_UNIT_DELIMITER))
+                || ((value >= 14) && (value <= 18)))) {
+            access_unit_offset = offset;
+        }
+        nal = next_nal;
+    }
+}
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2020  AIRTAME ApS
+ * All Rights Reserved.
+ *
+ * See LICENSE.txt for further information.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timestamp.hpp"
+
+namespace airtame {
+
+#define STREAM_INDEX_MAGIC "AIDX"
+#define STREAM_INDEX_VERSION 1
+/* Index is kept next to the stream, as file with this appended to its name */
+#define STREAM_INDEX_SUFFIX ".idx"
+
+/* Entry flags */
+#define STREAM_INDEX_KEYFRAME 0x01
+
+/* Offset value for parameter sets that weren't seen (and all of them in IVF) */
+#define STREAM_INDEX_NO_OFFSET UINT64_MAX
+/* Keyframe index value for entries that come before the first keyframe */
+#define STREAM_INDEX_NO_KEYFRAME UINT32_MAX
+
+enum class StreamIndexCodec : uint32_t {
+    UNKNOWN = 0,
+    VP8_IVF = 1,
+    H264_ANNEXB = 2,
+};
+
+/* One entry per frame (IVF) or picture (h264 Annex B), in decoding order.
+ Written to sidecar file as is, so fixed size and no padding */
+struct StreamIndexEntry {
+    /* Where frame starts: IVF frame header, or first NAL of the access unit
+     (so AUD, SEI or parameter sets that come before the first slice) */
+    uint64_t offset;
+    /* IVF frame timestamp. Annex B has no timestamps, so there it is just
+     picture number */
+    int64_t timestamp;
+    /* Last SPS and PPS the picture refers to that came before it, so that
+     decoding can start at a keyframe not preceded by its parameter sets */
+    uint64_t sps_offset;
+    uint64_t pps_offset;
+    /* Entry index of the nearest keyframe (IDR picture) at or before this
+     one, where decoding has to start to get to this frame */
+    uint32_t keyframe_index;
+    uint8_t flags;
+    uint8_t sps_id;
+    uint16_t reserved;
+};
+static_assert(sizeof(StreamIndexEntry) == 40, "StreamIndexEntry is written to disk");
+
+/* Sidecar file header, entries follow it. Index is valid only as long as
+ stream size and modification time stay the same */
+struct StreamIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t codec;
+    uint64_t source_size;
+    /* Nanoseconds */
+    int64_t source_mtime;
+    uint64_t number_of_entries;
+};
+static_assert(sizeof(StreamIndexHeader) == 40, "StreamIndexHeader is written to disk");
+
+/* Frame index of IVF or h264 Annex B stream, for seeking to given frame or
+ timestamp without walking (or start code scanning) the stream up to it.
+
+ Building the index walks the whole stream once, so it gets saved next to the
+ stream and next opens just map the saved copy. If there is no way to save it
+ (read only storage for example) index is just kept in memory */
+class StreamIndex {
+private:
+    StreamIndexCodec m_codec = StreamIndexCodec::UNKNOWN;
+    /* Points either into the mapped sidecar or into m_built_entries */
+    const StreamIndexEntry *m_entries = nullptr;
+    size_t m_number_of_entries = 0;
+    std::vector<StreamIndexEntry> m_built_entries;
+    void *m_mapping = nullptr;
+    size_t m_mapping_size = 0;
+
+public:
+    StreamIndex()
+    {
+    }
+    ~StreamIndex();
+
+    StreamIndex(const StreamIndex &) = delete;
+    StreamIndex &operator=(const StreamIndex &) = delete;
+
+    /* Loads index of stream (data and size being its whole content) from
+     the sidecar, or builds and saves it if sidecar doesn't match the stream.
+     Returns false if stream is neither IVF nor Annex B */
+    bool open(const std::string &path, const unsigned char *data, size_t size,
+              int64_t mtime);
+
+    StreamIndexCodec get_codec() const
+    {
+        return m_codec;
+    }
+
+    size_t get_number_of_entries() const
+    {
+        return m_number_of_entries;
+    }
+
+    const StreamIndexEntry &get_entry(size_t index) const
+    {
+        return m_entries[index];
+    }
+
+    /* True if index came from the sidecar file rather than was built now */
+    bool is_mapped() const
+    {
+        return nullptr != m_mapping;
+    }
+
+    /* Index of the last entry with timestamp not after given one (or the
+     first entry, if all of them are after it). Binary search, so entries are
+     expected in timestamp order - which holds for both IVF and Annex B picture
+     numbers, as long as stream isn't broken */
+    size_t find_by_timestamp(Timestamp timestamp) const;
+
+private:
+    bool load(const std::string &index_path, size_t size, int64_t mtime);
+    void save(const std::string &index_path, size_t size, int64_t mtime) const;
+    void build_ivf(const unsigned char *data, size_t size);
+    void build_h264(const unsigned char *data, size_t size);
+};
+}
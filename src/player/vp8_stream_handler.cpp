@@ -5,6 +5,9 @@
  * See LICENSE.txt for further information.
  */
 
+#include <string.h>
+
+#include "trace.hpp"
 #include "vp8_stream_handler.hpp"
 
 namespace airtame {
@@ -13,18 +16,30 @@ VP8StreamHandler::VP8StreamHandler(Stream &stream)
     , m_number_of_display_frames(2)
     , m_parser(m_logger, m_packs)
     , m_decoder(m_logger, m_number_of_display_frames)
+    , m_trick_play(std::make_shared<TrickPlayDropPolicy>())
 {
+    m_packs.set_drop_policy(m_trick_play);
     const unsigned char *read_pointer = m_stream.get_read_pointer();
     /* Read width, height and number of frames off file */
     size_t header_size = *(uint16_t *)(read_pointer + 6);
     size_t width = *(uint16_t *)(read_pointer + 12);
     size_t height = *(uint16_t *)(read_pointer + 14);
     size_t number_of_frames = *(uint32_t *)(read_pointer + 24);
+    uint32_t denominator = *(uint32_t *)(read_pointer + 16);
+    uint32_t numerator = *(uint32_t *)(read_pointer + 20);
     fprintf(stderr,
             "IVF file contains %zu frames, resolution %zux%zu, "
-            "header size %zu\n",
-            number_of_frames, width, height, header_size);
-    if (header_size > m_stream.get_size_left()) {
+            "header size %zu, timebase %u/%u\n",
+            number_of_frames, width, height, header_size, numerator, denominator);
+    if (numerator && denominator) {
+        m_timebase_numerator = numerator;
+        m_timebase_denominator = denominator;
+    } else {
+        /* Broken header, assume timestamps count frames at 30 frames/s */
+        m_timebase_numerator = 1;
+        m_timebase_denominator = 30;
+    }
+    if (!m_stream.read_ahead(header_size, true)) {
         fprintf(stderr, "IVF header size bigger than file size");
         /* Flush stream to avoid further processing attempts */
         m_stream.flush_bytes(m_stream.get_size_left());
@@ -36,14 +51,19 @@ VP8StreamHandler::VP8StreamHandler(Stream &stream)
 
 void VP8StreamHandler::offset(size_t off)
 {
-    if (off > m_stream.get_size_left()) {
+    /* Before playback starts, so this can wait for live input */
+    if (!m_stream.read_ahead(off, true)) {
         m_stream.flush_bytes(m_stream.get_size_left());
     } else {
         while (off) {
             /* Read in next frame size from frame header */
+            if (!m_stream.read_ahead(4, true)) {
+                m_stream.flush_bytes(m_stream.get_size_left());
+                break;
+            }
             size_t frame_size = *(uint32_t *)m_stream.get_read_pointer();
             frame_size += 12; // size doesn't include frame header
-            if (frame_size <= m_stream.get_size_left()) {
+            if (m_stream.read_ahead(frame_size, true)) {
                 m_stream.flush_bytes(frame_size);
                 if (off < frame_size) {
                     /* offset was in this frame, so will start with next one */
@@ -61,7 +81,6 @@ void VP8StreamHandler::offset(size_t off)
 
 bool VP8StreamHandler::init()
 {
-    m_fake_timestamp = 0;
     return true;
 }
 
@@ -71,36 +90,148 @@ bool VP8StreamHandler::step()
      in more clever, OO-way. But still, there might be some vp8-specific things
      we might want to add, also this is just an example. */
     while (!m_decoded_frame.has_data()) {
-        /* Create at least one frame pack loading subsequent frames */
-        while (!m_packs.has_pack_for_consumption() && load_frame()) ;
+        /* Create at least one frame pack loading subsequent frames, and
+         enough for the decoder to feed ahead */
+        while ((!m_packs.has_pack_for_consumption()
+                || (m_packs.size() < m_decoder.get_feed_ahead() + 2))
+               && load_frame()) ;
 
         /* No need to check completion of frames, VP8 frames are always complete */
 
         if (!m_packs.has_pack_for_consumption()) {
+            if (m_stream.has_more_input()) {
+                /* Next frame hasn't come yet */
+                return false;
+            }
             /* This is the end */
             codec_log_info(m_logger, "Fed %zu packs, was given %zu decoded frames",
                            m_packs.get_number_of_packs_popped(),
-                           m_decoder.get_number_of_frames_given());
+                           m_backend->get_number_of_frames_given());
             return false;
         }
 
+        place_decoder();
+
         /* OK, have complete frame pack, can try to decode */
-        while (!m_decoded_frame.has_data() && m_decoder.has_frame_for_decoding()
+        while (!m_decoded_frame.has_data() && m_backend->has_frame_for_decoding()
                && m_packs.has_pack_for_consumption()) {
-            m_decoded_frame = m_decoder.step(m_packs);
+            m_decoded_frame = m_backend->step(m_packs);
+            if (!m_decoded_frame.has_data() || !m_trick_play->is_preroll()) {
+                continue;
+            }
+            if (m_decoded_frame.meta
+                && (m_decoded_frame.meta.get_timestamp() < m_trick_play->get_preroll_target())) {
+                /* Post-decode dropping, up to the frame seek asked for. Goes
+                 right back, so decoder has it to decode into */
+                m_backend->return_output_frame(m_decoded_frame);
+                m_decoded_frame.reset();
+            } else {
+                m_trick_play->end_preroll();
+            }
         }
     }
 
     return true;
 }
 
+bool VP8StreamHandler::prepare()
+{
+    /* Parser only works on our own queue and never calls the VPU, so this
+     can run while other stream decodes. Queue size limit bounds the work done
+     in one call */
+    bool parsed = false;
+    while ((m_packs.size() < STREAM_HANDLER_PACKS_AHEAD)
+           && (m_packs.get_bytes_pending() < STREAM_HANDLER_BYTES_AHEAD) && load_frame()) {
+        parsed = true;
+    }
+    return parsed;
+}
+
+bool VP8StreamHandler::seek_to_frame(size_t frame)
+{
+    const StreamIndex *index = m_stream.get_index();
+    if (!index || (frame >= index->get_number_of_entries())) {
+        return false;
+    }
+    /* No keyframe before it means stream starts with frames decoder skips
+     anyway, so just go there */
+    size_t keyframe = index->get_entry(frame).keyframe_index;
+    if (STREAM_INDEX_NO_KEYFRAME == keyframe) {
+        keyframe = frame;
+    }
+    const StreamIndexEntry &entry = index->get_entry(keyframe);
+    restart();
+    m_stream.seek(entry.offset);
+    m_trick_play->begin_preroll(get_presentation_timestamp(index->get_entry(frame).timestamp));
+    return true;
+}
+
+void VP8StreamHandler::set_decoder_placement(const std::shared_ptr<DecoderPlacement> &placement)
+{
+    m_placement = placement;
+    m_software_decoder = create_software_decoder(m_logger, m_number_of_display_frames);
+}
+
+void VP8StreamHandler::place_decoder()
+{
+    if (!m_placement || !m_packs.has_pack_for_consumption()
+        || !m_packs.front().m_can_reopen_decoding) {
+        return;
+    }
+    if (m_placed) {
+        migrate_decoder(m_logger, *m_placement, m_decoder, m_software_decoder.get(),
+                        m_packs.front(), m_backend);
+        return;
+    }
+    m_placed = true;
+    /* CPU can't rotate */
+    if (m_software_decoder && !m_decoder.get_rotation().is_enabled()
+        && (DecoderPlacement::Engine::CPU == m_placement->place(m_packs.front()))) {
+        codec_log_info(m_logger, "VPU is busy, decoding stream on the CPU");
+        m_backend = m_software_decoder.get();
+    }
+    m_placement->add_decoder(*m_backend);
+}
+
+double VP8StreamHandler::get_frame_rate()
+{
+    const StreamIndex *index = m_stream.get_index();
+    if (!index || (index->get_number_of_entries() < 2)) {
+        return 0.0;
+    }
+    Timestamp first = index->get_entry(0).timestamp;
+    Timestamp last = first;
+    for (size_t n = 1; n < index->get_number_of_entries(); ++n) {
+        Timestamp timestamp = index->get_entry(n).timestamp;
+        first = (timestamp < first) ? timestamp : first;
+        last = (timestamp > last) ? timestamp : last;
+    }
+    Timestamp span = get_presentation_timestamp(last - first);
+    return (span > 0) ? (index->get_number_of_entries() - 1) * 1000000.0 / span : 0.0;
+}
+
+void VP8StreamHandler::restart()
+{
+    m_backend->close();
+    m_packs.clear();
+    /* Reopened decoder needs sequence header before the first keyframe */
+    m_parser.reset();
+    m_decoded_frame.reset();
+    if (m_last_frame.dma) {
+        /* Stays on display until next frame comes */
+        m_last_frame_is_stale = true;
+    }
+    m_trick_play->end_preroll();
+}
+
 void VP8StreamHandler::swap()
 {
     if (m_decoded_frame.has_data()) {
-        if (m_last_frame.dma) {
+        if (m_last_frame.dma && !m_last_frame_is_stale) {
             /* We have next frame to display, can give old one back */
-            m_decoder.return_output_frame(m_last_frame.dma.get()->phy_addr);
+            m_backend->return_output_frame(m_last_frame);
         }
+        m_last_frame_is_stale = false;
 
         /* Update m_last_frame */
         m_last_frame = m_decoded_frame;
@@ -115,13 +246,18 @@ bool VP8StreamHandler::is_interleaved()
 
 bool VP8StreamHandler::load_frame()
 {
-    /* Make sure we are not on EOF */
-    if (!m_stream.get_size_left()) {
+    TRACE_SCOPE("load_frame");
+    /* Make sure we are not on EOF (live input may not have brought what
+     comes next yet, that is no frame for now as well) */
+    if (!m_stream.read_ahead(1)) {
         return false;
     }
 
     /* Make sure there is enough data for frame size */
-    if (m_stream.get_size_left() < 4) {
+    if (!m_stream.read_ahead(4)) {
+        if (m_stream.has_more_input()) {
+            return false;
+        }
         codec_log_error(m_logger, "Unexpected end of stream");
         m_stream.flush_bytes(m_stream.get_size_left());
         return false;
@@ -132,19 +268,24 @@ bool VP8StreamHandler::load_frame()
      pointer is always at the next frame as IVF/VP8 has no resync features. */
     const unsigned char *read_pointer = m_stream.get_read_pointer();
     size_t frame_size = *(uint32_t *)read_pointer;
-    if ((frame_size + 12) <= m_stream.get_size_left()) {
+    if (m_stream.read_ahead(frame_size + 12)) {
         /* Wrap it up and send for processing */
         VideoBuffer buffer;
         buffer.data = read_pointer + 12;
         buffer.size = frame_size;
-        // TODO: we are passing zero as timestamp, but IVF contains 64-bit
-        // timestamps just after frame size, so could extract them there
-        buffer.meta.reset(new FrameMetaData(m_fake_timestamp++));
+        buffer.free_callback = m_stream.hold(frame_size + 12);
+        /* 64-bit timestamp follows frame size, pass it on in usec */
+        Timestamp timestamp;
+        ::memcpy(&timestamp, read_pointer + 4, sizeof(timestamp));
+        buffer.meta = FrameMeta(get_presentation_timestamp(timestamp));
         m_parser.process_buffer(buffer);
 
         /* Move on stream */
         m_stream.flush_bytes(frame_size + 12);
         return true;
+    } else if (m_stream.has_more_input()) {
+        /* Rest of the frame is yet to come */
+        return false;
     } else {
         fprintf(stderr, "EOF inside of IVF frame");
         m_stream.flush_bytes(m_stream.get_size_left());
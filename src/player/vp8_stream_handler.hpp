@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include "decoder_placement.hpp"
+#include "pack_drop_policy.hpp"
 #include "pack_queue.hpp"
 #include "simple_logger.hpp"
 #include "stream_handler.hpp"
@@ -21,13 +23,29 @@ private:
     PackQueue m_packs;
     VP8StreamParser m_parser;
     VPUDecoder m_decoder;
+    /* With decoder placement, stream may be decoded by the CPU instead, or
+     move there once VPU runs out of DMA memory, see place_decoder().
+     Backend points to the decoder that does */
+    std::shared_ptr<DecoderPlacement> m_placement;
+    std::unique_ptr<DecodeBackend> m_software_decoder;
+    DecodeBackend *m_backend = &m_decoder;
+    bool m_placed = false;
     VPUOutputFrame m_decoded_frame;
-    size_t m_fake_timestamp = 0;
+    /* IVF frame timestamps are in units of numerator/denominator seconds */
+    Timestamp m_timebase_numerator = 1;
+    Timestamp m_timebase_denominator = 1;
+    /* Fast forward and seek pre-roll, with drop policy user set chained
+     after it. Frames decoded before pre-roll target are dropped, to get to
+     the frame seek asked for */
+    std::shared_ptr<TrickPlayDropPolicy> m_trick_play;
 
 public:
     VP8StreamHandler(Stream &stream);
     virtual ~VP8StreamHandler()
     {
+        if (m_placement) {
+            m_placement->remove_decoder(*m_backend);
+        }
     }
 
     void offset(size_t off);
@@ -35,8 +53,85 @@ public:
     bool step();
     void swap();
     bool is_interleaved();
+    bool prepare() override;
+    bool seek_to_frame(size_t frame) override;
+    void set_busy_callback(const VPUBusyCallback &callback) override
+    {
+        m_decoder.set_busy_callback(callback);
+        if (m_software_decoder) {
+            m_software_decoder->set_busy_callback(callback);
+        }
+    }
+    void set_frame_pool(const std::shared_ptr<VPUFramePool> &pool) override
+    {
+        m_decoder.set_frame_pool(pool);
+        if (m_software_decoder) {
+            m_software_decoder->set_frame_pool(pool);
+        }
+    }
+    const DecodingStats *get_decoding_stats() override
+    {
+        return &m_backend->get_stats();
+    }
+    /* From timestamps of all the frames, by the stream index - IVF timebase
+     needn't be one tick per frame */
+    double get_frame_rate() override;
+    PackQueue *get_pack_queue() override
+    {
+        return &m_packs;
+    }
+    const VPUOutputFrame *get_decoded_frame() override
+    {
+        return m_decoded_frame.has_data() ? &m_decoded_frame : nullptr;
+    }
+    void set_drop_policy(const std::shared_ptr<PackDropPolicy> &policy) override
+    {
+        m_trick_play->set_next(policy);
+    }
+    bool set_playback_rate(double rate, const PlaybackClock &clock) override
+    {
+        m_trick_play->set_rate(rate);
+        m_trick_play->set_clock(clock);
+        return true;
+    }
+    void set_rotation(const VPURotation &rotation) override
+    {
+        m_decoder.set_rotation(rotation);
+    }
+    void set_frame_layout(VPUFrameLayout frame_layout) override
+    {
+        m_decoder.set_frame_layout(frame_layout);
+    }
+    void set_feed_ahead(size_t number_of_packs) override
+    {
+        m_decoder.set_feed_ahead(number_of_packs);
+    }
+    void set_keyframes_only(bool keyframes_only) override
+    {
+        m_decoder.set_keyframes_only(keyframes_only);
+    }
+    void set_display_frame_bounds(size_t min_frames, size_t max_frames) override
+    {
+        m_decoder.set_display_frame_bounds(min_frames, max_frames);
+    }
+    void set_decoder_placement(const std::shared_ptr<DecoderPlacement> &placement) override;
+
+protected:
+    Timestamp get_index_timestamp(Timestamp timestamp) override
+    {
+        return timestamp * m_timebase_denominator / (m_timebase_numerator * 1000000);
+    }
 
 private:
     bool load_frame();
+    /* IVF frame timestamp to presentation one (usec) */
+    Timestamp get_presentation_timestamp(Timestamp timestamp) const
+    {
+        return timestamp * m_timebase_numerator * 1000000 / m_timebase_denominator;
+    }
+    /* Picks decoder for the stream once its first pack can open it */
+    void place_decoder();
+    /* Closes decoder and drops everything parsed so far */
+    void restart();
 };
 }